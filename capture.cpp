@@ -0,0 +1,146 @@
+// -----------------------------------------------------------------------
+// |             _     _              _____         _____                |
+// |            |  \  | |            / ____|  /\   |  __ \               |
+// |            | | \ | |  __       | (___   /  \  | |__) |              |
+// |            | |\ \| | /__\|   |  \___ \ / /\ \ |  _  /               |
+// |            | | \ \ ||    |   |   ___) / /__\ \| | \ \               |
+// |            |_|  \_\| \__/ \_/|/|_____/________\_|  \_\              |
+// |                                                                     |
+// -----------------------------------------------------------------------
+// COPYRIGHT
+// -----------------------------------------------------------------------
+//
+// This software is copyright protected and proprietary to Neusoft Reach.
+// Neusoft Reach grants to you only those rights as set out in the license
+// conditions.
+// All other rights remain with Neusoft Reach.
+// -----------------------------------------------------------------------
+
+#if defined(__linux__)
+#   include <pthread.h>
+#   define SET_CURRENT_THREAD_NAME(n) pthread_setname_np(pthread_self(), n)
+#else
+#   define SET_CURRENT_THREAD_NAME(n) do { } while (0)
+#endif
+
+#include <sf-msgbus/types/scoped_unlocker.h>
+#include <sf-msgbus/blackbox2/log.h>
+
+#include "capture.h"
+
+namespace asf {
+namespace msgbus {
+namespace blackbox2 {
+
+Capture::Capture(size_t capacity)
+    : ring_(capacity)
+    , worker_idle_(false)
+    , dropped_(0)
+    , worker_run_(false)
+    , next_sink_id_(1) {
+}
+
+Capture::~Capture() {
+    Stop();
+}
+
+bool Capture::Start() {
+    std::lock_guard<std::mutex> lg(mutex_);
+    if (worker_run_) {
+        return false;
+    }
+    worker_run_ = true;
+    worker_thread_ = std::thread(std::bind(&Capture::WorkerThread, this));
+    return true;
+}
+
+void Capture::Stop() {
+    {
+        std::lock_guard<std::mutex> lg(mutex_);
+        if (!worker_run_) {
+            return;
+        }
+        worker_run_ = false;
+        cond_.notify_one();
+    }
+    worker_thread_.join();
+    CaptureEntry entry;
+    while (ring_.TryPop(entry)) {
+    }
+}
+
+uint64_t Capture::AddSink(CaptureSink* sink) {
+    std::lock_guard<std::mutex> lg(sink_mutex_);
+    auto id = next_sink_id_++;
+    sinks_[sink] = id;
+    return id;
+}
+
+void Capture::RemoveSink(CaptureSink* sink) {
+    std::lock_guard<std::mutex> lg(sink_mutex_);
+    sinks_.erase(sink);
+}
+
+bool Capture::Push(CaptureEntry&& entry) {
+    if (!ring_.TryPush(std::move(entry))) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    // Pairs with the fence in WorkerThread, either the worker sees the entry
+    // or we see it idle and wake it up.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (worker_idle_.load(std::memory_order_relaxed) && worker_idle_.exchange(false)) {
+        std::lock_guard<std::mutex> lg(mutex_);
+        cond_.notify_one();
+    }
+    return true;
+}
+
+void Capture::WorkerThread() {
+    SET_CURRENT_THREAD_NAME("CaptureThread");
+    ASBLog(INFO) << "CaptureThread start.";
+
+    CaptureEntry entry;
+    uint64_t dropped = 0;
+
+    std::unique_lock<std::mutex> lg(mutex_);
+    while (worker_run_) {
+        {
+            ScopedUnlocker<std::mutex> unlocker(mutex_);
+            while (ring_.TryPop(entry)) {
+                {
+                    // The id tells a new sink at the address of a removed one apart.
+                    std::lock_guard<std::mutex> sink_lg(sink_mutex_);
+                    auto it = sinks_.find(entry.sink);
+                    if (it != sinks_.end() && it->second == entry.sink_id) {
+                        entry.sink->HandleCapture(entry);
+                    }
+                }
+                entry = CaptureEntry();
+            }
+        }
+
+        auto current_dropped = dropped_.load(std::memory_order_relaxed);
+        if (current_dropped != dropped) {
+            ASBLog(WARNING) << "Capture ring full, " << (current_dropped - dropped) << " messages dropped.";
+            dropped = current_dropped;
+        }
+
+        worker_idle_.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!ring_.IsEmpty()) {
+            worker_idle_.store(false, std::memory_order_relaxed);
+            continue;
+        }
+        cond_.wait(lg, [this] {
+            return !worker_idle_.load(std::memory_order_relaxed) || !worker_run_;
+        });
+        worker_idle_.store(false, std::memory_order_relaxed);
+    }
+
+    ASBLog(INFO) << "CaptureThread exited.";
+}
+
+}  // namespace blackbox2
+}  // namespace msgbus
+}  // namespace asf
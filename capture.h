@@ -0,0 +1,166 @@
+// -----------------------------------------------------------------------
+// |             _     _              _____         _____                |
+// |            |  \  | |            / ____|  /\   |  __ \               |
+// |            | | \ | |  __       | (___   /  \  | |__) |              |
+// |            | |\ \| | /__\|   |  \___ \ / /\ \ |  _  /               |
+// |            | | \ \ ||    |   |   ___) / /__\ \| | \ \               |
+// |            |_|  \_\| \__/ \_/|/|_____/________\_|  \_\              |
+// |                                                                     |
+// -----------------------------------------------------------------------
+// COPYRIGHT
+// -----------------------------------------------------------------------
+//
+// This software is copyright protected and proprietary to Neusoft Reach.
+// Neusoft Reach grants to you only those rights as set out in the license
+// conditions.
+// All other rights remain with Neusoft Reach.
+// -----------------------------------------------------------------------
+
+#ifndef SF_MSGBUS_BLACKBOX2_CAPTURE_H_
+#define SF_MSGBUS_BLACKBOX2_CAPTURE_H_
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+#include <condition_variable>
+
+#include <sf-msgbus/types/array.h>
+#include <sf-msgbus/message/message_info.h>
+
+#include "protocol.h"
+
+namespace asf {
+namespace msgbus {
+namespace blackbox2 {
+
+// Bounded lock-free multi-producer queue, consumed by a single thread.
+template <typename T>
+class MpscRing {
+ public:
+    explicit MpscRing(size_t capacity)
+        : cells_(RoundUp(capacity))
+        , mask_(cells_.size() - 1)
+        , head_(0)
+        , tail_(0) {
+        for (size_t i = 0; i < cells_.size(); ++i) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+ public:
+    bool TryPush(T&& value) {
+        auto pos = tail_.load(std::memory_order_relaxed);
+        for (;;) {
+            auto& cell = cells_[pos & mask_];
+            auto seq = cell.sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.value = std::move(value);
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Consumer side only.
+    bool IsEmpty() const {
+        return (cells_[head_ & mask_].sequence.load(std::memory_order_acquire) != head_ + 1);
+    }
+
+    bool TryPop(T& value) {
+        auto& cell = cells_[head_ & mask_];
+        auto seq = cell.sequence.load(std::memory_order_acquire);
+        if (seq != head_ + 1) {
+            return false;
+        }
+        value = std::move(cell.value);
+        cell.sequence.store(head_ + cells_.size(), std::memory_order_release);
+        ++head_;
+        return true;
+    }
+
+ private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    static size_t RoundUp(size_t n) {
+        size_t size = 2;
+        while (size < n) {
+            size <<= 1;
+        }
+        return size;
+    }
+
+    std::vector<Cell> cells_;
+    const size_t mask_;
+    size_t head_;
+    alignas(64) std::atomic<size_t> tail_;
+};
+
+class CaptureSink;
+
+// The serialize type is interned, see InternSerializeType().
+struct CaptureEntry {
+    CaptureSink* sink;
+    uint64_t sink_id;
+    protocol::Direction dir;
+    ByteArray payload;
+    const std::string* serialize_type;
+    MessageInfo msg_info;
+};
+
+class CaptureSink {
+ public:
+    virtual ~CaptureSink() = default;
+    virtual void HandleCapture(CaptureEntry& entry) = 0;
+};
+
+// Moves message encoding off the publishing threads: they only push an
+// entry into the ring and a worker thread encodes and sends it. Entries of
+// a sink are dropped once it is removed, RemoveSink() waits for the one
+// being handled.
+class Capture {
+ public:
+    explicit Capture(size_t capacity);
+    ~Capture();
+
+ public:
+    bool Start();
+    void Stop();
+    uint64_t AddSink(CaptureSink* sink);
+    void RemoveSink(CaptureSink* sink);
+    bool Push(CaptureEntry&& entry);
+
+ private:
+    void WorkerThread();
+
+ private:
+    MpscRing<CaptureEntry> ring_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::atomic<bool> worker_idle_;
+    std::atomic<uint64_t> dropped_;
+    bool worker_run_;
+    std::thread worker_thread_;
+    std::mutex sink_mutex_;
+    std::unordered_map<CaptureSink*, uint64_t> sinks_;
+    uint64_t next_sink_id_;
+};
+
+}  // namespace blackbox2
+}  // namespace msgbus
+}  // namespace asf
+
+#endif  // SF_MSGBUS_BLACKBOX2_CAPTURE_H_
@@ -27,8 +27,8 @@ namespace asf {
 namespace msgbus {
 namespace blackbox2 {
 
-ChannelProxyImpl::ChannelProxyImpl(std::shared_ptr<Context> context, ENetPeer* enet_peer, protocol::Channel&& protocol_channel)
-    : MessageProxyImpl(context, enet_peer)
+ChannelProxyImpl::ChannelProxyImpl(std::shared_ptr<Context> context, Endpoint* endpoint, protocol::Channel&& protocol_channel)
+    : MessageProxyImpl(context, endpoint)
     , protocol_channel_(std::move(protocol_channel)) {
     auto& configs = protocol_channel_.config();
     for (auto& config: configs) {
@@ -31,7 +31,7 @@ namespace blackbox2 {
 
 class ChannelProxyImpl: public MessageProxyImpl<ChannelProxy> {
 public:
-    ChannelProxyImpl(std::shared_ptr<Context> context, ENetPeer* enet_peer, protocol::Channel&& protocol_channel);
+    ChannelProxyImpl(std::shared_ptr<Context> context, Endpoint* endpoint, protocol::Channel&& protocol_channel);
     ~ChannelProxyImpl() override;
 
 public:
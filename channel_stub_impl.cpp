@@ -41,7 +41,7 @@ ChannelStubImpl::ChannelStubImpl(std::shared_ptr<Context> context, const Channel
     }
     protocol::GetCurrentThread(*protocol_channel_.mutable_owner_thread());
     if (process != nullptr) {
-        protocol_channel_.mutable_owner_process()->set_id(process->GetInstanceId());
+        protocol_channel_.mutable_owner_process()->set_id(AssignedInstanceId::Of(process));
     }
     auto pmap = protocol_channel_.mutable_config();
     for (auto &kv: channel_config.properties) {
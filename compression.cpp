@@ -0,0 +1,216 @@
+// -----------------------------------------------------------------------
+// |             _     _              _____         _____                |
+// |            |  \  | |            / ____|  /\   |  __ \               |
+// |            | | \ | |  __       | (___   /  \  | |__) |              |
+// |            | |\ \| | /__\|   |  \___ \ / /\ \ |  _  /               |
+// |            | | \ \ ||    |   |   ___) / /__\ \| | \ \               |
+// |            |_|  \_\| \__/ \_/|/|_____/________\_|  \_\              |
+// |                                                                     |
+// -----------------------------------------------------------------------
+// COPYRIGHT
+// -----------------------------------------------------------------------
+//
+// This software is copyright protected and proprietary to Neusoft Reach.
+// Neusoft Reach grants to you only those rights as set out in the license
+// conditions.
+// All other rights remain with Neusoft Reach.
+// -----------------------------------------------------------------------
+
+#include <mutex>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+
+#ifdef SF_MSGBUS_BLACKBOX2_WITH_ZLIB
+#   include <zlib.h>
+#endif
+
+#include <sf-msgbus/blackbox2/log.h>
+
+#include "compression.h"
+
+namespace asf {
+namespace msgbus {
+namespace blackbox2 {
+
+const std::string& GetSerializeTypeDictionary(const std::string& serialize_type) {
+    static std::mutex mutex;
+    static std::unordered_map<std::string, std::string> dictionaries;
+    std::lock_guard<std::mutex> lg(mutex);
+    auto it = dictionaries.find(serialize_type);
+    if (it != dictionaries.end()) {
+        return it->second;
+    }
+    auto& dictionary = dictionaries[serialize_type];
+    const char* env_dir = getenv("SF_MSGBUS_BLACKBOX2_DICT_DIR");
+    if (env_dir != nullptr && *env_dir != '\0') {
+        std::string name = serialize_type;
+        for (auto& c: name) {
+            if (c == '/' || c == '\\') {
+                c = '_';
+            }
+        }
+        std::ifstream file(std::string(env_dir) + "/" + name + ".dict", std::ios::binary);
+        if (file) {
+            std::ostringstream ss;
+            ss << file.rdbuf();
+            dictionary = ss.str();
+            ASBLog(INFO) << "Load dictionary of " << serialize_type << ", " << dictionary.size() << " bytes.";
+        }
+    }
+    return dictionary;
+}
+
+#ifdef SF_MSGBUS_BLACKBOX2_WITH_ZLIB
+
+namespace {
+
+int GetCompressionLevel(protocol::Compression compression) {
+    return (compression == protocol::Compression::kHigh) ? Z_BEST_COMPRESSION : Z_BEST_SPEED;
+}
+
+}
+
+struct PayloadCompressor::Stream {
+    z_stream zs;
+    int level;
+};
+
+PayloadCompressor::PayloadCompressor() {
+}
+
+PayloadCompressor::~PayloadCompressor() {
+    if (stream_) {
+        deflateEnd(&stream_->zs);
+    }
+}
+
+bool PayloadCompressor::Compress(protocol::Compression compression, const std::string& dictionary, const uint8_t* data,
+                                 size_t size, std::string& out) {
+    if (compression == protocol::Compression::kNone || size == 0) {
+        return false;
+    }
+    auto level = GetCompressionLevel(compression);
+    if (stream_ && stream_->level != level) {
+        deflateEnd(&stream_->zs);
+        stream_.reset();
+    }
+    if (!stream_) {
+        std::unique_ptr<Stream> stream(new Stream());
+        if (deflateInit(&stream->zs, level) != Z_OK) {
+            ASBLog(ERROR) << "Failed to init deflate stream.";
+            return false;
+        }
+        stream->level = level;
+        stream_ = std::move(stream);
+    } else if (deflateReset(&stream_->zs) != Z_OK) {
+        return false;
+    }
+    auto& zs = stream_->zs;
+    if (!dictionary.empty() &&
+        deflateSetDictionary(&zs, reinterpret_cast<const Bytef*>(dictionary.data()), static_cast<uInt>(dictionary.size())) != Z_OK) {
+        return false;
+    }
+    // Only a smaller payload is worth it, so no room past the input size.
+    out.resize(size);
+    zs.next_in = const_cast<Bytef*>(data);
+    zs.avail_in = static_cast<uInt>(size);
+    zs.next_out = reinterpret_cast<Bytef*>(&out[0]);
+    zs.avail_out = static_cast<uInt>(out.size());
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+        return false;
+    }
+    out.resize(zs.total_out);
+    return true;
+}
+
+struct PayloadDecompressor::Stream {
+    z_stream zs;
+};
+
+PayloadDecompressor::PayloadDecompressor()
+    : stats_{ 0, 0, 0, std::chrono::nanoseconds(0) } {
+}
+
+PayloadDecompressor::~PayloadDecompressor() {
+    if (stream_) {
+        inflateEnd(&stream_->zs);
+    }
+}
+
+bool PayloadDecompressor::Decompress(const std::string& dictionary, const uint8_t* data, size_t size, uint8_t* out,
+                                     size_t out_size) {
+    auto start = std::chrono::steady_clock::now();
+    if (!stream_) {
+        std::unique_ptr<Stream> stream(new Stream());
+        if (inflateInit(&stream->zs) != Z_OK) {
+            ASBLog(ERROR) << "Failed to init inflate stream.";
+            return false;
+        }
+        stream_ = std::move(stream);
+    } else if (inflateReset(&stream_->zs) != Z_OK) {
+        return false;
+    }
+    auto& zs = stream_->zs;
+    zs.next_in = const_cast<Bytef*>(data);
+    zs.avail_in = static_cast<uInt>(size);
+    zs.next_out = out;
+    zs.avail_out = static_cast<uInt>(out_size);
+    auto ret = inflate(&zs, Z_FINISH);
+    if (ret == Z_NEED_DICT) {
+        if (dictionary.empty() ||
+            inflateSetDictionary(&zs, reinterpret_cast<const Bytef*>(dictionary.data()), static_cast<uInt>(dictionary.size())) != Z_OK) {
+            return false;
+        }
+        ret = inflate(&zs, Z_FINISH);
+    }
+    if (ret != Z_STREAM_END || zs.total_out != out_size) {
+        return false;
+    }
+    ++stats_.count;
+    stats_.packed_bytes += size;
+    stats_.raw_bytes += out_size;
+    stats_.time += std::chrono::steady_clock::now() - start;
+    return true;
+}
+
+#else
+
+struct PayloadCompressor::Stream {
+};
+
+PayloadCompressor::PayloadCompressor() {
+}
+
+PayloadCompressor::~PayloadCompressor() {
+}
+
+bool PayloadCompressor::Compress(protocol::Compression, const std::string&, const uint8_t*, size_t, std::string&) {
+    return false;
+}
+
+struct PayloadDecompressor::Stream {
+};
+
+PayloadDecompressor::PayloadDecompressor()
+    : stats_{ 0, 0, 0, std::chrono::nanoseconds(0) } {
+}
+
+PayloadDecompressor::~PayloadDecompressor() {
+}
+
+bool PayloadDecompressor::Decompress(const std::string&, const uint8_t*, size_t, uint8_t*, size_t) {
+    ASBLog(ERROR) << "Receive compressed payload, but built without zlib.";
+    return false;
+}
+
+#endif  // SF_MSGBUS_BLACKBOX2_WITH_ZLIB
+
+const PayloadDecompressor::Stats& PayloadDecompressor::GetStats() const {
+    return stats_;
+}
+
+}  // namespace blackbox2
+}  // namespace msgbus
+}  // namespace asf
@@ -0,0 +1,84 @@
+// -----------------------------------------------------------------------
+// |             _     _              _____         _____                |
+// |            |  \  | |            / ____|  /\   |  __ \               |
+// |            | | \ | |  __       | (___   /  \  | |__) |              |
+// |            | |\ \| | /__\|   |  \___ \ / /\ \ |  _  /               |
+// |            | | \ \ ||    |   |   ___) / /__\ \| | \ \               |
+// |            |_|  \_\| \__/ \_/|/|_____/________\_|  \_\              |
+// |                                                                     |
+// -----------------------------------------------------------------------
+// COPYRIGHT
+// -----------------------------------------------------------------------
+//
+// This software is copyright protected and proprietary to Neusoft Reach.
+// Neusoft Reach grants to you only those rights as set out in the license
+// conditions.
+// All other rights remain with Neusoft Reach.
+// -----------------------------------------------------------------------
+
+#ifndef SF_MSGBUS_BLACKBOX2_COMPRESSION_H_
+#define SF_MSGBUS_BLACKBOX2_COMPRESSION_H_
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <cstdint>
+
+#include "protocol.h"
+
+namespace asf {
+namespace msgbus {
+namespace blackbox2 {
+
+// Payloads below this size are not worth compressing.
+constexpr size_t kCompressMinSize = 128;
+
+// Trained dictionary of a serialize type, read once from
+// $SF_MSGBUS_BLACKBOX2_DICT_DIR/<serialize type>.dict. Empty if there is none.
+const std::string& GetSerializeTypeDictionary(const std::string& serialize_type);
+
+// Payload compression of one sender, it keeps its stream between payloads
+// and is not thread safe. Without zlib nothing is ever compressed.
+class PayloadCompressor {
+ public:
+    PayloadCompressor();
+    ~PayloadCompressor();
+
+ public:
+    // False if compression is unavailable or does not make data smaller.
+    bool Compress(protocol::Compression compression, const std::string& dictionary, const uint8_t* data, size_t size,
+                  std::string& out);
+
+ private:
+    struct Stream;
+    std::unique_ptr<Stream> stream_;
+};
+
+class PayloadDecompressor {
+ public:
+    struct Stats {
+        uint64_t count;
+        uint64_t packed_bytes;
+        uint64_t raw_bytes;
+        std::chrono::nanoseconds time;
+    };
+
+ public:
+    PayloadDecompressor();
+    ~PayloadDecompressor();
+
+ public:
+    bool Decompress(const std::string& dictionary, const uint8_t* data, size_t size, uint8_t* out, size_t out_size);
+    const Stats& GetStats() const;
+
+ private:
+    struct Stream;
+    std::unique_ptr<Stream> stream_;
+    Stats stats_;
+};
+
+}  // namespace blackbox2
+}  // namespace msgbus
+}  // namespace asf
+
+#endif  // SF_MSGBUS_BLACKBOX2_COMPRESSION_H_
@@ -19,6 +19,8 @@
 #include <cerrno>
 #include <cassert>
 #include <cstring>
+#include <algorithm>
+#include <vector>
 
 #if defined(__linux__)
 #   include <pthread.h>
@@ -37,13 +39,118 @@ namespace asf {
 namespace msgbus {
 namespace blackbox2 {
 
-Context::RequestContext::RequestContext(std::shared_ptr<Context> context, ENetPeer* enet_peer,
-                                        protocol::Opcode opcode, uint32_t session, google::protobuf::io::ZeroCopyInputStream& payload)
+namespace {
+
+constexpr size_t kBulkBudget = 64 * 1024;
+constexpr size_t kChannelCount = static_cast<size_t>(protocol::EnetChannel::kMax);
+constexpr size_t kBatchMaxBytes = 1200;
+constexpr size_t kBatchMaxRecord = kBatchMaxBytes / 2;
+constexpr uint32_t kBatchMaxCount = 64;
+constexpr std::chrono::milliseconds kBatchMaxDelay(2);
+constexpr size_t kSendQueueMaxBytes = 8 * 1024 * 1024;
+constexpr size_t kSendQueueMaxPackets = 4096;
+constexpr std::chrono::milliseconds kSendQueueTimeout(100);
+constexpr std::chrono::milliseconds kDropReportInterval(1000);
+constexpr uint32_t kLocalRetryTimeout = 1;
+constexpr std::chrono::milliseconds kRetryBaseDelay(100);
+constexpr std::chrono::milliseconds kRetryMaxDelay(10000);
+constexpr std::chrono::milliseconds kBusyPollReportInterval(10000);
+constexpr std::chrono::milliseconds kPacketPoolReportInterval(60000);
+constexpr size_t kIoBatch = 32;
+constexpr enet_uint32 kDeliveryFlags =
+    ENET_PACKET_FLAG_RELIABLE | ENET_PACKET_FLAG_UNSEQUENCED | ENET_PACKET_FLAG_UNRELIABLE_FRAGMENT;
+
+void InitHeader(uint8_t* data, protocol::Type type, protocol::Opcode opcode, uint32_t object_id, uint32_t session,
+                uint32_t extra_data) {
+    auto header = reinterpret_cast<protocol::Header*>(data);
+    header->version = protocol::kVersion;
+    header->type = static_cast<uint8_t>(type);
+    header->opcode = static_cast<uint8_t>(opcode);
+    header->flags = 0;
+    header->session = htonl(session);
+    header->extra_data = htonl(extra_data);
+    header->object = htonl(object_id);
+}
+
+// Calls visit(object_id, opcode, size) for each event of a kEvent or a
+// kBatch packet, size includes the trailer of the event.
+template <typename Visitor>
+bool VisitEvents(ENetPacket* enet_pkt, Visitor&& visit) {
+    auto data = reinterpret_cast<const uint8_t*>(enet_packet_get_data(enet_pkt));
+    size_t size = enet_packet_get_length(enet_pkt);
+    protocol::Header header;
+    if (size < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    data += sizeof(header);
+    size -= sizeof(header);
+    if (header.type == static_cast<uint8_t>(protocol::Type::kEvent)) {
+        if (header.flags & protocol::kHeaderTrailer) {
+            size += ntohl(header.extra_data);
+        }
+        visit(ntohl(header.object), static_cast<protocol::Opcode>(header.opcode), size);
+        return true;
+    }
+    if (header.type != static_cast<uint8_t>(protocol::Type::kBatch)) {
+        return false;
+    }
+    for (uint32_t i = ntohl(header.extra_data); i > 0; --i) {
+        protocol::BatchRecord record;
+        if (size < sizeof(record)) {
+            return false;
+        }
+        memcpy(&record, data, sizeof(record));
+        auto record_size = ntohl(record.size);
+        if (size - sizeof(record) < record_size) {
+            return false;
+        }
+        visit(ntohl(record.object), static_cast<protocol::Opcode>(record.opcode), record_size);
+        data += sizeof(record) + record_size;
+        size -= sizeof(record) + record_size;
+    }
+    return true;
+}
+
+// Only kMessage events may be dropped, the other bulk events carry state
+// such as the serialize types the following messages refer to.
+bool IsDroppablePacket(ENetPacket* enet_pkt) {
+    bool droppable = true;
+    return VisitEvents(enet_pkt, [&droppable](uint32_t, protocol::Opcode opcode, size_t) {
+        droppable = droppable && (opcode == protocol::Opcode::kMessage);
+    }) && droppable;
+}
+
+const char* GetSendQueuePolicyName(int policy) {
+    static const char* names[] = { "drop-newest", "drop-oldest", "block" };
+    return names[policy];
+}
+
+enet_uint32 GetPacketFlags(protocol::Delivery delivery) {
+    switch (delivery) {
+    case protocol::Delivery::kSequenced:
+        return ENET_PACKET_FLAG_UNRELIABLE_FRAGMENT;
+    case protocol::Delivery::kUnsequenced:
+        return ENET_PACKET_FLAG_UNSEQUENCED | ENET_PACKET_FLAG_UNRELIABLE_FRAGMENT;
+    default:
+        return ENET_PACKET_FLAG_RELIABLE;
+    }
+}
+
+}
+
+Context::RequestContext::RequestContext(std::shared_ptr<Context> context, Endpoint* endpoint,
+                                        protocol::Opcode opcode, uint32_t session, google::protobuf::io::ZeroCopyInputStream& payload,
+                                        uint64_t instance_id, std::string* batch_response)
     : context_(context)
-    , enet_peer_(enet_peer)
+    , endpoint_(endpoint)
+    , enet_peer_(endpoint->enet_peer)
+    , object_id_(endpoint->object_id)
     , opcode_(opcode)
     , session_(session)
     , payload_(payload)
+    , instance_id_(instance_id)
+    , batch_response_(batch_response)
     , response_dirty_(true)
     , response_packet_(nullptr) {
 }
@@ -56,8 +163,12 @@ std::shared_ptr<Context> Context::RequestContext::GetContext() {
     return context_.lock();
 }
 
-ENetPeer* Context::RequestContext::GetENetPeer() {
-    return enet_peer_;
+Endpoint* Context::RequestContext::GetEndpoint() {
+    return endpoint_;
+}
+
+uint64_t Context::RequestContext::GetInstanceId() const {
+    return instance_id_;
 }
 
 protocol::Opcode Context::RequestContext::GetOpcode() const {
@@ -74,9 +185,9 @@ google::protobuf::io::ZeroCopyInputStream& Context::RequestContext::GetPayload()
 
 bool Context::RequestContext::SetResponse(Result result, const google::protobuf::Message* payload) {
     if (response_packet_ != nullptr) {
-        enet_packet_destroy(response_packet_);
+        PacketPool::Destroy(response_packet_);
     }
-    response_packet_ = CreateResponsePacket(opcode_, session_, result, payload);
+    response_packet_ = CreateResponsePacket(opcode_, object_id_, session_, result, payload);
     response_dirty_ = (response_packet_ != nullptr);
     return response_dirty_;
 }
@@ -84,15 +195,27 @@ bool Context::RequestContext::SetResponse(Result result, const google::protobuf:
 void Context::RequestContext::FlushResponse() {
     if (response_dirty_) {
         if (response_packet_ == nullptr) {
-            response_packet_ = CreateResponsePacket(opcode_, session_, Result::kUnknown);
+            response_packet_ = CreateResponsePacket(opcode_, object_id_, session_, Result::kUnknown);
         }
-        if (response_packet_ != nullptr) {
+        if (response_packet_ != nullptr && batch_response_ != nullptr) {
+            auto data = reinterpret_cast<const char*>(enet_packet_get_data(response_packet_));
+            auto size = enet_packet_get_length(response_packet_) - sizeof(protocol::Header);
+            protocol::AttachResult record = {};
+            record.object = htonl(object_id_);
+            record.result = reinterpret_cast<const protocol::Header*>(data)->extra_data;
+            record.size = htonl(static_cast<uint32_t>(size));
+            batch_response_->append(reinterpret_cast<const char*>(&record), sizeof(record));
+            batch_response_->append(data + sizeof(protocol::Header), size);
+            PacketPool::Destroy(response_packet_);
+            response_packet_ = nullptr;
+            response_dirty_ = false;
+        } else if (response_packet_ != nullptr) {
             auto context = context_.lock();
             if (context) {
                 if (context->SendPacket(enet_peer_, response_packet_)) {
                     response_dirty_ = false;
                 } else {
-                    enet_packet_destroy(response_packet_);
+                    PacketPool::Destroy(response_packet_);
                 }
             }
             response_packet_ = nullptr;
@@ -100,13 +223,52 @@ void Context::RequestContext::FlushResponse() {
     }
 }
 
+// Context::RawEvent
+
+Context::RawEvent::RawEvent(const uint8_t* meta, size_t meta_size, const uint8_t* bytes, size_t bytes_size, PacketRef& packet)
+    : meta_(meta)
+    , meta_size_(meta_size)
+    , bytes_(bytes)
+    , bytes_size_(bytes_size)
+    , packet_(packet) {
+}
+
+const uint8_t* Context::RawEvent::GetMeta() const {
+    return meta_;
+}
+
+size_t Context::RawEvent::GetMetaSize() const {
+    return meta_size_;
+}
+
+size_t Context::RawEvent::GetBytesSize() const {
+    return bytes_size_;
+}
+
+ByteArray Context::RawEvent::GetBytes() {
+    auto packet = packet_.Share();
+    return ByteArray(const_cast<uint8_t*>(bytes_), bytes_size_, [packet](uint8_t*, size_t, void*) {});
+}
+
 // Context
 
 Context::Context()
     : is_enabled_(false)
     , enet_host_(nullptr)
     , backend_run_(false)
-    , session_(1) {
+    , async_pending_(false)
+    , shared_peer_(nullptr)
+    , next_object_id_(1)
+    , transport_(Transport::kEnet)
+    , send_queue_config_{ kSendQueueMaxBytes, kSendQueueMaxPackets, SendQueuePolicy::kDropNewest, kSendQueueTimeout }
+    , retry_attempts_(0)
+    , retry_random_(std::random_device()())
+    , timer_wheel_(std::chrono::milliseconds(10), 512)
+    , next_timer_id_(1)
+    , busy_poll_()
+    , packet_pool_stats_()
+    , io_batch_(kIoBatch) {
+    PacketPool::Install();
 }
 
 Context::~Context() {
@@ -126,13 +288,13 @@ bool Context::StartAsClient(const ENetAddress* enet_address) {
         return false;
     }
 
-    if (backend_run_ && pipe_.IsOpen()) {
+    if (backend_run_ && poller_.IsOpen()) {
         ASBLog(ERROR) << "ENet host has already started.";
         return false;
     }
 
     assert(enet_host_ == nullptr);
-    enet_host_ = enet_host_create(nullptr, 256, 1, 0, 0);
+    enet_host_ = enet_host_create(nullptr, 8, kChannelCount, 0, 0);
     if (enet_host_ == nullptr) {
         return false;
     }
@@ -148,13 +310,22 @@ bool Context::StartAsClient(const ENetAddress* enet_address) {
 
     enet_host_guard.Dismiss();
 
+    const char* env_capture = getenv("SF_MSGBUS_BLACKBOX2_CAPTURE");
+    if (env_capture != nullptr && atoi(env_capture) > 0) {
+        if (!capture_) {
+            capture_.reset(new Capture(atoi(env_capture)));
+        }
+        capture_->Start();
+        ASBLog(INFO) << "Blackbox2 capture enabled, ring size " << atoi(env_capture);
+    }
+
     return true;
 }
 
-bool Context::StartAsServer(ConnectHandler handler, const ENetAddress* enet_address) {
+bool Context::StartAsServer(ConnectHandler handler, const ENetAddress* enet_address, bool reuse_port) {
     std::unique_lock<std::mutex> lg(mutex_);
 
-    if (backend_run_ && pipe_.IsOpen()) {
+    if (backend_run_ && poller_.IsOpen()) {
         ASBLog(ERROR) << "ENet host has already started.";
         return false;
     }
@@ -162,10 +333,16 @@ bool Context::StartAsServer(ConnectHandler handler, const ENetAddress* enet_addr
     InitConfig(enet_address);
 
     assert(enet_host_ == nullptr);
-    enet_host_ = enet_host_create(&server_address_, 512, 1, 0, 0);
-    if (enet_host_ == nullptr) {
-        ASBLog(ERROR) << "Failed to create enet host.";
-        return false;
+    if (reuse_port) {
+        if (!CreateReusePortHost()) {
+            return false;
+        }
+    } else {
+        enet_host_ = enet_host_create(&server_address_, 512, kChannelCount, 0, 0);
+        if (enet_host_ == nullptr) {
+            ASBLog(ERROR) << "Failed to create enet host.";
+            return false;
+        }
     }
 
     auto enet_host_guard = MakeScopeGuard([this] {
@@ -185,32 +362,94 @@ bool Context::StartAsServer(ConnectHandler handler, const ENetAddress* enet_addr
 }
 
 void Context::Stop() {
+    // The capture worker sends through the context, stop it first.
+    if (capture_) {
+        capture_->Stop();
+    }
+
     std::unique_lock<std::mutex> lg(mutex_);
 
     if (backend_run_) {
-        assert(pipe_.IsOpen());
-        char quit_cmd = AsyncCommand::kAsyncExit;
-        if (pipe_.Write(&quit_cmd, 1) == 1) {
+        assert(poller_.IsOpen());
+        backend_run_ = false;
+        if (poller_.Wakeup()) {
             ScopedUnlocker<std::mutex> unlocker(mutex_);
             backend_thread_.join();
         } else {
-            ASBLog(ERROR) << "Failed to write enet async pipe: " << strerror(errno);
+            ASBLog(ERROR) << "Failed to wake up backend thread: " << strerror(errno);
+        }
+    }
+
+    poller_.Close();
+
+    for (auto& qit: bulk_queue_map_) {
+        for (auto enet_pkt: qit.second.packets) {
+            PacketPool::Destroy(enet_pkt);
         }
     }
 
-    pipe_.Close();
+    for (auto& tit: trailer_map_) {
+        PacketPool::Destroy(tit.second);
+    }
+    trailer_map_.clear();
+
+    // Links release their pending packets into the bulk queues.
+    for (auto& lit: local_peers_) {
+        ReleasePeerBlock(lit.first);
+    }
+    local_peers_.clear();
+    local_listener_.Close();
 
     if (enet_host_ != nullptr) {
+        for (size_t i = 0; i < enet_host_->peerCount; ++i) {
+            ReleasePeerBlock(&enet_host_->peers[i]);
+        }
         enet_host_destroy(enet_host_);
         enet_host_ = nullptr;
     }
 
+    bulk_queue_map_.clear();
+    bulk_queue_cv_.notify_all();
+    drop_report_map_.clear();
+    event_batch_map_.clear();
+    attach_batch_map_.clear();
+    shared_peer_ = nullptr;
     pending_connections_.clear();
     pending_disconnections_.clear();
-    disconnect_handler_map_.clear();
+    timer_wheel_.Clear();
+    scheduled_timers_.clear();
+    retry_callbacks_.clear();
+    retry_attempts_ = 0;
     connect_handler_ = nullptr;
 }
 
+// Accepts the local links of the clients on the same host.
+bool Context::ListenLocal() {
+    std::lock_guard<std::mutex> lg(mutex_);
+    if (!backend_run_ || !poller_.IsOpen()) {
+        ASBLog(ERROR) << "Listen local links before the context has started.";
+        return false;
+    }
+    // Handshakes are watched until the link is added, all on the backend.
+    auto watch_handler = [this](ENetSocket socket, bool watch) {
+        if (!watch) {
+            poller_.Unwatch(socket);
+            return true;
+        }
+        return poller_.Watch(socket);
+    };
+    if (!local_listener_.Listen(GetLocalLinkName(server_address_.port), watch_handler)) {
+        return false;
+    }
+    if (!poller_.Watch(local_listener_.GetSocket())) {
+        ASBLog(ERROR) << "Failed to watch local listener, " << strerror(errno);
+        local_listener_.Close();
+        return false;
+    }
+    WakeupBackend();
+    return true;
+}
+
 bool Context::Connect(ConnectCallback cb) {
     std::unique_lock<std::mutex> lg(mutex_);
 
@@ -219,151 +458,292 @@ bool Context::Connect(ConnectCallback cb) {
         return false;
     }
 
-    ENetPeer* enet_peer = enet_host_connect(enet_host_, &server_address_, 1, 0);
-    if (enet_peer == nullptr) {
-        ASBLog(ERROR) << "Connect failed.";
-        return false;
+    // All objects of the process share one peer, a new peer is only created
+    // when there is none or the previous one has been lost.
+    if (shared_peer_ == nullptr && transport_ != Transport::kEnet) {
+        shared_peer_ = ConnectLocal();
+    }
+    if (shared_peer_ == nullptr) {
+        shared_peer_ = enet_host_connect(enet_host_, &server_address_, kChannelCount, 0);
+        if (shared_peer_ == nullptr) {
+            ASBLog(ERROR) << "Connect failed.";
+            return false;
+        }
+        //ASBLog(INFO) << "Peer " << shared_peer_ << " connecting...";
+        enet_peer_timeout(shared_peer_, 3, 1000, 4000);
     }
 
-    //ASBLog(INFO) << "Peer " << enet_peer << " connecting...";
-
-    enet_peer_timeout(enet_peer, 3, 1000, 4000);
-    pending_connections_[enet_peer] = std::move(cb);
+    auto endpoint = CreateEndpoint(shared_peer_, next_object_id_);
+    if (endpoint == nullptr) {
+        ASBLog(ERROR) << "Failed to create endpoint.";
+        return false;
+    }
+    next_object_id_ = std::max<uint32_t>(next_object_id_ + 1, 1);
+    pending_connections_[endpoint] = std::move(cb);
     WakeupBackend();
 
     return true;
 }
 
-bool Context::Disconnect(ENetPeer* enet_peer, DisconnectCallback cb) {
-    assert(enet_peer != nullptr);
+bool Context::Disconnect(Endpoint* endpoint, DisconnectCallback cb) {
+    assert(endpoint != nullptr);
     std::unique_lock<std::mutex> lg(mutex_);
-    if (enet_host_ == nullptr || enet_peer == nullptr) {
-        ASBLog(ERROR) << "Disconnect with invalid enet_host or invalid enet_peer.";
+    if (enet_host_ == nullptr || endpoint == nullptr) {
+        ASBLog(ERROR) << "Disconnect with invalid enet_host or invalid endpoint.";
         return false;
     }
-    if (pending_disconnections_.count(enet_peer) == 0) {
-        enet_peer_disconnect(enet_peer, 0);
-        if (cb) {
-            pending_disconnections_[enet_peer] = std::move(cb);
+    if (FindEndpoint(endpoint->enet_peer, endpoint->object_id) != endpoint) {
+        ASBLog(WARNING) << "Endpoint " << endpoint << " is already disconnected.";
+        return false;
+    }
+    // Only the endpoint is closed, the peer stays up for the other objects.
+    if (endpoint->enet_peer->state == ENET_PEER_STATE_CONNECTED) {
+        auto enet_pkt = CreatePacket(protocol::Type::kClose, protocol::Opcode::kInvalid, endpoint->object_id, 0);
+        if (!SendPacket(endpoint->enet_peer, enet_pkt) && enet_pkt != nullptr) {
+            PacketPool::Destroy(enet_pkt);
         }
-        WakeupBackend();
+    }
+    RemoveEndpoint(endpoint);
+    if (cb) {
+        pending_disconnections_.push_back(std::move(cb));
+    }
+    WakeupBackend();
+    return true;
+}
+
+bool Context::SendEvent(Endpoint* endpoint, protocol::Opcode opcode, const google::protobuf::Message* payload,
+                        protocol::Delivery delivery) {
+    assert(endpoint != nullptr);
+    std::lock_guard<std::mutex> lg(mutex_);
+    return SendPacket(endpoint, protocol::Type::kEvent, opcode, 0, payload, delivery);
+}
+
+bool Context::SendEvent(Endpoint* endpoint, protocol::Opcode opcode, const void* meta, size_t meta_size, const ByteArray& bytes,
+                        protocol::Delivery delivery) {
+    assert(endpoint != nullptr);
+    std::unique_lock<std::mutex> lg(mutex_);
+    if (opcode == protocol::Opcode::kMessage && !WaitBulkQueue(lg, endpoint)) {
+        ASBLog(ERROR) << "Endpoint " << endpoint << " disconnected while waiting for its send queue.";
+        return false;
+    }
+    return SendRawPacket(endpoint, opcode, meta, meta_size, bytes, delivery);
+}
+
+bool Context::SendRequest(Endpoint* endpoint, protocol::Opcode opcode, const google::protobuf::Message* payload, RequestCallback cb,
+                          std::chrono::milliseconds timeout, uint32_t* session) {
+    assert(endpoint != nullptr);
+    assert(cb);
+    std::lock_guard<std::mutex> lg(mutex_);
+    auto peer_block = GetPeerBlock(endpoint->enet_peer);
+    if (peer_block == nullptr) {
+        ASBLog(ERROR) << "Send request with unknown endpoint " << endpoint;
+        return false;
+    }
+    // Sessions are per peer, 0 is never used.
+    auto request_session = peer_block->next_session;
+    peer_block->next_session = std::max<uint32_t>(request_session + 1, 1);
+    if (!SendPacket(endpoint, protocol::Type::kRequest, opcode, request_session, payload)) {
+        return false;
+    }
+    //ASBLog(INFO) << "Send request: opcode " << static_cast<uint8_t>(opcode) << ", session " << request_session;
+    auto enet_peer = endpoint->enet_peer;
+    auto object_id = endpoint->object_id;
+    auto timer = timer_wheel_.Add(TimerWheel::Clock::now() + timeout, [this, enet_peer, object_id, request_session] {
+        HandleRequestTimeout(enet_peer, object_id, request_session);
+    });
+    static_cast<EndpointBlock*>(endpoint)->sessions[request_session] = RequestSession{ std::move(cb), timer };
+    if (session != nullptr) {
+        *session = request_session;
+    }
+    // Let the backend thread pick up the new deadline.
+    WakeupBackend();
+    return true;
+}
+
+bool Context::CancelRequest(Endpoint* endpoint, uint32_t session) {
+    assert(endpoint != nullptr);
+    std::lock_guard<std::mutex> lg(mutex_);
+    auto& sessions = static_cast<EndpointBlock*>(endpoint)->sessions;
+    auto it = sessions.find(session);
+    if (it == sessions.end()) {
+        return false;
+    }
+    timer_wheel_.Cancel(it->second.timer);
+    sessions.erase(it);
+    return true;
+}
+
+// An object attached before sends only the digest of an unchanged payload,
+// the server resumes it from the payload it kept.
+bool Context::SendAttach(Endpoint* endpoint, uint64_t instance_id, protocol::Opcode opcode, const google::protobuf::Message& payload,
+                         RequestCallback cb, std::chrono::milliseconds timeout) {
+    assert(endpoint != nullptr);
+    assert(cb);
+    std::lock_guard<std::mutex> lg(mutex_);
+    auto enet_peer = endpoint->enet_peer;
+    if (GetPeerBlock(enet_peer) == nullptr || enet_peer->state != ENET_PEER_STATE_CONNECTED) {
+        ASBLog(ERROR) << "Send attach with unconnected endpoint " << endpoint;
+        return false;
+    }
+    std::string data;
+    if (!payload.SerializeToString(&data)) {
+        ASBLog(ERROR) << "Failed to serialize attach payload.";
+        return false;
+    }
+    auto block = static_cast<EndpointBlock*>(endpoint);
+    uint32_t session;
+    if (instance_id != 0) {
+        auto digest = protocol::Digest(data.data(), data.size());
+        auto rit = resumable_.find(instance_id);
+        bool resume = (rit != resumable_.end() && rit->second == digest);
+        session = QueueAttachRecord(endpoint, opcode, resume ? protocol::kAttachResume : 0, instance_id, digest,
+                                    resume ? std::string() : data);
+        block->attach.reset(new PendingAttach{ opcode, instance_id, digest, std::move(data), timeout });
     } else {
-        ASBLog(WARNING) << "Peer " << enet_peer << " is in disconnecting.";
+        session = QueueAttachRecord(endpoint, opcode, 0, 0, 0, data);
     }
+    auto object_id = endpoint->object_id;
+    auto timer = timer_wheel_.Add(TimerWheel::Clock::now() + timeout, [this, enet_peer, object_id, session] {
+        HandleRequestTimeout(enet_peer, object_id, session);
+    });
+    block->sessions[session] = RequestSession{ std::move(cb), timer };
+    WakeupBackend();
     return true;
 }
 
-bool Context::SendEvent(ENetPeer* enet_peer, protocol::Opcode opcode, const google::protobuf::Message* payload) {
-    assert(enet_peer != nullptr);
+void Context::RetryLater(std::function<void ()> cb) {
     std::lock_guard<std::mutex> lg(mutex_);
-    return SendPacket(enet_peer, protocol::Type::kEvent, opcode, 0, payload);
+    retry_callbacks_.push_back(std::move(cb));
+    if (retry_callbacks_.size() > 1) {
+        return;
+    }
+    // Full jitter, the processes that lost the server together spread their
+    // reconnects over the whole delay.
+    auto max_delay = std::min<std::chrono::milliseconds>(kRetryMaxDelay, kRetryBaseDelay * (1 << std::min<uint32_t>(retry_attempts_, 16)));
+    std::uniform_int_distribution<int64_t> distribution(0, max_delay.count());
+    auto delay = std::chrono::milliseconds(distribution(retry_random_));
+    ++retry_attempts_;
+    ASBLog(INFO) << "Reconnect in " << delay.count() << " ms, attempt " << retry_attempts_;
+    timer_wheel_.Add(TimerWheel::Clock::now() + delay, [this] {
+        HandleRetry();
+    });
+    WakeupBackend();
 }
 
-bool Context::SendRequest(ENetPeer* enet_peer, protocol::Opcode opcode, const google::protobuf::Message* payload, RequestCallback cb) {
-    assert(enet_peer != nullptr);
+Context::TimerId Context::Schedule(std::chrono::milliseconds delay, TimerCallback cb, std::chrono::milliseconds period) {
     assert(cb);
     std::lock_guard<std::mutex> lg(mutex_);
-    if (SendPacket(enet_peer, protocol::Type::kRequest, opcode, session_, payload)) {
-        //ASBLog(INFO) << "Send request: opcode " << static_cast<uint8_t>(opcode) << ", session " << session_;
-        request_session_map_[enet_peer][session_] = std::move(cb);
-        session_ += 1;
-        return true;
+    auto id = next_timer_id_++;
+    AddScheduledTimer(id, TimerWheel::Clock::now() + delay, std::make_shared<TimerCallback>(std::move(cb)), period);
+    // Let the backend thread pick up the new deadline.
+    WakeupBackend();
+    return id;
+}
+
+bool Context::CancelTimer(TimerId id) {
+    std::lock_guard<std::mutex> lg(mutex_);
+    auto it = scheduled_timers_.find(id);
+    if (it == scheduled_timers_.end()) {
+        return false;
     }
-    return false;
+    timer_wheel_.Cancel(it->second);
+    scheduled_timers_.erase(it);
+    return true;
+}
+
+void Context::SetResumeCache(std::shared_ptr<ResumeCache> resume_cache) {
+    std::lock_guard<std::mutex> lg(mutex_);
+    resume_cache_ = std::move(resume_cache);
+}
+
+void Context::RegisterDisconnectHandler(Endpoint* endpoint, DisconnectHandler handler) {
+    assert(endpoint != nullptr);
+    assert(handler);
+    std::unique_lock<std::mutex> lg(mutex_);
+    static_cast<EndpointBlock*>(endpoint)->disconnect_handler = std::move(handler);
 }
 
-void Context::RegisterDisconnectHandler(ENetPeer* enet_peer, DisconnectHandler handler) {
-    assert(enet_peer != nullptr);
+void Context::RegisterEventHandler(Endpoint* endpoint, protocol::Opcode opcode, EventHandler handler) {
+    assert(endpoint != nullptr);
     assert(handler);
+    if (opcode >= protocol::Opcode::kMax) {
+        ASBLog(ERROR) << "Register event handler with invalid opcode " << static_cast<uint32_t>(opcode);
+        return;
+    }
     std::unique_lock<std::mutex> lg(mutex_);
+    auto& slot = static_cast<EndpointBlock*>(endpoint)->event_handlers[static_cast<size_t>(opcode)];
     if (!handler) {
-        auto it = disconnect_handler_map_.find(enet_peer);
-        if (it != disconnect_handler_map_.end()) {
-            disconnect_handler_map_.erase(it);
-        }
+        slot.reset();
     } else {
-        disconnect_handler_map_[enet_peer] = std::move(handler);
+        slot = std::make_shared<EventHandler>(std::move(handler));
     }
 }
 
-void Context::RegisterEventHandler(ENetPeer* enet_peer, protocol::Opcode opcode, EventHandler handler) {
-    assert(enet_peer != nullptr);
+void Context::RegisterRawEventHandler(Endpoint* endpoint, protocol::Opcode opcode, RawEventHandler handler) {
+    assert(endpoint != nullptr);
     assert(handler);
+    if (opcode >= protocol::Opcode::kMax) {
+        ASBLog(ERROR) << "Register raw event handler with invalid opcode " << static_cast<uint32_t>(opcode);
+        return;
+    }
     std::unique_lock<std::mutex> lg(mutex_);
+    auto& slot = static_cast<EndpointBlock*>(endpoint)->raw_event_handlers[static_cast<size_t>(opcode)];
     if (!handler) {
-        auto pit = event_handler_map_.find(enet_peer);
-        if (pit == event_handler_map_.end()) {
-            return;
-        }
-        auto hit = pit->second.find(opcode);
-        if (hit == pit->second.end()) {
-            return;
-        }
-        pit->second.erase(hit);
-        if (pit->second.empty()) {
-            event_handler_map_.erase(pit);
-        }
+        slot.reset();
     } else {
-        event_handler_map_[enet_peer][opcode] = std::move(handler);
+        slot = std::make_shared<RawEventHandler>(std::move(handler));
     }
 }
 
-void Context::RegisterRequestHandler(ENetPeer* enet_peer, protocol::Opcode opcode, RequestHandler handler) {
-    assert(enet_peer != nullptr);
+void Context::RegisterRequestHandler(Endpoint* endpoint, protocol::Opcode opcode, RequestHandler handler) {
+    assert(endpoint != nullptr);
     assert(handler);
+    if (opcode >= protocol::Opcode::kMax) {
+        ASBLog(ERROR) << "Register request handler with invalid opcode " << static_cast<uint32_t>(opcode);
+        return;
+    }
     std::unique_lock<std::mutex> lg(mutex_);
+    auto& slot = static_cast<EndpointBlock*>(endpoint)->request_handlers[static_cast<size_t>(opcode)];
     if (!handler) {
-        auto pit = request_handler_map_.find(enet_peer);
-        if (pit == request_handler_map_.end()) {
-            return;
-        }
-        auto hit = pit->second.find(opcode);
-        if (hit == pit->second.end()) {
-            return;
-        }
-        pit->second.erase(hit);
-        if (pit->second.empty()) {
-            request_handler_map_.erase(pit);
-        }
+        slot.reset();
     } else {
-        request_handler_map_[enet_peer][opcode] = std::move(handler);
+        slot = std::make_shared<RequestHandler>(std::move(handler));
     }
 }
 
-void Context::UnregisterAll(ENetPeer* enet_peer) {
-    assert(enet_peer != nullptr);
-    ASBLog(INFO) << "Peer " << enet_peer << " unregister all...";
+uint64_t Context::GetConflatedCount(Endpoint* endpoint) {
+    assert(endpoint != nullptr);
+    std::lock_guard<std::mutex> lg(mutex_);
+    return static_cast<EndpointBlock*>(endpoint)->conflated;
+}
+
+void Context::UnregisterAll(Endpoint* endpoint) {
+    assert(endpoint != nullptr);
+    ASBLog(INFO) << "Endpoint " << endpoint << " unregister all...";
     std::unique_lock<std::mutex> lg(mutex_);
-    auto ehit = event_handler_map_.find(enet_peer);
-    if (ehit != event_handler_map_.end()) {
-        event_handler_map_.erase(ehit);
-    }
-    auto rhit = request_handler_map_.find(enet_peer);
-    if (rhit != request_handler_map_.end()) {
-        request_handler_map_.erase(rhit);
-    }
-    auto rsit = request_session_map_.find(enet_peer);
-    if (rsit != request_session_map_.end()) {
-        request_session_map_.erase(rsit);
+    auto block = static_cast<EndpointBlock*>(endpoint);
+    for (auto& slot: block->event_handlers) {
+        slot.reset();
     }
-    auto pcit = pending_connections_.find(enet_peer);
-    if (pcit != pending_connections_.end()) {
-        pending_connections_.erase(pcit);
+    for (auto& slot: block->raw_event_handlers) {
+        slot.reset();
     }
-    auto pdit = pending_disconnections_.find(enet_peer);
-    if (pdit != pending_disconnections_.end()) {
-        pending_disconnections_.erase(pdit);
-    }
-    auto dhit = disconnect_handler_map_.find(enet_peer);
-    if (dhit != disconnect_handler_map_.end()) {
-        disconnect_handler_map_.erase(dhit);
+    for (auto& slot: block->request_handlers) {
+        slot.reset();
     }
+    block->disconnect_handler = nullptr;
+    ClearSessions(block);
+    pending_connections_.erase(endpoint);
 }
 
 const ENetAddress& Context::GetServerAddress() {
     return server_address_;
 }
 
+Capture* Context::GetCapture() {
+    return capture_.get();
+}
+
 void Context::InitConfig(const ENetAddress *enet_address) {
     const char* env_enable = getenv("SF_MSGBUS_BLACKBOX2_ENABLE");
     if (env_enable != nullptr && env_enable[0] == '1') {
@@ -386,26 +766,126 @@ void Context::InitConfig(const ENetAddress *enet_address) {
     } else {
         server_address_ = *enet_address;
     }
+    send_queue_config_ = SendQueueConfig{ kSendQueueMaxBytes, kSendQueueMaxPackets, SendQueuePolicy::kDropNewest,
+                                          kSendQueueTimeout };
+    const char* env_queue_bytes = getenv("SF_MSGBUS_BLACKBOX2_SEND_QUEUE_BYTES");
+    if (env_queue_bytes != nullptr && atoll(env_queue_bytes) > 0) {
+        send_queue_config_.max_bytes = static_cast<size_t>(atoll(env_queue_bytes));
+    }
+    const char* env_queue_packets = getenv("SF_MSGBUS_BLACKBOX2_SEND_QUEUE_PACKETS");
+    if (env_queue_packets != nullptr && atoll(env_queue_packets) > 0) {
+        send_queue_config_.max_packets = static_cast<size_t>(atoll(env_queue_packets));
+    }
+    const char* env_queue_policy = getenv("SF_MSGBUS_BLACKBOX2_SEND_QUEUE_POLICY");
+    if (env_queue_policy != nullptr) {
+        if (strcmp(env_queue_policy, "drop-oldest") == 0) {
+            send_queue_config_.policy = SendQueuePolicy::kDropOldest;
+        } else if (strcmp(env_queue_policy, "block") == 0) {
+            send_queue_config_.policy = SendQueuePolicy::kBlock;
+        } else if (strcmp(env_queue_policy, "drop-newest") != 0) {
+            ASBLog(WARNING) << "Unknown send queue policy " << env_queue_policy << ", drop-newest is used.";
+        }
+    }
+    const char* env_queue_timeout = getenv("SF_MSGBUS_BLACKBOX2_SEND_QUEUE_TIMEOUT");
+    if (env_queue_timeout != nullptr && atoi(env_queue_timeout) >= 0) {
+        send_queue_config_.timeout = std::chrono::milliseconds(atoi(env_queue_timeout));
+    }
+    ASBLog(INFO) << "Blackbox2 send queue: " << send_queue_config_.max_bytes << " bytes, "
+                 << send_queue_config_.max_packets << " packets, "
+                 << GetSendQueuePolicyName(static_cast<int>(send_queue_config_.policy)) << ", "
+                 << send_queue_config_.timeout.count() << " ms.";
+    // Microseconds the backend spins after its last work before it parks.
+    busy_poll_.spin = std::chrono::microseconds(0);
+    const char* env_busy_poll = getenv("SF_MSGBUS_BLACKBOX2_BUSY_POLL");
+    if (env_busy_poll != nullptr && atoll(env_busy_poll) > 0) {
+        busy_poll_.spin = std::chrono::microseconds(atoll(env_busy_poll));
+        ASBLog(INFO) << "Blackbox2 busy poll, spin " << busy_poll_.spin.count() << " us before parking.";
+    }
+    // Datagrams per recvmmsg/sendmmsg, 1 sends and receives them one by one.
+    io_batch_ = kIoBatch;
+    const char* env_io_batch = getenv("SF_MSGBUS_BLACKBOX2_IO_BATCH");
+    if (env_io_batch != nullptr && atoi(env_io_batch) >= 0) {
+        io_batch_ = static_cast<size_t>(atoi(env_io_batch));
+    }
+    transport_ = Transport::kEnet;
+    const char* env_transport = getenv("SF_MSGBUS_BLACKBOX2_TRANSPORT");
+    if (env_transport != nullptr) {
+        if (strcmp(env_transport, "shm") == 0) {
+            transport_ = Transport::kShm;
+        } else if (strcmp(env_transport, "unix") == 0) {
+            transport_ = Transport::kUnix;
+        } else if (strcmp(env_transport, "enet") != 0) {
+            ASBLog(WARNING) << "Unknown transport " << env_transport << ", enet is used.";
+        }
+    }
     char host_name[64] = { 0 };
     enet_address_get_host_new(&server_address_, host_name, 60);
     ASBLog(INFO) << "Blackbox2 server: " << host_name << ":" << server_address_.port;
 }
 
+// Servers sharing the port with SO_REUSEPORT. The kernel hashes each client
+// address to one of the sockets, so a peer stays with the host it connected to.
+bool Context::CreateReusePortHost() {
+#ifdef SO_REUSEPORT
+    enet_host_ = enet_host_create(nullptr, 512, kChannelCount, 0, 0);
+    if (enet_host_ == nullptr) {
+        ASBLog(ERROR) << "Failed to create enet host.";
+        return false;
+    }
+    int value = 1;
+    if (setsockopt(enet_host_->socket, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value)) < 0 ||
+        enet_socket_bind(enet_host_->socket, &server_address_) < 0) {
+        ASBLog(ERROR) << "Failed to bind enet host with SO_REUSEPORT, " << strerror(errno);
+        enet_host_destroy(enet_host_);
+        enet_host_ = nullptr;
+        return false;
+    }
+    enet_socket_get_address(enet_host_->socket, &enet_host_->address);
+    return true;
+#else
+    ASBLog(ERROR) << "SO_REUSEPORT is not supported.";
+    return false;
+#endif
+}
+
 bool Context::Start() {
-    assert(!pipe_.IsOpen());
-    if (!pipe_.Open()) {
-        ASBLog(ERROR) << "Failed to create async pipe, " << strerror(errno);
+    assert(!poller_.IsOpen());
+    if (!poller_.Open()) {
+        ASBLog(ERROR) << "Failed to create poller, " << strerror(errno);
         return false;
     }
-    auto pipe_guard = MakeScopeGuard([this] {
-        pipe_.Close();
+    auto poller_guard = MakeScopeGuard([this] {
+        poller_.Close();
     });
+    if (!poller_.Watch(enet_host_->socket)) {
+        ASBLog(ERROR) << "Failed to watch enet socket, " << strerror(errno);
+        return false;
+    }
     backend_run_ = true;
     auto backend_run_guard = MakeScopeGuard([this] {
         backend_run_ = false;
     });
+#if defined(SF_MSGBUS_BLACKBOX2_SERVER) || defined(SF_MSGBUS_BLACKBOX2_OWNS_ENET)
+    // The host layout is only ours if the enet implementation is.
+    if (enet_host_io_batch(enet_host_, io_batch_) < 0) {
+        ASBLog(WARNING) << "Failed to batch enet socket io, datagrams are sent one by one.";
+    }
+#endif
+    busy_poll_.is_spinning = false;
+    busy_poll_.last_work = std::chrono::steady_clock::now();
+    if (busy_poll_.spin.count() > 0) {
+        AddScheduledTimer(next_timer_id_++, TimerWheel::Clock::now() + kBusyPollReportInterval,
+                          std::make_shared<TimerCallback>([this] {
+                              ReportBusyPoll();
+                          }), kBusyPollReportInterval);
+    }
+    packet_pool_stats_ = PacketPool::GetStats();
+    AddScheduledTimer(next_timer_id_++, TimerWheel::Clock::now() + kPacketPoolReportInterval,
+                      std::make_shared<TimerCallback>([this] {
+                          ReportPacketPool();
+                      }), kPacketPoolReportInterval);
     backend_thread_ = std::thread(std::bind(&Context::BackendThread, this));
-    pipe_guard.Dismiss();
+    poller_guard.Dismiss();
     backend_run_guard.Dismiss();
     return true;
 }
@@ -415,10 +895,14 @@ bool Context::WakeupBackend() {
         ASBLog(WARNING) << "Backend thread is not running.";
         return false;
     }
-    assert(pipe_.IsOpen());
-    char pipe_cmd = AsyncCommand::kAsyncWakeup;
-    if (pipe_.Write(&pipe_cmd, 1) != 1) {
-        ASBLog(ERROR) << "Failed to write async pipe.";
+    async_pending_ = true;
+    // The backend thread drains everything before it waits again.
+    if (std::this_thread::get_id() == backend_thread_.get_id() || busy_poll_.is_spinning) {
+        return true;
+    }
+    assert(poller_.IsOpen());
+    if (!poller_.Wakeup()) {
+        ASBLog(ERROR) << "Failed to wake up backend thread.";
         return false;
     }
     return true;
@@ -434,49 +918,61 @@ void Context::BackendThread() {
         ASBLog(INFO) << "Backend thread exited.";
     });
 
-    assert(pipe_.IsOpen());
+    assert(poller_.IsOpen());
 
     int ret;
-    int skmax;
-    int pipe_rh = pipe_.GetReadHandle();
-    ENetSocketSet skset;
 
     while (backend_run_) {
-        ENET_SOCKETSET_EMPTY(skset);
-        ENET_SOCKETSET_ADD(skset, pipe_rh);
-
-        if (enet_host_ != nullptr) {
-            HandleService();
+        auto pass_start = std::chrono::steady_clock::now();
+        auto work_count = busy_poll_.work_count;
+        HandleAsyncCommand();
+        HandleService();
+        HandleLocalPeers();
+        HandleTimers();
+        FlushAttachBatches();
+        FlushBatches();
+        FlushBulkQueues();
+        ReportDrops();
+        FlushLocalPeers();
+
+        if (busy_poll_.spin.count() > 0) {
+            auto now = std::chrono::steady_clock::now();
+            if (busy_poll_.work_count != work_count) {
+                busy_poll_.work_time += now - pass_start;
+                busy_poll_.last_work = now;
+            } else {
+                busy_poll_.spin_time += now - pass_start;
+            }
+            if (now - busy_poll_.last_work < busy_poll_.spin) {
+                // Gives the senders a chance at the mutex between passes.
+                busy_poll_.is_spinning = true;
+                ScopedUnlocker<std::mutex> unlocker(mutex_);
+                std::this_thread::yield();
+                continue;
+            }
+            busy_poll_.is_spinning = false;
         }
 
-        if (enet_host_ != nullptr) {
-            ENET_SOCKETSET_ADD(skset, enet_host_->socket);
-            skmax = std::max(skmax, (int)(enet_host_->socket));
-        } else {
-            skmax = pipe_rh;
+        if (async_pending_ || !backend_run_ || !PrepareLocalWait()) {
+            continue;
         }
 
+        auto timeout = GetWaitTimeout();
+        auto park_start = std::chrono::steady_clock::now();
         {
             ScopedUnlocker<std::mutex> unlocker(mutex_);
-            ret = enet_socketset_select(skmax + 1, &skset, nullptr, 1000);
-        }
-
-        if (enet_host_ != nullptr) {
-            HandleService();
+            ret = poller_.Wait(timeout);
         }
-
-        if (ret > 0) {
-            if (ENET_SOCKETSET_CHECK(skset, pipe_rh)) {
-                HandleAsyncCommand();
-            }
-            continue;
+        if (busy_poll_.spin.count() > 0) {
+            busy_poll_.park_time += std::chrono::steady_clock::now() - park_start;
+            ++busy_poll_.parks;
         }
 
         if (ret < 0) {
-            ASBLog(ERROR) << "ENet select failed, " << strerror(errno);
             if (errno == EINTR) {
                 continue;
             }
+            ASBLog(ERROR) << "Poller wait failed, " << strerror(errno);
             break;
         }
     }
@@ -490,7 +986,7 @@ void Context::HandleService() {
     while (enet_host_service(enet_host_, &enet_evt, 0) > 0) {
         switch (enet_evt.type) {
         case ENET_EVENT_TYPE_RECEIVE:
-            HandlePacket(enet_evt.peer, enet_evt.packet);
+            HandlePacket(enet_evt.peer, enet_evt.channelID, enet_evt.packet);
             break;
         case ENET_EVENT_TYPE_CONNECT:
             HandleConnect(enet_evt.peer);
@@ -506,62 +1002,282 @@ void Context::HandleService() {
     }
 }
 
-void Context::HandleConnect(ENetPeer* enet_peer) {
-    ASBLog(INFO) << "Peer " << enet_peer << " connected.";
-    auto it = pending_connections_.find(enet_peer);
-    if (it != pending_connections_.end()) {
-        ASBLog(INFO) << "Pending connection callback for peer " << enet_peer;
-        auto cb = std::move(it->second);
-        pending_connections_.erase(it);
-        ScopedUnlocker<std::mutex> unlocker(mutex_);
-        cb(Result::kOk, enet_peer);
-        return;
+void Context::HandleLocalPeers() {
+    if (local_listener_.IsOpen()) {
+        while (auto link = local_listener_.Accept()) {
+            AddLocalPeer(std::move(link));
+        }
+    }
+    // Handlers may connect and add peers, the iterators stay valid.
+    std::vector<ENetPeer*> closed;
+    for (auto& lit: local_peers_) {
+        auto enet_peer = lit.first;
+        if (!lit.second->connected) {
+            lit.second->connected = true;
+            HandleConnect(enet_peer);
+        }
+        if (!lit.second->link->Receive([this, enet_peer](enet_uint8 channel, ENetPacket* enet_pkt) {
+                HandlePacket(enet_peer, channel, enet_pkt);
+            })) {
+            closed.push_back(enet_peer);
+        }
+    }
+    for (auto enet_peer: closed) {
+        CloseLocalPeer(enet_peer);
     }
-    auto cb = connect_handler_;
-    ScopedUnlocker<std::mutex> unlocker(mutex_);
-    enet_peer_timeout(enet_peer, 3, 1000, 4000);
-    cb(enet_peer);
 }
 
-void Context::HandleDisconnect(ENetPeer* enet_peer) {
-    //ASBLog(INFO) << "Peer " << enet_peer << " disconnected.";
-    auto pdit = pending_disconnections_.find(enet_peer);
-    if (pdit != pending_disconnections_.end()) {
-        auto cb = std::move(pdit->second);
-        pending_disconnections_.erase(pdit);
-        ScopedUnlocker<std::mutex> unlocker(mutex_);
-        cb(Result::kOk);
-        return;
+// A link frees the budget of the bulk packets it writes, the bulk queue
+// refills it until it blocks instead of waiting for the next pass.
+void Context::FlushLocalPeers() {
+    for (auto& lit: local_peers_) {
+        auto& link = lit.second->link;
+        link->Flush();
+        auto qit = bulk_queue_map_.find(lit.first);
+        if (qit == bulk_queue_map_.end()) {
+            continue;
+        }
+        auto& queue = qit->second;
+        while (!queue.packets.empty() && queue.in_flight < kBulkBudget && !link->IsBlocked()) {
+            FlushBulkQueue(lit.first, queue);
+            link->Flush();
+        }
     }
-    auto pcit = pending_connections_.find(enet_peer);
-    if (pcit != pending_connections_.end()) {
-        auto cb = std::move(pcit->second);
-        pending_connections_.erase(pcit);
-        ScopedUnlocker<std::mutex> unlocker(mutex_);
-        cb(Result::kTimeout, nullptr);
-        return;
+}
+
+ENetPeer* Context::ConnectLocal() {
+    auto kind = (transport_ == Transport::kUnix) ? LocalLink::Kind::kUnix : LocalLink::Kind::kShm;
+    auto link = LocalLink::Connect(GetLocalLinkName(server_address_.port), kind);
+    if (!link) {
+        ASBLog(WARNING) << "Local link to the server failed, ENet is used.";
+        return nullptr;
     }
-    auto dhit = disconnect_handler_map_.find(enet_peer);
-    if (dhit != disconnect_handler_map_.end()) {
-        auto cb = std::move(dhit->second);
-        disconnect_handler_map_.erase(dhit);
-        ScopedUnlocker<std::mutex> unlocker(mutex_);
-        cb();
-        return;
+    return AddLocalPeer(std::move(link));
+}
+
+ENetPeer* Context::AddLocalPeer(std::unique_ptr<LocalLink> link) {
+    for (auto socket: link->GetSockets()) {
+        if (!poller_.Watch(socket)) {
+            ASBLog(ERROR) << "Failed to watch local link, " << strerror(errno);
+            for (auto watched: link->GetSockets()) {
+                poller_.Unwatch(watched);
+            }
+            return nullptr;
+        }
     }
-    //ASBLog(INFO) << "Unknown peer " << enet_peer << " disconnection.";
+    std::unique_ptr<LocalPeer> local_peer(new LocalPeer());
+    local_peer->enet_peer.state = ENET_PEER_STATE_CONNECTED;
+    local_peer->link = std::move(link);
+    local_peer->connected = false;
+    auto enet_peer = &local_peer->enet_peer;
+    local_peers_.emplace(enet_peer, std::move(local_peer));
+    ASBLog(INFO) << "Local peer " << enet_peer << " connected.";
+    WakeupBackend();
+    return enet_peer;
 }
 
-void Context::HandlePacket(ENetPeer* enet_peer, ENetPacket* enet_pkt) {
-    //ASBLog(INFO) << "Receive packet from peer " << enet_peer;
-    auto enet_pkt_guard = MakeScopeGuard([enet_pkt]{ enet_packet_destroy(enet_pkt); });
-    auto size = enet_packet_get_length(enet_pkt);
-    if (size < (sizeof(protocol::Header))) {
-        ASBLog(ERROR) << "Receive packet from enet peer " << enet_peer << " is too small.";
+void Context::CloseLocalPeer(ENetPeer* enet_peer) {
+    auto lit = local_peers_.find(enet_peer);
+    if (lit == local_peers_.end()) {
+        return;
+    }
+    for (auto socket: lit->second->link->GetSockets()) {
+        poller_.Unwatch(socket);
+    }
+    enet_peer->state = ENET_PEER_STATE_DISCONNECTED;
+    // The link releases its pending packets into the bulk queue, which goes
+    // with the peer in HandleDisconnect().
+    lit->second->link.reset();
+    HandleDisconnect(enet_peer);
+    local_peers_.erase(enet_peer);
+}
+
+bool Context::PrepareLocalWait() {
+    for (auto& lit: local_peers_) {
+        if (!lit.second->link->PrepareWait()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int Context::PeerSend(ENetPeer* enet_peer, enet_uint8 channel, ENetPacket* enet_pkt) {
+    if (enet_peer->host != nullptr) {
+        return enet_peer_send(enet_peer, channel, enet_pkt);
+    }
+    auto lit = local_peers_.find(enet_peer);
+    if (lit == local_peers_.end() || enet_peer->state != ENET_PEER_STATE_CONNECTED ||
+        !lit->second->link->Send(channel, enet_pkt)) {
+        return -1;
+    }
+    return 0;
+}
+
+void Context::HandleConnect(ENetPeer* enet_peer) {
+    ASBLog(INFO) << "Peer " << enet_peer << " connected.";
+    ++busy_poll_.work_count;
+    if (enet_peer == shared_peer_) {
+        HandlePendingConnections();
+        return;
+    }
+    // Endpoints of an accepted peer are created on their first packet.
+    if (enet_peer->host != nullptr) {
+        enet_peer_timeout(enet_peer, 3, 1000, 4000);
+    }
+}
+
+void Context::HandleDisconnect(ENetPeer* enet_peer) {
+    //ASBLog(INFO) << "Peer " << enet_peer << " disconnected.";
+    ++busy_poll_.work_count;
+    if (enet_peer == shared_peer_) {
+        shared_peer_ = nullptr;
+    }
+    ClearBulkQueue(enet_peer);
+    event_batch_map_.erase(enet_peer);
+    attach_batch_map_.erase(enet_peer);
+    drop_report_map_.erase(drop_report_map_.lower_bound({ enet_peer, 0 }),
+                           drop_report_map_.upper_bound({ enet_peer, UINT32_MAX }));
+    auto tit = trailer_map_.find(enet_peer);
+    if (tit != trailer_map_.end()) {
+        PacketPool::Destroy(tit->second);
+        trailer_map_.erase(tit);
+    }
+    auto peer_block = GetPeerBlock(enet_peer);
+    if (peer_block == nullptr) {
+        //ASBLog(INFO) << "Unknown peer " << enet_peer << " disconnection.";
+        return;
+    }
+    std::vector<uint32_t> object_ids;
+    object_ids.reserve(peer_block->endpoints.size());
+    for (auto& eit: peer_block->endpoints) {
+        object_ids.push_back(eit.first);
+    }
+    // Owners before their objects, so they reconnect and attach first.
+    std::sort(object_ids.begin(), object_ids.end());
+    // Callbacks may reconnect and create endpoints, so look each one up again.
+    for (auto object_id: object_ids) {
+        auto endpoint = FindEndpoint(enet_peer, object_id);
+        if (endpoint != nullptr) {
+            HandleEndpointDisconnect(endpoint);
+        }
+    }
+    // A reconnect may reuse the peer right away and keep its block.
+    if (enet_peer->state == ENET_PEER_STATE_DISCONNECTED) {
+        ReleasePeerBlock(enet_peer);
+    }
+}
+
+void Context::HandleEndpointDisconnect(Endpoint* endpoint) {
+    auto pcit = pending_connections_.find(endpoint);
+    if (pcit != pending_connections_.end()) {
+        auto cb = std::move(pcit->second);
+        pending_connections_.erase(pcit);
+        RemoveEndpoint(endpoint);
+        ScopedUnlocker<std::mutex> unlocker(mutex_);
+        cb(Result::kTimeout, nullptr);
+        return;
+    }
+    auto block = static_cast<EndpointBlock*>(endpoint);
+    auto enet_peer = endpoint->enet_peer;
+    auto object_id = endpoint->object_id;
+    // Complete the requests in flight first, the disconnect handler may
+    // reconnect and their callbacks must not see the new endpoint.
+    if (!block->sessions.empty()) {
+        std::vector<RequestCallback> aborted;
+        for (auto& sit: block->sessions) {
+            aborted.push_back(std::move(sit.second.cb));
+        }
+        ClearSessions(block);
+        {
+            ScopedUnlocker<std::mutex> unlocker(mutex_);
+            for (auto& cb: aborted) {
+                cb(Result::kTimeout, nullptr);
+            }
+        }
+        if (FindEndpoint(enet_peer, object_id) != endpoint) {
+            return;
+        }
+    }
+    if (block->disconnect_handler) {
+        auto cb = std::move(block->disconnect_handler);
+        block->disconnect_handler = nullptr;
+        {
+            ScopedUnlocker<std::mutex> unlocker(mutex_);
+            cb();
+        }
+        if (FindEndpoint(enet_peer, object_id) != endpoint) {
+            return;
+        }
+    }
+    RemoveEndpoint(endpoint);
+}
+
+void Context::HandlePendingConnections() {
+    // In the order the objects were created, so an owner comes before its
+    // objects in their attach batch and the server seldom holds orphans.
+    std::vector<Endpoint*> connected;
+    for (auto& pit: pending_connections_) {
+        if (pit.first->enet_peer->state == ENET_PEER_STATE_CONNECTED) {
+            connected.push_back(pit.first);
+        }
+    }
+    std::sort(connected.begin(), connected.end(), [](Endpoint* a, Endpoint* b) {
+        return a->object_id < b->object_id;
+    });
+    if (!connected.empty()) {
+        retry_attempts_ = 0;
+    }
+    for (auto endpoint: connected) {
+        // Callbacks may remove endpoints or connect new ones.
+        auto it = pending_connections_.find(endpoint);
+        if (it == pending_connections_.end() || endpoint->enet_peer->state != ENET_PEER_STATE_CONNECTED) {
+            continue;
+        }
+        //ASBLog(INFO) << "Pending connection callback for endpoint " << endpoint;
+        auto cb = std::move(it->second);
+        pending_connections_.erase(it);
+        ScopedUnlocker<std::mutex> unlocker(mutex_);
+        cb(Result::kOk, endpoint);
+    }
+}
+
+void Context::HandlePendingDisconnections() {
+    while (!pending_disconnections_.empty()) {
+        auto cb = std::move(pending_disconnections_.front());
+        pending_disconnections_.pop_front();
+        ScopedUnlocker<std::mutex> unlocker(mutex_);
+        cb(Result::kOk);
+    }
+}
+
+void Context::HandlePacket(ENetPeer* enet_peer, enet_uint8 channel, ENetPacket* enet_pkt) {
+    //ASBLog(INFO) << "Receive packet from peer " << enet_peer;
+    ++busy_poll_.work_count;
+    ENetPacket* trailer_pkt = nullptr;
+    auto tit = trailer_map_.find(enet_peer);
+    // Only the reliable packets of a channel are in order, the first one
+    // after the held event is its trailer. Unreliable and unsequenced events
+    // pass it by and are dispatched as usual.
+    if (tit != trailer_map_.end() && channel == static_cast<enet_uint8>(protocol::EnetChannel::kBulk) &&
+        (enet_pkt->flags & ENET_PACKET_FLAG_RELIABLE)) {
+        trailer_pkt = enet_pkt;
+        enet_pkt = tit->second;
+        trailer_map_.erase(tit);
+    }
+    PacketRef packet(enet_pkt);
+    PacketRef trailer(trailer_pkt);
+    auto size = enet_packet_get_length(enet_pkt);
+    if (size < (sizeof(protocol::Header))) {
+        ASBLog(ERROR) << "Receive packet from enet peer " << enet_peer << " is too small.";
         return;
     }
     uint8_t* data = reinterpret_cast<uint8_t*>(enet_packet_get_data(enet_pkt));
     auto header = reinterpret_cast<protocol::Header*>(data);
+    if ((header->flags & protocol::kHeaderTrailer) && trailer_pkt == nullptr) {
+        // Hold the event until its trailer, the next reliable packet on its channel.
+        trailer_map_[enet_peer] = packet.Release();
+        return;
+    }
     if (header->version < protocol::kVersion) {
         ASBLog(ERROR) << "Protocol version is mismatch, received is " << header->version << ", expected " << protocol::kVersion;
         return;
@@ -570,22 +1286,67 @@ void Context::HandlePacket(ENetPeer* enet_peer, ENetPacket* enet_pkt) {
         ASBLog(ERROR) << "Receive packet with invalid type: " << header->type;
         return;
     }
+    auto object_id = ntohl(header->object);
+    auto endpoint = FindEndpoint(enet_peer, object_id);
+    if (header->type == static_cast<uint8_t>(protocol::Type::kClose)) {
+        if (endpoint != nullptr) {
+            HandleEndpointDisconnect(endpoint);
+        }
+        return;
+    }
+    if (header->type == static_cast<uint8_t>(protocol::Type::kBatch)) {
+        HandleBatchPacket(enet_peer, ntohl(header->extra_data), data + sizeof(protocol::Header), size - sizeof(protocol::Header),
+                          packet);
+        return;
+    }
+    if (header->opcode == static_cast<uint8_t>(protocol::Opcode::kAttachBatch)) {
+        if (header->type == static_cast<uint8_t>(protocol::Type::kRequest) && connect_handler_) {
+            HandleAttachBatchPacket(enet_peer, object_id, ntohl(header->session), ntohl(header->extra_data),
+                                    data + sizeof(protocol::Header), size - sizeof(protocol::Header));
+        } else if (header->type == static_cast<uint8_t>(protocol::Type::kResponse)) {
+            HandleAttachBatchResponse(enet_peer, ntohl(header->session), data + sizeof(protocol::Header),
+                                      size - sizeof(protocol::Header));
+        }
+        return;
+    }
     if (header->opcode >= static_cast<uint8_t>(protocol::Opcode::kMax)) {
         ASBLog(ERROR) << "Receive packet with invalid opcode: " << header->opcode;
         return;
     }
+    if (endpoint == nullptr) {
+        // A new object always starts with its attach request. Events may be
+        // late on another channel and must not bring back a closed endpoint.
+        if (!connect_handler_ || header->type != static_cast<uint8_t>(protocol::Type::kRequest)) {
+            ASBLog(INFO) << "Receive packet for unknown object " << object_id << " of peer " << enet_peer;
+            return;
+        }
+        endpoint = AcceptEndpoint(enet_peer, object_id);
+        if (endpoint == nullptr) {
+            return;
+        }
+    }
     data += sizeof(protocol::Header);
     size -= sizeof(protocol::Header);
     google::protobuf::io::ArrayInputStream payload(data, size);
     switch (static_cast<protocol::Type>(header->type)) {
     case protocol::Type::kEvent:
-        HandleEventPacket(enet_peer, static_cast<protocol::Opcode>(header->opcode), payload);
+        if (header->flags & protocol::kHeaderRaw) {
+            if (trailer_pkt != nullptr && enet_packet_get_length(trailer_pkt) != ntohl(header->extra_data)) {
+                ASBLog(ERROR) << "Receive trailer of " << enet_packet_get_length(trailer_pkt) << " bytes, expected "
+                              << ntohl(header->extra_data);
+                break;
+            }
+            HandleRawEventPacket(endpoint, static_cast<protocol::Opcode>(header->opcode), data, size, packet,
+                                 (trailer_pkt != nullptr) ? &trailer : nullptr);
+            break;
+        }
+        HandleEventPacket(endpoint, static_cast<protocol::Opcode>(header->opcode), payload);
         break;
     case protocol::Type::kRequest:
-        HandleRequestPacket(enet_peer, static_cast<protocol::Opcode>(header->opcode), ntohl(header->session), payload);
+        HandleRequestPacket(endpoint, static_cast<protocol::Opcode>(header->opcode), ntohl(header->session), payload);
         break;
     case protocol::Type::kResponse:
-        HandleResponsePacket(enet_peer, ntohl(header->session), static_cast<Result>(ntohl(header->extra_data)), payload);
+        HandleResponsePacket(endpoint, ntohl(header->session), static_cast<Result>(ntohl(header->extra_data)), payload);
         break;
     default:
         ASBLog(ERROR) << "Unknown packet type " << header->type;
@@ -593,138 +1354,952 @@ void Context::HandlePacket(ENetPeer* enet_peer, ENetPacket* enet_pkt) {
     }
 }
 
-void Context::HandleEventPacket(ENetPeer* enet_peer, protocol::Opcode opcode, google::protobuf::io::ZeroCopyInputStream& payload) {
-    //ASBLog(INFO) << "Receive event packet from peer " << enet_peer;
-    auto pit = event_handler_map_.find(enet_peer);
-    if (pit != event_handler_map_.end()) {
-        auto hit = pit->second.find(opcode);
-        if (hit != pit->second.end()) {
-            auto cb = hit->second;
+void Context::HandleBatchPacket(ENetPeer* enet_peer, uint32_t count, const uint8_t* data, size_t size, PacketRef& packet) {
+    for (uint32_t i = 0; i < count; ++i) {
+        protocol::BatchRecord record;
+        if (size < sizeof(record)) {
+            ASBLog(ERROR) << "Receive truncated batch packet from peer " << enet_peer;
+            return;
+        }
+        memcpy(&record, data, sizeof(record));
+        data += sizeof(record);
+        size -= sizeof(record);
+        auto record_size = ntohl(record.size);
+        if (record_size > size || record.opcode >= static_cast<uint8_t>(protocol::Opcode::kMax)) {
+            ASBLog(ERROR) << "Receive invalid batch record from peer " << enet_peer;
+            return;
+        }
+        // Handlers run unlocked and may remove endpoints, so look each one up.
+        auto endpoint = FindEndpoint(enet_peer, ntohl(record.object));
+        if (endpoint != nullptr) {
+            if (record.flags & protocol::kHeaderRaw) {
+                HandleRawEventPacket(endpoint, static_cast<protocol::Opcode>(record.opcode), data, record_size, packet, nullptr);
+            } else {
+                google::protobuf::io::ArrayInputStream payload(data, record_size);
+                HandleEventPacket(endpoint, static_cast<protocol::Opcode>(record.opcode), payload);
+            }
+        }
+        data += record_size;
+        size -= record_size;
+    }
+}
+
+// Each record is handled like an attach request of its own, the responses
+// are collected into the one response of the batch.
+void Context::HandleAttachBatchPacket(ENetPeer* enet_peer, uint32_t object_id, uint32_t session, uint32_t count,
+                                      const uint8_t* data, size_t size) {
+    std::string response;
+    for (uint32_t i = 0; i < count; ++i) {
+        protocol::AttachRecord record;
+        if (size < sizeof(record)) {
+            ASBLog(ERROR) << "Receive truncated attach batch from peer " << enet_peer;
+            break;
+        }
+        memcpy(&record, data, sizeof(record));
+        data += sizeof(record);
+        size -= sizeof(record);
+        auto record_size = ntohl(record.size);
+        if (record_size > size || record.opcode < static_cast<uint8_t>(protocol::Opcode::kAttachProcess) ||
+            record.opcode > static_cast<uint8_t>(protocol::Opcode::kAttachHandle)) {
+            ASBLog(ERROR) << "Receive invalid attach record from peer " << enet_peer;
+            break;
+        }
+        auto payload_data = data;
+        auto payload_size = record_size;
+        data += record_size;
+        size -= record_size;
+        auto instance_id = protocol::NetToHost64(record.instance);
+        std::string resumed;
+        if ((record.flags & protocol::kAttachResume) != 0) {
+            if (!resume_cache_ || instance_id == 0 ||
+                !resume_cache_->Find(instance_id, record.opcode, protocol::NetToHost64(record.digest), resumed)) {
+                protocol::AttachResult result = {
+                    record.object, htonl(static_cast<uint32_t>(Result::kInvalidState)), 0, protocol::kAttachResume, { 0 }
+                };
+                response.append(reinterpret_cast<const char*>(&result), sizeof(result));
+                continue;
+            }
+            payload_data = reinterpret_cast<const uint8_t*>(resumed.data());
+            payload_size = static_cast<uint32_t>(resumed.size());
+        } else if (resume_cache_ && instance_id != 0) {
+            resume_cache_->Put(instance_id, record.opcode, protocol::Digest(payload_data, payload_size), payload_data, payload_size);
+        }
+        google::protobuf::io::ArrayInputStream payload(payload_data, payload_size);
+        auto endpoint = FindEndpoint(enet_peer, ntohl(record.object));
+        if (endpoint == nullptr) {
+            endpoint = AcceptEndpoint(enet_peer, ntohl(record.object));
+            if (endpoint == nullptr) {
+                continue;
+            }
+        }
+        if (resume_cache_ && instance_id != 0) {
+            static_cast<EndpointBlock*>(endpoint)->resume_instance = instance_id;
+        }
+        auto opcode = static_cast<protocol::Opcode>(record.opcode);
+        auto cb = static_cast<EndpointBlock*>(endpoint)->request_handlers[record.opcode];
+        RequestContext request_context(shared_from_this(), endpoint, opcode, session, payload, instance_id, &response);
+        if (cb) {
             ScopedUnlocker<std::mutex> unlocker(mutex_);
-            cb(payload);
+            (*cb)(request_context);
         } else {
-            ASBLog(INFO) << "No event " << static_cast<uint8_t>(opcode) << " handler";
+            ASBLog(INFO) << "No request handler " << static_cast<uint32_t>(opcode) << " handler";
+        }
+    }
+    auto enet_pkt = CreatePacket(protocol::Type::kResponse, protocol::Opcode::kAttachBatch, object_id, session, response,
+                                 static_cast<uint32_t>(Result::kOk));
+    if (!SendPacket(enet_peer, enet_pkt) && enet_pkt != nullptr) {
+        PacketPool::Destroy(enet_pkt);
+    }
+}
+
+void Context::HandleAttachBatchResponse(ENetPeer* enet_peer, uint32_t session, const uint8_t* data, size_t size) {
+    while (size > 0) {
+        protocol::AttachResult record;
+        if (size < sizeof(record)) {
+            ASBLog(ERROR) << "Receive truncated attach batch response from peer " << enet_peer;
+            return;
+        }
+        memcpy(&record, data, sizeof(record));
+        data += sizeof(record);
+        size -= sizeof(record);
+        auto record_size = ntohl(record.size);
+        if (record_size > size) {
+            ASBLog(ERROR) << "Receive invalid attach result from peer " << enet_peer;
+            return;
+        }
+        google::protobuf::io::ArrayInputStream payload(data, record_size);
+        data += record_size;
+        size -= record_size;
+        // Callbacks run unlocked and may remove endpoints, so look each one up.
+        auto endpoint = FindEndpoint(enet_peer, ntohl(record.object));
+        if (endpoint == nullptr) {
+            continue;
         }
+        auto block = static_cast<EndpointBlock*>(endpoint);
+        auto it = block->sessions.find(session);
+        if (it == block->sessions.end()) {
+            continue;
+        }
+        auto cb = std::move(it->second.cb);
+        timer_wheel_.Cancel(it->second.timer);
+        block->sessions.erase(it);
+        auto result = static_cast<Result>(ntohl(record.result));
+        if (block->attach) {
+            auto& attach = *block->attach;
+            if ((record.flags & protocol::kAttachResume) != 0) {
+                ASBLog(INFO) << "Endpoint " << endpoint << " cannot be resumed, attaching with its payload.";
+                resumable_.erase(attach.instance);
+                auto new_session = QueueAttachRecord(endpoint, attach.opcode, 0, attach.instance, attach.digest, attach.payload);
+                auto object_id = endpoint->object_id;
+                auto timer = timer_wheel_.Add(TimerWheel::Clock::now() + attach.timeout, [this, enet_peer, object_id, new_session] {
+                    HandleRequestTimeout(enet_peer, object_id, new_session);
+                });
+                block->sessions[new_session] = RequestSession{ std::move(cb), timer };
+                continue;
+            }
+            if (result == Result::kOk) {
+                resumable_[attach.instance] = attach.digest;
+            } else {
+                resumable_.erase(attach.instance);
+            }
+            block->attach.reset();
+        }
+        ScopedUnlocker<std::mutex> unlocker(mutex_);
+        cb(result, &payload);
+    }
+}
+
+void Context::HandleEventPacket(Endpoint* endpoint, protocol::Opcode opcode, google::protobuf::io::ZeroCopyInputStream& payload) {
+    //ASBLog(INFO) << "Receive event packet from endpoint " << endpoint;
+    auto cb = static_cast<EndpointBlock*>(endpoint)->event_handlers[static_cast<size_t>(opcode)];
+    if (cb) {
+        ScopedUnlocker<std::mutex> unlocker(mutex_);
+        (*cb)(payload);
     } else {
         ASBLog(INFO) << "No event " << static_cast<uint8_t>(opcode) << " handler";
     }
 }
 
-void Context::HandleRequestPacket(ENetPeer* enet_peer, protocol::Opcode opcode, uint32_t session, google::protobuf::io::ZeroCopyInputStream& payload) {
-    //ASBLog(INFO) << "Receive request packet from peer " << enet_peer << ", sessoin " << session;
-    auto pit = request_handler_map_.find(enet_peer);
-    if (pit != request_handler_map_.end()) {
-        auto hit = pit->second.find(opcode);
-        if (hit != pit->second.end()) {
-            RequestContext request_context(shared_from_this(), enet_peer, opcode, session, payload);
-            auto cb = hit->second;
-            ScopedUnlocker<std::mutex> unlocker(mutex_);
-            cb(request_context);
-        } else {
-            ASBLog(INFO) << "No request handler " << static_cast<uint8_t>(opcode) << " handler";
-        }
+void Context::HandleRawEventPacket(Endpoint* endpoint, protocol::Opcode opcode, const uint8_t* data, size_t size,
+                                   PacketRef& packet, PacketRef* trailer) {
+    protocol::RawHeader raw_header;
+    if (size < sizeof(raw_header)) {
+        ASBLog(ERROR) << "Receive raw event " << static_cast<uint32_t>(opcode) << " without raw header.";
+        return;
+    }
+    memcpy(&raw_header, data, sizeof(raw_header));
+    data += sizeof(raw_header);
+    size -= sizeof(raw_header);
+    auto meta_size = ntohl(raw_header.meta_size);
+    if (meta_size > size || (trailer != nullptr && meta_size != size)) {
+        ASBLog(ERROR) << "Receive raw event " << static_cast<uint32_t>(opcode) << " with invalid metadata size " << meta_size;
+        return;
+    }
+    auto cb = static_cast<EndpointBlock*>(endpoint)->raw_event_handlers[static_cast<size_t>(opcode)];
+    if (!cb) {
+        ASBLog(INFO) << "No raw event " << static_cast<uint32_t>(opcode) << " handler";
+        return;
+    }
+    if (trailer != nullptr) {
+        RawEvent event(data, meta_size, reinterpret_cast<const uint8_t*>(enet_packet_get_data(trailer->Get())),
+                       enet_packet_get_length(trailer->Get()), *trailer);
+        ScopedUnlocker<std::mutex> unlocker(mutex_);
+        (*cb)(event);
+    } else {
+        RawEvent event(data, meta_size, data + meta_size, size - meta_size, packet);
+        ScopedUnlocker<std::mutex> unlocker(mutex_);
+        (*cb)(event);
+    }
+}
+
+void Context::HandleRequestPacket(Endpoint* endpoint, protocol::Opcode opcode, uint32_t session, google::protobuf::io::ZeroCopyInputStream& payload) {
+    //ASBLog(INFO) << "Receive request packet from endpoint " << endpoint << ", sessoin " << session;
+    auto cb = static_cast<EndpointBlock*>(endpoint)->request_handlers[static_cast<size_t>(opcode)];
+    if (cb) {
+        RequestContext request_context(shared_from_this(), endpoint, opcode, session, payload);
+        ScopedUnlocker<std::mutex> unlocker(mutex_);
+        (*cb)(request_context);
     } else {
         ASBLog(INFO) << "No request handler " << static_cast<uint8_t>(opcode) << " handler";
     }
 }
 
-void Context::HandleResponsePacket(ENetPeer* enet_peer, uint32_t session, Result result, google::protobuf::io::ZeroCopyInputStream& payload) {
-    //ASBLog(INFO) << "Receive response packet from peer " << enet_peer;
-    auto pit = request_session_map_.find(enet_peer);
-    if (pit != request_session_map_.end()) {
-        auto hit = pit->second.find(session);
-        if (hit != pit->second.end()) {
-            auto cb = std::move(hit->second);
-            pit->second.erase(hit);
-            if (pit->second.empty()) {
-                request_session_map_.erase(pit);
-            }
-            ScopedUnlocker<std::mutex> unlocker(mutex_);
-            cb(result, &payload);
-        } else {
-            ASBLog(INFO) << "No request session " << session;
-        }
+void Context::HandleResponsePacket(Endpoint* endpoint, uint32_t session, Result result, google::protobuf::io::ZeroCopyInputStream& payload) {
+    //ASBLog(INFO) << "Receive response packet from endpoint " << endpoint;
+    auto& sessions = static_cast<EndpointBlock*>(endpoint)->sessions;
+    auto it = sessions.find(session);
+    if (it != sessions.end()) {
+        auto cb = std::move(it->second.cb);
+        timer_wheel_.Cancel(it->second.timer);
+        sessions.erase(it);
+        ScopedUnlocker<std::mutex> unlocker(mutex_);
+        cb(result, &payload);
     } else {
         ASBLog(INFO) << "No request session " << session;
     }
 }
 
 void Context::HandleAsyncCommand() {
-    assert(pipe_.IsOpen());
-    char async_cmd;
-    if (pipe_.Read(&async_cmd, 1) == 1) {
-        switch (async_cmd) {
-        case AsyncCommand::kAsyncWakeup:
-            // Nothing to do.
-            break;
-        case AsyncCommand::kAsyncExit:
-            ASBLog(INFO) << "Handle async exit.";
-            backend_run_ = false;
-            break;
-        default:
-            ASBLog(ERROR) << "Unknown async command " << async_cmd;
-            break;
+    // Any number of coalesced wakeups is served by a single pass.
+    if (!async_pending_) {
+        return;
+    }
+    async_pending_ = false;
+    ++busy_poll_.work_count;
+    HandlePendingConnections();
+    HandlePendingDisconnections();
+}
+
+void Context::HandleTimers() {
+    std::vector<TimerWheel::Callback> expired;
+    timer_wheel_.Advance(TimerWheel::Clock::now(), expired);
+    busy_poll_.work_count += expired.size();
+    for (auto& cb: expired) {
+        cb();
+    }
+}
+
+// A periodic timer keeps its phase, runs missed while the backend was busy
+// are skipped rather than run in a burst.
+void Context::AddScheduledTimer(TimerId id, TimerWheel::Clock::time_point deadline, std::shared_ptr<TimerCallback> cb,
+                                std::chrono::milliseconds period) {
+    scheduled_timers_[id] = timer_wheel_.Add(deadline, [this, id, deadline, cb, period] {
+        if (period.count() > 0) {
+            auto next = deadline + period;
+            auto now = TimerWheel::Clock::now();
+            if (next <= now) {
+                next += period * ((now - next) / period + 1);
+            }
+            AddScheduledTimer(id, next, cb, period);
+        } else {
+            scheduled_timers_.erase(id);
         }
+        ScopedUnlocker<std::mutex> unlocker(mutex_);
+        (*cb)();
+    });
+}
+
+void Context::ReportBusyPoll() {
+    using Milliseconds = std::chrono::duration<double, std::milli>;
+    std::lock_guard<std::mutex> lg(mutex_);
+    auto total = busy_poll_.spin_time + busy_poll_.work_time + busy_poll_.park_time;
+    ASBLog(INFO) << "Busy poll: spin " << Milliseconds(busy_poll_.spin_time).count() << " ms, work "
+                 << Milliseconds(busy_poll_.work_time).count() << " ms, parked "
+                 << Milliseconds(busy_poll_.park_time).count() << " ms in " << busy_poll_.parks << " parks, "
+                 << (total.count() > 0 ? 100.0 * busy_poll_.spin_time.count() / total.count() : 0.0) << "% spinning.";
+    busy_poll_.spin_time = busy_poll_.work_time = busy_poll_.park_time = std::chrono::steady_clock::duration::zero();
+    busy_poll_.parks = 0;
+}
+
+// The pool is shared by the process, a context reports what changed since
+// its last report.
+void Context::ReportPacketPool() {
+    auto stats = PacketPool::GetStats();
+    std::lock_guard<std::mutex> lg(mutex_);
+    auto hits = stats.hits - packet_pool_stats_.hits;
+    auto misses = stats.misses - packet_pool_stats_.misses;
+    packet_pool_stats_ = stats;
+    if (hits + misses > 0) {
+        ASBLog(INFO) << "Packet pool: " << hits << " hits, " << misses << " misses, "
+                     << 100.0 * hits / (hits + misses) << "% hit rate, " << stats.cached << " packets cached.";
     }
 }
 
+void Context::HandleRetry() {
+    std::vector<std::function<void ()>> callbacks;
+    callbacks.swap(retry_callbacks_);
+    ScopedUnlocker<std::mutex> unlocker(mutex_);
+    for (auto& cb: callbacks) {
+        cb();
+    }
+}
+
+void Context::HandleRequestTimeout(ENetPeer* enet_peer, uint32_t object_id, uint32_t session) {
+    auto endpoint = FindEndpoint(enet_peer, object_id);
+    if (endpoint == nullptr) {
+        return;
+    }
+    auto& sessions = static_cast<EndpointBlock*>(endpoint)->sessions;
+    auto it = sessions.find(session);
+    if (it == sessions.end()) {
+        return;
+    }
+    ASBLog(WARNING) << "Request session " << session << " of endpoint " << endpoint << " timed out.";
+    auto cb = std::move(it->second.cb);
+    sessions.erase(it);
+    ScopedUnlocker<std::mutex> unlocker(mutex_);
+    cb(Result::kTimeout, nullptr);
+}
+
+void Context::ClearSessions(EndpointBlock* block) {
+    for (auto& sit: block->sessions) {
+        timer_wheel_.Cancel(sit.second.timer);
+    }
+    block->sessions.clear();
+}
+
+Endpoint* Context::CreateEndpoint(ENetPeer* enet_peer, uint32_t object_id) {
+    auto peer_block = GetPeerBlock(enet_peer);
+    if (peer_block == nullptr) {
+        peer_block = new PeerBlock();
+        peer_block->next_session = 1;
+        enet_peer->data = peer_block;
+    }
+    auto& endpoint = peer_block->endpoints[object_id];
+    if (endpoint) {
+        ASBLog(ERROR) << "Object " << object_id << " of peer " << enet_peer << " already exists.";
+        return nullptr;
+    }
+    endpoint.reset(new EndpointBlock());
+    endpoint->enet_peer = enet_peer;
+    endpoint->object_id = object_id;
+    return endpoint.get();
+}
+
+// Endpoints of an accepted peer are created on their first request.
+Endpoint* Context::AcceptEndpoint(ENetPeer* enet_peer, uint32_t object_id) {
+    auto endpoint = CreateEndpoint(enet_peer, object_id);
+    if (endpoint == nullptr) {
+        ASBLog(ERROR) << "Failed to create endpoint for peer " << enet_peer;
+        return nullptr;
+    }
+    auto cb = connect_handler_;
+    ScopedUnlocker<std::mutex> unlocker(mutex_);
+    cb(endpoint);
+    return endpoint;
+}
+
+Endpoint* Context::FindEndpoint(ENetPeer* enet_peer, uint32_t object_id) {
+    auto peer_block = GetPeerBlock(enet_peer);
+    if (peer_block == nullptr) {
+        return nullptr;
+    }
+    auto eit = peer_block->endpoints.find(object_id);
+    if (eit == peer_block->endpoints.end()) {
+        return nullptr;
+    }
+    return eit->second.get();
+}
+
+void Context::RemoveEndpoint(Endpoint* endpoint) {
+    pending_connections_.erase(endpoint);
+    ClearSessions(static_cast<EndpointBlock*>(endpoint));
+    auto resume_instance = static_cast<EndpointBlock*>(endpoint)->resume_instance;
+    if (resume_instance != 0) {
+        resume_cache_->Release(resume_instance);
+    }
+    auto peer_block = GetPeerBlock(endpoint->enet_peer);
+    if (peer_block != nullptr) {
+        peer_block->endpoints.erase(endpoint->object_id);
+    }
+}
+
+Context::PeerBlock* Context::GetPeerBlock(ENetPeer* enet_peer) {
+    return static_cast<PeerBlock*>(enet_peer->data);
+}
+
+void Context::ReleasePeerBlock(ENetPeer* enet_peer) {
+    delete static_cast<PeerBlock*>(enet_peer->data);
+    enet_peer->data = nullptr;
+}
+
 bool Context::SendPacket(ENetPeer* enet_peer, ENetPacket* enet_pkt) {
     if (enet_peer == nullptr || enet_pkt == nullptr) {
         return false;
     }
-    if (enet_peer_send(enet_peer, 0, enet_pkt) < 0) {
+    if (PeerSend(enet_peer, static_cast<enet_uint8>(protocol::EnetChannel::kControl), enet_pkt) < 0) {
         return false;
     }
     WakeupBackend();
     return true;
 }
 
-bool Context::SendPacket(ENetPeer* enet_peer, protocol::Type type, protocol::Opcode opcode, uint32_t session, const google::protobuf::Message* payload) {
-    if (enet_peer == nullptr) {
-        ASBLog(ERROR) << "Invalid enet peer to send.";
+// A trailer is queued together with its event, neither is dropped alone.
+bool Context::QueueBulkPacket(ENetPeer* enet_peer, ENetPacket* enet_pkt, ENetPacket* trailer_pkt) {
+    if (enet_peer->state != ENET_PEER_STATE_CONNECTED) {
+        return false;
+    }
+    auto qit = bulk_queue_map_.find(enet_peer);
+    if (qit == bulk_queue_map_.end()) {
+        qit = bulk_queue_map_.emplace(enet_peer, BulkQueue{ {}, 0, 0, {} }).first;
+    }
+    auto& queue = qit->second;
+    // Unreliable samples are dropped rather than queued behind the budget.
+    if (!(enet_pkt->flags & ENET_PACKET_FLAG_RELIABLE) && (!queue.packets.empty() || queue.in_flight >= kBulkBudget)) {
+        DropPacket(enet_peer, enet_pkt);
+        return true;
+    }
+    auto size = enet_pkt->dataLength + (trailer_pkt != nullptr ? trailer_pkt->dataLength : 0);
+    if (IsBulkQueueFull(queue, size) && IsDroppablePacket(enet_pkt)) {
+        if (send_queue_config_.policy == SendQueuePolicy::kDropOldest) {
+            while (IsBulkQueueFull(queue, size) && DropOldestPacket(enet_peer, queue)) {
+            }
+        }
+        if (IsBulkQueueFull(queue, size)) {
+            DropPacket(enet_peer, enet_pkt, trailer_pkt);
+            return true;
+        }
+    }
+    queue.packets.push_back(enet_pkt);
+    queue.bytes += enet_pkt->dataLength;
+    if (trailer_pkt != nullptr) {
+        queue.packets.push_back(trailer_pkt);
+        queue.bytes += trailer_pkt->dataLength;
+    }
+    FlushBulkQueue(enet_peer, queue);
+    return true;
+}
+
+// The backend thread never waits, it is the one making room.
+bool Context::WaitBulkQueue(std::unique_lock<std::mutex>& lg, Endpoint* endpoint) {
+    if (send_queue_config_.policy != SendQueuePolicy::kBlock || std::this_thread::get_id() == backend_thread_.get_id()) {
+        return true;
+    }
+    auto enet_peer = endpoint->enet_peer;
+    auto object_id = endpoint->object_id;
+    auto has_room = [this, enet_peer] {
+        auto qit = bulk_queue_map_.find(enet_peer);
+        return qit == bulk_queue_map_.end() || !IsBulkQueueFull(qit->second, 0);
+    };
+    if (has_room()) {
+        return true;
+    }
+    // Still full on timeout, QueueBulkPacket then drops the newest.
+    bulk_queue_cv_.wait_for(lg, send_queue_config_.timeout, has_room);
+    return enet_host_ != nullptr && FindEndpoint(enet_peer, object_id) == endpoint;
+}
+
+// An empty queue takes a packet of any size.
+bool Context::IsBulkQueueFull(const BulkQueue& queue, size_t size) const {
+    return !queue.packets.empty() &&
+           (queue.packets.size() >= send_queue_config_.max_packets || queue.bytes + size > send_queue_config_.max_bytes);
+}
+
+bool Context::DropOldestPacket(ENetPeer* enet_peer, BulkQueue& queue) {
+    for (auto it = queue.packets.begin(); it != queue.packets.end(); ++it) {
+        // The event of a trailer left at the front has already been sent.
+        if ((*it)->freeCallback == &Context::HandleTrailerPacketFree || !IsDroppablePacket(*it)) {
+            continue;
+        }
+        auto enet_pkt = *it;
+        ENetPacket* trailer_pkt = nullptr;
+        auto next = std::next(it);
+        if (next != queue.packets.end() && (*next)->freeCallback == &Context::HandleTrailerPacketFree) {
+            trailer_pkt = *next;
+            queue.bytes -= trailer_pkt->dataLength;
+            next = queue.packets.erase(next);
+        }
+        queue.bytes -= enet_pkt->dataLength;
+        queue.packets.erase(std::prev(next));
+        // Erasing in the middle moves the slots.
+        queue.latest.clear();
+        DropPacket(enet_peer, enet_pkt, trailer_pkt);
+        return true;
+    }
+    return false;
+}
+
+void Context::DropPacket(ENetPeer* enet_peer, ENetPacket* enet_pkt, ENetPacket* trailer_pkt) {
+    VisitEvents(enet_pkt, [this, enet_peer](uint32_t object_id, protocol::Opcode opcode, size_t size) {
+        if (opcode != protocol::Opcode::kMessage) {
+            return;
+        }
+        auto& report = GetDropReport(enet_peer, object_id);
+        ++report.count;
+        report.bytes += size;
+    });
+    PacketPool::Destroy(enet_pkt);
+    PacketPool::Destroy(trailer_pkt);
+}
+
+bool Context::ConflateBulkPacket(Endpoint* endpoint, ENetPacket* enet_pkt) {
+    auto enet_peer = endpoint->enet_peer;
+    if (enet_peer->state != ENET_PEER_STATE_CONNECTED) {
+        return false;
+    }
+    auto qit = bulk_queue_map_.find(enet_peer);
+    if (qit != bulk_queue_map_.end()) {
+        auto& queue = qit->second;
+        auto lit = queue.latest.find(endpoint->object_id);
+        if (lit != queue.latest.end()) {
+            auto& slot = *lit->second;
+            queue.bytes = queue.bytes - slot->dataLength + enet_pkt->dataLength;
+            PacketPool::Destroy(slot);
+            slot = enet_pkt;
+            ++static_cast<EndpointBlock*>(endpoint)->conflated;
+            ++GetDropReport(enet_peer, endpoint->object_id).conflated;
+            return true;
+        }
+    }
+    if (!QueueBulkPacket(enet_peer, enet_pkt)) {
+        return false;
+    }
+    // Not flushed to ENet nor dropped, a newer message may replace it.
+    qit = bulk_queue_map_.find(enet_peer);
+    if (qit != bulk_queue_map_.end() && !qit->second.packets.empty() && qit->second.packets.back() == enet_pkt) {
+        qit->second.latest[endpoint->object_id] = &qit->second.packets.back();
+    }
+    return true;
+}
+
+Context::DropReport& Context::GetDropReport(ENetPeer* enet_peer, uint32_t object_id) {
+    if (drop_report_map_.empty()) {
+        drop_report_deadline_ = std::chrono::steady_clock::now() + kDropReportInterval;
+    }
+    return drop_report_map_[{ enet_peer, object_id }];
+}
+
+// Drops are logged and reported by the clients to the server, at most once
+// per interval.
+void Context::ReportDrops() {
+    if (drop_report_map_.empty() || std::chrono::steady_clock::now() < drop_report_deadline_) {
+        return;
+    }
+    auto reports = std::move(drop_report_map_);
+    drop_report_map_.clear();
+    for (auto& rit: reports) {
+        if (rit.second.count > 0) {
+            ASBLog(WARNING) << "Send queue of peer " << rit.first.first << " full, object " << rit.first.second
+                            << " dropped " << rit.second.count << " messages, " << rit.second.bytes << " bytes.";
+        }
+        if (connect_handler_) {
+            continue;
+        }
+        auto endpoint = FindEndpoint(rit.first.first, rit.first.second);
+        if (endpoint == nullptr) {
+            continue;
+        }
+        protocol::MessageDropBlock block = {};
+        block.count = htonl(rit.second.count);
+        block.conflated = htonl(rit.second.conflated);
+        block.bytes = protocol::HostToNet64(rit.second.bytes);
+        SendRawPacket(endpoint, protocol::Opcode::kMessageDrops, &block, sizeof(block), ByteArray(), protocol::Delivery::kReliable);
+    }
+}
+
+void Context::FlushBulkQueue(ENetPeer* enet_peer, BulkQueue& queue) {
+    bool sent = false;
+    while (!queue.packets.empty() && queue.in_flight < kBulkBudget) {
+        auto enet_pkt = queue.packets.front();
+        if (!queue.latest.empty() && enet_packet_get_length(enet_pkt) >= sizeof(protocol::Header)) {
+            auto header = reinterpret_cast<const protocol::Header*>(enet_packet_get_data(enet_pkt));
+            auto lit = queue.latest.find(ntohl(header->object));
+            if (lit != queue.latest.end() && lit->second == &queue.packets.front()) {
+                queue.latest.erase(lit);
+            }
+        }
+        queue.packets.pop_front();
+        queue.bytes -= enet_pkt->dataLength;
+        // Released by HandleBulkPacketFree once ENet drops its last reference.
+        queue.in_flight += enet_pkt->dataLength;
+        if (enet_pkt->freeCallback == &Context::HandleTrailerPacketFree) {
+            static_cast<TrailerRef*>(enet_pkt->userData)->queue = &queue;
+        } else {
+            enet_pkt->userData = &queue;
+            enet_pkt->freeCallback = &Context::HandleBulkPacketFree;
+        }
+        if (PeerSend(enet_peer, static_cast<enet_uint8>(protocol::EnetChannel::kBulk), enet_pkt) < 0) {
+            ASBLog(ERROR) << "Failed to send bulk packet for peer " << enet_peer;
+            PacketPool::Destroy(enet_pkt);
+            continue;
+        }
+        sent = true;
+    }
+    if (sent) {
+        bulk_queue_cv_.notify_all();
+        WakeupBackend();
+    }
+}
+
+void Context::FlushBulkQueues() {
+    for (auto& qit: bulk_queue_map_) {
+        if (!qit.second.packets.empty()) {
+            FlushBulkQueue(qit.first, qit.second);
+        }
+    }
+}
+
+void Context::ClearBulkQueue(ENetPeer* enet_peer) {
+    auto qit = bulk_queue_map_.find(enet_peer);
+    if (qit == bulk_queue_map_.end()) {
+        return;
+    }
+    for (auto enet_pkt: qit->second.packets) {
+        PacketPool::Destroy(enet_pkt);
+    }
+    bulk_queue_map_.erase(qit);
+    bulk_queue_cv_.notify_all();
+}
+
+template <typename Writer>
+bool Context::BatchEvent(Endpoint* endpoint, protocol::Opcode opcode, uint8_t flags, size_t size, protocol::Delivery delivery,
+                         Writer&& write) {
+    auto enet_peer = endpoint->enet_peer;
+    if (enet_peer->state != ENET_PEER_STATE_CONNECTED) {
+        ASBLog(ERROR) << "Failed to batch event for endpoint " << endpoint << ", peer not connected.";
+        return false;
+    }
+    auto& batch = event_batch_map_[enet_peer];
+    if (batch.count > 0 && batch.delivery != delivery) {
+        FlushBatch(enet_peer, batch);
+    }
+    bool first = (batch.count == 0);
+    if (first) {
+        batch.delivery = delivery;
+        batch.deadline = std::chrono::steady_clock::now() + kBatchMaxDelay;
+    }
+    protocol::BatchRecord record = {};
+    record.opcode = static_cast<uint8_t>(opcode);
+    record.flags = flags;
+    record.object = htonl(endpoint->object_id);
+    record.size = htonl(static_cast<uint32_t>(size));
+    auto offset = batch.data.size();
+    batch.data.resize(offset + sizeof(record) + size);
+    auto data = reinterpret_cast<uint8_t*>(&batch.data[offset]);
+    memcpy(data, &record, sizeof(record));
+    if (!write(data + sizeof(record))) {
+        batch.data.resize(offset);
+        ASBLog(ERROR) << "Failed to serialize payload.";
+        return false;
+    }
+    ++batch.count;
+    if (batch.data.size() >= kBatchMaxBytes || batch.count >= kBatchMaxCount) {
+        return FlushBatch(enet_peer, batch);
+    }
+    if (first) {
+        // Let the backend thread pick up the new deadline.
+        WakeupBackend();
+    }
+    return true;
+}
+
+bool Context::FlushBatch(ENetPeer* enet_peer, EventBatch& batch) {
+    if (batch.count == 0) {
+        return true;
+    }
+    auto count = batch.count;
+    batch.count = 0;
+    auto data_guard = MakeScopeGuard([&batch] { batch.data.clear(); });
+    auto enet_pkt = PacketPool::Create(nullptr, sizeof(protocol::Header) + batch.data.size(), GetPacketFlags(batch.delivery));
+    if (enet_pkt == nullptr) {
+        ASBLog(ERROR) << "Failed to create batch packet, " << count << " events dropped.";
+        return false;
+    }
+    uint8_t* data = reinterpret_cast<uint8_t*>(enet_packet_get_data(enet_pkt));
+    InitHeader(data, protocol::Type::kBatch, protocol::Opcode::kInvalid, 0, 0, count);
+    memcpy(data + sizeof(protocol::Header), batch.data.data(), batch.data.size());
+    if (!QueueBulkPacket(enet_peer, enet_pkt)) {
+        PacketPool::Destroy(enet_pkt);
+        ASBLog(ERROR) << "Failed to queue batch packet for peer " << enet_peer;
+        return false;
+    }
+    return true;
+}
+
+uint32_t Context::QueueAttachRecord(Endpoint* endpoint, protocol::Opcode opcode, uint8_t flags, uint64_t instance_id,
+                                    uint64_t digest, const std::string& payload) {
+    auto& batch = attach_batch_map_[endpoint->enet_peer];
+    if (batch.count == 0) {
+        auto peer_block = GetPeerBlock(endpoint->enet_peer);
+        batch.object_id = endpoint->object_id;
+        batch.session = peer_block->next_session;
+        peer_block->next_session = std::max<uint32_t>(batch.session + 1, 1);
+    }
+    protocol::AttachRecord record = {
+        static_cast<uint8_t>(opcode), flags, { 0 }, htonl(endpoint->object_id), htonl(static_cast<uint32_t>(payload.size())), 0,
+        protocol::HostToNet64(instance_id), protocol::HostToNet64(digest)
+    };
+    batch.data.append(reinterpret_cast<const char*>(&record), sizeof(record));
+    batch.data.append(payload);
+    ++batch.count;
+    return batch.session;
+}
+
+void Context::FlushAttachBatches() {
+    for (auto& bit: attach_batch_map_) {
+        auto& batch = bit.second;
+        if (batch.count == 0) {
+            continue;
+        }
+        // The attaches time out if the batch cannot be sent.
+        auto enet_pkt = CreatePacket(protocol::Type::kRequest, protocol::Opcode::kAttachBatch, batch.object_id, batch.session,
+                                     batch.data, batch.count);
+        if (!SendPacket(bit.first, enet_pkt) && enet_pkt != nullptr) {
+            ASBLog(ERROR) << "Failed to send attach batch of " << batch.count << " objects.";
+            PacketPool::Destroy(enet_pkt);
+        }
+    }
+    attach_batch_map_.clear();
+}
+
+void Context::FlushBatches() {
+    auto now = std::chrono::steady_clock::now();
+    for (auto& bit: event_batch_map_) {
+        if (bit.second.count > 0 && bit.second.deadline <= now) {
+            FlushBatch(bit.first, bit.second);
+        }
+    }
+}
+
+uint32_t Context::GetWaitTimeout() const {
+    // Without pending work the backend sleeps until a packet or a wakeup.
+    auto timeout = std::chrono::milliseconds(GetEnetTimeout(timer_wheel_.GetTimeout(TimerWheel::Clock::now(), Poller::kInfinite)));
+    auto now = std::chrono::steady_clock::now();
+    for (auto& bit: event_batch_map_) {
+        if (bit.second.count > 0) {
+            if (bit.second.deadline <= now) {
+                return 0;
+            }
+            timeout = std::min(timeout, std::chrono::ceil<std::chrono::milliseconds>(bit.second.deadline - now));
+        }
+    }
+    if (!drop_report_map_.empty()) {
+        if (drop_report_deadline_ <= now) {
+            return 0;
+        }
+        timeout = std::min(timeout, std::chrono::ceil<std::chrono::milliseconds>(drop_report_deadline_ - now));
+    }
+    // A full Unix socket does not wake the backend when it drains.
+    for (auto& lit: local_peers_) {
+        if (lit.second->link->IsBlocked()) {
+            timeout = std::min(timeout, std::chrono::milliseconds(kLocalRetryTimeout));
+        }
+    }
+    return static_cast<uint32_t>(timeout.count());
+}
+
+// ENet resends reliable commands and pings quiet peers from its service
+// call only, the backend wakes up for the earliest of them. A deadline that
+// has passed is waited for 1 ms, a peer stalled on its window would spin
+// the loop otherwise.
+uint32_t Context::GetEnetTimeout(uint32_t max_timeout) const {
+    if (enet_host_ == nullptr) {
+        return max_timeout;
+    }
+    auto now = enet_time_get();
+    auto timeout = max_timeout;
+    for (auto peer = enet_host_->peers; peer < &enet_host_->peers[enet_host_->peerCount]; ++peer) {
+        if (peer->state == ENET_PEER_STATE_DISCONNECTED || peer->state == ENET_PEER_STATE_ZOMBIE) {
+            continue;
+        }
+        enet_uint32 deadline;
+        if (!enet_list_empty(&peer->sentReliableCommands)) {
+            deadline = peer->nextTimeout;
+        } else if (peer->state == ENET_PEER_STATE_CONNECTED) {
+            deadline = peer->lastReceiveTime + peer->pingInterval;
+        } else {
+            continue;
+        }
+        auto wait = ENET_TIME_LESS_EQUAL(deadline, now) ? 1U : ENET_TIME_DIFFERENCE(deadline, now);
+        timeout = std::min<uint32_t>(timeout, wait);
+    }
+    return timeout;
+}
+
+void Context::HandleBulkPacketFree(void* packet) {
+    auto enet_pkt = static_cast<ENetPacket*>(packet);
+    auto queue = static_cast<BulkQueue*>(enet_pkt->userData);
+    queue->in_flight -= enet_pkt->dataLength;
+}
+
+void Context::HandleTrailerPacketFree(void* packet) {
+    auto enet_pkt = static_cast<ENetPacket*>(packet);
+    auto ref = static_cast<TrailerRef*>(enet_pkt->userData);
+    if (ref->queue != nullptr) {
+        ref->queue->in_flight -= enet_pkt->dataLength;
+    }
+    delete ref;
+}
+
+bool Context::SendPacket(Endpoint* endpoint, protocol::Type type, protocol::Opcode opcode, uint32_t session, const google::protobuf::Message* payload,
+                         protocol::Delivery delivery) {
+    if (endpoint == nullptr) {
+        ASBLog(ERROR) << "Invalid endpoint to send.";
         return false;
     }
     if (enet_host_ == nullptr || opcode > protocol::Opcode::kMax) {
         ASBLog(ERROR) << "Send packet with invalid enet host or invalid packet.";
         return false;
     }
-    auto enet_pkt = CreatePacket(type, opcode, session, payload);
+    auto channel = protocol::GetEnetChannel(type, opcode);
+    if (channel == protocol::EnetChannel::kBulk && type == protocol::Type::kEvent) {
+        auto size = (payload != nullptr) ? payload->ByteSizeLong() : 0;
+        if (size <= kBatchMaxRecord) {
+            return BatchEvent(endpoint, opcode, 0, size, delivery, [payload, size](uint8_t* data) {
+                return payload == nullptr || payload->SerializeToArray(data, static_cast<int>(size));
+            });
+        }
+        // Keep the bulk events of the peer in order.
+        auto bit = event_batch_map_.find(endpoint->enet_peer);
+        if (bit != event_batch_map_.end()) {
+            FlushBatch(bit->first, bit->second);
+        }
+    }
+    auto enet_pkt = CreatePacket(type, opcode, endpoint->object_id, session, payload);
     if (enet_pkt == nullptr) {
         ASBLog(ERROR) << "Failed to create packet to send.";
         return false;
     }
-    if (enet_peer_send(enet_peer, 0, enet_pkt) < 0) {
-        enet_packet_destroy(enet_pkt);
-        ASBLog(ERROR) << "Failed to send packet for peer " << enet_peer;
+    enet_pkt->flags = (enet_pkt->flags & ~kDeliveryFlags) | GetPacketFlags(delivery);
+    if (channel == protocol::EnetChannel::kBulk) {
+        if (!QueueBulkPacket(endpoint->enet_peer, enet_pkt)) {
+            PacketPool::Destroy(enet_pkt);
+            ASBLog(ERROR) << "Failed to queue bulk packet for endpoint " << endpoint;
+            return false;
+        }
+        return true;
+    }
+    if (PeerSend(endpoint->enet_peer, static_cast<enet_uint8>(channel), enet_pkt) < 0) {
+        PacketPool::Destroy(enet_pkt);
+        ASBLog(ERROR) << "Failed to send packet for endpoint " << endpoint;
+        return false;
+    }
+    WakeupBackend();
+    return true;
+}
+
+bool Context::SendRawPacket(Endpoint* endpoint, protocol::Opcode opcode, const void* meta, size_t meta_size,
+                            const ByteArray& bytes, protocol::Delivery delivery) {
+    auto enet_peer = endpoint->enet_peer;
+    if (enet_host_ == nullptr || enet_peer->state != ENET_PEER_STATE_CONNECTED) {
+        ASBLog(ERROR) << "Failed to send raw event for endpoint " << endpoint << ", peer not connected.";
+        return false;
+    }
+    protocol::RawHeader raw_header;
+    raw_header.meta_size = htonl(static_cast<uint32_t>(meta_size));
+    auto bytes_size = bytes.GetByteSize();
+    auto channel = protocol::GetEnetChannel(protocol::Type::kEvent, opcode);
+    if (channel == protocol::EnetChannel::kBulk) {
+        auto size = sizeof(raw_header) + meta_size + bytes_size;
+        if (size <= kBatchMaxRecord && delivery != protocol::Delivery::kConflated) {
+            return BatchEvent(endpoint, opcode, protocol::kHeaderRaw, size, delivery, [&](uint8_t* data) {
+                memcpy(data, &raw_header, sizeof(raw_header));
+                memcpy(data + sizeof(raw_header), meta, meta_size);
+                if (bytes_size > 0) {
+                    memcpy(data + sizeof(raw_header) + meta_size, bytes.GetData(), bytes_size);
+                }
+                return true;
+            });
+        }
+        auto bit = event_batch_map_.find(enet_peer);
+        if (bit != event_batch_map_.end()) {
+            FlushBatch(bit->first, bit->second);
+        }
+    }
+    // Only reliable packets of a channel arrive in order, so an unreliable
+    // event copies its bytes into the packet once instead. So does a
+    // conflated one, it may be replaced in the queue. The receiver pairs
+    // trailers on the bulk channel only.
+    bool has_trailer = (channel == protocol::EnetChannel::kBulk && delivery == protocol::Delivery::kReliable &&
+                        bytes_size >= kTrailerMinSize);
+    auto size = sizeof(protocol::Header) + sizeof(raw_header) + meta_size + (has_trailer ? 0 : bytes_size);
+    auto enet_pkt = PacketPool::Create(nullptr, size, GetPacketFlags(delivery));
+    if (enet_pkt == nullptr) {
+        ASBLog(ERROR) << "Failed to create enet packet.";
+        return false;
+    }
+    uint8_t* data = reinterpret_cast<uint8_t*>(enet_packet_get_data(enet_pkt));
+    InitHeader(data, protocol::Type::kEvent, opcode, endpoint->object_id, 0,
+               has_trailer ? static_cast<uint32_t>(bytes_size) : 0);
+    reinterpret_cast<protocol::Header*>(data)->flags = protocol::kHeaderRaw | (has_trailer ? protocol::kHeaderTrailer : 0);
+    data += sizeof(protocol::Header);
+    memcpy(data, &raw_header, sizeof(raw_header));
+    data += sizeof(raw_header);
+    memcpy(data, meta, meta_size);
+    if (!has_trailer && bytes_size > 0) {
+        memcpy(data + meta_size, bytes.GetData(), bytes_size);
+    }
+    ENetPacket* trailer_pkt = nullptr;
+    if (has_trailer) {
+        trailer_pkt = enet_packet_create(bytes.GetData(), bytes_size, ENET_PACKET_FLAG_RELIABLE | ENET_PACKET_FLAG_NO_ALLOCATE);
+        if (trailer_pkt == nullptr) {
+            PacketPool::Destroy(enet_pkt);
+            ASBLog(ERROR) << "Failed to create trailer packet.";
+            return false;
+        }
+        // The bytes stay referenced until ENet drops the packet.
+        trailer_pkt->userData = new TrailerRef{ bytes, nullptr };
+        trailer_pkt->freeCallback = &Context::HandleTrailerPacketFree;
+    }
+    if (channel == protocol::EnetChannel::kBulk) {
+        bool queued = (delivery == protocol::Delivery::kConflated) ? ConflateBulkPacket(endpoint, enet_pkt) :
+                                                                     QueueBulkPacket(enet_peer, enet_pkt, trailer_pkt);
+        if (!queued) {
+            PacketPool::Destroy(enet_pkt);
+            PacketPool::Destroy(trailer_pkt);
+            ASBLog(ERROR) << "Failed to queue bulk packet for endpoint " << endpoint;
+            return false;
+        }
+        return true;
+    }
+    if (PeerSend(enet_peer, static_cast<enet_uint8>(channel), enet_pkt) < 0) {
+        PacketPool::Destroy(enet_pkt);
+        ASBLog(ERROR) << "Failed to send packet for endpoint " << endpoint;
         return false;
     }
     WakeupBackend();
     return true;
 }
 
-ENetPacket* Context::CreateResponsePacket(protocol::Opcode opcode, uint32_t session, Result result, const google::protobuf::Message* payload) {
-    return CreatePacket(protocol::Type::kResponse, opcode, session, payload, static_cast<uint32_t>(result));
+ENetPacket* Context::CreateResponsePacket(protocol::Opcode opcode, uint32_t object_id, uint32_t session, Result result,
+                                          const google::protobuf::Message* payload) {
+    return CreatePacket(protocol::Type::kResponse, opcode, object_id, session, payload, static_cast<uint32_t>(result));
 }
 
-ENetPacket* Context::CreatePacket(protocol::Type type, protocol::Opcode opcode, uint32_t session,
+ENetPacket* Context::CreatePacket(protocol::Type type, protocol::Opcode opcode, uint32_t object_id, uint32_t session,
                                   const google::protobuf::Message* payload, uint32_t extra_data) {
     auto size = sizeof(protocol::Header);
     if (payload != nullptr) {
         size += payload->ByteSizeLong();
     }
-    auto enet_pkt = enet_packet_create(nullptr, size, ENET_PACKET_FLAG_RELIABLE);
+    auto enet_pkt = PacketPool::Create(nullptr, size, ENET_PACKET_FLAG_RELIABLE);
     if (enet_pkt == nullptr) {
         ASBLog(ERROR) << "Failed to create enet packet.";
         return nullptr;
     }
-    auto enet_pkt_guard = MakeScopeGuard([enet_pkt] { enet_packet_destroy(enet_pkt); });
+    auto enet_pkt_guard = MakeScopeGuard([enet_pkt] { PacketPool::Destroy(enet_pkt); });
     uint8_t* data = reinterpret_cast<uint8_t*>(enet_packet_get_data(enet_pkt));
-    auto header = reinterpret_cast<protocol::Header*>(data);
-    header->version = protocol::kVersion;
-    header->type = static_cast<uint8_t>(type);
-    header->opcode = static_cast<uint8_t>(opcode);
-    header->session = htonl(session);
-    header->extra_data = htonl(extra_data);
+    InitHeader(data, type, opcode, object_id, session, extra_data);
     data += sizeof(protocol::Header);
     size -= sizeof(protocol::Header);
     if (payload != nullptr && !payload->SerializeToArray(data, size)) {
@@ -735,6 +2310,19 @@ ENetPacket* Context::CreatePacket(protocol::Type type, protocol::Opcode opcode,
     return enet_pkt;
 }
 
+ENetPacket* Context::CreatePacket(protocol::Type type, protocol::Opcode opcode, uint32_t object_id, uint32_t session,
+                                  const std::string& payload, uint32_t extra_data) {
+    auto enet_pkt = PacketPool::Create(nullptr, sizeof(protocol::Header) + payload.size(), ENET_PACKET_FLAG_RELIABLE);
+    if (enet_pkt == nullptr) {
+        ASBLog(ERROR) << "Failed to create enet packet.";
+        return nullptr;
+    }
+    uint8_t* data = reinterpret_cast<uint8_t*>(enet_packet_get_data(enet_pkt));
+    InitHeader(data, type, opcode, object_id, session, extra_data);
+    memcpy(data + sizeof(protocol::Header), payload.data(), payload.size());
+    return enet_pkt;
+}
+
 }
 }
 }
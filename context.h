@@ -19,18 +19,32 @@
 #ifndef SF_MSGBUS_BLACKBOX2_CONTEXT_H_
 #define SF_MSGBUS_BLACKBOX2_CONTEXT_H_
 
+#include <list>
+#include <array>
+#include <deque>
 #include <map>
+#include <chrono>
+#include <string>
 #include <mutex>
+#include <condition_variable>
 #include <memory>
 #include <thread>
+#include <random>
+#include <vector>
 #include <functional>
+#include <unordered_map>
 
 #include <sf-msgbus/types/result.h>
 #include <sf-msgbus/blackbox2/common.h>
 #include <sf-msgbus/blackbox2/log.h>
 
 #include "enet.h"
-#include "pipe.h"
+#include "capture.h"
+#include "local_link.h"
+#include "packet_pool.h"
+#include "poller.h"
+#include "resume_cache.h"
+#include "timer_wheel.h"
 #include "protocol.h"
 
 #ifdef _WIN32
@@ -41,17 +55,28 @@ namespace asf {
 namespace msgbus {
 namespace blackbox2 {
 
+// An object's logical connection. All endpoints of a process are multiplexed
+// over a single ENet peer and told apart by the object id in the header.
+struct Endpoint {
+    ENetPeer* enet_peer;
+    uint32_t object_id;
+};
+
 class Context: public std::enable_shared_from_this<Context> {
 public:
     class RequestContext final {
     public:
-        RequestContext(std::shared_ptr<Context> context, ENetPeer* enet_peer,
-                       protocol::Opcode opcode, uint32_t session, google::protobuf::io::ZeroCopyInputStream& payload);
+        RequestContext(std::shared_ptr<Context> context, Endpoint* endpoint,
+                       protocol::Opcode opcode, uint32_t session, google::protobuf::io::ZeroCopyInputStream& payload,
+                       uint64_t instance_id = 0, std::string* batch_response = nullptr);
         ~RequestContext();
 
     public:
         std::shared_ptr<Context> GetContext();
-        ENetPeer* GetENetPeer();
+        Endpoint* GetEndpoint();
+        // Instance id the client picked in the kAttachBatch record of the
+        // request, 0 if the server picks it.
+        uint64_t GetInstanceId() const;
         protocol::Opcode GetOpcode() const;
         uint32_t GetSession() const;
         google::protobuf::io::ZeroCopyInputStream& GetPayload();
@@ -60,23 +85,57 @@ public:
 
     private:
         std::weak_ptr<Context> context_;
+        Endpoint* endpoint_;
         ENetPeer* enet_peer_;
+        uint32_t object_id_;
         protocol::Opcode opcode_;
         uint32_t session_;
         google::protobuf::io::ZeroCopyInputStream& payload_;
+        uint64_t instance_id_;
+        // The response of a request of a batch is appended to the response of
+        // the batch instead.
+        std::string* batch_response_;
         bool response_dirty_;
         ENetPacket* response_packet_;
     };
 
+    // A raw event, its metadata and bytes stay in the packets that carried
+    // them. GetBytes() hands out a view that keeps its packet alive.
+    class RawEvent final {
+    public:
+        RawEvent(const uint8_t* meta, size_t meta_size, const uint8_t* bytes, size_t bytes_size, PacketRef& packet);
+
+    public:
+        const uint8_t* GetMeta() const;
+        size_t GetMetaSize() const;
+        size_t GetBytesSize() const;
+        ByteArray GetBytes();
+
+    private:
+        const uint8_t* meta_;
+        size_t meta_size_;
+        const uint8_t* bytes_;
+        size_t bytes_size_;
+        PacketRef& packet_;
+    };
+
 public:
-    using ConnectCallback = std::function<void (Result, ENetPeer*)>;
+    using ConnectCallback = std::function<void (Result, Endpoint*)>;
     using DisconnectCallback = std::function<void (Result)>;
-    using ConnectHandler = std::function<void (ENetPeer*)>;
+    using ConnectHandler = std::function<void (Endpoint*)>;
     using DisconnectHandler = std::function<void ()>;
     using EventHandler = std::function<void (google::protobuf::io::ZeroCopyInputStream&)>;
+    using RawEventHandler = std::function<void (RawEvent&)>;
     using RequestHandler = std::function<void (RequestContext&)>;
     using RequestCallback = std::function<void (Result, google::protobuf::io::ZeroCopyInputStream*)>;
 
+    using TimerId = uint64_t;
+    using TimerCallback = std::function<void ()>;
+
+    static constexpr std::chrono::milliseconds kDefaultRequestTimeout{ 10000 };
+    // Raw bytes from this size on are sent from the caller's buffer as a trailer.
+    static constexpr size_t kTrailerMinSize = 4096;
+
 public:
     Context();
     Context(const Context&) = delete;
@@ -86,64 +145,294 @@ public:
 public:
     bool IsEnabled() const;
     bool StartAsClient(const ENetAddress* enet_address = nullptr);
-    bool StartAsServer(ConnectHandler handler, const ENetAddress* enet_address = nullptr);
+    bool StartAsServer(ConnectHandler handler, const ENetAddress* enet_address = nullptr, bool reuse_port = false);
     void Stop();
+    bool ListenLocal();
     bool Connect(ConnectCallback cb);
-    bool Disconnect(ENetPeer* enet_peer, DisconnectCallback cb = nullptr);
-    bool SendEvent(ENetPeer* enet_peer, protocol::Opcode opcode, const google::protobuf::Message* payload);
-    bool SendRequest(ENetPeer* enet_peer, protocol::Opcode opcode, const google::protobuf::Message* payload, RequestCallback cb);
-    void RegisterDisconnectHandler(ENetPeer* enet_peer, DisconnectHandler handler);
-    void RegisterEventHandler(ENetPeer* enet_peer, protocol::Opcode opcode, EventHandler handler);
-    void RegisterRequestHandler(ENetPeer* enet_peer, protocol::Opcode opcode, RequestHandler handler);
-    void UnregisterAll(ENetPeer* enet_peer);
+    bool Disconnect(Endpoint* endpoint, DisconnectCallback cb = nullptr);
+    bool SendEvent(Endpoint* endpoint, protocol::Opcode opcode, const google::protobuf::Message* payload,
+                   protocol::Delivery delivery = protocol::Delivery::kReliable);
+    bool SendEvent(Endpoint* endpoint, protocol::Opcode opcode, const void* meta, size_t meta_size, const ByteArray& bytes,
+                   protocol::Delivery delivery = protocol::Delivery::kReliable);
+    bool SendRequest(Endpoint* endpoint, protocol::Opcode opcode, const google::protobuf::Message* payload, RequestCallback cb,
+                     std::chrono::milliseconds timeout = kDefaultRequestTimeout, uint32_t* session = nullptr);
+    bool CancelRequest(Endpoint* endpoint, uint32_t session);
+    // Attach requests of a peer are sent in one kAttachBatch request per
+    // backend pass.
+    bool SendAttach(Endpoint* endpoint, uint64_t instance_id, protocol::Opcode opcode, const google::protobuf::Message& payload,
+                    RequestCallback cb, std::chrono::milliseconds timeout = kDefaultRequestTimeout);
+    void RegisterDisconnectHandler(Endpoint* endpoint, DisconnectHandler handler);
+    void RegisterEventHandler(Endpoint* endpoint, protocol::Opcode opcode, EventHandler handler);
+    void RegisterRawEventHandler(Endpoint* endpoint, protocol::Opcode opcode, RawEventHandler handler);
+    void RegisterRequestHandler(Endpoint* endpoint, protocol::Opcode opcode, RequestHandler handler);
+    void UnregisterAll(Endpoint* endpoint);
+    // Runs cb with the next reconnect attempt of the process. Attempts back
+    // off exponentially with jitter until a connection succeeds.
+    void RetryLater(std::function<void ()> cb);
+    // Runs cb unlocked on the backend thread after delay, then every period
+    // if it is not zero, until the timer is canceled.
+    TimerId Schedule(std::chrono::milliseconds delay, TimerCallback cb,
+                     std::chrono::milliseconds period = std::chrono::milliseconds(0));
+    bool CancelTimer(TimerId id);
+    // Keeps attach payloads for resuming clients, set before StartAsServer.
+    void SetResumeCache(std::shared_ptr<ResumeCache> resume_cache);
+    uint64_t GetConflatedCount(Endpoint* endpoint);
     const ENetAddress& GetServerAddress();
+    Capture* GetCapture();
 
 private:
-    enum AsyncCommand: char {
-        kAsyncExit = 'x',
-        kAsyncWakeup = 'w'
+    static constexpr size_t kOpcodeCount = static_cast<size_t>(protocol::Opcode::kMax);
+
+    struct RequestSession {
+        RequestCallback cb;
+        TimerWheel::TimerId timer;
+    };
+
+    // Attach in flight of a client, sent again with its payload if the
+    // server has nothing to resume it from.
+    struct PendingAttach {
+        protocol::Opcode opcode;
+        uint64_t instance;
+        uint64_t digest;
+        std::string payload;
+        std::chrono::milliseconds timeout;
+    };
+
+    // Dispatch block of an endpoint. Handlers are indexed by opcode and shared
+    // so a packet is dispatched without lookups, copies or allocations.
+    struct EndpointBlock: Endpoint {
+        std::array<std::shared_ptr<EventHandler>, kOpcodeCount> event_handlers;
+        std::array<std::shared_ptr<RawEventHandler>, kOpcodeCount> raw_event_handlers;
+        std::array<std::shared_ptr<RequestHandler>, kOpcodeCount> request_handlers;
+        DisconnectHandler disconnect_handler;
+        std::map<uint32_t, RequestSession> sessions;
+        uint64_t conflated;
+        std::unique_ptr<PendingAttach> attach;
+        uint64_t resume_instance;   // Server only, the instance its payload is kept for.
+    };
+
+    // Kept in ENetPeer::data from the first endpoint until the peer is gone.
+    struct PeerBlock {
+        std::unordered_map<uint32_t, std::unique_ptr<EndpointBlock>> endpoints;
+        uint32_t next_session;
+    };
+
+    // Transport of a client to the server, a local link falls back to ENet
+    // when the server cannot be reached through it.
+    enum class Transport {
+        kEnet,
+        kShm,
+        kUnix
+    };
+
+    // Stands in for the ENet peer of a local link, its host is null.
+    struct LocalPeer {
+        ENetPeer enet_peer;
+        std::unique_ptr<LocalLink> link;
+        bool connected;
+    };
+    using LocalPeerMap = std::map<ENetPeer*, std::unique_ptr<LocalPeer>>;
+
+    using ConnectCallbackMap = std::map<Endpoint*, ConnectCallback>;
+    using DisconnectCallbackList = std::list<DisconnectCallback>;
+
+    // Bulk packets are staged per peer and handed to ENet only while the bytes
+    // not yet acknowledged stay under a budget. ENet keeps the reliable
+    // commands of all channels in one outgoing list, so this keeps control
+    // packets from queueing behind megabytes of message fragments.
+    // The kConflated message of an endpoint still in the queue is kept by
+    // its slot in latest, deque slots stay put on pushes and pops at the ends.
+    struct BulkQueue {
+        std::deque<ENetPacket*> packets;
+        size_t bytes;
+        size_t in_flight;
+        std::unordered_map<uint32_t, ENetPacket**> latest;
+    };
+    using BulkQueueMap = std::map<ENetPeer*, BulkQueue>;
+
+    // What to do with a kMessage event when the bulk queue of its peer is
+    // over budget. Other bulk events are always queued.
+    enum class SendQueuePolicy {
+        kDropNewest,
+        kDropOldest,
+        kBlock      // Wait for room up to the timeout, then drop the newest.
+    };
+
+    struct SendQueueConfig {
+        size_t max_bytes;
+        size_t max_packets;
+        SendQueuePolicy policy;
+        std::chrono::milliseconds timeout;
     };
 
-    using ConnectCallbackMap = std::map<ENetPeer*, ConnectCallback>;
-    using DisconnectCallbackMap = std::map<ENetPeer*, DisconnectCallback>;
-    using DisconnectHandlerMap = std::map<ENetPeer*, DisconnectHandler>;
-    using EventHandlerMap = std::map<ENetPeer*, std::map<protocol::Opcode, EventHandler>>;
-    using RequestHandlerMap = std::map<ENetPeer*, std::map<protocol::Opcode, RequestHandler>>;
-    using RequestSessionMap = std::map<ENetPeer*, std::map<uint32_t, RequestCallback>>;
+    // kMessage events dropped or conflated per endpoint, reported to the
+    // other side.
+    struct DropReport {
+        uint32_t count;
+        uint32_t conflated;
+        uint64_t bytes;
+    };
+    using DropReportMap = std::map<std::pair<ENetPeer*, uint32_t>, DropReport>;
+
+    // Small bulk events of all endpoints of a peer are packed into one kBatch
+    // packet, flushed on its size, its record count or its age.
+    struct EventBatch {
+        std::string data;
+        uint32_t count;
+        protocol::Delivery delivery;
+        std::chrono::steady_clock::time_point deadline;
+    };
+    using EventBatchMap = std::map<ENetPeer*, EventBatch>;
+
+    // With busy polling the backend keeps passing over ENet and the local
+    // links for a while after its last work instead of parking in the
+    // poller, senders skip the wakeup while it spins.
+    struct BusyPoll {
+        std::chrono::microseconds spin;     // 0 if disabled.
+        bool is_spinning;
+        uint64_t work_count;
+        std::chrono::steady_clock::time_point last_work;
+        std::chrono::steady_clock::duration spin_time;
+        std::chrono::steady_clock::duration work_time;
+        std::chrono::steady_clock::duration park_time;
+        uint64_t parks;
+    };
+
+    // Attach requests of a peer not sent yet, its records share one session.
+    struct AttachBatch {
+        std::string data;
+        uint32_t count;
+        uint32_t object_id;
+        uint32_t session;
+    };
+    using AttachBatchMap = std::map<ENetPeer*, AttachBatch>;
+
+    // Owner of the bytes of a trailer packet, they are sent without a copy.
+    struct TrailerRef {
+        ByteArray bytes;
+        BulkQueue* queue;
+    };
+    // Received events waiting for their trailer, by peer.
+    using TrailerMap = std::map<ENetPeer*, ENetPacket*>;
 
     void InitConfig(const ENetAddress* enet_address);
+    bool CreateReusePortHost();
     bool Start();
     bool WakeupBackend();
     void BackendThread();
     void HandleService();
+    void HandleLocalPeers();
+    void FlushLocalPeers();
+    ENetPeer* ConnectLocal();
+    ENetPeer* AddLocalPeer(std::unique_ptr<LocalLink> link);
+    void CloseLocalPeer(ENetPeer* enet_peer);
+    bool PrepareLocalWait();
+    int PeerSend(ENetPeer* enet_peer, enet_uint8 channel, ENetPacket* enet_pkt);
     void HandleConnect(ENetPeer* enet_peer);
     void HandleDisconnect(ENetPeer* enet_peer);
-    void HandlePacket(ENetPeer* enet_peer, ENetPacket* enet_pkt);
-    void HandleEventPacket(ENetPeer* enet_peer, protocol::Opcode opcode, google::protobuf::io::ZeroCopyInputStream& payload);
-    void HandleRequestPacket(ENetPeer* enet_peer, protocol::Opcode opcode, uint32_t session, google::protobuf::io::ZeroCopyInputStream& payload);
-    void HandleResponsePacket(ENetPeer* enet_peer, uint32_t session, Result result, google::protobuf::io::ZeroCopyInputStream& payload);
+    void HandleEndpointDisconnect(Endpoint* endpoint);
+    void HandlePendingConnections();
+    void HandlePendingDisconnections();
+    void HandlePacket(ENetPeer* enet_peer, enet_uint8 channel, ENetPacket* enet_pkt);
+    void HandleBatchPacket(ENetPeer* enet_peer, uint32_t count, const uint8_t* data, size_t size, PacketRef& packet);
+    void HandleAttachBatchPacket(ENetPeer* enet_peer, uint32_t object_id, uint32_t session, uint32_t count, const uint8_t* data,
+                                 size_t size);
+    void HandleAttachBatchResponse(ENetPeer* enet_peer, uint32_t session, const uint8_t* data, size_t size);
+    void HandleEventPacket(Endpoint* endpoint, protocol::Opcode opcode, google::protobuf::io::ZeroCopyInputStream& payload);
+    void HandleRawEventPacket(Endpoint* endpoint, protocol::Opcode opcode, const uint8_t* data, size_t size, PacketRef& packet,
+                              PacketRef* trailer);
+    void HandleRequestPacket(Endpoint* endpoint, protocol::Opcode opcode, uint32_t session, google::protobuf::io::ZeroCopyInputStream& payload);
+    void HandleResponsePacket(Endpoint* endpoint, uint32_t session, Result result, google::protobuf::io::ZeroCopyInputStream& payload);
     void HandleAsyncCommand();
+    void HandleTimers();
+    void AddScheduledTimer(TimerId id, TimerWheel::Clock::time_point deadline, std::shared_ptr<TimerCallback> cb,
+                           std::chrono::milliseconds period);
+    void HandleRequestTimeout(ENetPeer* enet_peer, uint32_t object_id, uint32_t session);
+    void ClearSessions(EndpointBlock* block);
+    Endpoint* CreateEndpoint(ENetPeer* enet_peer, uint32_t object_id);
+    Endpoint* AcceptEndpoint(ENetPeer* enet_peer, uint32_t object_id);
+    Endpoint* FindEndpoint(ENetPeer* enet_peer, uint32_t object_id);
+    void RemoveEndpoint(Endpoint* endpoint);
+    static PeerBlock* GetPeerBlock(ENetPeer* enet_peer);
+    static void ReleasePeerBlock(ENetPeer* enet_peer);
     bool SendPacket(ENetPeer* enet_peer, ENetPacket* enet_pkt);
-    bool SendPacket(ENetPeer* enet_peer, protocol::Type type, protocol::Opcode opcode, uint32_t session, const google::protobuf::Message* payload);
-    static ENetPacket* CreateResponsePacket(protocol::Opcode opcode, uint32_t session, Result result, const google::protobuf::Message* payload = nullptr);
-    static ENetPacket* CreatePacket(protocol::Type type, protocol::Opcode opcode, uint32_t session, const google::protobuf::Message* payload = nullptr, uint32_t extra_data = 0);
+    bool QueueBulkPacket(ENetPeer* enet_peer, ENetPacket* enet_pkt, ENetPacket* trailer_pkt = nullptr);
+    bool WaitBulkQueue(std::unique_lock<std::mutex>& lg, Endpoint* endpoint);
+    bool IsBulkQueueFull(const BulkQueue& queue, size_t size) const;
+    bool DropOldestPacket(ENetPeer* enet_peer, BulkQueue& queue);
+    void DropPacket(ENetPeer* enet_peer, ENetPacket* enet_pkt, ENetPacket* trailer_pkt = nullptr);
+    bool ConflateBulkPacket(Endpoint* endpoint, ENetPacket* enet_pkt);
+    DropReport& GetDropReport(ENetPeer* enet_peer, uint32_t object_id);
+    void ReportDrops();
+    void FlushBulkQueue(ENetPeer* enet_peer, BulkQueue& queue);
+    void FlushBulkQueues();
+    void ClearBulkQueue(ENetPeer* enet_peer);
+    template <typename Writer>
+    bool BatchEvent(Endpoint* endpoint, protocol::Opcode opcode, uint8_t flags, size_t size, protocol::Delivery delivery,
+                    Writer&& write);
+    bool FlushBatch(ENetPeer* enet_peer, EventBatch& batch);
+    void FlushBatches();
+    uint32_t QueueAttachRecord(Endpoint* endpoint, protocol::Opcode opcode, uint8_t flags, uint64_t instance_id, uint64_t digest,
+                               const std::string& payload);
+    void FlushAttachBatches();
+    void HandleRetry();
+    void ReportBusyPoll();
+    void ReportPacketPool();
+    uint32_t GetWaitTimeout() const;
+    uint32_t GetEnetTimeout(uint32_t max_timeout) const;
+    static void HandleBulkPacketFree(void* packet);
+    static void HandleTrailerPacketFree(void* packet);
+    bool SendPacket(Endpoint* endpoint, protocol::Type type, protocol::Opcode opcode, uint32_t session, const google::protobuf::Message* payload,
+                    protocol::Delivery delivery = protocol::Delivery::kReliable);
+    bool SendRawPacket(Endpoint* endpoint, protocol::Opcode opcode, const void* meta, size_t meta_size, const ByteArray& bytes,
+                       protocol::Delivery delivery);
+    static ENetPacket* CreateResponsePacket(protocol::Opcode opcode, uint32_t object_id, uint32_t session, Result result,
+                                            const google::protobuf::Message* payload = nullptr);
+    static ENetPacket* CreatePacket(protocol::Type type, protocol::Opcode opcode, uint32_t object_id, uint32_t session,
+                                    const google::protobuf::Message* payload = nullptr, uint32_t extra_data = 0);
+    static ENetPacket* CreatePacket(protocol::Type type, protocol::Opcode opcode, uint32_t object_id, uint32_t session,
+                                    const std::string& payload, uint32_t extra_data);
 
 private:
     std::mutex mutex_;
     bool is_enabled_;
     ENetHost* enet_host_;
     ENetAddress server_address_;
-    Pipe pipe_;
+    Poller poller_;
     bool backend_run_;
+    bool async_pending_;
     std::thread backend_thread_;
-    uint32_t session_;
+    ENetPeer* shared_peer_;
+    uint32_t next_object_id_;
     ConnectCallbackMap pending_connections_;
-    DisconnectCallbackMap pending_disconnections_;
+    DisconnectCallbackList pending_disconnections_;
     ConnectHandler connect_handler_;
-    DisconnectHandlerMap disconnect_handler_map_;
-    EventHandlerMap event_handler_map_;
-    RequestHandlerMap request_handler_map_;
-    RequestSessionMap request_session_map_;
+    Transport transport_;
+    LocalListener local_listener_;
+    LocalPeerMap local_peers_;
+    SendQueueConfig send_queue_config_;
+    BulkQueueMap bulk_queue_map_;
+    std::condition_variable bulk_queue_cv_;
+    DropReportMap drop_report_map_;
+    std::chrono::steady_clock::time_point drop_report_deadline_;
+    EventBatchMap event_batch_map_;
+    AttachBatchMap attach_batch_map_;
+    // Digests of the attach payloads the server has taken, by instance id.
+    std::unordered_map<uint64_t, uint64_t> resumable_;
+    std::shared_ptr<ResumeCache> resume_cache_;
+    std::vector<std::function<void ()>> retry_callbacks_;
+    uint32_t retry_attempts_;
+    std::mt19937 retry_random_;
+    TrailerMap trailer_map_;
+    std::unique_ptr<Capture> capture_;
+    TimerWheel timer_wheel_;
+    // Timers of Schedule(), a periodic one is added to the wheel again on
+    // each run under the same id.
+    std::unordered_map<TimerId, TimerWheel::TimerId> scheduled_timers_;
+    TimerId next_timer_id_;
+    BusyPoll busy_poll_;
+    PacketPool::Stats packet_pool_stats_;
+    size_t io_batch_;
 };
 
 }
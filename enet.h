@@ -152,6 +152,11 @@
     #include <errno.h>
     #include <fcntl.h>
 
+    /* recvmmsg/sendmmsg, C++ compilers define _GNU_SOURCE on Linux. */
+    #if defined(__linux__) && defined(_GNU_SOURCE)
+    #define ENET_IO_BATCH 1
+    #endif
+
     #ifdef __APPLE__
     #include <mach/clock.h>
     #include <mach/mach.h>
@@ -740,6 +745,9 @@ extern "C" {
     /** Callback for intercepting received raw UDP packets. Should return 1 to intercept, 0 to ignore, or -1 to propagate an error. */
     typedef int (ENET_CALLBACK * ENetInterceptCallback)(struct _ENetHost *host, void *event);
 
+    /** Datagrams a host receives and sends with one recvmmsg/sendmmsg each, see enet_host_io_batch(). */
+    typedef struct _ENetIoBatch ENetIoBatch;
+
     /** An ENet host for communicating with peers.
      *
      * No fields should be modified unless otherwise stated.
@@ -792,6 +800,7 @@ extern "C" {
         size_t                duplicatePeers;     /**< optional number of allowed peers from duplicate IPs, defaults to ENET_PROTOCOL_MAXIMUM_PEER_ID */
         size_t                maximumPacketSize;  /**< the maximum allowable packet size that may be sent or received on a peer */
         size_t                maximumWaitingData; /**< the maximum aggregate amount of buffer space a peer may use waiting for packets to be delivered */
+        ENetIoBatch *         ioBatch;            /**< batched socket I/O, NULL unless enabled with enet_host_io_batch() */
     } ENetHost;
 
     /**
@@ -992,6 +1001,7 @@ extern "C" {
     ENET_API void       enet_host_compress(ENetHost *, const ENetCompressor *);
     ENET_API void       enet_host_channel_limit(ENetHost *, size_t);
     ENET_API void       enet_host_bandwidth_limit(ENetHost *, enet_uint32, enet_uint32);
+    ENET_API int        enet_host_io_batch(ENetHost *, size_t);
     extern   void       enet_host_bandwidth_throttle(ENetHost *);
     extern  enet_uint64 enet_host_random_seed(void);
 
@@ -2677,18 +2687,195 @@ extern "C" {
         return 0;
     } /* enet_protocol_handle_incoming_commands */
 
+    // =======================================================================//
+    // !
+    // ! Batched socket I/O
+    // !
+    // =======================================================================//
+
+    /* Received datagrams are handed out one by one from the slots of the
+     * last recvmmsg. Outgoing datagrams are copied into the send slots, the
+     * buffers of a datagram only live until the next one is built, and go
+     * out with one sendmmsg when the slots are full or the host is done. */
+    struct _ENetIoBatch {
+        size_t size;
+        size_t slotSize;
+        size_t receiveCount;
+        size_t receiveIndex;
+        size_t sendCount;
+        enet_uint8 *data;
+    #if defined(ENET_IO_BATCH)
+        struct mmsghdr *headers;
+        struct iovec *vectors;
+        struct sockaddr_in6 *addresses;
+    #endif
+    };
+
+    static void enet_io_batch_destroy(ENetIoBatch *batch) {
+        if (batch == NULL) {
+            return;
+        }
+        enet_free(batch->data);
+    #if defined(ENET_IO_BATCH)
+        enet_free(batch->headers);
+        enet_free(batch->vectors);
+        enet_free(batch->addresses);
+    #endif
+        enet_free(batch);
+    }
+
+    static int enet_io_batch_has_received(ENetHost *host) {
+        return host->ioBatch != NULL && host->ioBatch->receiveIndex < host->ioBatch->receiveCount;
+    }
+
+    /* Same results as enet_socket_receive(), -2 skips a truncated datagram. */
+    static int enet_io_batch_receive(ENetHost *host) {
+    #if defined(ENET_IO_BATCH)
+        ENetIoBatch *batch = host->ioBatch;
+        struct mmsghdr *header;
+        struct sockaddr_in6 *sin;
+        size_t i;
+        int count;
+
+        if (batch->receiveIndex >= batch->receiveCount) {
+            batch->receiveCount = batch->receiveIndex = 0;
+            for (i = 0; i < batch->size; ++i) {
+                batch->vectors[i].iov_base          = batch->data + i * batch->slotSize;
+                batch->vectors[i].iov_len           = batch->slotSize;
+                memset(&batch->headers[i], 0, sizeof(struct mmsghdr));
+                batch->headers[i].msg_hdr.msg_name    = &batch->addresses[i];
+                batch->headers[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+                batch->headers[i].msg_hdr.msg_iov     = &batch->vectors[i];
+                batch->headers[i].msg_hdr.msg_iovlen  = 1;
+            }
+            count = recvmmsg(host->socket, batch->headers, (unsigned int) batch->size, MSG_DONTWAIT, NULL);
+            if (count == -1) {
+                return (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR) ? 0 : -1;
+            }
+            batch->receiveCount = (size_t) count;
+            if (count == 0) {
+                return 0;
+            }
+        }
+
+        i      = batch->receiveIndex++;
+        header = &batch->headers[i];
+        sin    = &batch->addresses[i];
+        if (header->msg_hdr.msg_flags & MSG_TRUNC) {
+            return -2;
+        }
+
+        host->receivedAddress.host          = sin->sin6_addr;
+        host->receivedAddress.port          = ENET_NET_TO_HOST_16(sin->sin6_port);
+        host->receivedAddress.sin6_scope_id = sin->sin6_scope_id;
+        host->receivedData                  = batch->data + i * batch->slotSize;
+        return (int) header->msg_len;
+    #else
+        (void) host;
+        return -1;
+    #endif
+    }
+
+    static void enet_io_batch_flush(ENetHost *host) {
+    #if defined(ENET_IO_BATCH)
+        ENetIoBatch *batch = host->ioBatch;
+        struct mmsghdr *headers;
+        size_t sent = 0;
+        int count;
+
+        if (batch == NULL) {
+            return;
+        }
+        headers = batch->headers + batch->size;
+        while (sent < batch->sendCount) {
+            count = sendmmsg(host->socket, headers + sent, (unsigned int) (batch->sendCount - sent), MSG_NOSIGNAL);
+            if (count == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EWOULDBLOCK || errno == EAGAIN) {
+                    /* Lost like a datagram the kernel drops, reliable commands are resent. */
+                    break;
+                }
+                /* The first datagram failed alone, e.g. its peer is unreachable. */
+                count = 1;
+            }
+            sent += (size_t) count;
+        }
+        batch->sendCount = 0;
+    #else
+        (void) host;
+    #endif
+    }
+
+    /* Same results as enet_socket_send(), the datagram is only queued. */
+    static int enet_io_batch_send(ENetHost *host, const ENetAddress *address, const ENetBuffer *buffers, size_t bufferCount) {
+    #if defined(ENET_IO_BATCH)
+        ENetIoBatch *batch = host->ioBatch;
+        struct mmsghdr *header;
+        struct sockaddr_in6 *sin;
+        enet_uint8 *data;
+        size_t length = 0;
+        size_t i;
+
+        for (i = 0; i < bufferCount; ++i) {
+            length += buffers[i].dataLength;
+        }
+        if (length > batch->slotSize) {
+            enet_io_batch_flush(host);
+            return enet_socket_send(host->socket, address, buffers, bufferCount);
+        }
+        if (batch->sendCount == batch->size) {
+            enet_io_batch_flush(host);
+        }
+
+        i    = batch->sendCount++;
+        data = batch->data + (batch->size + i) * batch->slotSize;
+        for (length = 0; bufferCount > 0; ++buffers, --bufferCount) {
+            memcpy(data + length, buffers->data, buffers->dataLength);
+            length += buffers->dataLength;
+        }
+
+        sin = &batch->addresses[batch->size + i];
+        memset(sin, 0, sizeof(struct sockaddr_in6));
+        sin->sin6_family   = AF_INET6;
+        sin->sin6_port     = ENET_HOST_TO_NET_16(address->port);
+        sin->sin6_addr     = address->host;
+        sin->sin6_scope_id = address->sin6_scope_id;
+
+        batch->vectors[batch->size + i].iov_base = data;
+        batch->vectors[batch->size + i].iov_len  = length;
+
+        header = &batch->headers[batch->size + i];
+        memset(header, 0, sizeof(struct mmsghdr));
+        header->msg_hdr.msg_name    = sin;
+        header->msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+        header->msg_hdr.msg_iov     = &batch->vectors[batch->size + i];
+        header->msg_hdr.msg_iovlen  = 1;
+        return (int) length;
+    #else
+        return enet_socket_send(host->socket, address, buffers, bufferCount);
+    #endif
+    }
+
     static int enet_protocol_receive_incoming_commands(ENetHost *host, ENetEvent *event) {
         int packets;
 
-        for (packets = 0; packets < 256; ++packets) {
+        /* Datagrams already taken from the socket are never left behind. */
+        for (packets = 0; packets < 256 || enet_io_batch_has_received(host); ++packets) {
             int receivedLength;
             ENetBuffer buffer;
 
-            buffer.data       = host->packetData[0];
-            // buffer.dataLength = sizeof (host->packetData[0]);
-            buffer.dataLength = host->mtu;
+            if (host->ioBatch != NULL) {
+                receivedLength = enet_io_batch_receive(host);
+            } else {
+                buffer.data       = host->packetData[0];
+                // buffer.dataLength = sizeof (host->packetData[0]);
+                buffer.dataLength = host->mtu;
 
-            receivedLength    = enet_socket_receive(host->socket, &host->receivedAddress, &buffer, 1);
+                receivedLength    = enet_socket_receive(host->socket, &host->receivedAddress, &buffer, 1);
+                host->receivedData = host->packetData[0];
+            }
 
             if (receivedLength == -2)
                 continue;
@@ -2701,7 +2888,6 @@ extern "C" {
                 return 0;
             }
 
-            host->receivedData       = host->packetData[0];
             host->receivedDataLength = receivedLength;
 
             host->totalReceivedData += receivedLength;
@@ -3046,7 +3232,7 @@ extern "C" {
         return canPing;
     } /* enet_protocol_send_reliable_outgoing_commands */
 
-    static int enet_protocol_send_outgoing_commands(ENetHost *host, ENetEvent *event, int checkForTimeouts) {
+    static int enet_protocol_queue_outgoing_commands(ENetHost *host, ENetEvent *event, int checkForTimeouts) {
         enet_uint8 headerData[sizeof(ENetProtocolHeader) + sizeof(enet_uint32)];
         ENetProtocolHeader *header = (ENetProtocolHeader *) headerData;
         ENetPeer *currentPeer;
@@ -3171,7 +3357,11 @@ extern "C" {
                 }
 
                 currentPeer->lastSendTime = host->serviceTime;
-                sentLength = enet_socket_send(host->socket, &currentPeer->address, host->buffers, host->bufferCount);
+                if (host->ioBatch != NULL) {
+                    sentLength = enet_io_batch_send(host, &currentPeer->address, host->buffers, host->bufferCount);
+                } else {
+                    sentLength = enet_socket_send(host->socket, &currentPeer->address, host->buffers, host->bufferCount);
+                }
                 enet_protocol_remove_sent_unreliable_commands(currentPeer);
 
                 if (sentLength < 0) {
@@ -3191,6 +3381,12 @@ extern "C" {
         host->buffers[0].data = NULL;
 
         return 0;
+    } /* enet_protocol_queue_outgoing_commands */
+
+    static int enet_protocol_send_outgoing_commands(ENetHost *host, ENetEvent *event, int checkForTimeouts) {
+        int result = enet_protocol_queue_outgoing_commands(host, event, checkForTimeouts);
+        enet_io_batch_flush(host);
+        return result;
     } /* enet_protocol_send_outgoing_commands */
 
     /** Sends any queued packets on the host specified to its designated peers.
@@ -4476,6 +4672,7 @@ extern "C" {
         host->compressor.decompress         = NULL;
         host->compressor.destroy            = NULL;
         host->intercept                     = NULL;
+        host->ioBatch                       = NULL;
 
         enet_list_clear(&host->dispatchQueue);
 
@@ -4518,10 +4715,56 @@ extern "C" {
             (*host->compressor.destroy)(host->compressor.context);
         }
 
+        enet_io_batch_destroy(host->ioBatch);
         enet_free(host->peers);
         enet_free(host);
     }
 
+    /** Receives and sends up to batchSize datagrams per recvmmsg/sendmmsg call.
+     *  @param host host to set up
+     *  @param batchSize datagrams per call, 0 or 1 turns batching off
+     *  @returns 0 on success, < 0 if batching is not supported on this platform or the slots cannot be allocated
+     *  @remarks datagrams larger than the MTU of the host at this call are sent alone
+     */
+    int enet_host_io_batch(ENetHost *host, size_t batchSize) {
+    #if defined(ENET_IO_BATCH)
+        ENetIoBatch *batch = NULL;
+
+        if (host->ioBatch != NULL) {
+            if (enet_io_batch_has_received(host)) {
+                return -1;
+            }
+            enet_io_batch_flush(host);
+            enet_io_batch_destroy(host->ioBatch);
+            host->ioBatch = NULL;
+        }
+        if (batchSize <= 1) {
+            return 0;
+        }
+
+        batch = (ENetIoBatch *) enet_malloc(sizeof(ENetIoBatch));
+        if (batch == NULL) {
+            return -1;
+        }
+        memset(batch, 0, sizeof(ENetIoBatch));
+        batch->size      = batchSize;
+        batch->slotSize  = host->mtu;
+        batch->data      = (enet_uint8 *) enet_malloc(2 * batchSize * batch->slotSize);
+        batch->headers   = (struct mmsghdr *) enet_malloc(2 * batchSize * sizeof(struct mmsghdr));
+        batch->vectors   = (struct iovec *) enet_malloc(2 * batchSize * sizeof(struct iovec));
+        batch->addresses = (struct sockaddr_in6 *) enet_malloc(2 * batchSize * sizeof(struct sockaddr_in6));
+        if (batch->data == NULL || batch->headers == NULL || batch->vectors == NULL || batch->addresses == NULL) {
+            enet_io_batch_destroy(batch);
+            return -1;
+        }
+        host->ioBatch = batch;
+        return 0;
+    #else
+        (void) host;
+        return batchSize <= 1 ? 0 : -1;
+    #endif
+    }
+
     /** Initiates a connection to a foreign host.
      *  @param host host seeking the connection
      *  @param address destination for the connection
@@ -24,9 +24,9 @@ namespace asf {
 namespace msgbus {
 namespace blackbox2 {
 
-ExecutorProxyImpl::ExecutorProxyImpl(std::shared_ptr<Context> context, ENetPeer* enet_peer,
+ExecutorProxyImpl::ExecutorProxyImpl(std::shared_ptr<Context> context, Endpoint* endpoint,
                                      protocol::Executor&& protocol_executor)
-    : ProxyImpl(context, enet_peer)
+    : ProxyImpl(context, endpoint)
     , protocol_executor_(std::move(protocol_executor)) {
     is_running_ = protocol_executor_.is_runnning();
     auto& attached_nodes = protocol_executor_.attached_nodes();
@@ -104,9 +104,8 @@ void ExecutorProxyImpl::HandleRunBegin(google::protobuf::io::ZeroCopyInputStream
 
     ASBLog(INFO) << "is_running " << is_running_;
 
-    protocol::Thread protocol_thread;
-    if (protocol_thread.ParseFromZeroCopyStream(&input)) {
-        OnRunBegin(protocol_thread.id(), protocol_thread.name());
+    if (protocol_thread_.ParseFromZeroCopyStream(&input)) {
+        OnRunBegin(protocol_thread_.id(), protocol_thread_.name());
     } else {
         ASBLog(ERROR) << "Failed to parse executor run begin event.";
     }
@@ -123,18 +122,16 @@ void ExecutorProxyImpl::HandleRunEnd(google::protobuf::io::ZeroCopyInputStream&
 }
 
 void ExecutorProxyImpl::HandleTaskBegin(google::protobuf::io::ZeroCopyInputStream& input) {
-    protocol::ExecutorTask task;
-    if (task.ParseFromZeroCopyStream(&input)) {
-        OnTaskBegin(task.task_id(), task.thread().id(), task.thread().name());
+    if (protocol_task_.ParseFromZeroCopyStream(&input)) {
+        OnTaskBegin(protocol_task_.task_id(), protocol_task_.thread().id(), protocol_task_.thread().name());
     } else {
         ASBLog(ERROR) << "Failed to parse executo task begin event.";
     }
 }
 
 void ExecutorProxyImpl::HandleTaskEnd(google::protobuf::io::ZeroCopyInputStream& input) {
-    protocol::ExecutorTask task;
-    if (task.ParseFromZeroCopyStream(&input)) {
-        OnTaskEnd(task.task_id());
+    if (protocol_task_.ParseFromZeroCopyStream(&input)) {
+        OnTaskEnd(protocol_task_.task_id());
     } else {
         ASBLog(ERROR) << "Failed to parse executo task end event.";
     }
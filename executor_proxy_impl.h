@@ -31,7 +31,7 @@ namespace blackbox2 {
 
 class ExecutorProxyImpl: public ProxyImpl<ExecutorProxy> {
  public:
-    ExecutorProxyImpl(std::shared_ptr<Context> context, ENetPeer* enet_peer, protocol::Executor&& protocol_executor);
+    ExecutorProxyImpl(std::shared_ptr<Context> context, Endpoint* endpoint, protocol::Executor&& protocol_executor);
     ~ExecutorProxyImpl() override;
 
  public:
@@ -53,6 +53,9 @@ class ExecutorProxyImpl: public ProxyImpl<ExecutorProxy> {
     protocol::Executor protocol_executor_;
     bool is_running_;
     std::list<std::string> attached_nodes_;
+    // Parsed into by every run and task event, they keep their allocations.
+    protocol::Thread protocol_thread_;
+    protocol::ExecutorTask protocol_task_;
 };
 
 }  // namespace blackbox2
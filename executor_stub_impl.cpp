@@ -30,7 +30,7 @@ ExecutorStubImpl::ExecutorStubImpl(std::shared_ptr<Context> context, size_t thre
     protocol_executor_.set_is_runnning(false);
     protocol::GetCurrentThread(*protocol_executor_.mutable_owner_thread());
     if (process != nullptr) {
-        protocol_executor_.mutable_owner_process()->set_id(process->GetInstanceId());
+        protocol_executor_.mutable_owner_process()->set_id(AssignedInstanceId::Of(process));
     }
 }
 
@@ -61,34 +61,30 @@ void ExecutorStubImpl::DetachNode(std::shared_ptr<NodeStub> node_stub) {
 
 void ExecutorStubImpl::RunBegin() {
     std::lock_guard<std::mutex> lg(GetMutex());
-    protocol::Thread protocol_thread;
-    protocol::GetCurrentThread(protocol_thread);
-    SendEvent(protocol::Opcode::kExecutorRunBegin, protocol_thread);
+    protocol::GetCurrentThread(protocol_thread_);
+    SendEvent(protocol::Opcode::kExecutorRunBegin, protocol_thread_);
     protocol_executor_.set_is_runnning(true);
 }
 
 void ExecutorStubImpl::RunEnd() {
     std::lock_guard<std::mutex> lg(GetMutex());
-    protocol::Thread protocol_thread;
-    protocol::GetCurrentThread(protocol_thread);
-    SendEvent(protocol::Opcode::kExecutorRunEnd, protocol_thread);
+    protocol::GetCurrentThread(protocol_thread_);
+    SendEvent(protocol::Opcode::kExecutorRunEnd, protocol_thread_);
     protocol_executor_.set_is_runnning(false);
 }
 
 void ExecutorStubImpl::TaskBegin(int task_id) {
     std::lock_guard<std::mutex> lg(GetMutex());
-    protocol::ExecutorTask protocol_executor_task;
-    protocol::GetCurrentThread(*protocol_executor_task.mutable_thread());
-    protocol_executor_task.set_task_id(task_id);
-    SendEvent(protocol::Opcode::kExecutorTaskBegin, protocol_executor_task);
+    protocol::GetCurrentThread(*protocol_task_.mutable_thread());
+    protocol_task_.set_task_id(task_id);
+    SendEvent(protocol::Opcode::kExecutorTaskBegin, protocol_task_);
 }
 
 void ExecutorStubImpl::TaskEnd(int task_id) {
     std::lock_guard<std::mutex> lg(GetMutex());
-    protocol::ExecutorTask protocol_executor_task;
-    protocol::GetCurrentThread(*protocol_executor_task.mutable_thread());
-    protocol_executor_task.set_task_id(task_id);
-    SendEvent(protocol::Opcode::kExecutorTaskEnd, protocol_executor_task);
+    protocol::GetCurrentThread(*protocol_task_.mutable_thread());
+    protocol_task_.set_task_id(task_id);
+    SendEvent(protocol::Opcode::kExecutorTaskEnd, protocol_task_);
 }
 
 void ExecutorStubImpl::HandleParentInstanceIdChanged(uint64_t id) {
@@ -62,6 +62,9 @@ class ExecutorStubImpl: public StubImpl<ExecutorStub> {
 
  private:
     protocol::Executor protocol_executor_;
+    // Refilled by every run and task event, they keep their allocations.
+    protocol::Thread protocol_thread_;
+    protocol::ExecutorTask protocol_task_;
 };
 
 }  // namespace blackbox2
@@ -24,8 +24,8 @@ namespace asf {
 namespace msgbus {
 namespace blackbox2 {
 
-HandleProxyImpl::HandleProxyImpl(std::shared_ptr<Context> context, ENetPeer* enet_peer, protocol::Handle&& protocol_handle)
-    : MessageProxyImpl<HandleProxy>(context, enet_peer)
+HandleProxyImpl::HandleProxyImpl(std::shared_ptr<Context> context, Endpoint* endpoint, protocol::Handle&& protocol_handle)
+    : MessageProxyImpl<HandleProxy>(context, endpoint)
     , protocol_handle_(std::move(protocol_handle)) {
     is_enabled_ = protocol_handle_.is_enabled();
     auto& protocol_mapping_channels = protocol_handle_.mapping_channels();
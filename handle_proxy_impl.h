@@ -30,7 +30,7 @@ namespace blackbox2 {
 
 class HandleProxyImpl: public MessageProxyImpl<HandleProxy> {
  public:
-    HandleProxyImpl(std::shared_ptr<Context> context, ENetPeer* enet_peer, protocol::Handle&& protocol_handle);
+    HandleProxyImpl(std::shared_ptr<Context> context, Endpoint* endpoint, protocol::Handle&& protocol_handle);
     ~HandleProxyImpl() override;
 
  public:
@@ -31,7 +31,7 @@ HandleStubImpl::HandleStubImpl(std::shared_ptr<Context> context, HandleType hand
     protocol_handle_.set_key(key);
     protocol::GetCurrentThread(*protocol_handle_.mutable_owner_thread());
     if (node != nullptr) {
-        protocol_handle_.mutable_owner_node()->set_id(node->GetInstanceId());
+        protocol_handle_.mutable_owner_node()->set_id(AssignedInstanceId::Of(node));
     }
     switch (handle_type) {
     case HandleType::kReader:
@@ -0,0 +1,108 @@
+// -----------------------------------------------------------------------
+// |             _     _              _____         _____                |
+// |            |  \  | |            / ____|  /\   |  __ \               |
+// |            | | \ | |  __       | (___   /  \  | |__) |              |
+// |            | |\ \| | /__\|   |  \___ \ / /\ \ |  _  /               |
+// |            | | \ \ ||    |   |   ___) / /__\ \| | \ \               |
+// |            |_|  \_\| \__/ \_/|/|_____/________\_|  \_\              |
+// |                                                                     |
+// -----------------------------------------------------------------------
+// COPYRIGHT
+// -----------------------------------------------------------------------
+//
+// This software is copyright protected and proprietary to Neusoft Reach.
+// Neusoft Reach grants to you only those rights as set out in the license
+// conditions.
+// All other rights remain with Neusoft Reach.
+// -----------------------------------------------------------------------
+
+#ifndef SF_MSGBUS_BLACKBOX2_LOCAL_LINK_H_
+#define SF_MSGBUS_BLACKBOX2_LOCAL_LINK_H_
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <functional>
+
+#include <sf-msgbus/blackbox2/common.h>
+
+#include "enet.h"
+
+namespace asf {
+namespace msgbus {
+namespace blackbox2 {
+
+// A connection to a process on the same host that stands in for an ENet
+// peer. Packets keep their channel and their order and are handed over as
+// ENet packets, so the context dispatches them unchanged.
+class LocalLink {
+ public:
+    enum class Kind: uint8_t {
+        kShm = 'S',     // memfd rings and a buffer pool, eventfd notifications.
+        kUnix = 'U'     // Packets framed into the records of the Unix socket.
+    };
+
+    using PacketHandler = std::function<void (enet_uint8 channel, ENetPacket* enet_pkt)>;
+
+    virtual ~LocalLink() {}
+
+ public:
+    // Takes the packet over on success, it is destroyed once its bytes are
+    // in the link. A full link keeps it until the other side makes room.
+    virtual bool Send(enet_uint8 channel, ENetPacket* enet_pkt) = 0;
+    // Writes what Send() could not, the backend calls it once per pass.
+    virtual void Flush() = 0;
+    // True while output waits for room the other side does not signal, the
+    // backend then retries shortly.
+    virtual bool IsBlocked() const = 0;
+    // Hands every received packet to handler, false once the link is closed.
+    virtual bool Receive(const PacketHandler& handler) = 0;
+    // Called before the backend waits, false if it must not wait because
+    // there is something to receive already.
+    virtual bool PrepareWait() = 0;
+    // Sockets to watch for the backend to wake up on this link.
+    virtual std::vector<ENetSocket> GetSockets() const = 0;
+
+    static std::unique_ptr<LocalLink> Connect(const std::string& name, Kind kind);
+};
+
+// Accepts local links on a SOCK_SEQPACKET Unix socket, the kind is picked by
+// the client. The handshake never blocks: accepted sockets are handed to
+// the watch handler until the client has sent its kind.
+class LocalListener {
+ public:
+    // Starts (watch) or stops watching socket, false if it cannot be watched.
+    using WatchHandler = std::function<bool (ENetSocket socket, bool watch)>;
+
+    LocalListener();
+    LocalListener(const LocalListener&) = delete;
+    ~LocalListener();
+
+ public:
+    bool Listen(const std::string& name, WatchHandler watch_handler);
+    void Close();
+    bool IsOpen() const;
+    ENetSocket GetSocket() const;
+    // Returns nullptr when no handshake has completed.
+    std::unique_ptr<LocalLink> Accept();
+
+ private:
+    struct Handshake {
+        ENetSocket socket;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    ENetSocket socket_;
+    WatchHandler watch_handler_;
+    std::vector<Handshake> handshakes_;
+};
+
+// Name of the local links of the server on port.
+std::string GetLocalLinkName(uint16_t port);
+
+}
+}
+}
+
+#endif //  SF_MSGBUS_BLACKBOX2_LOCAL_LINK_H_
@@ -0,0 +1,836 @@
+// -----------------------------------------------------------------------
+// |             _     _              _____         _____                |
+// |            |  \  | |            / ____|  /\   |  __ \               |
+// |            | | \ | |  __       | (___   /  \  | |__) |              |
+// |            | |\ \| | /__\|   |  \___ \ / /\ \ |  _  /               |
+// |            | | \ \ ||    |   |   ___) / /__\ \| | \ \               |
+// |            |_|  \_\| \__/ \_/|/|_____/________\_|  \_\              |
+// |                                                                     |
+// -----------------------------------------------------------------------
+// COPYRIGHT
+// -----------------------------------------------------------------------
+//
+// This software is copyright protected and proprietary to Neusoft Reach.
+// Neusoft Reach grants to you only those rights as set out in the license
+// conditions.
+// All other rights remain with Neusoft Reach.
+// -----------------------------------------------------------------------
+
+#include <new>
+#include <atomic>
+#include <deque>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include <sf-msgbus/blackbox2/log.h>
+
+#include "packet_pool.h"
+#include "local_link.h"
+
+namespace asf {
+namespace msgbus {
+namespace blackbox2 {
+
+namespace {
+
+constexpr uint32_t kShmMagic = 0x53424232;      // "SBB2"
+constexpr size_t kShmRingSize = 1024 * 1024;
+constexpr size_t kShmSlotSize = 1024 * 1024;
+constexpr size_t kShmSlotCount = 8;
+constexpr size_t kShmInlineMax = 16 * 1024;
+constexpr size_t kShmBlockSize = 4096;
+constexpr int kHandshakeTimeout = 1000;
+constexpr size_t kHandshakesMax = 64;
+constexpr uint32_t kUnixMagic = 0x55424232;     // "UBB2"
+constexpr size_t kUnixRecordMax = 64 * 1024;
+constexpr size_t kUnixFramesMax = 64;
+constexpr int kUnixBufferSize = 1024 * 1024;
+// Largest packet reassembled from pieces, as ENet's own limit.
+constexpr size_t kLocalPacketMax = ENET_HOST_DEFAULT_MAXIMUM_PACKET_SIZE;
+
+// Control block of one direction of a link, the producer owns head and the
+// slots it fills, the consumer owns tail and frees the slots.
+struct ShmBlock {
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    alignas(64) std::atomic<uint32_t> consumer_waiting;
+    std::atomic<uint32_t> producer_waiting;
+    std::atomic<uint32_t> slots[kShmSlotCount];
+};
+static_assert(sizeof(ShmBlock) <= kShmBlockSize, "ShmBlock too large");
+
+// Two blocks, two rings and two slot pools, the first of each is for the
+// server to client direction.
+constexpr size_t kShmRingOffset = 2 * kShmBlockSize;
+constexpr size_t kShmPoolOffset = kShmRingOffset + 2 * kShmRingSize;
+constexpr size_t kShmSize = kShmPoolOffset + 2 * kShmSlotCount * kShmSlotSize;
+
+enum ShmRecordKind: uint8_t {
+    kShmPad = 0,        // Skip to the start of the ring.
+    kShmInline,         // size bytes follow.
+    kShmSlot,           // size bytes are in the slot.
+    kShmFragment        // size bytes of a packet of total bytes follow.
+};
+
+struct ShmRecord {
+    uint32_t size;
+    uint32_t total;
+    uint8_t channel;
+    uint8_t kind;
+    uint16_t slot;
+    uint32_t __pad;
+};
+
+constexpr size_t AlignRecord(size_t size) {
+    return (size + sizeof(ShmRecord) - 1) & ~(sizeof(ShmRecord) - 1);
+}
+
+struct ShmMapping {
+    ShmMapping(uint8_t* base)
+        : base(base) {
+    }
+    ~ShmMapping() {
+        munmap(base, kShmSize);
+    }
+    uint8_t* base;
+};
+
+// Keeps the mapping of a received slot until its packet is gone.
+struct SlotRef {
+    std::shared_ptr<ShmMapping> mapping;
+    std::atomic<uint32_t>* slot;
+};
+
+void HandleSlotPacketFree(void* packet) {
+    auto ref = static_cast<SlotRef*>(static_cast<ENetPacket*>(packet)->userData);
+    ref->slot->store(0, std::memory_order_release);
+    delete ref;
+}
+
+void SetTimeout(int socket, int timeout) {
+    struct timeval tv;
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// Abstract socket address, nothing is left in the file system.
+socklen_t InitAddress(sockaddr_un& addr, const std::string& name) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    auto size = std::min(name.size(), sizeof(addr.sun_path) - 1);
+    memcpy(addr.sun_path + 1, name.data(), size);
+    return static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + 1 + size);
+}
+
+void Notify(int event_fd) {
+    uint64_t counter = 1;
+    while (write(event_fd, &counter, sizeof(counter)) < 0 && errno == EINTR) {
+    }
+}
+
+// Frame of size bytes of a packet of total bytes, a record of the socket
+// carries one or more frames.
+struct UnixFrame {
+    uint32_t size;
+    uint32_t total;
+    uint8_t channel;
+    uint8_t __pad[3];
+};
+
+class ShmLink final: public LocalLink {
+ public:
+    ShmLink(int socket, std::shared_ptr<ShmMapping> mapping, int event_fd, int peer_event_fd, bool is_server)
+        : socket_(socket)
+        , mapping_(std::move(mapping))
+        , event_fd_(event_fd)
+        , peer_event_fd_(peer_event_fd)
+        , rx_tail_(0)
+        , closed_(false)
+        , assembling_(nullptr)
+        , assembling_total_(0)
+        , assembled_(0) {
+        auto base = mapping_->base;
+        size_t tx = is_server ? 0 : 1;
+        size_t rx = 1 - tx;
+        tx_block_ = reinterpret_cast<ShmBlock*>(base + tx * kShmBlockSize);
+        rx_block_ = reinterpret_cast<ShmBlock*>(base + rx * kShmBlockSize);
+        tx_ring_ = base + kShmRingOffset + tx * kShmRingSize;
+        rx_ring_ = base + kShmRingOffset + rx * kShmRingSize;
+        tx_pool_ = base + kShmPoolOffset + tx * kShmSlotCount * kShmSlotSize;
+        rx_pool_ = base + kShmPoolOffset + rx * kShmSlotCount * kShmSlotSize;
+    }
+
+    ~ShmLink() override {
+        for (auto& pending: pending_) {
+            PacketPool::Destroy(pending.packet);
+        }
+        PacketPool::Destroy(assembling_);
+        close(event_fd_);
+        close(peer_event_fd_);
+        close(socket_);
+    }
+
+    static std::unique_ptr<ShmLink> Create(int socket) {
+        int memfd = memfd_create("sf-msgbus-blackbox2", MFD_CLOEXEC);
+        if (memfd < 0) {
+            return nullptr;
+        }
+        int fds[3] = { memfd, eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC), eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) };
+        auto mapping = (fds[1] >= 0 && fds[2] >= 0 && ftruncate(memfd, kShmSize) == 0) ? Map(memfd) : nullptr;
+        if (mapping) {
+            for (size_t i = 0; i < 2; ++i) {
+                new (mapping->base + i * kShmBlockSize) ShmBlock();
+            }
+        }
+        // The client gets the memfd, the server's eventfd and its own.
+        bool sent = mapping && SendFds(socket, fds);
+        close(memfd);
+        if (!sent) {
+            for (size_t i = 1; i < 3; ++i) {
+                if (fds[i] >= 0) {
+                    close(fds[i]);
+                }
+            }
+            return nullptr;
+        }
+        return std::unique_ptr<ShmLink>(new ShmLink(socket, std::move(mapping), fds[1], fds[2], true));
+    }
+
+    static std::unique_ptr<ShmLink> Open(int socket) {
+        int fds[3];
+        if (!ReceiveFds(socket, fds)) {
+            return nullptr;
+        }
+        auto mapping = Map(fds[0]);
+        close(fds[0]);
+        if (!mapping) {
+            close(fds[1]);
+            close(fds[2]);
+            return nullptr;
+        }
+        return std::unique_ptr<ShmLink>(new ShmLink(socket, std::move(mapping), fds[2], fds[1], false));
+    }
+
+ public:
+    bool Send(enet_uint8 channel, ENetPacket* enet_pkt) override {
+        if (closed_) {
+            return false;
+        }
+        pending_.push_back(Pending{ enet_pkt, channel, 0 });
+        FlushPending();
+        return true;
+    }
+
+    void Flush() override {
+        FlushPending();
+    }
+
+    bool IsBlocked() const override {
+        return false;
+    }
+
+    bool Receive(const PacketHandler& handler) override {
+        uint64_t counter;
+        while (read(event_fd_, &counter, sizeof(counter)) < 0 && errno == EINTR) {
+        }
+        if (!closed_ && !ReceiveRecords(handler)) {
+            ASBLog(ERROR) << "Malformed record on local link.";
+            closed_ = true;
+        }
+        if (closed_) {
+            return false;
+        }
+        FlushPending();
+        char byte;
+        auto ret = recv(socket_, &byte, sizeof(byte), MSG_DONTWAIT);
+        return !(ret == 0 || (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR));
+    }
+
+    bool PrepareWait() override {
+        rx_block_->consumer_waiting.store(1);
+        if (rx_block_->head.load() != rx_tail_) {
+            rx_block_->consumer_waiting.store(0);
+            return false;
+        }
+        return true;
+    }
+
+    std::vector<ENetSocket> GetSockets() const override {
+        return { socket_, event_fd_ };
+    }
+
+ private:
+    struct Pending {
+        ENetPacket* packet;
+        enet_uint8 channel;
+        size_t offset;
+    };
+
+    static std::shared_ptr<ShmMapping> Map(int memfd) {
+        auto base = mmap(nullptr, kShmSize, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+        if (base == MAP_FAILED) {
+            return nullptr;
+        }
+        return std::make_shared<ShmMapping>(static_cast<uint8_t*>(base));
+    }
+
+    static bool SendFds(int socket, const int (&fds)[3]) {
+        char control[CMSG_SPACE(sizeof(fds))];
+        memset(control, 0, sizeof(control));
+        uint32_t magic = kShmMagic;
+        iovec iov = { &magic, sizeof(magic) };
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        auto cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+        return sendmsg(socket, &msg, MSG_NOSIGNAL) == sizeof(magic);
+    }
+
+    static bool ReceiveFds(int socket, int (&fds)[3]) {
+        char control[CMSG_SPACE(sizeof(fds))];
+        uint32_t magic = 0;
+        iovec iov = { &magic, sizeof(magic) };
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(socket, &msg, MSG_CMSG_CLOEXEC) != sizeof(magic)) {
+            return false;
+        }
+        auto cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg == nullptr || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+            return false;
+        }
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+        if (magic != kShmMagic) {
+            for (auto fd: fds) {
+                close(fd);
+            }
+            return false;
+        }
+        return true;
+    }
+
+    void FlushPending() {
+        bool written = false;
+        while (!pending_.empty()) {
+            if (!Write(pending_.front())) {
+                // The consumer notifies us when it has made room.
+                tx_block_->producer_waiting.store(1);
+                if (!Write(pending_.front())) {
+                    break;
+                }
+            }
+            PacketPool::Destroy(pending_.front().packet);
+            pending_.pop_front();
+            written = true;
+        }
+        if (written && tx_block_->consumer_waiting.load() && tx_block_->consumer_waiting.exchange(0)) {
+            Notify(peer_event_fd_);
+        }
+    }
+
+    // Writes what is left of a packet, true once all of it is in the link.
+    bool Write(Pending& pending) {
+        auto data = reinterpret_cast<const uint8_t*>(enet_packet_get_data(pending.packet));
+        size_t size = enet_packet_get_length(pending.packet);
+        if (size <= kShmInlineMax) {
+            return Push(pending.channel, kShmInline, data, size, size, 0);
+        }
+        if (pending.offset == 0 && size <= kShmSlotSize) {
+            for (uint16_t i = 0; i < kShmSlotCount; ++i) {
+                if (tx_block_->slots[i].load(std::memory_order_acquire) != 0) {
+                    continue;
+                }
+                return Push(pending.channel, kShmSlot, data, size, size, i);
+            }
+        }
+        // No slot, the packet goes through the ring in pieces.
+        while (pending.offset < size) {
+            auto fragment = std::min(size - pending.offset, kShmInlineMax);
+            if (!Push(pending.channel, kShmFragment, data + pending.offset, fragment, size, 0)) {
+                return false;
+            }
+            pending.offset += fragment;
+        }
+        return true;
+    }
+
+    // A slot record carries the bytes in the slot instead of the ring.
+    bool Push(enet_uint8 channel, uint8_t kind, const uint8_t* data, size_t size, size_t total, uint16_t slot) {
+        auto inline_size = (kind == kShmSlot) ? 0 : size;
+        auto head = tx_block_->head.load(std::memory_order_relaxed);
+        auto tail = tx_block_->tail.load();
+        auto need = sizeof(ShmRecord) + AlignRecord(inline_size);
+        auto offset = head & (kShmRingSize - 1);
+        auto pad = (kShmRingSize - offset < need) ? kShmRingSize - offset : 0;
+        if (head + pad + need - tail > kShmRingSize) {
+            return false;
+        }
+        if (pad > 0) {
+            reinterpret_cast<ShmRecord*>(tx_ring_ + offset)->kind = kShmPad;
+            head += pad;
+            offset = 0;
+        }
+        if (kind == kShmSlot) {
+            tx_block_->slots[slot].store(1, std::memory_order_relaxed);
+            memcpy(tx_pool_ + slot * kShmSlotSize, data, size);
+        }
+        ShmRecord record = { static_cast<uint32_t>(size), static_cast<uint32_t>(total), channel, kind, slot, 0 };
+        memcpy(tx_ring_ + offset, &record, sizeof(record));
+        if (inline_size > 0) {
+            memcpy(tx_ring_ + offset + sizeof(record), data, inline_size);
+        }
+        tx_block_->head.store(head + need);
+        return true;
+    }
+
+    // The ring is writable by the peer, a record that does not fit in what it
+    // has published fails the link. The tail is kept here for the same reason.
+    bool ReceiveRecords(const PacketHandler& handler) {
+        auto tail = rx_tail_;
+        uint64_t head;
+        while (tail != (head = rx_block_->head.load(std::memory_order_acquire))) {
+            if (head - tail > kShmRingSize) {
+                return false;
+            }
+            auto offset = tail & (kShmRingSize - 1);
+            ShmRecord record;
+            memcpy(&record, rx_ring_ + offset, sizeof(record));
+            if (record.kind == kShmPad) {
+                tail += kShmRingSize - offset;
+                rx_tail_ = tail;
+                rx_block_->tail.store(tail);
+                continue;
+            }
+            auto inline_size = (record.kind == kShmSlot) ? 0 : record.size;
+            auto need = sizeof(record) + AlignRecord(inline_size);
+            if (offset + need > kShmRingSize || need > head - tail) {
+                return false;
+            }
+            auto data = rx_ring_ + offset + sizeof(record);
+            ENetPacket* enet_pkt = nullptr;
+            if (record.kind == kShmInline) {
+                if (record.size > kShmInlineMax || assembled_ != 0) {
+                    return false;
+                }
+                enet_pkt = PacketPool::Create(data, record.size, ENET_PACKET_FLAG_RELIABLE);
+            } else if (record.kind == kShmSlot) {
+                if (record.slot >= kShmSlotCount || record.size > kShmSlotSize || assembled_ != 0) {
+                    return false;
+                }
+                // The packet views the slot, it is freed with the packet.
+                enet_pkt = enet_packet_create(rx_pool_ + record.slot * kShmSlotSize, record.size,
+                                              ENET_PACKET_FLAG_RELIABLE | ENET_PACKET_FLAG_NO_ALLOCATE);
+                if (enet_pkt != nullptr) {
+                    enet_pkt->userData = new SlotRef{ mapping_, &rx_block_->slots[record.slot] };
+                    enet_pkt->freeCallback = &HandleSlotPacketFree;
+                } else {
+                    rx_block_->slots[record.slot].store(0, std::memory_order_release);
+                }
+            } else if (record.kind == kShmFragment) {
+                if (record.size > kShmInlineMax || record.total > kLocalPacketMax) {
+                    return false;
+                }
+                if (assembled_ == 0) {
+                    assembling_total_ = record.total;
+                    assembling_ = PacketPool::Create(nullptr, record.total, ENET_PACKET_FLAG_RELIABLE);
+                }
+                // Every piece of a packet repeats the total of its first one.
+                if (record.total != assembling_total_ || assembled_ + record.size > assembling_total_) {
+                    return false;
+                }
+                if (assembling_ != nullptr && record.size > 0) {
+                    memcpy(reinterpret_cast<uint8_t*>(enet_packet_get_data(assembling_)) + assembled_, data, record.size);
+                }
+                assembled_ += record.size;
+                if (assembled_ == assembling_total_) {
+                    enet_pkt = assembling_;
+                    assembling_ = nullptr;
+                    assembled_ = 0;
+                }
+            } else {
+                return false;
+            }
+            tail += need;
+            rx_tail_ = tail;
+            rx_block_->tail.store(tail);
+            if (rx_block_->producer_waiting.load() && rx_block_->producer_waiting.exchange(0)) {
+                Notify(peer_event_fd_);
+            }
+            if (enet_pkt != nullptr) {
+                handler(record.channel, enet_pkt);
+            }
+        }
+        return true;
+    }
+
+ private:
+    int socket_;
+    std::shared_ptr<ShmMapping> mapping_;
+    int event_fd_;
+    int peer_event_fd_;
+    ShmBlock* tx_block_;
+    ShmBlock* rx_block_;
+    uint8_t* tx_ring_;
+    uint8_t* rx_ring_;
+    uint8_t* tx_pool_;
+    uint8_t* rx_pool_;
+    std::deque<Pending> pending_;
+    uint64_t rx_tail_;
+    bool closed_;
+    ENetPacket* assembling_;
+    size_t assembling_total_;
+    size_t assembled_;
+};
+
+// Packets over a SOCK_SEQPACKET socket. Send() only queues, Flush() gathers
+// the queued packets into records of up to kUnixRecordMax bytes, one
+// sendmsg() each, larger packets are split over several records.
+class UnixLink final: public LocalLink {
+ public:
+    UnixLink(int socket)
+        : socket_(socket)
+        , buffer_(kUnixRecordMax)
+        , blocked_(false)
+        , closed_(false)
+        , assembling_(nullptr)
+        , assembling_total_(0)
+        , assembled_(0) {
+        int size = kUnixBufferSize;
+        setsockopt(socket_, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        setsockopt(socket_, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+
+    ~UnixLink() override {
+        for (auto& pending: pending_) {
+            PacketPool::Destroy(pending.packet);
+        }
+        PacketPool::Destroy(assembling_);
+        close(socket_);
+    }
+
+    static std::unique_ptr<UnixLink> Create(int socket) {
+        uint32_t magic = kUnixMagic;
+        if (send(socket, &magic, sizeof(magic), MSG_NOSIGNAL) != sizeof(magic)) {
+            return nullptr;
+        }
+        return std::unique_ptr<UnixLink>(new UnixLink(socket));
+    }
+
+    static std::unique_ptr<UnixLink> Open(int socket) {
+        uint32_t magic = 0;
+        if (recv(socket, &magic, sizeof(magic), 0) != sizeof(magic) || magic != kUnixMagic) {
+            return nullptr;
+        }
+        return std::unique_ptr<UnixLink>(new UnixLink(socket));
+    }
+
+ public:
+    bool Send(enet_uint8 channel, ENetPacket* enet_pkt) override {
+        if (closed_) {
+            return false;
+        }
+        pending_.push_back(Pending{ enet_pkt, channel, 0 });
+        return true;
+    }
+
+    void Flush() override {
+        while (!pending_.empty() && !closed_) {
+            UnixFrame frames[kUnixFramesMax];
+            iovec iov[kUnixFramesMax * 2];
+            size_t frame_count = 0;
+            size_t iov_count = 0;
+            size_t bytes = 0;
+            for (auto& pending: pending_) {
+                if (frame_count == kUnixFramesMax || bytes + sizeof(UnixFrame) >= kUnixRecordMax) {
+                    break;
+                }
+                auto data = reinterpret_cast<uint8_t*>(enet_packet_get_data(pending.packet));
+                size_t size = enet_packet_get_length(pending.packet);
+                auto piece = std::min(size - pending.offset, kUnixRecordMax - bytes - sizeof(UnixFrame));
+                auto& frame = frames[frame_count++];
+                frame = UnixFrame{ static_cast<uint32_t>(piece), static_cast<uint32_t>(size), pending.channel, {} };
+                iov[iov_count++] = iovec{ &frame, sizeof(frame) };
+                if (piece > 0) {
+                    iov[iov_count++] = iovec{ data + pending.offset, piece };
+                }
+                bytes += sizeof(frame) + piece;
+                if (pending.offset + piece < size) {
+                    break;
+                }
+            }
+            msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iov_count;
+            if (sendmsg(socket_, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+                    blocked_ = true;
+                    return;
+                }
+                closed_ = true;
+                return;
+            }
+            // A record goes out whole or not at all.
+            for (size_t i = 0; i < frame_count; ++i) {
+                auto& pending = pending_.front();
+                pending.offset += frames[i].size;
+                if (pending.offset < enet_packet_get_length(pending.packet)) {
+                    break;
+                }
+                PacketPool::Destroy(pending.packet);
+                pending_.pop_front();
+            }
+        }
+        blocked_ = false;
+    }
+
+    bool IsBlocked() const override {
+        return blocked_;
+    }
+
+    bool Receive(const PacketHandler& handler) override {
+        while (!closed_) {
+            auto ret = recv(socket_, buffer_.data(), buffer_.size(), MSG_DONTWAIT);
+            if (ret == 0) {
+                closed_ = true;
+            } else if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                closed_ = true;
+            } else if (!ReceiveFrames(static_cast<size_t>(ret), handler)) {
+                ASBLog(ERROR) << "Malformed record of " << ret << " bytes on local link.";
+                closed_ = true;
+            }
+        }
+        return !closed_;
+    }
+
+    bool PrepareWait() override {
+        // Anything left is still readable on the socket.
+        return true;
+    }
+
+    std::vector<ENetSocket> GetSockets() const override {
+        return { socket_ };
+    }
+
+ private:
+    struct Pending {
+        ENetPacket* packet;
+        enet_uint8 channel;
+        size_t offset;
+    };
+
+    bool ReceiveFrames(size_t size, const PacketHandler& handler) {
+        size_t offset = 0;
+        while (offset < size) {
+            UnixFrame frame;
+            if (size - offset < sizeof(frame)) {
+                return false;
+            }
+            memcpy(&frame, buffer_.data() + offset, sizeof(frame));
+            offset += sizeof(frame);
+            if (size - offset < frame.size || frame.total > kLocalPacketMax) {
+                return false;
+            }
+            if (assembled_ == 0) {
+                assembling_total_ = frame.total;
+                assembling_ = PacketPool::Create(nullptr, frame.total, ENET_PACKET_FLAG_RELIABLE);
+            }
+            // Every piece of a packet repeats the total of its first one.
+            if (frame.total != assembling_total_ || assembled_ + frame.size > assembling_total_) {
+                return false;
+            }
+            if (assembling_ != nullptr && frame.size > 0) {
+                memcpy(reinterpret_cast<uint8_t*>(enet_packet_get_data(assembling_)) + assembled_,
+                       buffer_.data() + offset, frame.size);
+            }
+            offset += frame.size;
+            assembled_ += frame.size;
+            if (assembled_ == assembling_total_) {
+                auto enet_pkt = assembling_;
+                assembling_ = nullptr;
+                assembled_ = 0;
+                if (enet_pkt != nullptr) {
+                    handler(frame.channel, enet_pkt);
+                }
+            }
+        }
+        return true;
+    }
+
+ private:
+    int socket_;
+    std::vector<uint8_t> buffer_;
+    std::deque<Pending> pending_;
+    bool blocked_;
+    bool closed_;
+    ENetPacket* assembling_;
+    size_t assembling_total_;
+    size_t assembled_;
+};
+
+}
+
+// LocalLink
+
+std::unique_ptr<LocalLink> LocalLink::Connect(const std::string& name, Kind kind) {
+    int socket = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (socket < 0) {
+        return nullptr;
+    }
+    sockaddr_un addr;
+    auto addr_size = InitAddress(addr, name);
+    SetTimeout(socket, kHandshakeTimeout);
+    auto request = static_cast<char>(kind);
+    std::unique_ptr<LocalLink> link;
+    if (connect(socket, reinterpret_cast<sockaddr*>(&addr), addr_size) == 0 &&
+        send(socket, &request, sizeof(request), MSG_NOSIGNAL) == sizeof(request)) {
+        if (kind == Kind::kUnix) {
+            link = UnixLink::Open(socket);
+        } else {
+            link = ShmLink::Open(socket);
+        }
+    }
+    if (!link) {
+        ASBLog(WARNING) << "Failed to connect local link " << name << ", " << strerror(errno);
+        close(socket);
+    }
+    return link;
+}
+
+// LocalListener
+
+LocalListener::LocalListener()
+    : socket_(-1) {
+}
+
+LocalListener::~LocalListener() {
+    Close();
+}
+
+bool LocalListener::Listen(const std::string& name, WatchHandler watch_handler) {
+    Close();
+    watch_handler_ = std::move(watch_handler);
+    socket_ = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (socket_ < 0) {
+        return false;
+    }
+    sockaddr_un addr;
+    auto addr_size = InitAddress(addr, name);
+    if (bind(socket_, reinterpret_cast<sockaddr*>(&addr), addr_size) < 0 || listen(socket_, SOMAXCONN) < 0) {
+        ASBLog(ERROR) << "Failed to listen on local link " << name << ", " << strerror(errno);
+        Close();
+        return false;
+    }
+    ASBLog(INFO) << "Listen on local link " << name;
+    return true;
+}
+
+void LocalListener::Close() {
+    // Closing a socket also removes it from the poller.
+    for (auto& handshake: handshakes_) {
+        close(handshake.socket);
+    }
+    handshakes_.clear();
+    if (socket_ >= 0) {
+        close(socket_);
+        socket_ = -1;
+    }
+}
+
+bool LocalListener::IsOpen() const {
+    return (socket_ >= 0);
+}
+
+ENetSocket LocalListener::GetSocket() const {
+    return socket_;
+}
+
+std::unique_ptr<LocalLink> LocalListener::Accept() {
+    while (socket_ >= 0) {
+        int socket = accept4(socket_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (socket < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (handshakes_.size() >= kHandshakesMax || !watch_handler_(socket, true)) {
+            ASBLog(WARNING) << "Too many local links in handshake, connection refused.";
+            close(socket);
+            continue;
+        }
+        handshakes_.push_back(Handshake{ socket,
+            std::chrono::steady_clock::now() + std::chrono::milliseconds(kHandshakeTimeout) });
+    }
+    // The client sends the kind of link right after connecting.
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = handshakes_.begin(); it != handshakes_.end();) {
+        char kind = 0;
+        auto ret = recv(it->socket, &kind, sizeof(kind), MSG_DONTWAIT);
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) && now < it->deadline) {
+            ++it;
+            continue;
+        }
+        int socket = it->socket;
+        it = handshakes_.erase(it);
+        watch_handler_(socket, false);
+        std::unique_ptr<LocalLink> link;
+        if (ret == sizeof(kind)) {
+            if (kind == static_cast<char>(LocalLink::Kind::kShm)) {
+                link = ShmLink::Create(socket);
+            } else if (kind == static_cast<char>(LocalLink::Kind::kUnix)) {
+                link = UnixLink::Create(socket);
+            }
+        }
+        if (link) {
+            return link;
+        }
+        ASBLog(ERROR) << "Failed to accept local link of kind " << static_cast<int>(kind);
+        close(socket);
+    }
+    return nullptr;
+}
+
+std::string GetLocalLinkName(uint16_t port) {
+    const char* env_name = getenv("SF_MSGBUS_BLACKBOX2_LOCAL_NAME");
+    if (env_name != nullptr && env_name[0] != '\0') {
+        return env_name;
+    }
+    return "sf-msgbus-blackbox2." + std::to_string(port);
+}
+
+}
+}
+}
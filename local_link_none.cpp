@@ -0,0 +1,72 @@
+// -----------------------------------------------------------------------
+// |             _     _              _____         _____                |
+// |            |  \  | |            / ____|  /\   |  __ \               |
+// |            | | \ | |  __       | (___   /  \  | |__) |              |
+// |            | |\ \| | /__\|   |  \___ \ / /\ \ |  _  /               |
+// |            | | \ \ ||    |   |   ___) / /__\ \| | \ \               |
+// |            |_|  \_\| \__/ \_/|/|_____/________\_|  \_\              |
+// |                                                                     |
+// -----------------------------------------------------------------------
+// COPYRIGHT
+// -----------------------------------------------------------------------
+//
+// This software is copyright protected and proprietary to Neusoft Reach.
+// Neusoft Reach grants to you only those rights as set out in the license
+// conditions.
+// All other rights remain with Neusoft Reach.
+// -----------------------------------------------------------------------
+
+#include <cstdlib>
+
+#include <sf-msgbus/blackbox2/log.h>
+
+#include "local_link.h"
+
+namespace asf {
+namespace msgbus {
+namespace blackbox2 {
+
+// Local links need memfd and eventfd, ENet is used on the other platforms.
+
+std::unique_ptr<LocalLink> LocalLink::Connect(const std::string& name, Kind kind) {
+    ASBLog(WARNING) << "Local links are not supported on this platform.";
+    return nullptr;
+}
+
+LocalListener::LocalListener()
+    : socket_(ENET_SOCKET_NULL) {
+}
+
+LocalListener::~LocalListener() {
+}
+
+bool LocalListener::Listen(const std::string& name, WatchHandler watch_handler) {
+    return false;
+}
+
+void LocalListener::Close() {
+}
+
+bool LocalListener::IsOpen() const {
+    return false;
+}
+
+ENetSocket LocalListener::GetSocket() const {
+    return socket_;
+}
+
+std::unique_ptr<LocalLink> LocalListener::Accept() {
+    return nullptr;
+}
+
+std::string GetLocalLinkName(uint16_t port) {
+    const char* env_name = getenv("SF_MSGBUS_BLACKBOX2_LOCAL_NAME");
+    if (env_name != nullptr && env_name[0] != '\0') {
+        return env_name;
+    }
+    return "sf-msgbus-blackbox2." + std::to_string(port);
+}
+
+}
+}
+}
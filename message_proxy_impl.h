@@ -21,6 +21,7 @@
 
 #include <sf-msgbus/blackbox2/message_proxy.h>
 
+#include "compression.h"
 #include "proxy_impl.h"
 
 namespace asf {
@@ -32,14 +33,38 @@ class MessageProxyImpl: public ProxyImpl<T> {
     static_assert(std::is_base_of<MessageProxy, T>::value);
 
  public:
-    MessageProxyImpl(std::shared_ptr<Context> context, ENetPeer* enet_peer)
-        : ProxyImpl<T>(context, enet_peer)
-        , message_fields_(Message::kHasDefault) {
-        ProxyImpl<T>::RegisterEventHandler(protocol::Opcode::kMessage,
+    MessageProxyImpl(std::shared_ptr<Context> context, Endpoint* endpoint)
+        : ProxyImpl<T>(context, endpoint)
+        , message_fields_(Message::kHasDefault)
+        , drop_stats_{ 0, 0, 0 } {
+        ProxyImpl<T>::RegisterRawEventHandler(protocol::Opcode::kMessage,
             std::bind(&MessageProxyImpl::HandleMessage, this, std::placeholders::_1));
+        ProxyImpl<T>::RegisterRawEventHandler(protocol::Opcode::kMessageType,
+            std::bind(&MessageProxyImpl::HandleMessageType, this, std::placeholders::_1));
+        ProxyImpl<T>::RegisterRawEventHandler(protocol::Opcode::kMessageDrops,
+            std::bind(&MessageProxyImpl::HandleMessageDrops, this, std::placeholders::_1));
     }
 
+    // Messages of the handle dropped from the full send queue of its client,
+    // and those replaced there by a newer one with Delivery::kConflated.
+    struct DropStats {
+        uint64_t count;
+        uint64_t bytes;
+        uint64_t conflated;
+    };
+
     ~MessageProxyImpl() override {
+        auto& stats = decompressor_.GetStats();
+        if (stats.count > 0) {
+            ASBLog(INFO) << "MessageProxyImpl " << this << " decompressed " << stats.count << " messages, "
+                         << stats.packed_bytes << " -> " << stats.raw_bytes << " bytes, ratio "
+                         << static_cast<double>(stats.raw_bytes) / stats.packed_bytes << ", "
+                         << std::chrono::duration_cast<std::chrono::microseconds>(stats.time).count() << " us.";
+        }
+        if (drop_stats_.count > 0) {
+            ASBLog(WARNING) << "MessageProxyImpl " << this << " lost " << drop_stats_.count << " messages, "
+                            << drop_stats_.bytes << " bytes, on full send queues.";
+        }
     }
 
  public:
@@ -47,48 +72,99 @@ class MessageProxyImpl: public ProxyImpl<T> {
         if (!message.HasPayloadAndSerializeType()) {
             return Result::kInvalidParameter;
         }
-        std::lock_guard<std::mutex> lg(ProxyImpl<T>::GetMutex());
-        if (message_fields_ == 0) {
+        std::lock_guard<std::mutex> lg(Object<T>::GetMutex());
+        if ((message_fields_ & ~protocol::kFieldOptionMask) == 0) {
             return Result::kInvalidState;
         }
-        protocol::Message protocol_message;
+        protocol::MessageBlock block = {};
         switch (message.GetDir()) {
         case Message::Direction::kIn:
-            protocol_message.set_dir(protocol::Direction::In);
+            block.dir = protocol::Direction::In;
             break;
         case Message::Direction::kOut:
-            protocol_message.set_dir(protocol::Direction::Out);
+            block.dir = protocol::Direction::Out;
             break;
         default:
             return Result::kInvalidParameter;
         }
         if (message.HasGenTimestamp()) {
-            protocol_message.set_gen_timestamp(
-                std::chrono::duration_cast<std::chrono::microseconds>(message.GetGenTimestamp().time_since_epoch()).count());
+            block.fields |= protocol::kHasGenTimestamp;
+            block.gen_timestamp =
+                std::chrono::duration_cast<std::chrono::microseconds>(message.GetGenTimestamp().time_since_epoch()).count();
         }
         if (message.HasTxTimestamp()) {
-            protocol_message.set_gen_timestamp(
-                std::chrono::duration_cast<std::chrono::microseconds>(message.GetTxTimestamp().time_since_epoch()).count());
+            block.fields |= protocol::kHasTxTimestamp;
+            block.tx_timestamp =
+                std::chrono::duration_cast<std::chrono::microseconds>(message.GetTxTimestamp().time_since_epoch()).count();
         }
         if (message.HasRxTimestamp()) {
-            protocol_message.set_gen_timestamp(
-                std::chrono::duration_cast<std::chrono::microseconds>(message.GetRxTimestamp().time_since_epoch()).count());
+            block.fields |= protocol::kHasRxTimestamp;
+            block.rx_timestamp =
+                std::chrono::duration_cast<std::chrono::microseconds>(message.GetRxTimestamp().time_since_epoch()).count();
+        }
+        block.fields |= protocol::kHasPayload;
+        block.type_id = serialize_type_ids_.Find(message.GetSerializeType());
+        if (block.type_id == 0) {
+            block.type_id = SendMessageType(message.GetSerializeType());
+            if (block.type_id == 0) {
+                return Result::kUnknown;
+            }
         }
-        const auto& payload = message.GetPayload();
-        protocol_message.set_payload(std::string(reinterpret_cast<const char*>(payload.GetData()), payload.GetByteSize()));
-        protocol_message.set_serialize_type(message.GetSerializeType());
-        if (!ProxyImpl<T>::SendEvent(protocol::Opcode::kMessage, protocol_message)) {
+        auto net_block = protocol::EncodeMessageBlock(block);
+        if (!ProxyImpl<T>::SendEvent(protocol::Opcode::kMessage, &net_block, sizeof(net_block), message.GetPayload())) {
             return Result::kUnknown;
         }
         return Result::kOk;
     }
 
+    // The upper bits of the fields select the protocol::Delivery and the
+    // protocol::Compression of the handle's messages, so they can be set
+    // together with the fields.
     unsigned int GetMessageFields() const override {
         return message_fields_;
     }
 
     void SetMessageFields(unsigned int fields) override {
-        std::lock_guard<std::mutex> lg(ProxyImpl<T>::GetMutex());
+        std::lock_guard<std::mutex> lg(Object<T>::GetMutex());
+        UpdateMessageFields(fields);
+    }
+
+    protocol::Delivery GetDelivery() const {
+        std::lock_guard<std::mutex> lg(Object<T>::GetMutex());
+        return protocol::GetDelivery(message_fields_);
+    }
+
+    void SetDelivery(protocol::Delivery delivery) {
+        std::lock_guard<std::mutex> lg(Object<T>::GetMutex());
+        UpdateMessageFields((message_fields_ & ~protocol::kDeliveryMask) |
+                            (static_cast<unsigned int>(delivery) << protocol::kDeliveryShift));
+    }
+
+    protocol::Compression GetCompression() const {
+        std::lock_guard<std::mutex> lg(Object<T>::GetMutex());
+        return protocol::GetCompression(message_fields_);
+    }
+
+    void SetCompression(protocol::Compression compression) {
+        std::lock_guard<std::mutex> lg(Object<T>::GetMutex());
+        UpdateMessageFields((message_fields_ & ~protocol::kCompressionMask) |
+                            (static_cast<unsigned int>(compression) << protocol::kCompressionShift));
+    }
+
+    // Compression ratio and time of the messages received by the handle.
+    PayloadDecompressor::Stats GetCompressionStats() const {
+        std::lock_guard<std::mutex> lg(Object<T>::GetMutex());
+        return decompressor_.GetStats();
+    }
+
+    DropStats GetDropStats() const {
+        std::lock_guard<std::mutex> lg(Object<T>::GetMutex());
+        return drop_stats_;
+    }
+
+ private:
+    // The option setters change their bits of the fields under the same lock.
+    void UpdateMessageFields(unsigned int fields) {
         if (message_fields_ != fields) {
             message_fields_ = fields;
             protocol::MessageFields protocol_message_fields;
@@ -97,15 +173,59 @@ class MessageProxyImpl: public ProxyImpl<T> {
         }
     }
 
- private:
-    void HandleMessage(google::protobuf::io::ZeroCopyInputStream& input) {
-        auto protocol_message = std::make_shared<protocol::Message>();
-        if (!protocol_message->ParseFromZeroCopyStream(&input)) {
-            ASBLog(ERROR) << "Failed to parse message packet.";
+    uint16_t SendMessageType(const std::string& serialize_type) {
+        auto type_id = serialize_type_ids_.Add(serialize_type);
+        if (type_id == 0) {
+            ASBLog(ERROR) << "Too many serialize types, drop message of " << serialize_type;
+            return 0;
+        }
+        std::string meta;
+        protocol::EncodeMessageType(meta, type_id, serialize_type);
+        if (!ProxyImpl<T>::SendEvent(protocol::Opcode::kMessageType, meta.data(), meta.size(), ByteArray())) {
+            serialize_type_ids_.Remove(serialize_type);
+            return 0;
+        }
+        return type_id;
+    }
+
+    void HandleMessageType(Context::RawEvent& event) {
+        uint16_t type_id;
+        std::string serialize_type;
+        auto dictionary = event.GetBytes();
+        if (!protocol::DecodeMessageType(event.GetMeta(), event.GetMetaSize(), type_id, serialize_type) ||
+            !serialize_types_.Set(type_id, serialize_type,
+                                  std::string(reinterpret_cast<const char*>(dictionary.GetData()), dictionary.GetByteSize()))) {
+            ASBLog(ERROR) << "Failed to decode message type event.";
             return;
         }
+        // Until then the sender sends the unreliable messages of the type reliably.
+        std::string ack;
+        protocol::EncodeMessageType(ack, type_id, std::string());
+        ProxyImpl<T>::SendEvent(protocol::Opcode::kMessageTypeAck, ack.data(), ack.size(), ByteArray());
+    }
+
+    void HandleMessageDrops(Context::RawEvent& event) {
+        protocol::MessageDropBlock block;
+        if (event.GetMetaSize() != sizeof(block)) {
+            ASBLog(ERROR) << "MessageProxyImpl " << this << " received invalid message drops.";
+            return;
+        }
+        memcpy(&block, event.GetMeta(), sizeof(block));
+        std::lock_guard<std::mutex> lg(Object<T>::GetMutex());
+        drop_stats_.count += ntohl(block.count);
+        drop_stats_.bytes += protocol::NetToHost64(block.bytes);
+        drop_stats_.conflated += ntohl(block.conflated);
+    }
+
+    void HandleMessage(Context::RawEvent& event) {
         Message message;
-        if (MessageFromProtocol(message, protocol_message)) {
+        bool decoded;
+        {
+            std::lock_guard<std::mutex> lg(Object<T>::GetMutex());
+            decoded = MessageFromProtocol(message, event.GetMeta(), event.GetMetaSize(), event.GetBytes(), serialize_types_,
+                                          decompressor_);
+        }
+        if (decoded) {
             T::OnMessage(message);
         } else {
             ASBLog(ERROR) << "Failed to convert message.";
@@ -114,6 +234,10 @@ class MessageProxyImpl: public ProxyImpl<T> {
 
  private:
     unsigned int message_fields_;
+    SerializeTypeIds serialize_type_ids_;
+    SerializeTypeTable serialize_types_;
+    PayloadDecompressor decompressor_;
+    DropStats drop_stats_;
 };
 
 }  // namespace blackbox2
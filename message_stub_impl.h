@@ -19,13 +19,16 @@
 #ifndef SF_MSGBUS_BLACKBOX2_MESSAGE_STUB_IMPL_H_
 #define SF_MSGBUS_BLACKBOX2_MESSAGE_STUB_IMPL_H_
 
+#include <atomic>
 #include <string>
 
 #include <sf-msgbus/types/result.h>
 #include <sf-msgbus/blackbox2/message_stub.h>
 
+#include "compression.h"
 #include "local_player.h"
 #include "local_recorder.h"
+#include "serialize_types.h"
 #include "stub_impl.h"
 
 namespace asf {
@@ -33,7 +36,7 @@ namespace msgbus {
 namespace blackbox2 {
 
 template <typename T>
-class MessageStubImpl: public StubImpl<T> {
+class MessageStubImpl: public StubImpl<T>, public CaptureSink {
     static_assert(std::is_base_of<MessageStub, T>::value);
 
  public:
@@ -42,115 +45,224 @@ class MessageStubImpl: public StubImpl<T> {
         : StubImpl<T>(context, attach_opcode, attach_payload, parent)
         , inject_message_handler_(std::move(inject_message_handler))
         , message_fields_(Message::kHasDefault)
-        , local_recorder_(nullptr) {
-        Object<T>::RegisterEventHandler(protocol::Opcode::kMessage,
-                                        std::bind(&MessageStubImpl::HandleMessage, this, std::placeholders::_1));
+        , local_recorder_(nullptr)
+        , capture_(context->GetCapture())
+        , capture_sink_id_((capture_ != nullptr) ? capture_->AddSink(this) : 0)
+        , capture_type_(nullptr) {
+        Object<T>::RegisterRawEventHandler(protocol::Opcode::kMessage,
+                                           std::bind(&MessageStubImpl::HandleMessage, this, std::placeholders::_1));
+        Object<T>::RegisterRawEventHandler(protocol::Opcode::kMessageType,
+                                           std::bind(&MessageStubImpl::HandleMessageType, this, std::placeholders::_1));
+        Object<T>::RegisterRawEventHandler(protocol::Opcode::kMessageTypeAck,
+                                           std::bind(&MessageStubImpl::HandleMessageTypeAck, this, std::placeholders::_1));
         Object<T>::RegisterEventHandler(protocol::Opcode::kMessageFields,
                                         std::bind(&MessageStubImpl::HandleMessageField, this, std::placeholders::_1));
     }
 
     ~MessageStubImpl() override {
         ASBLog(INFO) << "MessageStubImpl " << this << " releasing...";
+        if (capture_ != nullptr) {
+            capture_->RemoveSink(this);
+        }
     }
 
  public:
     void SendMessage(const ByteArray& payload, const std::string& serialize_type, const MessageInfo& msg_info) override {
-        std::lock_guard<std::mutex> lg(StubImpl<T>::GetMutex());
-        if (local_recorder_ != nullptr) {
-            // TODO
-        }
-        if (message_fields_ == 0) {
+        if (capture_ != nullptr) {
+            CaptureMessage(protocol::Direction::Out, payload, serialize_type, msg_info);
             return;
         }
-        if (!StubImpl<T>::IsActivated()) {
+        std::lock_guard<std::mutex> lg(StubImpl<T>::GetMutex());
+        EncodeMessage(protocol::Direction::Out, payload, serialize_type, msg_info);
+    }
+
+    void ReceiveMessage(const ByteArray& payload, const std::string& serialize_type, const MessageInfo& msg_info) override {
+        if (capture_ != nullptr) {
+            CaptureMessage(protocol::Direction::In, payload, serialize_type, msg_info);
             return;
         }
-        protocol::Message protocol_message;
-        protocol_message.set_dir(protocol::Direction::Out);
-        if ((message_fields_ & Message::kHasGenTimestamp) && msg_info.HasGenTimestamp()) {
-            protocol_message.set_gen_timestamp(msg_info.GetGenTimestamp());
+        std::lock_guard<std::mutex> lg(StubImpl<T>::GetMutex());
+        EncodeMessage(protocol::Direction::In, payload, serialize_type, msg_info);
+    }
+
+    // Messages replaced in the send queue by a newer one, see Delivery::kConflated.
+    uint64_t GetConflatedCount() {
+        std::lock_guard<std::mutex> lg(StubImpl<T>::GetMutex());
+        auto endpoint = Object<T>::GetEndpoint();
+        return (endpoint != nullptr) ? Object<T>::GetContext()->GetConflatedCount(endpoint) : 0;
+    }
+
+    void SetLocalPlayer(LocalPlayer* p) {
+        std::lock_guard<std::mutex> lg(StubImpl<T>::GetMutex());
+        local_player_ = p;
+    }
+
+    void SetLocalRecorder(LocalRecorder *p) {
+        std::lock_guard<std::mutex> lg(StubImpl<T>::GetMutex());
+        local_recorder_ = p;
+    }
+
+ private:
+    void HandleMessage(Context::RawEvent& event) {
+        if (!inject_message_handler_) {
+            ASBLog(WARNING) << "No inject message handler.";
+            return;
         }
-        if ((message_fields_ & Message::kHasTxTimestamp) && msg_info.HasTxTimestamp()) {
-            protocol_message.set_tx_timestamp(
-                std::chrono::duration_cast<std::chrono::microseconds>(msg_info.GetTxTimestamp().time_since_epoch()).count());
+        Message message;
+        if (!MessageFromProtocol(message, event.GetMeta(), event.GetMetaSize(), event.GetBytes(), serialize_types_,
+                                 decompressor_)) {
+            ASBLog(ERROR) << "Failed to decode message.";
+            return;
         }
-        if ((message_fields_ & Message::kHasRxTimestamp) && msg_info.HasRxTimestamp()) {
-            protocol_message.set_rx_timestamp(
-                std::chrono::duration_cast<std::chrono::microseconds>(msg_info.GetRxTimestamp().time_since_epoch()).count());
+        ScopedUnlocker<std::mutex> unlocker(StubImpl<T>::GetMutex());
+        inject_message_handler_(std::move(message));
+    }
+
+    // Runs on the publishing thread: no locks and no encoding.
+    void CaptureMessage(protocol::Direction dir, const ByteArray& payload, const std::string& serialize_type,
+                        const MessageInfo& msg_info) {
+        if ((message_fields_.load(std::memory_order_relaxed) & ~protocol::kFieldOptionMask) == 0) {
+            return;
         }
-        if ((message_fields_ & Message::kHasPayloadAndSerializeType)) {
-            protocol_message.set_payload(std::string(reinterpret_cast<const char*>(payload.GetData()), payload.GetByteSize()));
-            protocol_message.set_serialize_type(serialize_type);
+        // A handle mostly sends one type, interning takes a process wide lock.
+        auto type = capture_type_.load(std::memory_order_acquire);
+        if (type == nullptr || *type != serialize_type) {
+            type = InternSerializeType(serialize_type);
+            capture_type_.store(type, std::memory_order_release);
         }
-        StubImpl<T>::SendEvent(protocol::Opcode::kMessage, protocol_message);
+        capture_->Push(CaptureEntry{ this, capture_sink_id_, dir, payload, type, msg_info });
     }
 
-    void ReceiveMessage(const ByteArray& payload, const std::string& serialize_type, const MessageInfo& msg_info) override {
+    void HandleCapture(CaptureEntry& entry) override {
         std::lock_guard<std::mutex> lg(StubImpl<T>::GetMutex());
+        EncodeMessage(entry.dir, entry.payload, *entry.serialize_type, entry.msg_info);
+    }
+
+    void EncodeMessage(protocol::Direction dir, const ByteArray& payload, const std::string& serialize_type,
+                       const MessageInfo& msg_info) {
         if (local_recorder_ != nullptr) {
             // TODO
         }
-        if (message_fields_ == 0) {
+        // Delivery and compression come with the fields, all set by the backend at once.
+        auto flags = message_fields_.load(std::memory_order_relaxed);
+        auto message_fields = flags & ~protocol::kFieldOptionMask;
+        if (message_fields == 0) {
             return;
         }
+        auto delivery = protocol::GetDelivery(flags);
+        auto compression = protocol::GetCompression(flags);
         if (!StubImpl<T>::IsActivated()) {
             return;
         }
-        protocol::Message protocol_message;
-        protocol_message.set_dir(protocol::Direction::In);
-        if ((message_fields_ & Message::kHasGenTimestamp) && msg_info.HasGenTimestamp()) {
-            protocol_message.set_gen_timestamp(msg_info.GetGenTimestamp());
+        protocol::MessageBlock block = {};
+        block.dir = static_cast<uint8_t>(dir);
+        if ((message_fields & Message::kHasGenTimestamp) && msg_info.HasGenTimestamp()) {
+            block.fields |= protocol::kHasGenTimestamp;
+            block.gen_timestamp = msg_info.GetGenTimestamp();
         }
-        if ((message_fields_ & Message::kHasTxTimestamp) && msg_info.HasTxTimestamp()) {
-            protocol_message.set_tx_timestamp(
-                std::chrono::duration_cast<std::chrono::microseconds>(msg_info.GetTxTimestamp().time_since_epoch()).count());
+        if ((message_fields & Message::kHasTxTimestamp) && msg_info.HasTxTimestamp()) {
+            block.fields |= protocol::kHasTxTimestamp;
+            block.tx_timestamp =
+                std::chrono::duration_cast<std::chrono::microseconds>(msg_info.GetTxTimestamp().time_since_epoch()).count();
         }
-        if ((message_fields_ & Message::kHasRxTimestamp) && msg_info.HasRxTimestamp()) {
-            protocol_message.set_rx_timestamp(
-                std::chrono::duration_cast<std::chrono::microseconds>(msg_info.GetRxTimestamp().time_since_epoch()).count());
+        if ((message_fields & Message::kHasRxTimestamp) && msg_info.HasRxTimestamp()) {
+            block.fields |= protocol::kHasRxTimestamp;
+            block.rx_timestamp =
+                std::chrono::duration_cast<std::chrono::microseconds>(msg_info.GetRxTimestamp().time_since_epoch()).count();
+        }
+        if (!(message_fields & Message::kHasPayloadAndSerializeType)) {
+            auto net_block = protocol::EncodeMessageBlock(block);
+            StubImpl<T>::SendEvent(protocol::Opcode::kMessage, &net_block, sizeof(net_block), ByteArray(), delivery);
+            return;
         }
-        if ((message_fields_ & Message::kHasPayloadAndSerializeType)) {
-            protocol_message.set_payload(std::string(reinterpret_cast<const char*>(payload.GetData()), payload.GetByteSize()));
-            protocol_message.set_serialize_type(serialize_type);
+        block.fields |= protocol::kHasPayload;
+        block.type_id = serialize_type_ids_.Find(serialize_type);
+        if (block.type_id == 0) {
+            block.type_id = SendMessageType(serialize_type);
+            if (block.type_id == 0) {
+                return;
+            }
         }
-        StubImpl<T>::SendEvent(protocol::Opcode::kMessage, protocol_message);
+        // An unreliable message may pass the kMessageType event of its type,
+        // it goes reliable behind it until the receiver has the type.
+        if ((delivery == protocol::Delivery::kSequenced || delivery == protocol::Delivery::kUnsequenced) &&
+            !serialize_type_ids_.IsAnnounced(block.type_id)) {
+            delivery = protocol::Delivery::kReliable;
+        }
+        if (compression != protocol::Compression::kNone && payload.GetByteSize() >= kCompressMinSize) {
+            std::unique_ptr<std::string> packed(new std::string());
+            if (compressor_.Compress(compression, GetSerializeTypeDictionary(serialize_type), payload.GetData(),
+                                     payload.GetByteSize(), *packed)) {
+                block.fields |= protocol::kIsCompressed;
+                block.raw_size = static_cast<uint32_t>(payload.GetByteSize());
+                auto net_block = protocol::EncodeMessageBlock(block);
+                // The packed bytes may be sent as a trailer, so they are owned by the ByteArray.
+                auto data = reinterpret_cast<uint8_t*>(&(*packed)[0]);
+                auto size = packed->size();
+                ByteArray bytes(data, size, [p = packed.release()](uint8_t*, size_t, void*) { delete p; });
+                StubImpl<T>::SendEvent(protocol::Opcode::kMessage, &net_block, sizeof(net_block), bytes, delivery);
+                return;
+            }
+        }
+        auto net_block = protocol::EncodeMessageBlock(block);
+        StubImpl<T>::SendEvent(protocol::Opcode::kMessage, &net_block, sizeof(net_block), payload, delivery);
     }
 
-    void SetLocalPlayer(LocalPlayer* p) {
-        std::lock_guard<std::mutex> lg(StubImpl<T>::GetMutex());
-        local_player_ = p;
+    uint16_t SendMessageType(const std::string& serialize_type) {
+        auto type_id = serialize_type_ids_.Add(serialize_type);
+        if (type_id == 0) {
+            ASBLog(ERROR) << "Too many serialize types, drop message of " << serialize_type;
+            return 0;
+        }
+        std::string meta;
+        protocol::EncodeMessageType(meta, type_id, serialize_type);
+        // Dictionaries are loaded once and never released.
+        auto& dictionary = GetSerializeTypeDictionary(serialize_type);
+        ByteArray bytes(reinterpret_cast<uint8_t*>(const_cast<char*>(dictionary.data())), dictionary.size(),
+                        [](uint8_t*, size_t, void*) {});
+        if (!StubImpl<T>::SendEvent(protocol::Opcode::kMessageType, meta.data(), meta.size(), bytes)) {
+            serialize_type_ids_.Remove(serialize_type);
+            return 0;
+        }
+        return type_id;
     }
 
-    void SetLocalRecorder(LocalRecorder *p) {
-        std::lock_guard<std::mutex> lg(StubImpl<T>::GetMutex());
-        local_recorder_ = p;
+    void HandleMessageType(Context::RawEvent& event) {
+        uint16_t type_id;
+        std::string serialize_type;
+        auto dictionary = event.GetBytes();
+        if (!protocol::DecodeMessageType(event.GetMeta(), event.GetMetaSize(), type_id, serialize_type) ||
+            !serialize_types_.Set(type_id, serialize_type,
+                                  std::string(reinterpret_cast<const char*>(dictionary.GetData()), dictionary.GetByteSize()))) {
+            ASBLog(ERROR) << "Failed to decode message type event.";
+        }
     }
 
- private:
-    void HandleMessage(google::protobuf::io::ZeroCopyInputStream& input) {
-        if (!inject_message_handler_) {
-            ASBLog(WARNING) << "No inject message handler.";
-            return;
-        }
-        auto protocol_message = std::make_shared<protocol::Message>();
-        if (!protocol_message->ParseFromZeroCopyStream(&input)) {
-            ASBLog(ERROR) << "Failed to parse message event.";
+    void HandleMessageTypeAck(Context::RawEvent& event) {
+        uint16_t type_id;
+        std::string serialize_type;
+        if (!protocol::DecodeMessageType(event.GetMeta(), event.GetMetaSize(), type_id, serialize_type)) {
+            ASBLog(ERROR) << "Failed to decode message type ack event.";
             return;
         }
-        Message message;
-        if (!MessageFromProtocol(message, protocol_message)) {
-            ASBLog(ERROR) << "Failed to decode message.";
-            return;
-        }
-        ScopedUnlocker<std::mutex> unlocker(StubImpl<T>::GetMutex());
-        inject_message_handler_(std::move(message));
+        std::lock_guard<std::mutex> lg(StubImpl<T>::GetMutex());
+        serialize_type_ids_.Announce(type_id);
+    }
+
+    // A new attachment talks to a new proxy, types are registered again.
+    void HandleAttached() override {
+        serialize_type_ids_.Clear();
+        serialize_types_.Clear();
     }
 
     void HandleMessageField(google::protobuf::io::ZeroCopyInputStream& input) {
         protocol::MessageFields protocol_message_fields;
         if (protocol_message_fields.ParseFromZeroCopyStream(&input)) {
-            message_fields_ = protocol_message_fields.has_flags();
-            ASBLog(INFO) << "Set message field " << message_fields_;
+            auto flags = protocol_message_fields.has_flags();
+            message_fields_.store(flags, std::memory_order_relaxed);
+            ASBLog(INFO) << "Set message field " << (flags & ~protocol::kFieldOptionMask) << ", delivery "
+                         << static_cast<int>(protocol::GetDelivery(flags)) << ", compression "
+                         << static_cast<int>(protocol::GetCompression(flags));
         } else {
             ASBLog(ERROR) << "Failed to parse message fields event.";
         }
@@ -158,9 +270,17 @@ class MessageStubImpl: public StubImpl<T> {
 
  private:
     MessageStub::Handler inject_message_handler_;
-    unsigned int message_fields_;
+    // Message fields with the delivery and compression in the option bits.
+    std::atomic<unsigned int> message_fields_;
     LocalPlayer* local_player_;
     LocalRecorder* local_recorder_;
+    Capture* capture_;
+    uint64_t capture_sink_id_;
+    std::atomic<const std::string*> capture_type_;
+    SerializeTypeIds serialize_type_ids_;
+    SerializeTypeTable serialize_types_;
+    PayloadCompressor compressor_;
+    PayloadDecompressor decompressor_;
 };
 
 }  // namespace blackbox2
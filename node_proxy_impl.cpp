@@ -24,8 +24,8 @@ namespace asf {
 namespace msgbus {
 namespace blackbox2 {
 
-NodeProxyImpl::NodeProxyImpl(std::shared_ptr<Context> context, ENetPeer* enet_peer, protocol::Node&& protocol_node)
-    : ProxyImpl(context, enet_peer)
+NodeProxyImpl::NodeProxyImpl(std::shared_ptr<Context> context, Endpoint* endpoint, protocol::Node&& protocol_node)
+    : ProxyImpl(context, endpoint)
     , protocol_node_(std::move(protocol_node)) {
     is_attached_ = protocol_node.is_attached();
     ProxyImpl::RegisterEventHandler(protocol::Opcode::kNodeAttach, std::bind(&NodeProxyImpl::HandleAttach, this, std::placeholders::_1));
@@ -63,15 +63,15 @@ std::vector<std::shared_ptr<HandleProxy>> NodeProxyImpl::GetHandles() const {
 
 void NodeProxyImpl::AddHandleProxy(std::shared_ptr<HandleProxyImpl> handle_proxy_impl) {
     std::lock_guard<std::mutex> lg(GetMutex());
-    auto enet_peer = handle_proxy_impl->GetENetPeer();
-    auto it = handle_proxy_map_.find(enet_peer);
+    auto endpoint = handle_proxy_impl->GetEndpoint();
+    auto it = handle_proxy_map_.find(endpoint);
     if (it != handle_proxy_map_.end()) {
         ASBLog(ERROR) << "Duplicated handle";
         return;
     }
-    auto connection = handle_proxy_impl->OnDisconnected.connect([this, enet_peer] {
+    auto connection = handle_proxy_impl->OnDisconnected.connect([this, endpoint] {
         std::lock_guard<std::mutex> lg(GetMutex());
-        auto it = handle_proxy_map_.find(enet_peer);
+        auto it = handle_proxy_map_.find(endpoint);
         if (it != handle_proxy_map_.end()) {
             auto handle_proxy_impl = it->second.first;
             handle_proxy_map_.erase(it);
@@ -79,7 +79,7 @@ void NodeProxyImpl::AddHandleProxy(std::shared_ptr<HandleProxyImpl> handle_proxy
             OnHandleRemoved(handle_proxy_impl);
         }
     });
-    handle_proxy_map_[enet_peer] = std::make_pair(handle_proxy_impl, connection);
+    handle_proxy_map_[endpoint] = std::make_pair(handle_proxy_impl, connection);
     ScopedUnlocker<std::mutex> unlocker(GetMutex());
     OnHandleAdded(handle_proxy_impl);
 }
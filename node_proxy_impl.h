@@ -34,7 +34,7 @@ namespace blackbox2 {
 
 class NodeProxyImpl: public ProxyImpl<NodeProxy> {
  public:
-    NodeProxyImpl(std::shared_ptr<Context> context, ENetPeer* enet_peer, protocol::Node&& protocol_node);
+    NodeProxyImpl(std::shared_ptr<Context> context, Endpoint* endpoint, protocol::Node&& protocol_node);
     ~NodeProxyImpl() override;
 
  public:
@@ -56,7 +56,7 @@ class NodeProxyImpl: public ProxyImpl<NodeProxy> {
 
  private:
     using HandleInfo = std::pair<std::shared_ptr<HandleProxyImpl>, scoped_connection>;
-    using HandleProxyMap = std::map<ENetPeer*, HandleInfo>;
+    using HandleProxyMap = std::map<Endpoint*, HandleInfo>;
 
  private:
     protocol::Node protocol_node_;
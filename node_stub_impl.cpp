@@ -31,7 +31,7 @@ NodeStubImpl::NodeStubImpl(std::shared_ptr<Context> context, const std::string&
     protocol_node_.set_is_attached(false);
     protocol::GetCurrentThread(*protocol_node_.mutable_owner_thread());
     if (process != nullptr) {
-        protocol_node_.mutable_owner_process()->set_id(process->GetInstanceId());
+        protocol_node_.mutable_owner_process()->set_id(AssignedInstanceId::Of(process));
     }
 }
 
@@ -42,19 +42,19 @@ class Object: public T {
                   std::is_base_of<std::enable_shared_from_this<Stub>, T>::value);
 
  public:
-    Object(std::shared_ptr<Context> context, ENetPeer* enet_peer = nullptr)
+    Object(std::shared_ptr<Context> context, Endpoint* endpoint = nullptr)
         : context_(context)
-        , enet_peer_(nullptr) {
+        , endpoint_(nullptr) {
         assert(context_);
-        SetENetPeer(enet_peer);
+        SetEndpoint(endpoint);
     }
 
     virtual ~Object() {
         std::lock_guard<std::mutex> lg(mutex_);
-        if (enet_peer_ != nullptr) {
-            context_->UnregisterAll(enet_peer_);
-            context_->Disconnect(enet_peer_, nullptr);
-            SetENetPeer(nullptr);
+        if (endpoint_ != nullptr) {
+            context_->UnregisterAll(endpoint_);
+            context_->Disconnect(endpoint_, nullptr);
+            SetEndpoint(nullptr);
         }
     }
 
@@ -63,8 +63,8 @@ class Object: public T {
         return context_;
     }
 
-    ENetPeer* GetENetPeer() {
-        return enet_peer_;
+    Endpoint* GetEndpoint() {
+        return endpoint_;
     }
 
  protected:
@@ -73,23 +73,23 @@ class Object: public T {
     }
 
     bool IsConnected() const {
-        return (enet_peer_ != nullptr);
+        return (endpoint_ != nullptr);
     }
 
     using ConnectCallback = std::function<void (Result)>;
 
     bool Connect(ConnectCallback cb) {
-        if (enet_peer_ != nullptr) {
+        if (endpoint_ != nullptr) {
             return false;
         }
         auto wp = T::weak_from_this();
-        bool ret = context_->Connect([this, cb = std::move(cb), wp](Result result, ENetPeer* enet_peer) {
+        bool ret = context_->Connect([this, cb = std::move(cb), wp](Result result, Endpoint* endpoint) {
             auto p = wp.lock();
             if (p) {
                 {
                     std::lock_guard<std::mutex> lg(mutex_);
                     if (result == Result::kOk) {
-                        SetENetPeer(enet_peer);
+                        SetEndpoint(endpoint);
                     }
                 }
                 if (cb) {
@@ -105,13 +105,13 @@ class Object: public T {
     using DisconnectCallback = std::function<void (Result)>;
 
     bool Disconnect(DisconnectCallback cb = nullptr) {
-        if (enet_peer_ == nullptr) {
+        if (endpoint_ == nullptr) {
             return false;
         }
-        ENetPeer* enet_peer = enet_peer_;
-        enet_peer_ = nullptr;
+        Endpoint* endpoint = endpoint_;
+        endpoint_ = nullptr;
         auto wp = T::weak_from_this();
-        return context_->Disconnect(enet_peer, [this, cb = std::move(cb), wp](Result result) {
+        return context_->Disconnect(endpoint, [this, cb = std::move(cb), wp](Result result) {
             auto p = wp.lock();
             if (p) {
                 if (cb) {
@@ -124,31 +124,43 @@ class Object: public T {
     }
 
     bool SendEvent(protocol::Opcode opcode) {
-        if (enet_peer_ == nullptr) {
+        if (endpoint_ == nullptr) {
             //ASBLog(ERROR) << this << ": failed to send packet, no connection.";
             return false;
         }
-        return context_->SendEvent(enet_peer_, opcode, nullptr);
+        return context_->SendEvent(endpoint_, opcode, nullptr);
     }
 
-    bool SendEvent(protocol::Opcode opcode, const google::protobuf::Message& payload) {
-        if (enet_peer_ == nullptr) {
+    bool SendEvent(protocol::Opcode opcode, const google::protobuf::Message& payload,
+                   protocol::Delivery delivery = protocol::Delivery::kReliable) {
+        if (endpoint_ == nullptr) {
             //(ERROR) << this << ": failed to send packet, no connection.";
             return false;
         }
-        return context_->SendEvent(enet_peer_, opcode, &payload);
+        return context_->SendEvent(endpoint_, opcode, &payload, delivery);
+    }
+
+    bool SendEvent(protocol::Opcode opcode, const void* meta, size_t meta_size, const ByteArray& bytes,
+                   protocol::Delivery delivery = protocol::Delivery::kReliable) {
+        if (endpoint_ == nullptr) {
+            return false;
+        }
+        return context_->SendEvent(endpoint_, opcode, meta, meta_size, bytes, delivery);
     }
 
     using RequestContext = Context::RequestContext;
     using RequestCallback = Context::RequestCallback;
 
-    bool SendRequest(protocol::Opcode opcode, RequestCallback cb) {
-        if (enet_peer_ == nullptr) {
+    // A request fails with kTimeout after timeout, session is set to the
+    // handle of CancelRequest().
+    bool SendRequest(protocol::Opcode opcode, RequestCallback cb,
+                     std::chrono::milliseconds timeout = Context::kDefaultRequestTimeout, uint32_t* session = nullptr) {
+        if (endpoint_ == nullptr) {
             //(ERROR) << this << ": failed to send packet, no connection.";
             return false;
         }
         auto wp = T::weak_from_this();
-        return context_->SendRequest(enet_peer_, opcode, nullptr,
+        return context_->SendRequest(endpoint_, opcode, nullptr,
             [this, cb = std::move(cb), wp](Result result, google::protobuf::io::ZeroCopyInputStream* payload) {
                 auto p = wp.lock();
                 if (p) {
@@ -158,16 +170,43 @@ class Object: public T {
                 } else {
                     ASBLog(WARNING) << "Object " << this << " has been destroy.";
                 }
-            });
+            }, timeout, session);
     }
 
-    bool SendRequest(protocol::Opcode opcode, const google::protobuf::Message& payload, RequestCallback cb) {
-        if (enet_peer_ == nullptr) {
+    bool SendRequest(protocol::Opcode opcode, const google::protobuf::Message& payload, RequestCallback cb,
+                     std::chrono::milliseconds timeout = Context::kDefaultRequestTimeout, uint32_t* session = nullptr) {
+        if (endpoint_ == nullptr) {
             //ASBLog(ERROR) << this << ": failed to send packet, no connection.";
             return false;
         }
         auto wp = T::weak_from_this();
-        return context_->SendRequest(enet_peer_, opcode, &payload,
+        return context_->SendRequest(endpoint_, opcode, &payload,
+            [this, cb = std::move(cb), wp](Result result, google::protobuf::io::ZeroCopyInputStream* payload) {
+                auto p = wp.lock();
+                if (p) {
+                    if (cb) {
+                        cb(result, payload);
+                    }
+                } else {
+                    ASBLog(WARNING) << "Object " << this << " has been destroy.";
+                }
+            }, timeout, session);
+    }
+
+    // The callback of a cancelled request is never called.
+    bool CancelRequest(uint32_t session) {
+        if (endpoint_ == nullptr) {
+            return false;
+        }
+        return context_->CancelRequest(endpoint_, session);
+    }
+
+    bool SendAttach(uint64_t instance_id, protocol::Opcode opcode, const google::protobuf::Message& payload, RequestCallback cb) {
+        if (endpoint_ == nullptr) {
+            return false;
+        }
+        auto wp = T::weak_from_this();
+        return context_->SendAttach(endpoint_, instance_id, opcode, payload,
             [this, cb = std::move(cb), wp](Result result, google::protobuf::io::ZeroCopyInputStream* payload) {
                 auto p = wp.lock();
                 if (p) {
@@ -183,8 +222,8 @@ class Object: public T {
     using EventHandler = Context::EventHandler;
 
     void RegisterEventHandler(protocol::Opcode opcode, EventHandler handler) {
-        if (enet_peer_ != nullptr) {
-            context_->RegisterEventHandler(enet_peer_, opcode, handler);
+        if (endpoint_ != nullptr) {
+            context_->RegisterEventHandler(endpoint_, opcode, handler);
         }
         if (!handler) {
             auto it = event_hander_map_.find(opcode);
@@ -196,11 +235,27 @@ class Object: public T {
         }
     }
 
+    using RawEventHandler = Context::RawEventHandler;
+
+    void RegisterRawEventHandler(protocol::Opcode opcode, RawEventHandler handler) {
+        if (endpoint_ != nullptr) {
+            context_->RegisterRawEventHandler(endpoint_, opcode, handler);
+        }
+        if (!handler) {
+            auto it = raw_event_handler_map_.find(opcode);
+            if (it != raw_event_handler_map_.end()) {
+                raw_event_handler_map_.erase(it);
+            }
+        } else {
+            raw_event_handler_map_[opcode] = std::move(handler);
+        }
+    }
+
     using RequestHandler = Context::RequestHandler;
 
     void RegisterRequestHandler(protocol::Opcode opcode, RequestHandler handler) {
-        if (enet_peer_ != nullptr) {
-            context_->RegisterRequestHandler(enet_peer_, opcode, handler);
+        if (endpoint_ != nullptr) {
+            context_->RegisterRequestHandler(endpoint_, opcode, handler);
         }
         if (!handler) {
             auto it = request_handler_map_.find(opcode);
@@ -220,38 +275,43 @@ class Object: public T {
     void DisconnectHandler() {
         std::lock_guard<std::mutex> lg(mutex_);
         ASBLog(INFO) << this << ": disconnected.";
-        SetENetPeer(nullptr);
+        SetEndpoint(nullptr);
         HandleConnectionLost();
     }
 
-    void SetENetPeer(ENetPeer* enet_peer) {
-        if (enet_peer_ == enet_peer) {
+    void SetEndpoint(Endpoint* endpoint) {
+        if (endpoint_ == endpoint) {
             return;
         }
-        if (enet_peer_ != nullptr) {
-            context_->UnregisterAll(enet_peer_);
+        if (endpoint_ != nullptr) {
+            context_->UnregisterAll(endpoint_);
         }
-        enet_peer_ = enet_peer;
-        if (enet_peer_ != nullptr) {
-            context_->RegisterDisconnectHandler(enet_peer_, std::bind(&Object::DisconnectHandler, this));
+        endpoint_ = endpoint;
+        if (endpoint_ != nullptr) {
+            context_->RegisterDisconnectHandler(endpoint_, std::bind(&Object::DisconnectHandler, this));
             for (auto& h: event_hander_map_) {
-                context_->RegisterEventHandler(enet_peer_, h.first, h.second);
+                context_->RegisterEventHandler(endpoint_, h.first, h.second);
+            }
+            for (auto& h: raw_event_handler_map_) {
+                context_->RegisterRawEventHandler(endpoint_, h.first, h.second);
             }
             for (auto& h: request_handler_map_) {
-                context_->RegisterRequestHandler(enet_peer_, h.first, h.second);
+                context_->RegisterRequestHandler(endpoint_, h.first, h.second);
             }
         }
     }
 
  private:
     using EventHandlerMap = std::map<protocol::Opcode, EventHandler>;
+    using RawEventHandlerMap = std::map<protocol::Opcode, RawEventHandler>;
     using RequestHandlerMap = std::map<protocol::Opcode, RequestHandler>;
 
  private:
     mutable std::mutex mutex_;
     std::shared_ptr<Context> context_;
-    ENetPeer* enet_peer_;
+    Endpoint* endpoint_;
     EventHandlerMap event_hander_map_;
+    RawEventHandlerMap raw_event_handler_map_;
     RequestHandlerMap request_handler_map_;
 };
 
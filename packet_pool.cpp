@@ -0,0 +1,191 @@
+// -----------------------------------------------------------------------
+// |             _     _              _____         _____                |
+// |            |  \  | |            / ____|  /\   |  __ \               |
+// |            | | \ | |  __       | (___   /  \  | |__) |              |
+// |            | |\ \| | /__\|   |  \___ \ / /\ \ |  _  /               |
+// |            | | \ \ ||    |   |   ___) / /__\ \| | \ \               |
+// |            |_|  \_\| \__/ \_/|/|_____/________\_|  \_\              |
+// |                                                                     |
+// -----------------------------------------------------------------------
+// COPYRIGHT
+// -----------------------------------------------------------------------
+//
+// This software is copyright protected and proprietary to Neusoft Reach.
+// Neusoft Reach grants to you only those rights as set out in the license
+// conditions.
+// All other rights remain with Neusoft Reach.
+// -----------------------------------------------------------------------
+
+#include <cstring>
+#include <cassert>
+#include <cstdlib>
+#include <algorithm>
+
+#include <sf-msgbus/blackbox2/log.h>
+
+#include "packet_pool.h"
+
+namespace asf {
+namespace msgbus {
+namespace blackbox2 {
+
+namespace {
+
+constexpr enet_uint32 kPooledFlag = 1U << 15;
+
+std::atomic<bool> pool_installed(false);
+
+size_t GetSizeClass(size_t size, size_t min_shift) {
+    size_t index = 0;
+    while ((size_t(1) << (min_shift + index)) < size) {
+        ++index;
+    }
+    return index;
+}
+
+}
+
+PacketPool::PacketPool()
+    : hits_(0)
+    , misses_(0)
+    , cached_(0) {
+    for (size_t i = 0; i < kClassCount; ++i) {
+        classes_[i].capacity = std::max<size_t>(16, kClassBytes >> (kMinClassShift + i));
+        classes_[i].packets.reserve(classes_[i].capacity);
+    }
+}
+
+PacketPool& PacketPool::Instance() {
+    static PacketPool instance;
+    return instance;
+}
+
+bool PacketPool::Install() {
+#if !defined(SF_MSGBUS_BLACKBOX2_SERVER) && !defined(SF_MSGBUS_BLACKBOX2_OWNS_ENET)
+    // ENet is owned by another component, leave its callbacks alone.
+    return false;
+#endif
+    static std::once_flag once;
+    std::call_once(once, [] {
+        Instance();
+        ENetCallbacks inits;
+        memset(&inits, 0, sizeof(inits));
+        inits.packet_create = &PacketPool::Create;
+        inits.packet_destroy = &PacketPool::Destroy;
+        if (enet_initialize_with_callbacks(ENET_VERSION, &inits) == 0) {
+            pool_installed = true;
+        } else {
+            ASBLog(ERROR) << "Failed to install enet packet pool.";
+        }
+    });
+    return pool_installed;
+}
+
+ENetPacket* PacketPool::Create(const void* data, size_t size, enet_uint32 flags) {
+    if (!pool_installed || (flags & ENET_PACKET_FLAG_NO_ALLOCATE)) {
+        return enet_packet_create(data, size, flags);
+    }
+    auto packet = Instance().Allocate(size);
+    if (packet == nullptr) {
+        return enet_packet_create(data, size, flags);
+    }
+    packet->data = reinterpret_cast<enet_uint8*>(packet) + sizeof(ENetPacket);
+    if (data != nullptr) {
+        memcpy(packet->data, data, size);
+    }
+    packet->referenceCount = 0;
+    packet->flags = flags | kPooledFlag;
+    packet->dataLength = size;
+    packet->freeCallback = nullptr;
+    packet->userData = nullptr;
+    return packet;
+}
+
+void PacketPool::Destroy(ENetPacket* packet) {
+    if (packet == nullptr) {
+        return;
+    }
+    if (!(packet->flags & kPooledFlag)) {
+        enet_packet_destroy(packet);
+        return;
+    }
+    if (packet->freeCallback != nullptr) {
+        (*packet->freeCallback)(packet);
+    }
+    Instance().Release(packet);
+}
+
+PacketPool::Stats PacketPool::GetStats() {
+    auto& pool = Instance();
+    return Stats{ pool.hits_.load(), pool.misses_.load(), pool.cached_.load() };
+}
+
+ENetPacket* PacketPool::Allocate(size_t size) {
+    auto index = GetSizeClass(size, kMinClassShift);
+    if (index >= kClassCount) {
+        return nullptr;
+    }
+    auto& size_class = classes_[index];
+    {
+        std::lock_guard<std::mutex> lg(size_class.mutex);
+        if (!size_class.packets.empty()) {
+            auto packet = size_class.packets.back();
+            size_class.packets.pop_back();
+            hits_.fetch_add(1, std::memory_order_relaxed);
+            cached_.fetch_sub(1, std::memory_order_relaxed);
+            return packet;
+        }
+    }
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    // Same layout as ENet's own packets, so enet_packet_destroy() is still
+    // able to free a pooled packet.
+    return static_cast<ENetPacket*>(enet_malloc(sizeof(ENetPacket) + (size_t(1) << (kMinClassShift + index))));
+}
+
+void PacketPool::Release(ENetPacket* packet) {
+    auto index = GetSizeClass(packet->dataLength, kMinClassShift);
+    auto& size_class = classes_[index];
+    {
+        std::lock_guard<std::mutex> lg(size_class.mutex);
+        if (size_class.packets.size() < size_class.capacity) {
+            size_class.packets.push_back(packet);
+            cached_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+    enet_free(packet);
+}
+
+// PacketRef
+
+PacketRef::PacketRef(ENetPacket* packet)
+    : packet_(packet) {
+}
+
+PacketRef::~PacketRef() {
+    if (!shared_) {
+        PacketPool::Destroy(packet_);
+    }
+}
+
+ENetPacket* PacketRef::Get() const {
+    return packet_;
+}
+
+ENetPacket* PacketRef::Release() {
+    assert(!shared_);
+    auto packet = packet_;
+    packet_ = nullptr;
+    return packet;
+}
+
+std::shared_ptr<ENetPacket> PacketRef::Share() {
+    if (!shared_ && packet_ != nullptr) {
+        shared_.reset(packet_, &PacketPool::Destroy);
+    }
+    return shared_;
+}
+
+}  // namespace blackbox2
+}  // namespace msgbus
+}  // namespace asf
@@ -0,0 +1,101 @@
+// -----------------------------------------------------------------------
+// |             _     _              _____         _____                |
+// |            |  \  | |            / ____|  /\   |  __ \               |
+// |            | | \ | |  __       | (___   /  \  | |__) |              |
+// |            | |\ \| | /__\|   |  \___ \ / /\ \ |  _  /               |
+// |            | | \ \ ||    |   |   ___) / /__\ \| | \ \               |
+// |            |_|  \_\| \__/ \_/|/|_____/________\_|  \_\              |
+// |                                                                     |
+// -----------------------------------------------------------------------
+// COPYRIGHT
+// -----------------------------------------------------------------------
+//
+// This software is copyright protected and proprietary to Neusoft Reach.
+// Neusoft Reach grants to you only those rights as set out in the license
+// conditions.
+// All other rights remain with Neusoft Reach.
+// -----------------------------------------------------------------------
+
+#ifndef SF_MSGBUS_BLACKBOX2_PACKET_POOL_H_
+#define SF_MSGBUS_BLACKBOX2_PACKET_POOL_H_
+
+#include <array>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <vector>
+#include <cstdint>
+
+#include "enet.h"
+
+namespace asf {
+namespace msgbus {
+namespace blackbox2 {
+
+// Size-class pool of ENet packets. It is installed as ENet's packet_create
+// and packet_destroy callbacks, so received packets are pooled as well as
+// the ones created by Context. Pooled packets keep ENet's memory layout and
+// are told apart by a private flag, everything else falls back to ENet.
+class PacketPool {
+ public:
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t cached;
+    };
+
+ public:
+    static bool Install();
+    static ENetPacket* Create(const void* data, size_t size, enet_uint32 flags);
+    static void Destroy(ENetPacket* packet);
+    static Stats GetStats();
+
+ private:
+    PacketPool();
+
+    static PacketPool& Instance();
+
+    ENetPacket* Allocate(size_t size);
+    void Release(ENetPacket* packet);
+
+ private:
+    static constexpr size_t kMinClassShift = 7;
+    static constexpr size_t kClassCount = 10;
+    static constexpr size_t kClassBytes = 1024 * 1024;
+
+    struct SizeClass {
+        std::mutex mutex;
+        std::vector<ENetPacket*> packets;
+        size_t capacity;
+    };
+
+    std::array<SizeClass, kClassCount> classes_;
+    std::atomic<uint64_t> hits_;
+    std::atomic<uint64_t> misses_;
+    std::atomic<uint64_t> cached_;
+};
+
+// A received packet while it is dispatched. It is destroyed with the ref
+// unless Share() handed out references that keep it alive.
+class PacketRef final {
+ public:
+    explicit PacketRef(ENetPacket* packet = nullptr);
+    PacketRef(const PacketRef&) = delete;
+    PacketRef& operator=(const PacketRef&) = delete;
+    ~PacketRef();
+
+ public:
+    ENetPacket* Get() const;
+    ENetPacket* Release();
+    std::shared_ptr<ENetPacket> Share();
+
+ private:
+    ENetPacket* packet_;
+    std::shared_ptr<ENetPacket> shared_;
+};
+
+}  // namespace blackbox2
+}  // namespace msgbus
+}  // namespace asf
+
+#endif  // SF_MSGBUS_BLACKBOX2_PACKET_POOL_H_
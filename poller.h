@@ -0,0 +1,61 @@
+// -----------------------------------------------------------------------
+// |             _     _              _____         _____                |
+// |            |  \  | |            / ____|  /\   |  __ \               |
+// |            | | \ | |  __       | (___   /  \  | |__) |              |
+// |            | |\ \| | /__\|   |  \___ \ / /\ \ |  _  /               |
+// |            | | \ \ ||    |   |   ___) / /__\ \| | \ \               |
+// |            |_|  \_\| \__/ \_/|/|_____/________\_|  \_\              |
+// |                                                                     |
+// -----------------------------------------------------------------------
+// COPYRIGHT
+// -----------------------------------------------------------------------
+//
+// This software is copyright protected and proprietary to Neusoft Reach.
+// Neusoft Reach grants to you only those rights as set out in the license
+// conditions.
+// All other rights remain with Neusoft Reach.
+// -----------------------------------------------------------------------
+
+#ifndef SF_MSGBUS_BLACKBOX2_POLLER_H_
+#define SF_MSGBUS_BLACKBOX2_POLLER_H_
+
+#include <memory>
+#include <cstdint>
+
+#include <sf-msgbus/blackbox2/common.h>
+
+#include "enet.h"
+
+namespace asf {
+namespace msgbus {
+namespace blackbox2 {
+
+// Waits on the ENet sockets and a wakeup signal for the backend thread.
+// Wakeup() is coalesced: only the first call after a Wait() returned issues
+// a syscall, the others are dropped until the backend has woken up.
+class Poller {
+ public:
+    // Wait() until an event or a wakeup, without a timeout.
+    static constexpr uint32_t kInfinite = UINT32_MAX;
+
+    Poller();
+
+ public:
+    bool Open();
+    void Close();
+    bool IsOpen() const;
+    bool Watch(ENetSocket socket);
+    void Unwatch(ENetSocket socket);
+    int Wait(uint32_t timeout);
+    bool Wakeup();
+
+ private:
+    class Impl;
+    std::shared_ptr<Impl> impl_;
+};
+
+}
+}
+}
+
+#endif //  SF_MSGBUS_BLACKBOX2_POLLER_H_
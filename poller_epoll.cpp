@@ -0,0 +1,160 @@
+// -----------------------------------------------------------------------
+// |             _     _              _____         _____                |
+// |            |  \  | |            / ____|  /\   |  __ \               |
+// |            | | \ | |  __       | (___   /  \  | |__) |              |
+// |            | |\ \| | /__\|   |  \___ \ / /\ \ |  _  /               |
+// |            | | \ \ ||    |   |   ___) / /__\ \| | \ \               |
+// |            |_|  \_\| \__/ \_/|/|_____/________\_|  \_\              |
+// |                                                                     |
+// -----------------------------------------------------------------------
+// COPYRIGHT
+// -----------------------------------------------------------------------
+//
+// This software is copyright protected and proprietary to Neusoft Reach.
+// Neusoft Reach grants to you only those rights as set out in the license
+// conditions.
+// All other rights remain with Neusoft Reach.
+// -----------------------------------------------------------------------
+
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "poller.h"
+
+namespace asf {
+namespace msgbus {
+namespace blackbox2 {
+
+class Poller::Impl final {
+public:
+    Impl()
+        : epoll_fd_(-1)
+        , event_fd_(-1)
+        , wakeup_pending_(false) {
+    }
+
+    ~Impl() {
+        Close();
+    }
+
+public:
+    bool Open() {
+        Close();
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd_ < 0) {
+            return false;
+        }
+        event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (event_fd_ < 0 || !Watch(event_fd_)) {
+            Close();
+            return false;
+        }
+        wakeup_pending_.store(false);
+        return true;
+    }
+
+    void Close() {
+        if (event_fd_ >= 0) {
+            close(event_fd_);
+            event_fd_ = -1;
+        }
+        if (epoll_fd_ >= 0) {
+            close(epoll_fd_);
+            epoll_fd_ = -1;
+        }
+    }
+
+    bool IsOpen() const {
+        return (epoll_fd_ >= 0);
+    }
+
+    bool Watch(int fd) {
+        assert(epoll_fd_ >= 0);
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        return (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) == 0);
+    }
+
+    void Unwatch(int fd) {
+        assert(epoll_fd_ >= 0);
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+    }
+
+    int Wait(uint32_t timeout) {
+        assert(epoll_fd_ >= 0);
+        epoll_event events[kMaxEvents];
+        int ret = epoll_wait(epoll_fd_, events, kMaxEvents, (timeout == kInfinite) ? -1 : static_cast<int>(timeout));
+        for (int i = 0; i < ret; ++i) {
+            if (events[i].data.fd == event_fd_) {
+                // One read resets the counter of all coalesced wakeups.
+                uint64_t counter;
+                while (read(event_fd_, &counter, sizeof(counter)) < 0 && errno == EINTR) {
+                }
+                wakeup_pending_.store(false);
+            }
+        }
+        return ret;
+    }
+
+    bool Wakeup() {
+        assert(event_fd_ >= 0);
+        if (wakeup_pending_.exchange(true)) {
+            return true;
+        }
+        uint64_t counter = 1;
+        if (write(event_fd_, &counter, sizeof(counter)) != sizeof(counter)) {
+            wakeup_pending_.store(false);
+            return false;
+        }
+        return true;
+    }
+
+private:
+    static constexpr int kMaxEvents = 8;
+
+    int epoll_fd_;
+    int event_fd_;
+    std::atomic<bool> wakeup_pending_;
+};
+
+Poller::Poller()
+    : impl_(std::make_shared<Impl>()) {
+}
+
+bool Poller::Open() {
+    return impl_->Open();
+}
+
+void Poller::Close() {
+    impl_->Close();
+}
+
+bool Poller::IsOpen() const {
+    return impl_->IsOpen();
+}
+
+bool Poller::Watch(ENetSocket socket) {
+    return impl_->Watch(socket);
+}
+
+void Poller::Unwatch(ENetSocket socket) {
+    impl_->Unwatch(socket);
+}
+
+int Poller::Wait(uint32_t timeout) {
+    return impl_->Wait(timeout);
+}
+
+bool Poller::Wakeup() {
+    return impl_->Wakeup();
+}
+
+}
+}
+}
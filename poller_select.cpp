@@ -0,0 +1,140 @@
+// -----------------------------------------------------------------------
+// |             _     _              _____         _____                |
+// |            |  \  | |            / ____|  /\   |  __ \               |
+// |            | | \ | |  __       | (___   /  \  | |__) |              |
+// |            | |\ \| | /__\|   |  \___ \ / /\ \ |  _  /               |
+// |            | | \ \ ||    |   |   ___) / /__\ \| | \ \               |
+// |            |_|  \_\| \__/ \_/|/|_____/________\_|  \_\              |
+// |                                                                     |
+// -----------------------------------------------------------------------
+// COPYRIGHT
+// -----------------------------------------------------------------------
+//
+// This software is copyright protected and proprietary to Neusoft Reach.
+// Neusoft Reach grants to you only those rights as set out in the license
+// conditions.
+// All other rights remain with Neusoft Reach.
+// -----------------------------------------------------------------------
+
+#include <atomic>
+#include <vector>
+#include <cassert>
+#include <algorithm>
+
+#include "pipe.h"
+#include "poller.h"
+
+namespace asf {
+namespace msgbus {
+namespace blackbox2 {
+
+class Poller::Impl final {
+public:
+    Impl()
+        : wakeup_pending_(false) {
+    }
+
+public:
+    bool Open() {
+        Close();
+        if (!pipe_.Open()) {
+            return false;
+        }
+        wakeup_pending_.store(false);
+        return true;
+    }
+
+    void Close() {
+        pipe_.Close();
+        sockets_.clear();
+    }
+
+    bool IsOpen() const {
+        return pipe_.IsOpen();
+    }
+
+    bool Watch(ENetSocket socket) {
+        sockets_.push_back(socket);
+        return true;
+    }
+
+    void Unwatch(ENetSocket socket) {
+        sockets_.erase(std::remove(sockets_.begin(), sockets_.end(), socket), sockets_.end());
+    }
+
+    int Wait(uint32_t timeout) {
+        assert(pipe_.IsOpen());
+        ENetSocketSet skset;
+        ENET_SOCKETSET_EMPTY(skset);
+        int pipe_rh = pipe_.GetReadHandle();
+        int skmax = pipe_rh;
+        ENET_SOCKETSET_ADD(skset, pipe_rh);
+        for (auto socket: sockets_) {
+            ENET_SOCKETSET_ADD(skset, socket);
+            skmax = std::max(skmax, static_cast<int>(socket));
+        }
+        // kInfinite makes some 49 days here, which is as good.
+        int ret = enet_socketset_select(skmax + 1, &skset, nullptr, timeout);
+        if (ret > 0 && ENET_SOCKETSET_CHECK(skset, pipe_rh)) {
+            // Drain all coalesced wakeups in one read.
+            char buff[64];
+            pipe_.Read(buff, sizeof(buff));
+            wakeup_pending_.store(false);
+        }
+        return ret;
+    }
+
+    bool Wakeup() {
+        assert(pipe_.IsOpen());
+        if (wakeup_pending_.exchange(true)) {
+            return true;
+        }
+        char wakeup_cmd = 'w';
+        if (pipe_.Write(&wakeup_cmd, 1) != 1) {
+            wakeup_pending_.store(false);
+            return false;
+        }
+        return true;
+    }
+
+private:
+    Pipe pipe_;
+    std::vector<ENetSocket> sockets_;
+    std::atomic<bool> wakeup_pending_;
+};
+
+Poller::Poller()
+    : impl_(std::make_shared<Impl>()) {
+}
+
+bool Poller::Open() {
+    return impl_->Open();
+}
+
+void Poller::Close() {
+    impl_->Close();
+}
+
+bool Poller::IsOpen() const {
+    return impl_->IsOpen();
+}
+
+bool Poller::Watch(ENetSocket socket) {
+    return impl_->Watch(socket);
+}
+
+void Poller::Unwatch(ENetSocket socket) {
+    impl_->Unwatch(socket);
+}
+
+int Poller::Wait(uint32_t timeout) {
+    return impl_->Wait(timeout);
+}
+
+bool Poller::Wakeup() {
+    return impl_->Wakeup();
+}
+
+}
+}
+}
@@ -24,8 +24,8 @@ namespace asf {
 namespace msgbus {
 namespace blackbox2 {
 
-ProcessProxyImpl::ProcessProxyImpl(std::shared_ptr<Context> context, ENetPeer* enet_peer, protocol::Process&& protocol_process)
-    : ProxyImpl<ProcessProxy>(context, enet_peer)
+ProcessProxyImpl::ProcessProxyImpl(std::shared_ptr<Context> context, Endpoint* endpoint, protocol::Process&& protocol_process)
+    : ProxyImpl<ProcessProxy>(context, endpoint)
     , protocol_process_(std::move(protocol_process)) {
     startup_time_ = std::chrono::system_clock::time_point(std::chrono::microseconds(protocol_process_.startup_timestamp()));
 }
@@ -106,6 +106,11 @@ std::vector<std::shared_ptr<NodeProxy>> ProcessProxyImpl::GetNodes() const {
 }
 
 bool ProcessProxyImpl::GetKeyStat(const std::string& key, GetStatCallback cb) {
+    return GetKeyStat(key, Context::kDefaultRequestTimeout, std::move(cb));
+}
+
+bool ProcessProxyImpl::GetKeyStat(const std::string& key, std::chrono::milliseconds timeout, GetStatCallback cb,
+                                  uint32_t* session) {
     std::lock_guard<std::mutex> lg(GetMutex());
     protocol::String protocol_key;
     protocol_key.set_value(key);
@@ -143,23 +148,28 @@ bool ProcessProxyImpl::GetKeyStat(const std::string& key, GetStatCallback cb) {
         } else {
             cb(Result::kUnknown, nullptr);
         }
-    });
+    }, timeout, session);
+}
+
+bool ProcessProxyImpl::CancelKeyStat(uint32_t session) {
+    std::lock_guard<std::mutex> lg(GetMutex());
+    return CancelRequest(session);
 }
 
 void ProcessProxyImpl::AddChannelProxy(std::shared_ptr<ChannelProxyImpl> channel_proxy_impl) {
     std::lock_guard<std::mutex> lg(GetMutex());
-    auto enet_peer = channel_proxy_impl->GetENetPeer();
+    auto endpoint = channel_proxy_impl->GetEndpoint();
     for (auto it = channel_proxy_vector_.begin(); it != channel_proxy_vector_.end(); ++it) {
-        if (it->first->GetENetPeer() == enet_peer) {
+        if (it->first->GetEndpoint() == endpoint) {
             ASBLog(ERROR) << "Duplicated channel.";
             return;
         }
     }
-    auto connection = channel_proxy_impl->OnDisconnected.connect([this, enet_peer] {
+    auto connection = channel_proxy_impl->OnDisconnected.connect([this, endpoint] {
         std::lock_guard<std::mutex> lg(GetMutex());
         for (auto it = channel_proxy_vector_.begin(); it != channel_proxy_vector_.end(); ++it) {
             auto channel_proxy = it->first;
-            if (channel_proxy->GetENetPeer() == enet_peer) {
+            if (channel_proxy->GetEndpoint() == endpoint) {
                 channel_proxy_vector_.erase(it);
                 ScopedUnlocker<std::mutex> unlocker(GetMutex());
                 OnChannelRemoved(channel_proxy);
@@ -178,18 +188,18 @@ void ProcessProxyImpl::AddExecutorProxy(std::shared_ptr<ExecutorProxyImpl> execu
         return;
     }
     std::lock_guard<std::mutex> lg(GetMutex());
-    auto enet_peer = executor_proxy_impl->GetENetPeer();
+    auto endpoint = executor_proxy_impl->GetEndpoint();
     for (auto it = executor_proxy_vector_.begin(); it != executor_proxy_vector_.end(); ++it) {
-        if (it->first->GetENetPeer() == enet_peer) {
+        if (it->first->GetEndpoint() == endpoint) {
             ASBLog(ERROR) << "Duplicated executor.";
             return;
         }
     }
-    auto connection = executor_proxy_impl->OnDisconnected.connect([this, enet_peer] {
+    auto connection = executor_proxy_impl->OnDisconnected.connect([this, endpoint] {
         std::lock_guard<std::mutex> lg(GetMutex());
         for (auto it = executor_proxy_vector_.begin(); it != executor_proxy_vector_.end(); ++it) {
             auto executor_proxy = it->first;
-            if (executor_proxy->GetENetPeer() == enet_peer) {
+            if (executor_proxy->GetEndpoint() == endpoint) {
                 executor_proxy_vector_.erase(it);
                 ScopedUnlocker<std::mutex> unlocker(GetMutex());
                 OnExecutorRemoved(executor_proxy);
@@ -204,18 +214,18 @@ void ProcessProxyImpl::AddExecutorProxy(std::shared_ptr<ExecutorProxyImpl> execu
 
 void ProcessProxyImpl::AddNodeProxy(std::shared_ptr<NodeProxyImpl> node_proxy_impl) {
     std::lock_guard<std::mutex> lg(GetMutex());
-    auto enet_peer = node_proxy_impl->GetENetPeer();
+    auto endpoint = node_proxy_impl->GetEndpoint();
     for (auto it = node_proxy_vector_.begin(); it != node_proxy_vector_.end(); ++it) {
-        if (it->first->GetENetPeer() == enet_peer) {
+        if (it->first->GetEndpoint() == endpoint) {
             ASBLog(ERROR) << "Duplicated node.";
             return;
         }
     }
-    auto connection = node_proxy_impl->OnDisconnected.connect([this, enet_peer] {
+    auto connection = node_proxy_impl->OnDisconnected.connect([this, endpoint] {
         std::lock_guard<std::mutex> lg(GetMutex());
         for (auto it = node_proxy_vector_.begin(); it != node_proxy_vector_.end(); ++it) {
             auto node_proxy = it->first;
-            if (node_proxy->GetENetPeer() == enet_peer) {
+            if (node_proxy->GetEndpoint() == endpoint) {
                 node_proxy_vector_.erase(it);
                 ScopedUnlocker<std::mutex> unlocker(GetMutex());
                 OnNodeRemoved(node_proxy);
@@ -36,7 +36,7 @@ namespace blackbox2 {
 
 class ProcessProxyImpl: public ProxyImpl<ProcessProxy> {
  public:
-    ProcessProxyImpl(std::shared_ptr<Context> context, ENetPeer* enet_peer, protocol::Process&& protocol_process);
+    ProcessProxyImpl(std::shared_ptr<Context> context, Endpoint* endpoint, protocol::Process&& protocol_process);
     ~ProcessProxyImpl() override;
 
  public:
@@ -54,6 +54,10 @@ class ProcessProxyImpl: public ProxyImpl<ProcessProxy> {
     std::vector<std::shared_ptr<ExecutorProxy>> GetExecutors() const override;
     std::vector<std::shared_ptr<NodeProxy>> GetNodes() const override;
     bool GetKeyStat(const std::string& key, GetStatCallback cb) override;
+    // Fails with kTimeout after timeout, session is set to the handle of
+    // CancelKeyStat(), which drops the request without calling cb.
+    bool GetKeyStat(const std::string& key, std::chrono::milliseconds timeout, GetStatCallback cb, uint32_t* session = nullptr);
+    bool CancelKeyStat(uint32_t session);
 
  public:
     void AddChannelProxy(std::shared_ptr<ChannelProxyImpl> channel_proxy_impl);
@@ -36,10 +36,16 @@
 #   error unsupported platform.
 #endif
 
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <random>
+
 #include <sf-msgbus/types/scope_guard.h>
 #include <sf-msgbus/blackbox2/common.h>
 #include <sf-msgbus/blackbox2/log.h>
 
+#include "compression.h"
 #include "protocol.h"
 
 namespace asf {
@@ -48,6 +54,50 @@ namespace blackbox2 {
 
 namespace protocol {
 
+EnetChannel GetEnetChannel(Type type, Opcode opcode) {
+    if (type != Type::kEvent) {
+        return EnetChannel::kControl;
+    }
+    switch (opcode) {
+    case Opcode::kMessage:
+    case Opcode::kMessageType:
+        return EnetChannel::kBulk;
+    case Opcode::kExecutorRunBegin:
+    case Opcode::kExecutorRunEnd:
+    case Opcode::kExecutorTaskBegin:
+    case Opcode::kExecutorTaskEnd:
+        return EnetChannel::kTrace;
+    default:
+        return EnetChannel::kControl;
+    }
+}
+
+// A random prefix per process and a counter, the prefix keeps the ids of the
+// processes of all hosts apart.
+uint64_t CreateInstanceId() {
+    constexpr unsigned int kCounterBits = 28;
+    static const uint64_t prefix = [] {
+        std::random_device device;
+        std::seed_seq seed{ device(), device(),
+                            static_cast<unsigned int>(std::chrono::steady_clock::now().time_since_epoch().count()) };
+        std::mt19937_64 generator(seed);
+        return generator();
+    }();
+    static std::atomic<uint64_t> counter(1);
+    auto count = counter.fetch_add(1, std::memory_order_relaxed) & ((1ULL << kCounterBits) - 1);
+    return kClientInstanceBit | ((prefix << kCounterBits) & ~kClientInstanceBit) | count;
+}
+
+// 64-bit FNV-1a.
+uint64_t Digest(const void* data, size_t size) {
+    auto bytes = static_cast<const uint8_t*>(data);
+    uint64_t digest = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < size; ++i) {
+        digest = (digest ^ bytes[i]) * 0x100000001B3ULL;
+    }
+    return digest;
+}
+
 void GetCurrentProcess(Process& out) {
 #ifdef _WIN32
     // TODO
@@ -83,11 +133,67 @@ void GetCurrentThread(Thread& out) {
 #endif
 }
 
+Delivery GetDelivery(unsigned int fields) {
+    auto delivery = (fields & kDeliveryMask) >> kDeliveryShift;
+    return (delivery < static_cast<unsigned int>(Delivery::kMax)) ? static_cast<Delivery>(delivery) : Delivery::kReliable;
+}
+
+Compression GetCompression(unsigned int fields) {
+    auto compression = (fields & kCompressionMask) >> kCompressionShift;
+    return (compression < static_cast<unsigned int>(Compression::kMax)) ?
+        static_cast<Compression>(compression) : Compression::kNone;
+}
+
+MessageBlock EncodeMessageBlock(const MessageBlock& block) {
+    MessageBlock net_block = block;
+    net_block.type_id = htons(block.type_id);
+    net_block.raw_size = htonl(block.raw_size);
+    net_block.gen_timestamp = HostToNet64(block.gen_timestamp);
+    net_block.tx_timestamp = HostToNet64(block.tx_timestamp);
+    net_block.rx_timestamp = HostToNet64(block.rx_timestamp);
+    return net_block;
+}
+
+void EncodeMessageType(std::string& out, uint16_t type_id, const std::string& serialize_type) {
+    MessageTypeBlock block;
+    block.type_id = htons(type_id);
+    block.type_size = htons(static_cast<uint16_t>(serialize_type.size()));
+    out.assign(reinterpret_cast<const char*>(&block), sizeof(block));
+    out.append(serialize_type);
+}
+
+bool DecodeMessageType(const uint8_t* meta, size_t meta_size, uint16_t& type_id, std::string& serialize_type) {
+    MessageTypeBlock block;
+    if (meta_size < sizeof(block)) {
+        return false;
+    }
+    memcpy(&block, meta, sizeof(block));
+    auto type_size = ntohs(block.type_size);
+    if (meta_size < sizeof(block) + type_size) {
+        return false;
+    }
+    type_id = ntohs(block.type_id);
+    serialize_type.assign(reinterpret_cast<const char*>(meta + sizeof(block)), type_size);
+    return true;
+}
+
 }  // namespace protocol
 
-bool MessageFromProtocol(Message& out, std::shared_ptr<protocol::Message> in) {
-    assert(in);
-    switch (in->dir()) {
+namespace {
+
+constexpr uint32_t kMaxRawSize = 64 * 1024 * 1024;
+
+}
+
+bool MessageFromProtocol(Message& out, const uint8_t* meta, size_t meta_size, ByteArray&& payload,
+                         const SerializeTypeTable& types, PayloadDecompressor& decompressor) {
+    protocol::MessageBlock block;
+    if (meta_size < sizeof(block)) {
+        ASBLog(ERROR) << "Message metadata is too small.";
+        return false;
+    }
+    memcpy(&block, meta, sizeof(block));
+    switch (block.dir) {
     case protocol::Direction::In:
         out.SetDir(Message::Direction::kIn);
         break;
@@ -98,23 +204,40 @@ bool MessageFromProtocol(Message& out, std::shared_ptr<protocol::Message> in) {
         out.SetDir(Message::Direction::kUnknown);
         break;
     }
-    if (in->has_gen_timestamp()) {
-        out.SetGenTimestamp(std::chrono::system_clock::time_point(std::chrono::microseconds(in->gen_timestamp())));
+    if (block.fields & protocol::kHasGenTimestamp) {
+        out.SetGenTimestamp(std::chrono::system_clock::time_point(
+            std::chrono::microseconds(protocol::NetToHost64(block.gen_timestamp))));
     }
-    if (in->has_tx_timestamp()) {
-        out.SetTxTimestamp(std::chrono::system_clock::time_point(std::chrono::microseconds(in->tx_timestamp())));
+    if (block.fields & protocol::kHasTxTimestamp) {
+        out.SetTxTimestamp(std::chrono::system_clock::time_point(
+            std::chrono::microseconds(protocol::NetToHost64(block.tx_timestamp))));
     }
-    if (in->has_rx_timestamp()) {
-        out.SetRxTimestamp(std::chrono::system_clock::time_point(std::chrono::microseconds(in->rx_timestamp())));
+    if (block.fields & protocol::kHasRxTimestamp) {
+        out.SetRxTimestamp(std::chrono::system_clock::time_point(
+            std::chrono::microseconds(protocol::NetToHost64(block.rx_timestamp))));
     }
-    if (in->has_payload()) {
-        if (!in->has_serialize_type()) {
-            ASBLog(ERROR) << "Message has payload but no serialize type.";
+    if (block.fields & protocol::kHasPayload) {
+        auto type_id = ntohs(block.type_id);
+        auto serialize_type = types.Find(type_id);
+        if (serialize_type == nullptr) {
+            ASBLog(ERROR) << "Message has payload but unknown serialize type " << type_id;
             return false;
         }
-        auto payload = in->payload();
-        out.SetPayload(ByteArray(reinterpret_cast<uint8_t*>(const_cast<char*>(payload.data())),
-                                 payload.length(), [in](uint8_t*, size_t, void*){}), in->serialize_type());
+        if (block.fields & protocol::kIsCompressed) {
+            auto raw_size = ntohl(block.raw_size);
+            if (raw_size > kMaxRawSize) {
+                ASBLog(ERROR) << "Compressed message of " << raw_size << " bytes is too large.";
+                return false;
+            }
+            auto raw = new uint8_t[raw_size];
+            if (!decompressor.Decompress(types.FindDictionary(type_id), payload.GetData(), payload.GetByteSize(), raw, raw_size)) {
+                delete[] raw;
+                ASBLog(ERROR) << "Failed to decompress message of " << *serialize_type;
+                return false;
+            }
+            payload = ByteArray(raw, raw_size, [](uint8_t* data, size_t, void*) { delete[] data; });
+        }
+        out.SetPayload(std::move(payload), *serialize_type);
     }
     return true;
 }
@@ -30,16 +30,21 @@
 
 #include "enet.h"
 #include "protocol_message.pb.h"
+#include "serialize_types.h"
 
 namespace asf {
 namespace msgbus {
 namespace blackbox2 {
 
+class PayloadDecompressor;
+
 namespace protocol {
     enum class Type: uint8_t {
         kEvent = 0,
         kRequest,
         kResponse,
+        kClose,
+        kBatch,
         kMax,
         kInvalid = 0xFFU
     };
@@ -52,9 +57,13 @@ namespace protocol {
         kAttachExecutor,
         kAttachNode,
         kAttachHandle,
+        kAttachBatch,
 
         kMessage,
         kMessageFields,
+        kMessageType,
+        kMessageTypeAck,
+        kMessageDrops,
 
         kProcessGetKeyStat,
         kProcessStartLocalPlayer,
@@ -79,22 +88,176 @@ namespace protocol {
         kInvalid = 0xFFU
     };
 
-    constexpr uint8_t kVersion = 3;
+    // ENet channels. Reliable commands are sequenced per channel, so control
+    // packets are never held back at the receiver behind bulk message data.
+    enum class EnetChannel: uint8_t {
+        kControl = 0,
+        kTrace,
+        kBulk,
+        kMax
+    };
+
+    // Delivery of kMessage events, carried in the upper bits of the message
+    // fields so the server sets it together with them.
+    enum class Delivery: uint8_t {
+        kReliable = 0,
+        kSequenced,     // Unreliable, late packets are dropped.
+        kUnsequenced,   // Unreliable and unordered.
+        kConflated,     // Reliable, a message still in the send queue is replaced by a newer one.
+        kMax
+    };
+
+    // Compression of kMessage payloads, carried in the message fields like
+    // the delivery.
+    enum class Compression: uint8_t {
+        kNone = 0,
+        kFast,
+        kHigh,
+        kMax
+    };
+
+    constexpr unsigned int kDeliveryShift = 24;
+    constexpr unsigned int kDeliveryMask = 0x0FU << kDeliveryShift;
+    constexpr unsigned int kCompressionShift = 28;
+    constexpr unsigned int kCompressionMask = 0x0FU << kCompressionShift;
+    constexpr unsigned int kFieldOptionMask = kDeliveryMask | kCompressionMask;
+
+    constexpr uint8_t kVersion = 4;
+
+    // Instance ids chosen by clients have the top bit set, the ids a server
+    // derives from its endpoints never do.
+    constexpr uint64_t kClientInstanceBit = 1ULL << 63;
+
+    // A kEvent with kHeaderTrailer is followed on its channel by a reliable
+    // packet of extra_data raw bytes, the bytes of the event. The sender
+    // references them instead of copying them into the packet. Both are
+    // reliable, so the trailer is the next reliable packet of the channel.
+    constexpr uint8_t kHeaderTrailer = 0x01U;
+    // The payload of a kEvent with kHeaderRaw is a RawHeader, meta_size bytes
+    // of metadata and then the raw bytes of the event, up to its end.
+    constexpr uint8_t kHeaderRaw = 0x02U;
 
     struct Header {
         uint8_t version;
         uint8_t type;
         uint8_t opcode;
-        uint8_t __pad;
+        uint8_t flags;
         uint32_t session;
         uint32_t extra_data;
+        uint32_t object;    // Object id of the endpoint within its peer.
+    };
+
+    // A kBatch packet carries extra_data records, each one a BatchRecord
+    // followed by the size bytes of an event payload.
+    struct BatchRecord {
+        uint8_t opcode;
+        uint8_t flags;      // kHeaderRaw only.
+        uint8_t __pad[2];
+        uint32_t object;
+        uint32_t size;
+    };
+
+    // A kAttachBatch request carries extra_data records, each one an
+    // AttachRecord followed by the size bytes of the payload of its attach
+    // request. The client picks the instance id of each object, so payloads
+    // name owners that have not attached yet.
+    struct AttachRecord {
+        uint8_t opcode;     // kAttachProcess to kAttachHandle.
+        uint8_t flags;
+        uint8_t __pad[2];
+        uint32_t object;
+        uint32_t size;
+        uint32_t __pad2;
+        uint64_t instance;  // 0 lets the server pick it.
+        uint64_t digest;    // Of the payload, kAttachResume only.
+    };
+
+    // The response carries an AttachResult for each record the server has
+    // handled, in order, each one followed by the size bytes of the payload
+    // of its attach response.
+    struct AttachResult {
+        uint32_t object;
+        uint32_t result;
+        uint32_t size;
+        uint8_t flags;
+        uint8_t __pad[3];
+    };
+
+    enum AttachFlag: uint8_t {
+        // A record without payload, the server attaches with the payload it
+        // keeps for the instance if the digest matches. A result with it
+        // asks for the record again with its payload.
+        kAttachResume = 0x01U,
+    };
+
+    struct RawHeader {
+        uint32_t meta_size;
+    };
+
+    enum MessageBlockField: uint8_t {
+        kHasGenTimestamp = 0x01U,
+        kHasTxTimestamp = 0x02U,
+        kHasRxTimestamp = 0x04U,
+        kHasPayload = 0x08U,
+        kIsCompressed = 0x10U     // The payload is deflated to raw_size bytes.
+    };
+
+    // Metadata of a raw kMessage event, the payload is the raw bytes of the
+    // event. The serialize type is sent once per connection by a kMessageType
+    // event on the same channel and then referred to by its id.
+    struct MessageBlock {
+        uint8_t dir;
+        uint8_t fields;
+        uint16_t type_id;
+        uint32_t raw_size;
+        uint64_t gen_timestamp;
+        uint64_t tx_timestamp;
+        uint64_t rx_timestamp;
+    };
+
+    inline uint64_t HostToNet64(uint64_t v) {
+        if (htonl(1) == 1) {
+            return v;
+        }
+        return (static_cast<uint64_t>(htonl(static_cast<uint32_t>(v))) << 32) | htonl(static_cast<uint32_t>(v >> 32));
+    }
+
+    inline uint64_t NetToHost64(uint64_t v) {
+        return HostToNet64(v);
+    }
+
+    // Metadata of a raw kMessageType event, followed by type_size bytes of
+    // the serialize type. The bytes of the event are its dictionary. The
+    // receiver returns the block without the type in a kMessageTypeAck event.
+    struct MessageTypeBlock {
+        uint16_t type_id;
+        uint16_t type_size;
+    };
+
+    // Metadata of a raw kMessageDrops event, the kMessage events of the
+    // endpoint its sender dropped from a full send queue or replaced by a
+    // newer one since the last one.
+    struct MessageDropBlock {
+        uint32_t count;
+        uint32_t conflated;
+        uint64_t bytes;
     };
 
+    MessageBlock EncodeMessageBlock(const MessageBlock& block);
+    void EncodeMessageType(std::string& out, uint16_t type_id, const std::string& serialize_type);
+    bool DecodeMessageType(const uint8_t* meta, size_t meta_size, uint16_t& type_id, std::string& serialize_type);
+
+    EnetChannel GetEnetChannel(Type type, Opcode opcode);
+    Delivery GetDelivery(unsigned int fields);
+    Compression GetCompression(unsigned int fields);
+    uint64_t CreateInstanceId();
+    uint64_t Digest(const void* data, size_t size);
     void GetCurrentProcess(Process& out);
     void GetCurrentThread(Thread& out);
 }
 
-bool MessageFromProtocol(Message& out, std::shared_ptr<protocol::Message> in);
+bool MessageFromProtocol(Message& out, const uint8_t* meta, size_t meta_size, ByteArray&& payload,
+                         const SerializeTypeTable& types, PayloadDecompressor& decompressor);
 
 }  // namespace blackbox2
 }  // namespace msgbus
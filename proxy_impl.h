@@ -39,15 +39,15 @@ class ProxyImpl: public Object<T> {
     static_assert(std::is_base_of<Proxy, T>::value);
 
  public:
-    ProxyImpl(std::shared_ptr<Context> context, ENetPeer* enet_peer)
-        : Object<T>(context, enet_peer)
+    ProxyImpl(std::shared_ptr<Context> context, Endpoint* endpoint)
+        : Object<T>(context, endpoint)
         , is_activated_(true)
         , timestamp_(std::chrono::system_clock::now()) {
-        assert(enet_peer != nullptr);
+        assert(endpoint != nullptr);
         char host_buf[512] = { 0 };
-        enet_address_get_host(&enet_peer->address, host_buf, 510);
+        enet_address_get_host(&endpoint->enet_peer->address, host_buf, 510);
         host_ = host_buf;
-        port_ = enet_peer->address.port;
+        port_ = endpoint->enet_peer->address.port;
     }
 
     ~ProxyImpl() override {
@@ -0,0 +1,244 @@
+// -----------------------------------------------------------------------
+// |             _     _              _____         _____                |
+// |            |  \  | |            / ____|  /\   |  __ \               |
+// |            | | \ | |  __       | (___   /  \  | |__) |              |
+// |            | |\ \| | /__\|   |  \___ \ / /\ \ |  _  /               |
+// |            | | \ \ ||    |   |   ___) / /__\ \| | \ \               |
+// |            |_|  \_\| \__/ \_/|/|_____/________\_|  \_\              |
+// |                                                                     |
+// -----------------------------------------------------------------------
+// COPYRIGHT
+// -----------------------------------------------------------------------
+//
+// This software is copyright protected and proprietary to Neusoft Reach.
+// Neusoft Reach grants to you only those rights as set out in the license
+// conditions.
+// All other rights remain with Neusoft Reach.
+// -----------------------------------------------------------------------
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+
+#if defined(__linux__)
+#   include <pthread.h>
+#   define SET_CURRENT_THREAD_NAME(n) pthread_setname_np(pthread_self(), n)
+#else
+#   define SET_CURRENT_THREAD_NAME(n) do { } while (0)
+#endif
+
+#include <sf-msgbus/types/scoped_unlocker.h>
+#include <sf-msgbus/blackbox2/log.h>
+
+#include "resume_cache.h"
+
+namespace asf {
+namespace msgbus {
+namespace blackbox2 {
+
+namespace {
+
+constexpr uint32_t kSnapshotMagic = 0x53524242U;    // "BBRS"
+constexpr uint32_t kSnapshotVersion = 1;
+
+// The snapshot is only read back on the same host, in host byte order.
+struct SnapshotHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t count;
+};
+
+struct SnapshotRecord {
+    uint64_t instance;
+    uint64_t digest;
+    uint8_t opcode;
+    uint8_t __pad[3];
+    uint32_t size;
+};
+
+}
+
+ResumeCache::ResumeCache(std::string snapshot_path, std::chrono::seconds ttl)
+    : snapshot_path_(std::move(snapshot_path))
+    , ttl_(ttl)
+    , is_dirty_(false)
+    , is_saving_(false)
+    , maintain_run_(false) {
+}
+
+ResumeCache::~ResumeCache() {
+    Stop();
+}
+
+bool ResumeCache::Find(uint64_t instance_id, uint8_t opcode, uint64_t digest, std::string& payload) {
+    std::lock_guard<std::mutex> lg(mutex_);
+    auto it = entries_.find(instance_id);
+    if (it == entries_.end() || it->second.opcode != opcode || it->second.digest != digest) {
+        return false;
+    }
+    it->second.expire = Clock::time_point::max();
+    payload = *it->second.payload;
+    return true;
+}
+
+void ResumeCache::Put(uint64_t instance_id, uint8_t opcode, uint64_t digest, const uint8_t* data, size_t size) {
+    std::lock_guard<std::mutex> lg(mutex_);
+    auto& entry = entries_[instance_id];
+    entry.expire = Clock::time_point::max();
+    if (entry.payload && entry.digest == digest && entry.opcode == opcode && entry.payload->size() == size) {
+        return;
+    }
+    entry.opcode = opcode;
+    entry.digest = digest;
+    entry.payload = std::make_shared<const std::string>(reinterpret_cast<const char*>(data), size);
+    is_dirty_ = true;
+}
+
+void ResumeCache::Release(uint64_t instance_id) {
+    std::lock_guard<std::mutex> lg(mutex_);
+    auto it = entries_.find(instance_id);
+    if (it != entries_.end()) {
+        it->second.expire = Clock::now() + ttl_;
+    }
+}
+
+// Restored payloads wait one ttl for their clients to come back.
+bool ResumeCache::Load() {
+    if (snapshot_path_.empty()) {
+        return false;
+    }
+    std::ifstream file(snapshot_path_, std::ios::binary | std::ios::ate);
+    if (!file) {
+        return false;
+    }
+    // Sizes are checked against what is left of the file before anything
+    // is allocated for them.
+    auto left = static_cast<uint64_t>(file.tellg());
+    file.seekg(0);
+    SnapshotHeader header;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        header.magic != kSnapshotMagic || header.version != kSnapshotVersion ||
+        header.count > (left - sizeof(header)) / sizeof(SnapshotRecord)) {
+        ASBLog(WARNING) << "Ignore invalid resume snapshot " << snapshot_path_;
+        return false;
+    }
+    left -= sizeof(header);
+    EntryMap entries;
+    auto expire = Clock::now() + ttl_;
+    for (uint64_t i = 0; i < header.count; ++i) {
+        SnapshotRecord record;
+        if (!file.read(reinterpret_cast<char*>(&record), sizeof(record)) || record.size > left - sizeof(record)) {
+            ASBLog(WARNING) << "Ignore truncated resume snapshot " << snapshot_path_;
+            return false;
+        }
+        left -= sizeof(record) + record.size;
+        std::string payload(record.size, '\0');
+        if (record.size > 0 && !file.read(&payload[0], record.size)) {
+            ASBLog(WARNING) << "Ignore truncated resume snapshot " << snapshot_path_;
+            return false;
+        }
+        auto& entry = entries[record.instance];
+        entry.opcode = record.opcode;
+        entry.digest = record.digest;
+        entry.payload = std::make_shared<const std::string>(std::move(payload));
+        entry.expire = expire;
+    }
+    std::lock_guard<std::mutex> lg(mutex_);
+    entries_ = std::move(entries);
+    ASBLog(INFO) << "Load " << entries_.size() << " resumable instances from " << snapshot_path_;
+    return true;
+}
+
+bool ResumeCache::Start(std::chrono::milliseconds interval) {
+    std::lock_guard<std::mutex> lg(mutex_);
+    if (maintain_run_) {
+        return false;
+    }
+    maintain_run_ = true;
+    maintain_thread_ = std::thread(std::bind(&ResumeCache::MaintainThread, this, interval));
+    return true;
+}
+
+void ResumeCache::Stop() {
+    {
+        std::lock_guard<std::mutex> lg(mutex_);
+        if (!maintain_run_) {
+            return;
+        }
+        maintain_run_ = false;
+        cond_.notify_one();
+    }
+    maintain_thread_.join();
+    Maintain(Clock::now());
+}
+
+void ResumeCache::MaintainThread(std::chrono::milliseconds interval) {
+    SET_CURRENT_THREAD_NAME("ResumeThread");
+    std::unique_lock<std::mutex> lg(mutex_);
+    while (maintain_run_) {
+        if (cond_.wait_for(lg, interval, [this] { return !maintain_run_; })) {
+            break;
+        }
+        ScopedUnlocker<std::mutex> unlocker(mutex_);
+        Maintain(Clock::now());
+    }
+}
+
+void ResumeCache::Maintain(Clock::time_point now) {
+    std::unique_lock<std::mutex> lg(mutex_);
+    for (auto it = entries_.begin(); it != entries_.end(); ) {
+        if (it->second.expire <= now) {
+            it = entries_.erase(it);
+            is_dirty_ = true;
+        } else {
+            ++it;
+        }
+    }
+    if (!is_dirty_ || is_saving_ || snapshot_path_.empty()) {
+        return;
+    }
+    // Written from a copy sharing the payloads, so the shards keep attaching meanwhile.
+    auto entries = entries_;
+    is_dirty_ = false;
+    is_saving_ = true;
+    bool ret;
+    {
+        ScopedUnlocker<std::mutex> unlocker(mutex_);
+        ret = Save(entries);
+    }
+    is_saving_ = false;
+    is_dirty_ = is_dirty_ || !ret;
+}
+
+// Written next to the snapshot and renamed over it, a crash never leaves a
+// partial snapshot behind.
+bool ResumeCache::Save(const EntryMap& entries) {
+    auto temp_path = snapshot_path_ + ".tmp";
+    {
+        std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+        SnapshotHeader header = { kSnapshotMagic, kSnapshotVersion, entries.size() };
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        for (auto& eit: entries) {
+            SnapshotRecord record = {
+                eit.first, eit.second.digest, eit.second.opcode, { 0 }, static_cast<uint32_t>(eit.second.payload->size())
+            };
+            file.write(reinterpret_cast<const char*>(&record), sizeof(record));
+            file.write(eit.second.payload->data(), eit.second.payload->size());
+        }
+        if (!file.flush()) {
+            ASBLog(ERROR) << "Failed to write resume snapshot " << temp_path;
+            return false;
+        }
+    }
+    if (std::rename(temp_path.c_str(), snapshot_path_.c_str()) != 0) {
+        ASBLog(ERROR) << "Failed to replace resume snapshot " << snapshot_path_ << ", " << strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+}  // namespace blackbox2
+}  // namespace msgbus
+}  // namespace asf
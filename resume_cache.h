@@ -0,0 +1,92 @@
+// -----------------------------------------------------------------------
+// |             _     _              _____         _____                |
+// |            |  \  | |            / ____|  /\   |  __ \               |
+// |            | | \ | |  __       | (___   /  \  | |__) |              |
+// |            | |\ \| | /__\|   |  \___ \ / /\ \ |  _  /               |
+// |            | | \ \ ||    |   |   ___) / /__\ \| | \ \               |
+// |            |_|  \_\| \__/ \_/|/|_____/________\_|  \_\              |
+// |                                                                     |
+// -----------------------------------------------------------------------
+// COPYRIGHT
+// -----------------------------------------------------------------------
+//
+// This software is copyright protected and proprietary to Neusoft Reach.
+// Neusoft Reach grants to you only those rights as set out in the license
+// conditions.
+// All other rights remain with Neusoft Reach.
+// -----------------------------------------------------------------------
+
+#ifndef SF_MSGBUS_BLACKBOX2_RESUME_CACHE_H_
+#define SF_MSGBUS_BLACKBOX2_RESUME_CACHE_H_
+
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <cstdint>
+#include <unordered_map>
+#include <condition_variable>
+
+namespace asf {
+namespace msgbus {
+namespace blackbox2 {
+
+// Attach payloads a server keeps by client instance id, a reconnecting
+// client presents the digest of a payload instead of sending it again.
+// With a snapshot file the payloads also survive a restart of the server.
+// Shared by the shards of a server, thread-safe. Expired payloads are
+// dropped and the snapshot is written on a thread of its own, never on a
+// backend thread.
+class ResumeCache {
+ public:
+    using Clock = std::chrono::steady_clock;
+
+    ResumeCache(std::string snapshot_path, std::chrono::seconds ttl);
+    ~ResumeCache();
+
+ public:
+    bool Find(uint64_t instance_id, uint8_t opcode, uint64_t digest, std::string& payload);
+    void Put(uint64_t instance_id, uint8_t opcode, uint64_t digest, const uint8_t* data, size_t size);
+    // The instance is gone, its payload is dropped after the ttl unless the
+    // instance attaches again.
+    void Release(uint64_t instance_id);
+    bool Load();
+    // Maintains the cache every interval until Stop(), which writes the
+    // snapshot a last time.
+    bool Start(std::chrono::milliseconds interval);
+    void Stop();
+    // Drops expired payloads and writes the snapshot if anything changed
+    // since the last one.
+    void Maintain(Clock::time_point now);
+
+ private:
+    // Payloads are shared with the copy being written, never copied.
+    struct Entry {
+        uint8_t opcode;
+        uint64_t digest;
+        std::shared_ptr<const std::string> payload;
+        Clock::time_point expire;
+    };
+    using EntryMap = std::unordered_map<uint64_t, Entry>;
+
+    void MaintainThread(std::chrono::milliseconds interval);
+    bool Save(const EntryMap& entries);
+
+ private:
+    const std::string snapshot_path_;
+    const std::chrono::seconds ttl_;
+    std::mutex mutex_;
+    EntryMap entries_;
+    bool is_dirty_;
+    bool is_saving_;
+    std::condition_variable cond_;
+    bool maintain_run_;
+    std::thread maintain_thread_;
+};
+
+}  // namespace blackbox2
+}  // namespace msgbus
+}  // namespace asf
+
+#endif  // SF_MSGBUS_BLACKBOX2_RESUME_CACHE_H_
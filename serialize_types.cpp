@@ -0,0 +1,114 @@
+// -----------------------------------------------------------------------
+// |             _     _              _____         _____                |
+// |            |  \  | |            / ____|  /\   |  __ \               |
+// |            | | \ | |  __       | (___   /  \  | |__) |              |
+// |            | |\ \| | /__\|   |  \___ \ / /\ \ |  _  /               |
+// |            | | \ \ ||    |   |   ___) / /__\ \| | \ \               |
+// |            |_|  \_\| \__/ \_/|/|_____/________\_|  \_\              |
+// |                                                                     |
+// -----------------------------------------------------------------------
+// COPYRIGHT
+// -----------------------------------------------------------------------
+//
+// This software is copyright protected and proprietary to Neusoft Reach.
+// Neusoft Reach grants to you only those rights as set out in the license
+// conditions.
+// All other rights remain with Neusoft Reach.
+// -----------------------------------------------------------------------
+
+#include <mutex>
+#include <unordered_set>
+
+#include "serialize_types.h"
+
+namespace asf {
+namespace msgbus {
+namespace blackbox2 {
+
+namespace {
+
+constexpr uint32_t kMaxSerializeTypeId = 0xFFFFU;
+
+}
+
+const std::string* InternSerializeType(const std::string& type) {
+    static std::mutex mutex;
+    static std::unordered_set<std::string> types;
+    std::lock_guard<std::mutex> lg(mutex);
+    // Elements of an unordered_set keep their address across rehashing.
+    return &*types.insert(type).first;
+}
+
+// SerializeTypeIds
+
+SerializeTypeIds::SerializeTypeIds()
+    : next_id_(1) {
+}
+
+uint16_t SerializeTypeIds::Find(const std::string& type) const {
+    auto it = ids_.find(type);
+    return (it != ids_.end()) ? it->second : 0;
+}
+
+uint16_t SerializeTypeIds::Add(const std::string& type) {
+    if (next_id_ > kMaxSerializeTypeId) {
+        return 0;
+    }
+    auto id = static_cast<uint16_t>(next_id_++);
+    ids_[type] = id;
+    announced_.resize(next_id_, false);
+    return id;
+}
+
+void SerializeTypeIds::Remove(const std::string& type) {
+    ids_.erase(type);
+}
+
+void SerializeTypeIds::Clear() {
+    ids_.clear();
+    announced_.clear();
+    next_id_ = 1;
+}
+
+// Ids not assigned since the last Clear() are left alone, their
+// acknowledgement is from an earlier receiver.
+void SerializeTypeIds::Announce(uint16_t id) {
+    if (id < announced_.size()) {
+        announced_[id] = true;
+    }
+}
+
+bool SerializeTypeIds::IsAnnounced(uint16_t id) const {
+    return id < announced_.size() && announced_[id];
+}
+
+// SerializeTypeTable
+
+bool SerializeTypeTable::Set(uint16_t id, const std::string& type, std::string dictionary) {
+    if (id == 0) {
+        return false;
+    }
+    if (id >= types_.size()) {
+        types_.resize(id + 1, Entry{ nullptr, std::string() });
+    }
+    types_[id].type = InternSerializeType(type);
+    types_[id].dictionary = std::move(dictionary);
+    return true;
+}
+
+const std::string* SerializeTypeTable::Find(uint16_t id) const {
+    return (id < types_.size()) ? types_[id].type : nullptr;
+}
+
+const std::string& SerializeTypeTable::FindDictionary(uint16_t id) const {
+    static const std::string empty;
+    return (id < types_.size()) ? types_[id].dictionary : empty;
+}
+
+void SerializeTypeTable::Clear() {
+    types_.clear();
+}
+
+}  // namespace blackbox2
+}  // namespace msgbus
+}  // namespace asf
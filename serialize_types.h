@@ -0,0 +1,77 @@
+// -----------------------------------------------------------------------
+// |             _     _              _____         _____                |
+// |            |  \  | |            / ____|  /\   |  __ \               |
+// |            | | \ | |  __       | (___   /  \  | |__) |              |
+// |            | |\ \| | /__\|   |  \___ \ / /\ \ |  _  /               |
+// |            | | \ \ ||    |   |   ___) / /__\ \| | \ \               |
+// |            |_|  \_\| \__/ \_/|/|_____/________\_|  \_\              |
+// |                                                                     |
+// -----------------------------------------------------------------------
+// COPYRIGHT
+// -----------------------------------------------------------------------
+//
+// This software is copyright protected and proprietary to Neusoft Reach.
+// Neusoft Reach grants to you only those rights as set out in the license
+// conditions.
+// All other rights remain with Neusoft Reach.
+// -----------------------------------------------------------------------
+
+#ifndef SF_MSGBUS_BLACKBOX2_SERIALIZE_TYPES_H_
+#define SF_MSGBUS_BLACKBOX2_SERIALIZE_TYPES_H_
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+
+namespace asf {
+namespace msgbus {
+namespace blackbox2 {
+
+// Returns the process wide copy of a serialize type. Interned types are
+// never released, so the pointer stays valid.
+const std::string* InternSerializeType(const std::string& type);
+
+// Sender side ids of the serialize types sent over one connection. Id 0 is
+// never assigned. An id is announced once the receiver has acknowledged it.
+class SerializeTypeIds {
+ public:
+    SerializeTypeIds();
+
+ public:
+    uint16_t Find(const std::string& type) const;
+    uint16_t Add(const std::string& type);
+    void Remove(const std::string& type);
+    void Clear();
+    void Announce(uint16_t id);
+    bool IsAnnounced(uint16_t id) const;
+
+ private:
+    std::unordered_map<std::string, uint16_t> ids_;
+    std::vector<bool> announced_;
+    uint32_t next_id_;
+};
+
+// Receiver side serialize types of one connection and their compression
+// dictionaries, by id.
+class SerializeTypeTable {
+ public:
+    bool Set(uint16_t id, const std::string& type, std::string dictionary = std::string());
+    const std::string* Find(uint16_t id) const;
+    const std::string& FindDictionary(uint16_t id) const;
+    void Clear();
+
+ private:
+    struct Entry {
+        const std::string* type;
+        std::string dictionary;
+    };
+
+    std::vector<Entry> types_;
+};
+
+}  // namespace blackbox2
+}  // namespace msgbus
+}  // namespace asf
+
+#endif  // SF_MSGBUS_BLACKBOX2_SERIALIZE_TYPES_H_
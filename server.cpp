@@ -16,12 +16,15 @@
 // All other rights remain with Neusoft Reach.
 // -----------------------------------------------------------------------
 
+#include <iterator>
 #include <map>
 #include <set>
 #include <list>
 #include <mutex>
 #include <thread>
 #include <vector>
+#include <cstdlib>
+#include <algorithm>
 
 #include <sf-msgbus/types/scope_guard.h>
 #include <sf-msgbus/types/scoped_unlocker.h>
@@ -34,6 +37,7 @@
 #include "executor_proxy_impl.h"
 #include "node_proxy_impl.h"
 #include "handle_proxy_impl.h"
+#include "resume_cache.h"
 
 namespace asf {
 namespace msgbus {
@@ -42,6 +46,48 @@ namespace blackbox2 {
 using namespace std::placeholders;
 using namespace std::chrono_literals;
 
+namespace {
+
+constexpr size_t kMaxShardCount = 64;
+constexpr std::chrono::seconds kResumeTtl{ 600 };
+constexpr std::chrono::milliseconds kResumeMaintainInterval{ 1000 };
+constexpr std::chrono::seconds kOrphanTimeout{ 30 };
+constexpr std::chrono::milliseconds kOrphanCheckInterval{ 10000 };
+constexpr std::chrono::milliseconds kCompressionReportInterval{ 60000 };
+
+// Each shard is a context with its own ENet host and thread, they share the
+// port through SO_REUSEPORT.
+size_t GetShardCount() {
+    const char* env_shards = getenv("SF_MSGBUS_BLACKBOX2_SERVER_SHARDS");
+    if (env_shards == nullptr || atoi(env_shards) <= 1) {
+        return 1;
+    }
+#ifdef SO_REUSEPORT
+    return std::min<size_t>(atoi(env_shards), kMaxShardCount);
+#else
+    ASBLog(WARNING) << "Sharded server needs SO_REUSEPORT, only one shard is started.";
+    return 1;
+#endif
+}
+
+// Attach payloads of the clients, kept across restarts in the file named by
+// SF_MSGBUS_BLACKBOX2_RESUME_SNAPSHOT if it is set.
+std::shared_ptr<ResumeCache> CreateResumeCache() {
+    const char* env_snapshot = getenv("SF_MSGBUS_BLACKBOX2_RESUME_SNAPSHOT");
+    auto resume_cache = std::make_shared<ResumeCache>((env_snapshot != nullptr) ? env_snapshot : "", kResumeTtl);
+    resume_cache->Load();
+    return resume_cache;
+}
+
+// Clients of kAttachBatch pick the instance ids, the endpoint stands for the
+// instance otherwise.
+uint64_t GetInstanceId(Context::RequestContext& request_context) {
+    auto instance_id = request_context.GetInstanceId();
+    return (instance_id != 0) ? instance_id : reinterpret_cast<uint64_t>(request_context.GetEndpoint());
+}
+
+}
+
 class Server::Impl final {
  public:
     Impl(const std::string& host, uint16_t port,
@@ -71,25 +117,54 @@ class Server::Impl final {
             enet_address_set_host(&enet_address, host_.c_str());
         }
 
-        auto context = std::make_shared<Context>();
-        if (!context->StartAsServer(std::bind(&Impl::HandleConnect, this, _1))) {
-            return false;
+        auto shard_count = GetShardCount();
+        std::vector<std::shared_ptr<Context>> contexts;
+        auto contexts_guard = MakeScopeGuard([&contexts] {
+            for (auto& context: contexts) {
+                context->Stop();
+            }
+        });
+        auto resume_cache = CreateResumeCache();
+        for (size_t i = 0; i < shard_count; ++i) {
+            auto context = std::make_shared<Context>();
+            context->SetResumeCache(resume_cache);
+            if (!context->StartAsServer(std::bind(&Impl::HandleConnect, this, context.get(), _1), nullptr, shard_count > 1)) {
+                return false;
+            }
+            contexts.push_back(std::move(context));
+        }
+        contexts_guard.Dismiss();
+        contexts.front()->Schedule(kOrphanCheckInterval, std::bind(&Impl::CheckOrphans, this), kOrphanCheckInterval);
+        contexts.front()->Schedule(kCompressionReportInterval, std::bind(&Impl::ReportCompression, this),
+                                   kCompressionReportInterval);
+        resume_cache->Start(kResumeMaintainInterval);
+        resume_cache_ = std::move(resume_cache);
+        // Clients on this host may connect through a local link instead.
+        if (!contexts.front()->ListenLocal()) {
+            ASBLog(WARNING) << "Server " << this << ": local links are not available.";
         }
 
-        context_ = context;
+        contexts_ = std::move(contexts);
+        ASBLog(INFO) << "Server " << this << ": " << shard_count << " shards started.";
 
         return true;
     }
 
     void Stop() {
-        std::shared_ptr<Context> context;
+        std::vector<std::shared_ptr<Context>> contexts;
+        std::shared_ptr<ResumeCache> resume_cache;
         {
             std::lock_guard<std::mutex> lg(mutex_);
-            context = context_;
-            context_.reset();
+            contexts.swap(contexts_);
+            resume_cache.swap(resume_cache_);
         }
         ASBLog(INFO) << "Server " << this << ": Stopping blackbox server...";
-        context->Stop();
+        for (auto& context: contexts) {
+            context->Stop();
+        }
+        if (resume_cache) {
+            resume_cache->Stop();
+        }
     }
 
     std::vector<std::shared_ptr<ProcessProxy>> GetProcesses() const {
@@ -103,26 +178,28 @@ class Server::Impl final {
     }
 
  private:
-    void HandleConnect(ENetPeer* enet_peer) {
-        ASBLog(INFO) << "New peer " << enet_peer;
+    // A client's objects share its peer, so they all live in the shard of its
+    // process and the maps below are shared by the shards.
+    void HandleConnect(Context* context, Endpoint* endpoint) {
+        ASBLog(INFO) << "New endpoint " << endpoint << " of peer " << endpoint->enet_peer;
         std::lock_guard<std::mutex> lg(mutex_);
-        context_->RegisterRequestHandler(enet_peer, protocol::Opcode::kAttachProcess,
+        context->RegisterRequestHandler(endpoint, protocol::Opcode::kAttachProcess,
                                          std::bind(&Impl::HandleAttachProcess, this, std::placeholders::_1));
-        context_->RegisterRequestHandler(enet_peer, protocol::Opcode::kAttachChannel,
+        context->RegisterRequestHandler(endpoint, protocol::Opcode::kAttachChannel,
                                          std::bind(&Impl::HandleAttachChannel, this, std::placeholders::_1));
-        context_->RegisterRequestHandler(enet_peer, protocol::Opcode::kAttachExecutor,
+        context->RegisterRequestHandler(endpoint, protocol::Opcode::kAttachExecutor,
                                          std::bind(&Impl::HandleAttachExecutor, this, std::placeholders::_1));
-        context_->RegisterRequestHandler(enet_peer, protocol::Opcode::kAttachNode,
+        context->RegisterRequestHandler(endpoint, protocol::Opcode::kAttachNode,
                                          std::bind(&Impl::HandleAttachNode, this, std::placeholders::_1));
-        context_->RegisterRequestHandler(enet_peer, protocol::Opcode::kAttachHandle,
+        context->RegisterRequestHandler(endpoint, protocol::Opcode::kAttachHandle,
                                          std::bind(&Impl::HandleAttachHandle, this, std::placeholders::_1));
     }
 
     bool HandleAttachProcess(Context::RequestContext& request_context) {
         ASBLog(INFO) << "New process attaching...";
         std::lock_guard<std::mutex> lg(mutex_);
-        auto enet_peer = request_context.GetENetPeer();
-        auto it = process_proxy_map_.find(enet_peer);
+        auto endpoint = request_context.GetEndpoint();
+        auto it = process_proxy_map_.find(endpoint);
         if (it != process_proxy_map_.end()) {
             ASBLog(ERROR) << "Duplicated process attched.";
             request_context.SetResponse(Result::kExisted);
@@ -134,11 +211,18 @@ class Server::Impl final {
             request_context.SetResponse(Result::kDeserializeError);
             return false;
         }
-        auto process_proxy_impl = std::make_shared<ProcessProxyImpl>(context_, enet_peer, std::move(protocol_process));
-        auto connection = process_proxy_impl->OnDisconnected.connect([this, enet_peer] {
+        auto instance_id = GetInstanceId(request_context);
+        if (!CanBindInstance(request_context, instance_id)) {
+            ASBLog(ERROR) << "Attach process with instance " << instance_id << " of another endpoint.";
+            request_context.SetResponse(Result::kExisted);
+            return false;
+        }
+        auto process_proxy_impl = std::make_shared<ProcessProxyImpl>(request_context.GetContext(), endpoint, std::move(protocol_process));
+        auto connection = process_proxy_impl->OnDisconnected.connect([this, endpoint, instance_id] {
             std::lock_guard<std::mutex> lg(mutex_);
-            ASBLog(INFO) << "Process " << enet_peer << " disconnected, removing...";
-            auto it = process_proxy_map_.find(enet_peer);
+            ASBLog(INFO) << "Process " << endpoint << " disconnected, removing...";
+            RemoveInstance(instance_id, endpoint);
+            auto it = process_proxy_map_.find(endpoint);
             if (it != process_proxy_map_.end()) {
                 auto process_proxy = it->second.first;
                 process_proxy_map_.erase(it);
@@ -146,11 +230,13 @@ class Server::Impl final {
                 on_process_removed_(process_proxy);
             }
         });
-        process_proxy_map_.emplace(enet_peer, std::make_pair(process_proxy_impl, connection));
+        process_proxy_map_.emplace(endpoint, std::make_pair(process_proxy_impl, connection));
+        instances_.emplace(instance_id, endpoint);
         protocol::AttachResponse protocol_attach_response;
         protocol_attach_response.set_is_activated(process_proxy_impl->IsActivated());
-        protocol_attach_response.mutable_instance()->set_id(reinterpret_cast<uint64_t>(enet_peer));
+        protocol_attach_response.mutable_instance()->set_id(instance_id);
         request_context.SetResponse(Result::kOk, &protocol_attach_response);
+        AdoptOrphans(instance_id);
         ScopedUnlocker<std::mutex> unlocker(mutex_);
         on_process_added_(process_proxy_impl);
         ASBLog(INFO) << "New process attached: " << process_proxy_impl->GetName() << "[" << process_proxy_impl->GetPid() << "]";
@@ -160,8 +246,8 @@ class Server::Impl final {
     bool HandleAttachChannel(Context::RequestContext& request_context) {
         ASBLog(INFO) << "New channel attaching...";
         std::lock_guard<std::mutex> lg(mutex_);
-        auto enet_peer = request_context.GetENetPeer();
-        auto it = channel_proxy_map_.find(enet_peer);
+        auto endpoint = request_context.GetEndpoint();
+        auto it = channel_proxy_map_.find(endpoint);
         if (it != channel_proxy_map_.end()) {
             ASBLog(ERROR) << "Duplicated channel attached.";
             request_context.SetResponse(Result::kExisted);
@@ -173,33 +259,33 @@ class Server::Impl final {
             request_context.SetResponse(Result::kDeserializeError);
             return false;
         }
-        ENetPeer* process_enet_peer = reinterpret_cast<ENetPeer*>(protocol_channel.owner_process().id());
-        if (process_enet_peer == nullptr) {
-            ASBLog(ERROR) << "Attach channel with invalid process.";
-            request_context.SetResponse(Result::kInvalidParameter);
-            return false;
-        }
-        auto pit = process_proxy_map_.find(process_enet_peer);
-        if (pit == process_proxy_map_.end()) {
+        auto owner_id = protocol_channel.owner_process().id();
+        auto process_proxy = FindProcessProxy(owner_id);
+        if (!process_proxy && !IsClientInstance(owner_id)) {
             ASBLog(ERROR) << "Attach channel with unknown process.";
             request_context.SetResponse(Result::kInvalidParameter);
             return false;
         }
-        auto channel_proxy_impl = std::make_shared<ChannelProxyImpl>(context_, enet_peer, std::move(protocol_channel));
-        auto connection = channel_proxy_impl->OnDisconnected.connect([this, enet_peer] {
+        auto channel_proxy_impl = std::make_shared<ChannelProxyImpl>(request_context.GetContext(), endpoint, std::move(protocol_channel));
+        auto connection = channel_proxy_impl->OnDisconnected.connect([this, endpoint] {
             std::lock_guard<std::mutex> lg(mutex_);
-            ASBLog(INFO) << "Channel " << enet_peer << " disconnected, removing...";
-            auto it = channel_proxy_map_.find(enet_peer);
+            ASBLog(INFO) << "Channel " << endpoint << " disconnected, removing...";
+            RemoveOrphan(endpoint);
+            auto it = channel_proxy_map_.find(endpoint);
             if (it != channel_proxy_map_.end()) {
                 channel_proxy_map_.erase(it);
             }
         });
-        channel_proxy_map_.emplace(enet_peer, std::make_pair(channel_proxy_impl, connection));
+        channel_proxy_map_.emplace(endpoint, std::make_pair(channel_proxy_impl, connection));
         protocol::AttachResponse protocol_attach_response;
         protocol_attach_response.set_is_activated(channel_proxy_impl->IsActivated());
-        protocol_attach_response.mutable_instance()->set_id(reinterpret_cast<uint64_t>(enet_peer));
+        protocol_attach_response.mutable_instance()->set_id(GetInstanceId(request_context));
         request_context.SetResponse(Result::kOk, &protocol_attach_response);
-        pit->second.first->AddChannelProxy(channel_proxy_impl);
+        if (process_proxy) {
+            process_proxy->AddChannelProxy(channel_proxy_impl);
+        } else {
+            AddOrphan(owner_id, endpoint);
+        }
         ASBLog(INFO) << "New channel attached: " << channel_proxy_impl->GetId();
         return true;
     }
@@ -207,8 +293,8 @@ class Server::Impl final {
     bool HandleAttachExecutor(Context::RequestContext& request_context) {
         ASBLog(INFO) << "New executor attaching...";
         std::lock_guard<std::mutex> lg(mutex_);
-        auto enet_peer = request_context.GetENetPeer();
-        auto it = executor_proxy_map_.find(enet_peer);
+        auto endpoint = request_context.GetEndpoint();
+        auto it = executor_proxy_map_.find(endpoint);
         if (it != executor_proxy_map_.end()) {
             ASBLog(ERROR) << "Duplicated executor attached.";
             request_context.SetResponse(Result::kExisted);
@@ -220,39 +306,33 @@ class Server::Impl final {
             request_context.SetResponse(Result::kDeserializeError);
             return false;
         }
-        auto id = protocol_executor.owner_process().id();
-        if (id == 0) {
-            ASBLog(ERROR) << "Attach executor with invalid process id.";
-            request_context.SetResponse(Result::kInvalidParameter);
-            return false;
-        }
-        ENetPeer* process_enet_peer = reinterpret_cast<ENetPeer*>(protocol_executor.owner_process().id());
-        if (process_enet_peer == nullptr) {
-            ASBLog(ERROR) << "Attach executor with invalid process.";
-            request_context.SetResponse(Result::kInvalidParameter);
-            return false;
-        }
-        auto pit = process_proxy_map_.find(process_enet_peer);
-        if (pit == process_proxy_map_.end()) {
+        auto owner_id = protocol_executor.owner_process().id();
+        auto process_proxy = FindProcessProxy(owner_id);
+        if (!process_proxy && !IsClientInstance(owner_id)) {
             ASBLog(ERROR) << "Attach executor with unknown process.";
             request_context.SetResponse(Result::kInvalidParameter);
             return false;
         }
-        auto executor_proxy_impl = std::make_shared<ExecutorProxyImpl>(context_, enet_peer, std::move(protocol_executor));
-        auto connection = executor_proxy_impl->OnDisconnected.connect([this, enet_peer] {
-            ASBLog(INFO) << "Executor " << enet_peer << " disconnected, removing...";
+        auto executor_proxy_impl = std::make_shared<ExecutorProxyImpl>(request_context.GetContext(), endpoint, std::move(protocol_executor));
+        auto connection = executor_proxy_impl->OnDisconnected.connect([this, endpoint] {
+            ASBLog(INFO) << "Executor " << endpoint << " disconnected, removing...";
             std::lock_guard<std::mutex> lg(mutex_);
-            auto it = executor_proxy_map_.find(enet_peer);
+            RemoveOrphan(endpoint);
+            auto it = executor_proxy_map_.find(endpoint);
             if (it != executor_proxy_map_.end()) {
                 executor_proxy_map_.erase(it);
             }
         });
-        executor_proxy_map_.emplace(enet_peer, std::make_pair(executor_proxy_impl, connection));
+        executor_proxy_map_.emplace(endpoint, std::make_pair(executor_proxy_impl, connection));
         protocol::AttachResponse protocol_attach_response;
         protocol_attach_response.set_is_activated(executor_proxy_impl->IsActivated());
-        protocol_attach_response.mutable_instance()->set_id(reinterpret_cast<uint64_t>(enet_peer));
+        protocol_attach_response.mutable_instance()->set_id(GetInstanceId(request_context));
         request_context.SetResponse(Result::kOk, &protocol_attach_response);
-        pit->second.first->AddExecutorProxy(executor_proxy_impl);
+        if (process_proxy) {
+            process_proxy->AddExecutorProxy(executor_proxy_impl);
+        } else {
+            AddOrphan(owner_id, endpoint);
+        }
         ASBLog(INFO) << "New executor attached.";
         return true;
     }
@@ -260,8 +340,8 @@ class Server::Impl final {
     bool HandleAttachNode(Context::RequestContext& request_context) {
         ASBLog(INFO) << "New node attaching...";
         std::lock_guard<std::mutex> lg(mutex_);
-        auto enet_peer = request_context.GetENetPeer();
-        auto it = node_proxy_map_.find(enet_peer);
+        auto endpoint = request_context.GetEndpoint();
+        auto it = node_proxy_map_.find(endpoint);
         if (it != node_proxy_map_.end()) {
             ASBLog(ERROR) << "Duplicated node attached.";
             request_context.SetResponse(Result::kExisted);
@@ -273,33 +353,42 @@ class Server::Impl final {
             request_context.SetResponse(Result::kDeserializeError);
             return false;
         }
-        ENetPeer* process_enet_peer = reinterpret_cast<ENetPeer*>(protocol_node.owner_process().id());
-        if (process_enet_peer == nullptr) {
-            ASBLog(ERROR) << "Attach node with invalid process.";
+        auto owner_id = protocol_node.owner_process().id();
+        auto process_proxy = FindProcessProxy(owner_id);
+        if (!process_proxy && !IsClientInstance(owner_id)) {
+            ASBLog(ERROR) << "Attach node with unknown process.";
             request_context.SetResponse(Result::kInvalidParameter);
             return false;
         }
-        auto pit = process_proxy_map_.find(process_enet_peer);
-        if (pit == process_proxy_map_.end()) {
-            ASBLog(ERROR) << "Attach node with unknown process.";
-            request_context.SetResponse(Result::kInvalidParameter);
+        auto instance_id = GetInstanceId(request_context);
+        if (!CanBindInstance(request_context, instance_id)) {
+            ASBLog(ERROR) << "Attach node with instance " << instance_id << " of another endpoint.";
+            request_context.SetResponse(Result::kExisted);
             return false;
         }
-        auto node_proxy_impl = std::make_shared<NodeProxyImpl>(context_, enet_peer, std::move(protocol_node));
-        auto connection = node_proxy_impl->OnDisconnected.connect([this, enet_peer] {
-            ASBLog(INFO) << "Node " << enet_peer << " disconnected, removing...";
+        auto node_proxy_impl = std::make_shared<NodeProxyImpl>(request_context.GetContext(), endpoint, std::move(protocol_node));
+        auto connection = node_proxy_impl->OnDisconnected.connect([this, endpoint, instance_id] {
+            ASBLog(INFO) << "Node " << endpoint << " disconnected, removing...";
             std::lock_guard<std::mutex> lg(mutex_);
-            auto it = node_proxy_map_.find(enet_peer);
+            RemoveInstance(instance_id, endpoint);
+            RemoveOrphan(endpoint);
+            auto it = node_proxy_map_.find(endpoint);
             if (it != node_proxy_map_.end()) {
                 node_proxy_map_.erase(it);
             }
         });
-        node_proxy_map_.emplace(enet_peer, std::make_pair(node_proxy_impl, connection));
+        node_proxy_map_.emplace(endpoint, std::make_pair(node_proxy_impl, connection));
+        instances_.emplace(instance_id, endpoint);
         protocol::AttachResponse protocol_attach_response;
         protocol_attach_response.set_is_activated(node_proxy_impl->IsActivated());
-        protocol_attach_response.mutable_instance()->set_id(reinterpret_cast<uint64_t>(enet_peer));
+        protocol_attach_response.mutable_instance()->set_id(instance_id);
         request_context.SetResponse(Result::kOk, &protocol_attach_response);
-        pit->second.first->AddNodeProxy(node_proxy_impl);
+        if (process_proxy) {
+            process_proxy->AddNodeProxy(node_proxy_impl);
+        } else {
+            AddOrphan(owner_id, endpoint);
+        }
+        AdoptOrphans(instance_id);
         ASBLog(INFO) << "New node attached: " << node_proxy_impl->GetName();
         return true;
     }
@@ -307,8 +396,8 @@ class Server::Impl final {
     bool HandleAttachHandle(Context::RequestContext& request_context) {
         ASBLog(INFO) << "New handle attaching...";
         std::lock_guard<std::mutex> lg(mutex_);
-        auto enet_peer = request_context.GetENetPeer();
-        auto it = handle_proxy_map_.find(enet_peer);
+        auto endpoint = request_context.GetEndpoint();
+        auto it = handle_proxy_map_.find(endpoint);
         if (it != handle_proxy_map_.end()) {
             ASBLog(ERROR) << "Duplicated handle attached.";
             request_context.SetResponse(Result::kExisted);
@@ -320,58 +409,185 @@ class Server::Impl final {
             request_context.SetResponse(Result::kDeserializeError);
             return false;
         }
-        ENetPeer* node_enet_peer = reinterpret_cast<ENetPeer*>(protocol_handle.owner_node().id());
-        if (node_enet_peer == nullptr) {
-            ASBLog(ERROR) << "Attach handle with invalid node.";
-            request_context.SetResponse(Result::kInvalidParameter);
-            return false;
-        }
-        auto nit = node_proxy_map_.find(node_enet_peer);
-        if (nit == node_proxy_map_.end()) {
+        auto owner_id = protocol_handle.owner_node().id();
+        auto node_proxy = FindNodeProxy(owner_id);
+        if (!node_proxy && !IsClientInstance(owner_id)) {
             ASBLog(ERROR) << "Attach handle with unknown node.";
             request_context.SetResponse(Result::kInvalidParameter);
             return false;
         }
-        auto handle_proxy_impl = std::make_shared<HandleProxyImpl>(context_, enet_peer, std::move(protocol_handle));
-        auto connection = handle_proxy_impl->OnDisconnected.connect([this, enet_peer] {
-            ASBLog(INFO) << "Handle " << enet_peer << " disconnected, removing...";
+        auto handle_proxy_impl = std::make_shared<HandleProxyImpl>(request_context.GetContext(), endpoint, std::move(protocol_handle));
+        auto connection = handle_proxy_impl->OnDisconnected.connect([this, endpoint] {
+            ASBLog(INFO) << "Handle " << endpoint << " disconnected, removing...";
             std::lock_guard<std::mutex> lg(mutex_);
-            auto it = handle_proxy_map_.find(enet_peer);
+            RemoveOrphan(endpoint);
+            auto it = handle_proxy_map_.find(endpoint);
             if (it != handle_proxy_map_.end()) {
                 handle_proxy_map_.erase(it);
             }
         });
-        handle_proxy_map_.emplace(enet_peer, std::make_pair(handle_proxy_impl, connection));
+        handle_proxy_map_.emplace(endpoint, std::make_pair(handle_proxy_impl, connection));
         protocol::AttachResponse protocol_attach_response;
         protocol_attach_response.set_is_activated(handle_proxy_impl->IsActivated());
-        protocol_attach_response.mutable_instance()->set_id(reinterpret_cast<uint64_t>(enet_peer));
+        protocol_attach_response.mutable_instance()->set_id(GetInstanceId(request_context));
         request_context.SetResponse(Result::kOk, &protocol_attach_response);
-        nit->second.first->AddHandleProxy(handle_proxy_impl);
+        if (node_proxy) {
+            node_proxy->AddHandleProxy(handle_proxy_impl);
+        } else {
+            AddOrphan(owner_id, endpoint);
+        }
         ASBLog(INFO) << "New handle attached: " << HandleTypeName(handle_proxy_impl->GetType()) << ", [" << handle_proxy_impl->GetKey() << "]";
         return true;
     }
 
+    static bool IsClientInstance(uint64_t instance_id) {
+        return (instance_id & protocol::kClientInstanceBit) != 0;
+    }
+
+    std::shared_ptr<ProcessProxyImpl> FindProcessProxy(uint64_t instance_id) {
+        auto iit = instances_.find(instance_id);
+        if (iit == instances_.end()) {
+            return nullptr;
+        }
+        auto pit = process_proxy_map_.find(iit->second);
+        return (pit != process_proxy_map_.end()) ? pit->second.first : nullptr;
+    }
+
+    std::shared_ptr<NodeProxyImpl> FindNodeProxy(uint64_t instance_id) {
+        auto iit = instances_.find(instance_id);
+        if (iit == instances_.end()) {
+            return nullptr;
+        }
+        auto nit = node_proxy_map_.find(iit->second);
+        return (nit != node_proxy_map_.end()) ? nit->second.first : nullptr;
+    }
+
+    // Client picked ids carry kClientInstanceBit, so they never meet the ids
+    // of endpoints. An id stays with its endpoint until that is gone, a
+    // reconnecting client is refused until the server has dropped its old
+    // endpoint and retries.
+    bool CanBindInstance(Context::RequestContext& request_context, uint64_t instance_id) {
+        if (request_context.GetInstanceId() != 0 && !IsClientInstance(instance_id)) {
+            return false;
+        }
+        auto iit = instances_.find(instance_id);
+        return (iit == instances_.end() || iit->second == request_context.GetEndpoint());
+    }
+
+    void RemoveInstance(uint64_t instance_id, Endpoint* endpoint) {
+        auto iit = instances_.find(instance_id);
+        if (iit != instances_.end() && iit->second == endpoint) {
+            instances_.erase(iit);
+        }
+    }
+
+    // Hands the objects that attached before their owner over to it.
+    void AdoptOrphans(uint64_t owner_id) {
+        auto range = orphans_.equal_range(owner_id);
+        if (range.first == range.second) {
+            return;
+        }
+        auto process_proxy = FindProcessProxy(owner_id);
+        auto node_proxy = FindNodeProxy(owner_id);
+        for (auto it = range.first; it != range.second; ++it) {
+            auto endpoint = it->second.endpoint;
+            auto cit = channel_proxy_map_.find(endpoint);
+            auto eit = executor_proxy_map_.find(endpoint);
+            auto nit = node_proxy_map_.find(endpoint);
+            auto hit = handle_proxy_map_.find(endpoint);
+            if (process_proxy && cit != channel_proxy_map_.end()) {
+                process_proxy->AddChannelProxy(cit->second.first);
+            } else if (process_proxy && eit != executor_proxy_map_.end()) {
+                process_proxy->AddExecutorProxy(eit->second.first);
+            } else if (process_proxy && nit != node_proxy_map_.end()) {
+                process_proxy->AddNodeProxy(nit->second.first);
+            } else if (node_proxy && hit != handle_proxy_map_.end()) {
+                node_proxy->AddHandleProxy(hit->second.first);
+            }
+        }
+        ASBLog(INFO) << "Instance " << owner_id << " adopted " << std::distance(range.first, range.second) << " orphans.";
+        orphans_.erase(range.first, range.second);
+    }
+
+    void AddOrphan(uint64_t owner_id, Endpoint* endpoint) {
+        orphans_.emplace(owner_id, Orphan{ endpoint, std::chrono::steady_clock::now(), false });
+    }
+
+    void RemoveOrphan(Endpoint* endpoint) {
+        for (auto it = orphans_.begin(); it != orphans_.end(); ++it) {
+            if (it->second.endpoint == endpoint) {
+                orphans_.erase(it);
+                return;
+            }
+        }
+    }
+
+    // An owner that never attaches leaves its objects out of the tree until
+    // they disconnect, each is reported once.
+    void CheckOrphans() {
+        std::lock_guard<std::mutex> lg(mutex_);
+        auto now = std::chrono::steady_clock::now();
+        for (auto& oit: orphans_) {
+            if (!oit.second.is_reported && now - oit.second.since >= kOrphanTimeout) {
+                oit.second.is_reported = true;
+                ASBLog(WARNING) << "Endpoint " << oit.second.endpoint << " still waits for its owner " << oit.first
+                                << " after " << kOrphanTimeout.count() << " s.";
+            }
+        }
+    }
+
+    // Channels that decompressed messages since the last report, with their
+    // totals since they attached.
+    void ReportCompression() {
+        std::lock_guard<std::mutex> lg(mutex_);
+        std::map<Endpoint*, uint64_t> counts;
+        for (auto& cit: channel_proxy_map_) {
+            auto& channel_proxy = cit.second.first;
+            auto stats = channel_proxy->GetCompressionStats();
+            counts.emplace(cit.first, stats.count);
+            auto rit = compression_counts_.find(cit.first);
+            if (stats.count == 0 || (rit != compression_counts_.end() && rit->second == stats.count)) {
+                continue;
+            }
+            ASBLog(INFO) << "Channel " << channel_proxy->GetId() << " decompressed " << stats.count << " messages, "
+                         << stats.packed_bytes << " -> " << stats.raw_bytes << " bytes, ratio "
+                         << static_cast<double>(stats.raw_bytes) / stats.packed_bytes << ", "
+                         << std::chrono::duration_cast<std::chrono::microseconds>(stats.time).count() << " us.";
+        }
+        compression_counts_.swap(counts);
+    }
+
 private:
     using ProcessInfo = std::pair<std::shared_ptr<ProcessProxyImpl>, scoped_connection>;
-    using ProcessProxyMap = std::map<ENetPeer*, ProcessInfo>;
+    using ProcessProxyMap = std::map<Endpoint*, ProcessInfo>;
 
     using ChannelInfo = std::pair<std::shared_ptr<ChannelProxyImpl>, scoped_connection>;
-    using ChannelProxyMap = std::map<ENetPeer*, ChannelInfo>;
+    using ChannelProxyMap = std::map<Endpoint*, ChannelInfo>;
 
     using ExecutorInfo = std::pair<std::shared_ptr<ExecutorProxyImpl>, scoped_connection>;
-    using ExecutorProxyMap = std::map<ENetPeer*, ExecutorInfo>;
+    using ExecutorProxyMap = std::map<Endpoint*, ExecutorInfo>;
 
     using NodeInfo = std::pair<std::shared_ptr<NodeProxyImpl>, scoped_connection>;
-    using NodeProxyMap = std::map<ENetPeer*, NodeInfo>;
+    using NodeProxyMap = std::map<Endpoint*, NodeInfo>;
 
     using HandleInfo = std::pair<std::shared_ptr<HandleProxyImpl>, scoped_connection>;
-    using HandleProxyMap = std::map<ENetPeer*, HandleInfo>;
+    using HandleProxyMap = std::map<Endpoint*, HandleInfo>;
+
+    using InstanceMap = std::map<uint64_t, Endpoint*>;
+    struct Orphan {
+        Endpoint* endpoint;
+        std::chrono::steady_clock::time_point since;
+        bool is_reported;
+    };
+    // Objects waiting for their owner, by the instance id of the owner.
+    using OrphanMap = std::multimap<uint64_t, Orphan>;
 
  private:
     mutable std::mutex mutex_;
     signal<std::shared_ptr<ProcessProxy>>& on_process_added_;
     signal<std::shared_ptr<ProcessProxy>>& on_process_removed_;
-    std::shared_ptr<Context> context_;
+    std::vector<std::shared_ptr<Context>> contexts_;
+    std::shared_ptr<ResumeCache> resume_cache_;
     std::string host_;
     uint16_t port_;
     ProcessProxyMap process_proxy_map_;
@@ -379,6 +595,10 @@ private:
     ExecutorProxyMap executor_proxy_map_;
     NodeProxyMap node_proxy_map_;
     HandleProxyMap handle_proxy_map_;
+    InstanceMap instances_;
+    OrphanMap orphans_;
+    // Messages decompressed by each channel at the last compression report.
+    std::map<Endpoint*, uint64_t> compression_counts_;
 };
 
 // Server
@@ -33,8 +33,30 @@ namespace asf {
 namespace msgbus {
 namespace blackbox2 {
 
+// Instance id a stub attaches with. The client picks it, so children name
+// their owner before the owner has attached and the whole tree attaches at
+// once.
+class AssignedInstanceId {
+ public:
+    AssignedInstanceId()
+        : assigned_instance_id_(protocol::CreateInstanceId()) {
+    }
+
+    uint64_t GetAssignedInstanceId() const {
+        return assigned_instance_id_;
+    }
+
+    static uint64_t Of(const Stub* stub) {
+        auto assigned = dynamic_cast<const AssignedInstanceId*>(stub);
+        return (assigned != nullptr) ? assigned->GetAssignedInstanceId() : stub->GetInstanceId();
+    }
+
+ private:
+    const uint64_t assigned_instance_id_;
+};
+
 template <typename T>
-class StubImpl: public Object<T> {
+class StubImpl: public Object<T>, public AssignedInstanceId {
     static_assert(std::is_base_of<Stub, T>::value);
 
  public:
@@ -47,16 +69,16 @@ class StubImpl: public Object<T> {
         , attach_payload_(attach_payload)
         , is_activated_(true)
         , parent_(parent)
+        , is_attaching_(false)
         , instance_id_(0) {
         Object<T>::RegisterEventHandler(protocol::Opcode::kActivate,
             std::bind(&StubImpl::ActivateHandler, this, std::placeholders::_1));
         if (parent_ != nullptr) {
             parent_instance_id_changed_connection_ = parent_->OnInstanceIdChanged.connect([this](uint64_t id) {
                 std::lock_guard<std::mutex> lg(Object<T>::GetMutex());
-                HandleParentInstanceIdChanged(id);
                 if (id > 0) {
                     ASBLog(INFO) << this << ": parent ready.";
-                    TryToAttach();
+                    HandleParentInstanceIdChanged(id);
                 }
             });
         }
@@ -115,7 +137,8 @@ protected:
         return Object<T>::SendEvent(opcode);
     }
 
-    bool SendEvent(protocol::Opcode opcode, const google::protobuf::Message& payload) {
+    bool SendEvent(protocol::Opcode opcode, const google::protobuf::Message& payload,
+                   protocol::Delivery delivery = protocol::Delivery::kReliable) {
         if (parent_ != nullptr && parent_->GetInstanceId() == 0) {
             //ASBLog(ERROR) << this << ": parent stub is not ready.";
             return false;
@@ -124,7 +147,18 @@ protected:
             //ASBLog(ERROR) << this << ": Cannot send event " << static_cast<uint8_t>(opcode) << ", not activated.";
             return false;
         }
-        return Object<T>::SendEvent(opcode, payload);
+        return Object<T>::SendEvent(opcode, payload, delivery);
+    }
+
+    bool SendEvent(protocol::Opcode opcode, const void* meta, size_t meta_size, const ByteArray& bytes,
+                   protocol::Delivery delivery = protocol::Delivery::kReliable) {
+        if (parent_ != nullptr && parent_->GetInstanceId() == 0) {
+            return false;
+        }
+        if (!is_activated_) {
+            return false;
+        }
+        return Object<T>::SendEvent(opcode, meta, meta_size, bytes, delivery);
     }
 
     bool SendRequest(protocol::Opcode opcode, typename Object<T>::RequestCallback cb) {
@@ -154,13 +188,9 @@ protected:
  protected:
     void HandleConnectionLost() override {
         ASBLog(INFO) << this << ": disconnected.";
+        is_attaching_ = false;
         SetInstanceId(0);
-        if (connector_) {
-            ASBLog(INFO) << this << ": retry...";
-            connector_();
-        } else {
-            ASBLog(INFO) << this << ": not started, no retry";
-        }
+        RetryConnect();
     }
 
     virtual void HandleAttached() {
@@ -180,39 +210,55 @@ protected:
     }
 
     void ConnectCallback(Result result) {
-        //ASBLog(INFO) << "Peer " << Object<T>::GetENetPeer() << " connect callback, result " << static_cast<int>(result);
+        //ASBLog(INFO) << "Peer " << Object<T>::GetEndpoint() << " connect callback, result " << static_cast<int>(result);
         if (result != Result::kOk) {
             //ASBLog(ERROR) << this << ": connect failed: " << static_cast<int>(result);
-            if (connector_) {
-                //ASBLog(INFO) << this << ": retry...";
-                connector_();
-            } else {
-                ASBLog(INFO) << this << ": not started.";
-            }
+            RetryConnect();
         } else {
             TryToAttach();
         }
     }
 
-    void TryToAttach() {
-        if (parent_ != nullptr && parent_->GetInstanceId() == 0) {
-            ASBLog(ERROR) << Object<T>::GetENetPeer() << ": attach: parent is not ready.";
+    // The stubs of the process reconnect together, backing off while the
+    // server is away.
+    void RetryConnect() {
+        if (!connector_) {
+            ASBLog(INFO) << this << ": not started, no retry";
             return;
         }
+        ASBLog(INFO) << this << ": retry...";
+        auto wp = this->weak_from_this();
+        Object<T>::GetContext()->RetryLater([this, wp] {
+            auto p = wp.lock();
+            if (p) {
+                std::lock_guard<std::mutex> lg(Object<T>::GetMutex());
+                if (connector_) {
+                    connector_();
+                }
+            }
+        });
+    }
+
+    // The server holds a child whose parent has not attached yet until the
+    // parent does, so the child does not wait for it.
+    void TryToAttach() {
         if (instance_id_ > 0) {
-            ASBLog(WARNING) << Object<T>::GetENetPeer() << ": attach: already attached.";
+            ASBLog(WARNING) << Object<T>::GetEndpoint() << ": attach: already attached.";
+            return;
+        }
+        if (is_attaching_) {
+            ASBLog(INFO) << Object<T>::GetEndpoint() << ": attach: already attaching.";
             return;
         }
-        ASBLog(INFO) << Object<T>::GetENetPeer() << ": attaching...";
-        bool ret = Object<T>::SendRequest(attach_opcode_, attach_payload_,
+        ASBLog(INFO) << Object<T>::GetEndpoint() << ": attaching...";
+        bool ret = Object<T>::SendAttach(GetAssignedInstanceId(), attach_opcode_, attach_payload_,
             std::bind(&StubImpl::HandleAttachResponse, this, std::placeholders::_1, std::placeholders::_2));
+        is_attaching_ = ret;
         if (!ret) {
-            ASBLog(INFO) << Object<T>::GetENetPeer() << ": attach send failed.";
+            ASBLog(INFO) << Object<T>::GetEndpoint() << ": attach send failed.";
             Object<T>::Disconnect([this](Result) {
                 std::lock_guard<std::mutex> lg(Object<T>::GetMutex());
-                if (connector_) {
-                    connector_();
-                }
+                RetryConnect();
             });
         }
     }
@@ -220,9 +266,18 @@ protected:
     void HandleAttachResponse(Result result, google::protobuf::io::ZeroCopyInputStream* payload) {
         ASBLog(INFO) << this << ": got attach response.";
         protocol::AttachResponse protocol_attach_response;
-        if (protocol_attach_response.ParseFromZeroCopyStream(payload)) {
+        if (result != Result::kOk || payload == nullptr) {
+            ASBLog(ERROR) << this << ": attach failed, result " << static_cast<int>(result) << ", reconnecting...";
+            std::lock_guard<std::mutex> lg(Object<T>::GetMutex());
+            is_attaching_ = false;
+            Object<T>::Disconnect([this](Result) {
+                std::lock_guard<std::mutex> lg(Object<T>::GetMutex());
+                RetryConnect();
+            });
+        } else if (protocol_attach_response.ParseFromZeroCopyStream(payload)) {
             ASBLog(INFO) << this << ": attached.";
             std::lock_guard<std::mutex> lg(Object<T>::GetMutex());
+            is_attaching_ = false;
             auto instance_id = protocol_attach_response.instance().id();
             if (instance_id > 0) {
                 is_activated_ = protocol_attach_response.is_activated();
@@ -233,13 +288,13 @@ protected:
                 Object<T>::Disconnect([this](Result) {
                     ASBLog(ERROR) << this << ": reconnecting...";
                     std::lock_guard<std::mutex> lg(Object<T>::GetMutex());
-                    if (connector_) {
-                        connector_();
-                    }
+                    RetryConnect();
                 });
             }
         } else {
             ASBLog(ERROR) << this << ": failed to parse attach response.";
+            std::lock_guard<std::mutex> lg(Object<T>::GetMutex());
+            is_attaching_ = false;
         }
     }
 
@@ -259,6 +314,7 @@ protected:
     Stub* parent_;
     std::function<bool ()> connector_;
     bool is_activated_;
+    bool is_attaching_;
     uint64_t instance_id_;
     scoped_connection parent_instance_id_changed_connection_;
 };
@@ -0,0 +1,575 @@
+// -----------------------------------------------------------------------
+// |             _     _              _____         _____                |
+// |            |  \  | |            / ____|  /\   |  __ \               |
+// |            | | \ | |  __       | (___   /  \  | |__) |              |
+// |            | |\ \| | /__\|   |  \___ \ / /\ \ |  _  /               |
+// |            | | \ \ ||    |   |   ___) / /__\ \| | \ \               |
+// |            |_|  \_\| \__/ \_/|/|_____/________\_|  \_\              |
+// |                                                                     |
+// -----------------------------------------------------------------------
+// COPYRIGHT
+// -----------------------------------------------------------------------
+//
+// This software is copyright protected and proprietary to Neusoft Reach.
+// Neusoft Reach grants to you only those rights as set out in the license
+// conditions.
+// All other rights remain with Neusoft Reach.
+// -----------------------------------------------------------------------
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+#include <condition_variable>
+
+#include <gtest/gtest.h>
+
+#include <sf-msgbus/types/scope_guard.h>
+
+#include "context.h"
+#include "local_link.h"
+
+namespace asf {
+namespace msgbus {
+namespace blackbox2 {
+
+namespace {
+
+constexpr auto kTimeout = std::chrono::seconds(10);
+// Not batched and not sent as a trailer.
+constexpr size_t kPlainSize = 2000;
+
+// A client and a server context over loopback ENet. The server keeps the
+// kMessage events it receives, sums up the drops its clients report and
+// knows each object by the instance it names in kAttachChannel.
+class ContextTest: public ::testing::Test {
+ protected:
+    struct Meta {
+        uint32_t stream;
+        uint32_t seq;
+    };
+
+    struct Received {
+        Meta meta;
+        std::vector<uint8_t> bytes;
+    };
+
+    void TearDown() override {
+        if (client_) {
+            client_->Stop();
+        }
+        if (server_) {
+            server_->Stop();
+        }
+    }
+
+    void Start(const char* policy, const char* max_packets) {
+        setenv("SF_MSGBUS_BLACKBOX2_ENABLE", "1", 1);
+        setenv("SF_MSGBUS_BLACKBOX2_SEND_QUEUE_POLICY", policy, 1);
+        setenv("SF_MSGBUS_BLACKBOX2_SEND_QUEUE_PACKETS", max_packets, 1);
+        static uint16_t port_offset = 0;
+        enet_address_set_host(&address_, "127.0.0.1");
+        address_.port = static_cast<uint16_t>(40000 + getpid() % 20000 + port_offset++);
+
+        server_ = std::make_shared<Context>();
+        ASSERT_TRUE(server_->StartAsServer([this](Endpoint* endpoint) {
+            HandleConnect(endpoint);
+        }, &address_));
+        client_ = std::make_shared<Context>();
+        ASSERT_TRUE(client_->StartAsClient(&address_));
+    }
+
+    // Connects an object, the server takes it with its first request.
+    Endpoint* Connect() {
+        std::promise<Endpoint*> connected;
+        EXPECT_TRUE(client_->Connect([&connected](Result result, Endpoint* endpoint) {
+            connected.set_value(result == Result::kOk ? endpoint : nullptr);
+        }));
+        auto future = connected.get_future();
+        if (future.wait_for(kTimeout) != std::future_status::ready) {
+            return nullptr;
+        }
+        auto endpoint = future.get();
+        if (endpoint == nullptr) {
+            return nullptr;
+        }
+        std::promise<Result> attached;
+        EXPECT_TRUE(client_->SendRequest(endpoint, protocol::Opcode::kAttachProcess, nullptr,
+            [&attached](Result result, google::protobuf::io::ZeroCopyInputStream*) {
+                attached.set_value(result);
+            }));
+        auto result = attached.get_future();
+        if (result.wait_for(kTimeout) != std::future_status::ready || result.get() != Result::kOk) {
+            return nullptr;
+        }
+        return endpoint;
+    }
+
+    void HandleConnect(Endpoint* endpoint) {
+        server_->RegisterRequestHandler(endpoint, protocol::Opcode::kAttachProcess, [](Context::RequestContext& request) {
+            request.SetResponse(Result::kOk);
+        });
+        server_->RegisterRequestHandler(endpoint, protocol::Opcode::kAttachChannel, [this](Context::RequestContext& request) {
+            protocol::Instance instance;
+            ASSERT_TRUE(instance.ParseFromZeroCopyStream(&request.GetPayload()));
+            {
+                std::lock_guard<std::mutex> lg(mutex_);
+                server_endpoints_[instance.id()] = request.GetEndpoint();
+                cond_.notify_all();
+            }
+            request.SetResponse(Result::kOk, &instance);
+        });
+        auto receive = [this](Context::RawEvent& event) {
+            Received received = {};
+            EXPECT_EQ(event.GetMetaSize(), sizeof(received.meta));
+            memcpy(&received.meta, event.GetMeta(), std::min(event.GetMetaSize(), sizeof(received.meta)));
+            auto bytes = event.GetBytes();
+            received.bytes.assign(bytes.GetData(), bytes.GetData() + bytes.GetByteSize());
+            std::lock_guard<std::mutex> lg(mutex_);
+            received_.push_back(std::move(received));
+            cond_.notify_all();
+        };
+        server_->RegisterRawEventHandler(endpoint, protocol::Opcode::kMessage, receive);
+        server_->RegisterRawEventHandler(endpoint, protocol::Opcode::kMessageType, receive);
+        server_->RegisterRawEventHandler(endpoint, protocol::Opcode::kExecutorRunBegin, receive);
+        server_->RegisterRawEventHandler(endpoint, protocol::Opcode::kMessageDrops, [this](Context::RawEvent& event) {
+            protocol::MessageDropBlock block = {};
+            ASSERT_EQ(event.GetMetaSize(), sizeof(block));
+            memcpy(&block, event.GetMeta(), sizeof(block));
+            std::lock_guard<std::mutex> lg(mutex_);
+            dropped_ += ntohl(block.count);
+            conflated_ += ntohl(block.conflated);
+            cond_.notify_all();
+        });
+    }
+
+    // The bytes are kept until the test ends, trailers are sent from them.
+    void Send(Endpoint* endpoint, uint32_t stream, uint32_t seq, size_t size,
+              protocol::Delivery delivery = protocol::Delivery::kReliable,
+              protocol::Opcode opcode = protocol::Opcode::kMessage) {
+        Meta meta = { stream, seq };
+        payloads_.emplace_back(size);
+        auto& payload = payloads_.back();
+        for (size_t i = 0; i < size; ++i) {
+            payload[i] = static_cast<uint8_t>(seq + i * 13);
+        }
+        EXPECT_TRUE(client_->SendEvent(endpoint, opcode, &meta, sizeof(meta),
+                                       ByteArray(payload.data(), payload.size(), [](uint8_t*, size_t, void*) {}), delivery));
+    }
+
+    // Sends from a response callback on the backend thread of the client, it
+    // neither services ENet nor gets acknowledgements meanwhile, so the bulk
+    // budget stays spent.
+    template <typename Sender>
+    void SendStalled(Endpoint* endpoint, Sender&& send) {
+        std::promise<void> done;
+        EXPECT_TRUE(client_->SendRequest(endpoint, protocol::Opcode::kAttachProcess, nullptr,
+            [&send, &done](Result, google::protobuf::io::ZeroCopyInputStream*) {
+                send();
+                done.set_value();
+            }));
+        ASSERT_EQ(done.get_future().wait_for(kTimeout), std::future_status::ready);
+    }
+
+    template <typename Predicate>
+    bool Wait(Predicate&& predicate) {
+        std::unique_lock<std::mutex> lg(mutex_);
+        return cond_.wait_for(lg, kTimeout, predicate);
+    }
+
+    static bool IsIntact(const Received& received) {
+        for (size_t i = 0; i < received.bytes.size(); ++i) {
+            if (received.bytes[i] != static_cast<uint8_t>(received.meta.seq + i * 13)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::vector<uint32_t> GetSeqs(uint32_t stream) {
+        std::lock_guard<std::mutex> lg(mutex_);
+        std::vector<uint32_t> seqs;
+        for (auto& received: received_) {
+            if (received.meta.stream == stream) {
+                seqs.push_back(received.meta.seq);
+            }
+        }
+        return seqs;
+    }
+
+    // A packet as a client context builds it, for orders it never sends in.
+    static ENetPacket* CreatePacket(protocol::Type type, protocol::Opcode opcode, uint8_t flags, uint32_t session,
+                                    uint32_t extra_data, const std::vector<uint8_t>& payload, enet_uint32 enet_flags) {
+        protocol::Header header = {};
+        header.version = protocol::kVersion;
+        header.type = static_cast<uint8_t>(type);
+        header.opcode = static_cast<uint8_t>(opcode);
+        header.flags = flags;
+        header.session = htonl(session);
+        header.extra_data = htonl(extra_data);
+        header.object = htonl(1);
+        std::vector<uint8_t> data(reinterpret_cast<const uint8_t*>(&header),
+                                  reinterpret_cast<const uint8_t*>(&header) + sizeof(header));
+        data.insert(data.end(), payload.begin(), payload.end());
+        return enet_packet_create(data.data(), data.size(), enet_flags);
+    }
+
+    // RawHeader and Meta of a kMessage event, then its inline bytes.
+    std::vector<uint8_t> CreateRawPayload(uint32_t stream, uint32_t seq, size_t inline_size) {
+        protocol::RawHeader raw_header = { htonl(sizeof(Meta)) };
+        Meta meta = { stream, seq };
+        std::vector<uint8_t> payload(reinterpret_cast<const uint8_t*>(&raw_header),
+                                     reinterpret_cast<const uint8_t*>(&raw_header) + sizeof(raw_header));
+        payload.insert(payload.end(), reinterpret_cast<const uint8_t*>(&meta), reinterpret_cast<const uint8_t*>(&meta) + sizeof(meta));
+        for (size_t i = 0; i < inline_size; ++i) {
+            payload.push_back(static_cast<uint8_t>(seq + i * 13));
+        }
+        return payload;
+    }
+
+    ENetAddress address_ = {};
+    std::shared_ptr<Context> server_;
+    std::shared_ptr<Context> client_;
+    std::deque<std::vector<uint8_t>> payloads_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::vector<Received> received_;
+    std::map<uint64_t, Endpoint*> server_endpoints_;
+    uint64_t dropped_ = 0;
+    uint64_t conflated_ = 0;
+};
+
+}
+
+TEST_F(ContextTest, RoutesTheObjectsOfAPeerByObjectId) {
+    Start("drop-newest", "4096");
+    constexpr uint64_t kCount = 4;
+    std::vector<Endpoint*> endpoints;
+    for (uint64_t i = 0; i < kCount; ++i) {
+        auto endpoint = Connect();
+        ASSERT_NE(endpoint, nullptr);
+        EXPECT_EQ(endpoint->enet_peer, endpoints.empty() ? endpoint->enet_peer : endpoints.front()->enet_peer);
+        for (auto other: endpoints) {
+            EXPECT_NE(endpoint->object_id, other->object_id);
+        }
+        endpoints.push_back(endpoint);
+    }
+
+    // Each object names itself, the response comes back to the object only.
+    std::map<uint64_t, std::vector<uint64_t>> events;
+    for (uint64_t i = 0; i < kCount; ++i) {
+        client_->RegisterEventHandler(endpoints[i], protocol::Opcode::kHandleEnable, [this, i, &events](google::protobuf::io::ZeroCopyInputStream& payload) {
+            protocol::Instance instance;
+            EXPECT_TRUE(instance.ParseFromZeroCopyStream(&payload));
+            std::lock_guard<std::mutex> lg(mutex_);
+            events[i].push_back(instance.id());
+            cond_.notify_all();
+        });
+        std::promise<uint64_t> named;
+        protocol::Instance instance;
+        instance.set_id(i);
+        ASSERT_TRUE(client_->SendRequest(endpoints[i], protocol::Opcode::kAttachChannel, &instance,
+            [&named](Result result, google::protobuf::io::ZeroCopyInputStream* payload) {
+                protocol::Instance response;
+                EXPECT_EQ(result, Result::kOk);
+                EXPECT_TRUE(response.ParseFromZeroCopyStream(payload));
+                named.set_value(response.id());
+            }));
+        auto future = named.get_future();
+        ASSERT_EQ(future.wait_for(kTimeout), std::future_status::ready);
+        EXPECT_EQ(future.get(), i);
+    }
+
+    // Events of the server reach the object they were sent to.
+    std::map<uint64_t, Endpoint*> server_endpoints;
+    {
+        std::lock_guard<std::mutex> lg(mutex_);
+        server_endpoints = server_endpoints_;
+    }
+    ASSERT_EQ(server_endpoints.size(), kCount);
+    for (auto& item: server_endpoints) {
+        EXPECT_EQ(item.second->enet_peer, server_endpoints.begin()->second->enet_peer);
+        protocol::Instance instance;
+        instance.set_id(item.first);
+        EXPECT_TRUE(server_->SendEvent(item.second, protocol::Opcode::kHandleEnable, &instance));
+    }
+    ASSERT_TRUE(Wait([&events] {
+        return events.size() == kCount;
+    }));
+    std::lock_guard<std::mutex> lg(mutex_);
+    for (auto& item: events) {
+        EXPECT_EQ(item.second, std::vector<uint64_t>{ item.first });
+    }
+}
+
+TEST_F(ContextTest, PairsTrailersWithTheirEvents) {
+    Start("drop-newest", "4096");
+    auto endpoint = Connect();
+    ASSERT_NE(endpoint, nullptr);
+
+    // Batched, plain and trailer events, with unsequenced ones in between
+    // that may overtake the trailers.
+    const size_t sizes[] = { 100, kPlainSize, Context::kTrailerMinSize, 20000, 5000 };
+    constexpr uint32_t kCount = 200;
+    uint32_t reliable = 0;
+    for (uint32_t seq = 0; seq < kCount; ++seq) {
+        auto size = sizes[seq % 5];
+        if (seq % 5 == 4) {
+            Send(endpoint, 1, seq, size, protocol::Delivery::kUnsequenced);
+        } else {
+            Send(endpoint, 0, seq, size);
+            ++reliable;
+        }
+    }
+    ASSERT_TRUE(Wait([this, reliable] {
+        return std::count_if(received_.begin(), received_.end(), [](const Received& received) {
+            return received.meta.stream == 0;
+        }) == reliable;
+    }));
+
+    std::lock_guard<std::mutex> lg(mutex_);
+    uint32_t expected = 0;
+    for (auto& received: received_) {
+        EXPECT_EQ(received.bytes.size(), sizes[received.meta.seq % 5]) << "seq " << received.meta.seq;
+        EXPECT_TRUE(IsIntact(received)) << "seq " << received.meta.seq;
+        if (received.meta.stream == 0) {
+            if (expected % 5 == 4) {
+                ++expected;
+            }
+            EXPECT_EQ(received.meta.seq, expected);
+            ++expected;
+        }
+    }
+}
+
+TEST_F(ContextTest, UnsequencedEventPassesAHeldEvent) {
+    Start("drop-newest", "4096");
+    auto host = enet_host_create(nullptr, 1, static_cast<size_t>(protocol::EnetChannel::kMax), 0, 0);
+    ASSERT_NE(host, nullptr);
+    auto host_guard = MakeScopeGuard([host] {
+        enet_host_destroy(host);
+    });
+    auto peer = enet_host_connect(host, &address_, static_cast<size_t>(protocol::EnetChannel::kMax), 0);
+    ASSERT_NE(peer, nullptr);
+    auto service = [host](ENetEventType type) {
+        auto deadline = std::chrono::steady_clock::now() + kTimeout;
+        ENetEvent event;
+        while (std::chrono::steady_clock::now() < deadline) {
+            if (enet_host_service(host, &event, 10) > 0) {
+                if (event.type == ENET_EVENT_TYPE_RECEIVE) {
+                    enet_packet_destroy(event.packet);
+                }
+                if (event.type == type) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    };
+    ASSERT_TRUE(service(ENET_EVENT_TYPE_CONNECT));
+    auto control = static_cast<enet_uint8>(protocol::EnetChannel::kControl);
+    auto bulk = static_cast<enet_uint8>(protocol::EnetChannel::kBulk);
+    enet_peer_send(peer, control, CreatePacket(protocol::Type::kRequest, protocol::Opcode::kAttachProcess, 0, 1, 0, {},
+                                               ENET_PACKET_FLAG_RELIABLE));
+    ASSERT_TRUE(service(ENET_EVENT_TYPE_RECEIVE));
+
+    // The unsequenced event arrives between the held event and its trailer.
+    constexpr size_t kTrailerSize = 5000;
+    std::vector<uint8_t> trailer(kTrailerSize);
+    for (size_t i = 0; i < trailer.size(); ++i) {
+        trailer[i] = static_cast<uint8_t>(i * 13);
+    }
+    enet_peer_send(peer, bulk, CreatePacket(protocol::Type::kEvent, protocol::Opcode::kMessage,
+                                            protocol::kHeaderRaw | protocol::kHeaderTrailer, 0, kTrailerSize,
+                                            CreateRawPayload(0, 0, 0), ENET_PACKET_FLAG_RELIABLE));
+    enet_peer_send(peer, bulk, CreatePacket(protocol::Type::kEvent, protocol::Opcode::kMessage, protocol::kHeaderRaw, 0, 0,
+                                            CreateRawPayload(1, 1, 100), ENET_PACKET_FLAG_UNSEQUENCED));
+    enet_peer_send(peer, bulk, enet_packet_create(trailer.data(), trailer.size(), ENET_PACKET_FLAG_RELIABLE));
+    enet_host_flush(host);
+    ASSERT_TRUE(Wait([this] {
+        return received_.size() == 2;
+    }));
+
+    EXPECT_EQ(GetSeqs(1), std::vector<uint32_t>{ 1 });
+    EXPECT_EQ(GetSeqs(0), std::vector<uint32_t>{ 0 });
+    std::lock_guard<std::mutex> lg(mutex_);
+    for (auto& received: received_) {
+        EXPECT_EQ(received.bytes.size(), received.meta.stream == 0 ? kTrailerSize : 100U);
+        EXPECT_TRUE(IsIntact(received));
+    }
+}
+
+TEST_F(ContextTest, ReliableMessagesFollowTheirHeldType) {
+    Start("drop-newest", "4096");
+    auto endpoint = Connect();
+    ASSERT_NE(endpoint, nullptr);
+
+    // A stub sends the messages of a type reliably until the type, here with
+    // a dictionary large enough for a trailer, is acknowledged.
+    constexpr uint32_t kCount = 20;
+    for (uint32_t seq = 0; seq < kCount; seq += 2) {
+        Send(endpoint, 0, seq, 20000, protocol::Delivery::kReliable, protocol::Opcode::kMessageType);
+        Send(endpoint, 0, seq + 1, 100);
+    }
+    ASSERT_TRUE(Wait([this] {
+        return received_.size() == kCount;
+    }));
+
+    std::vector<uint32_t> expected;
+    for (uint32_t seq = 0; seq < kCount; ++seq) {
+        expected.push_back(seq);
+    }
+    EXPECT_EQ(GetSeqs(0), expected);
+}
+
+TEST_F(ContextTest, SendsLargeEventsOffTheBulkChannelWhole) {
+    Start("drop-newest", "4096");
+    auto endpoint = Connect();
+    ASSERT_NE(endpoint, nullptr);
+
+    // A trace event is past the trailer size, but only bulk events have one.
+    Send(endpoint, 0, 0, 20000, protocol::Delivery::kReliable, protocol::Opcode::kExecutorRunBegin);
+    Send(endpoint, 0, 1, Context::kTrailerMinSize, protocol::Delivery::kReliable, protocol::Opcode::kExecutorRunBegin);
+    ASSERT_TRUE(Wait([this] {
+        return received_.size() == 2;
+    }));
+
+    EXPECT_EQ(GetSeqs(0), (std::vector<uint32_t>{ 0, 1 }));
+    std::lock_guard<std::mutex> lg(mutex_);
+    for (auto& received: received_) {
+        EXPECT_EQ(received.bytes.size(), received.meta.seq == 0 ? 20000U : Context::kTrailerMinSize);
+        EXPECT_TRUE(IsIntact(received));
+    }
+}
+
+TEST_F(ContextTest, DropNewestKeepsTheEarliestMessages) {
+    Start("drop-newest", "8");
+    auto endpoint = Connect();
+    ASSERT_NE(endpoint, nullptr);
+
+    constexpr uint32_t kCount = 100;
+    SendStalled(endpoint, [&] {
+        for (uint32_t seq = 0; seq < kCount; ++seq) {
+            Send(endpoint, 0, seq, kPlainSize);
+        }
+    });
+    ASSERT_TRUE(Wait([this] {
+        return received_.size() + dropped_ == kCount;
+    }));
+
+    auto seqs = GetSeqs(0);
+    ASSERT_FALSE(seqs.empty());
+    EXPECT_LT(seqs.size(), kCount);
+    for (uint32_t i = 0; i < seqs.size(); ++i) {
+        EXPECT_EQ(seqs[i], i);
+    }
+}
+
+TEST_F(ContextTest, DropOldestKeepsTheLatestMessages) {
+    Start("drop-oldest", "8");
+    auto endpoint = Connect();
+    ASSERT_NE(endpoint, nullptr);
+
+    constexpr uint32_t kCount = 100;
+    SendStalled(endpoint, [&] {
+        for (uint32_t seq = 0; seq < kCount; ++seq) {
+            Send(endpoint, 0, seq, kPlainSize);
+        }
+    });
+    ASSERT_TRUE(Wait([this] {
+        return received_.size() + dropped_ == kCount;
+    }));
+
+    // What ENet already holds is sent, the queue keeps the latest 8.
+    auto seqs = GetSeqs(0);
+    ASSERT_GE(seqs.size(), 9U);
+    EXPECT_LT(seqs.size(), kCount);
+    EXPECT_EQ(seqs.front(), 0U);
+    EXPECT_TRUE(std::is_sorted(seqs.begin(), seqs.end()));
+    std::vector<uint32_t> latest(seqs.end() - 8, seqs.end());
+    for (uint32_t i = 0; i < latest.size(); ++i) {
+        EXPECT_EQ(latest[i], kCount - 8 + i);
+    }
+}
+
+TEST_F(ContextTest, ConflatedKeepsOnlyTheLatestPendingMessage) {
+    Start("drop-newest", "4096");
+    auto bulk = Connect();
+    ASSERT_NE(bulk, nullptr);
+    auto latest = Connect();
+    ASSERT_NE(latest, nullptr);
+
+    // The bulk messages spend the budget, the conflated ones queue behind.
+    constexpr uint32_t kBulkCount = 64;
+    constexpr uint32_t kConflatedCount = 50;
+    SendStalled(bulk, [&] {
+        for (uint32_t seq = 0; seq < kBulkCount; ++seq) {
+            Send(bulk, 0, seq, kPlainSize);
+        }
+        for (uint32_t seq = 0; seq < kConflatedCount; ++seq) {
+            Send(latest, 1, seq, 100, protocol::Delivery::kConflated);
+        }
+    });
+    ASSERT_TRUE(Wait([this] {
+        return received_.size() == kBulkCount + 1 && conflated_ == kConflatedCount - 1;
+    }));
+
+    EXPECT_EQ(GetSeqs(0).size(), kBulkCount);
+    EXPECT_EQ(GetSeqs(1), std::vector<uint32_t>{ kConflatedCount - 1 });
+    EXPECT_EQ(client_->GetConflatedCount(latest), kConflatedCount - 1);
+    std::lock_guard<std::mutex> lg(mutex_);
+    EXPECT_EQ(dropped_, 0U);
+}
+
+TEST_F(ContextTest, ClosesALocalPeerWhileItsLinkIsBlocked) {
+    Start("drop-newest", "4096");
+    ASSERT_TRUE(server_->ListenLocal());
+    auto link = LocalLink::Connect(GetLocalLinkName(address_.port), LocalLink::Kind::kUnix);
+    ASSERT_TRUE(link);
+    protocol::Instance instance;
+    instance.set_id(1);
+    auto name = instance.SerializeAsString();
+    ASSERT_TRUE(link->Send(static_cast<enet_uint8>(protocol::EnetChannel::kControl),
+                           CreatePacket(protocol::Type::kRequest, protocol::Opcode::kAttachChannel, 0, 1, 0,
+                                        std::vector<uint8_t>(name.begin(), name.end()), ENET_PACKET_FLAG_RELIABLE)));
+    link->Flush();
+    ASSERT_TRUE(Wait([this] {
+        return server_endpoints_.count(1) > 0;
+    }));
+    Endpoint* server_endpoint;
+    {
+        std::lock_guard<std::mutex> lg(mutex_);
+        server_endpoint = server_endpoints_[1];
+    }
+    std::promise<void> disconnected;
+    server_->RegisterDisconnectHandler(server_endpoint, [&disconnected] {
+        disconnected.set_value();
+    });
+
+    // Nothing is read from the link, it fills up and the server keeps bulk
+    // packets and trailers pending in it until the link is closed.
+    payloads_.emplace_back(20000);
+    auto& payload = payloads_.back();
+    Meta meta = { 0, 0 };
+    for (uint32_t i = 0; i < 400; ++i) {
+        EXPECT_TRUE(server_->SendEvent(server_endpoint, protocol::Opcode::kMessage, &meta, sizeof(meta),
+                                       ByteArray(payload.data(), payload.size(), [](uint8_t*, size_t, void*) {})));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    // The pending packets give their budget back to the bulk queue of the
+    // peer, it must still be there.
+    link.reset();
+    EXPECT_EQ(disconnected.get_future().wait_for(kTimeout), std::future_status::ready);
+}
+
+}  // namespace blackbox2
+}  // namespace msgbus
+}  // namespace asf
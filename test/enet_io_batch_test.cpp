@@ -0,0 +1,191 @@
+// -----------------------------------------------------------------------
+// |             _     _              _____         _____                |
+// |            |  \  | |            / ____|  /\   |  __ \               |
+// |            | | \ | |  __       | (___   /  \  | |__) |              |
+// |            | |\ \| | /__\|   |  \___ \ / /\ \ |  _  /               |
+// |            | | \ \ ||    |   |   ___) / /__\ \| | \ \               |
+// |            |_|  \_\| \__/ \_/|/|_____/________\_|  \_\              |
+// |                                                                     |
+// -----------------------------------------------------------------------
+// COPYRIGHT
+// -----------------------------------------------------------------------
+//
+// This software is copyright protected and proprietary to Neusoft Reach.
+// Neusoft Reach grants to you only those rights as set out in the license
+// conditions.
+// All other rights remain with Neusoft Reach.
+// -----------------------------------------------------------------------
+
+#include <chrono>
+#include <vector>
+#include <cstring>
+
+#include <gtest/gtest.h>
+
+#include "enet.h"
+
+namespace asf {
+namespace msgbus {
+namespace blackbox2 {
+
+namespace {
+
+constexpr size_t kChannelCount = 2;
+constexpr uint32_t kRounds = 50;
+constexpr uint32_t kSmallPerRound = 20;
+constexpr size_t kLargeSize = 5000;
+
+// Datagrams per recvmmsg/sendmmsg of the server and of the client, 1 is
+// one by one.
+class EnetIoBatchTest: public ::testing::TestWithParam<std::pair<size_t, size_t>> {
+ protected:
+    struct Received {
+        std::vector<uint32_t> small;
+        std::vector<uint32_t> large;
+        uint32_t unreliable = 0;
+        bool is_corrupt = false;
+    };
+
+    void SetUp() override {
+        ASSERT_EQ(enet_initialize(), 0);
+        ENetAddress address = {};
+        enet_address_set_host(&address, "127.0.0.1");
+        server_ = enet_host_create(&address, 8, kChannelCount, 0, 0);
+        ASSERT_NE(server_, nullptr);
+        ASSERT_EQ(enet_socket_get_address(server_->socket, &address), 0);
+        client_ = enet_host_create(nullptr, 8, kChannelCount, 0, 0);
+        ASSERT_NE(client_, nullptr);
+        ASSERT_EQ(enet_host_io_batch(server_, GetParam().first), 0);
+        ASSERT_EQ(enet_host_io_batch(client_, GetParam().second), 0);
+
+        client_peer_ = enet_host_connect(client_, &address, kChannelCount, 0);
+        ASSERT_NE(client_peer_, nullptr);
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while ((client_peer_->state != ENET_PEER_STATE_CONNECTED || server_peer_ == nullptr) &&
+               std::chrono::steady_clock::now() < deadline) {
+            Service(server_, server_received_);
+            Service(client_, client_received_);
+        }
+        ASSERT_EQ(client_peer_->state, ENET_PEER_STATE_CONNECTED);
+        ASSERT_NE(server_peer_, nullptr);
+    }
+
+    void TearDown() override {
+        if (client_ != nullptr) {
+            enet_host_destroy(client_);
+        }
+        if (server_ != nullptr) {
+            enet_host_destroy(server_);
+        }
+        enet_deinitialize();
+    }
+
+    void Service(ENetHost* host, Received& received) {
+        ENetEvent event;
+        while (enet_host_service(host, &event, 1) > 0) {
+            if (event.type == ENET_EVENT_TYPE_CONNECT && host == server_) {
+                server_peer_ = event.peer;
+            }
+            if (event.type != ENET_EVENT_TYPE_RECEIVE) {
+                continue;
+            }
+            uint32_t seq = 0;
+            memcpy(&seq, event.packet->data, sizeof(seq));
+            if (!(event.packet->flags & ENET_PACKET_FLAG_RELIABLE)) {
+                ++received.unreliable;
+            } else if (event.channelID == 1) {
+                received.large.push_back(seq);
+                received.is_corrupt = received.is_corrupt || event.packet->dataLength != kLargeSize ||
+                                      event.packet->data[kLargeSize - 1] != static_cast<uint8_t>(seq);
+            } else {
+                received.small.push_back(seq);
+            }
+            enet_packet_destroy(event.packet);
+        }
+    }
+
+    static void SendRound(ENetPeer* peer, uint32_t round) {
+        for (uint32_t i = 0; i < kSmallPerRound; ++i) {
+            uint32_t seq = round * kSmallPerRound + i;
+            uint8_t data[100] = {};
+            memcpy(data, &seq, sizeof(seq));
+            enet_peer_send(peer, 0, enet_packet_create(data, sizeof(data), ENET_PACKET_FLAG_RELIABLE));
+            enet_peer_send(peer, 0, enet_packet_create(data, sizeof(data), 0));
+        }
+        // Fragmented over several datagrams of one batch.
+        std::vector<uint8_t> large(kLargeSize, static_cast<uint8_t>(round));
+        memcpy(large.data(), &round, sizeof(round));
+        enet_peer_send(peer, 1, enet_packet_create(large.data(), large.size(), ENET_PACKET_FLAG_RELIABLE));
+    }
+
+    static void ExpectInOrder(const Received& received) {
+        ASSERT_EQ(received.small.size(), kRounds * kSmallPerRound);
+        for (uint32_t i = 0; i < received.small.size(); ++i) {
+            ASSERT_EQ(received.small[i], i);
+        }
+        ASSERT_EQ(received.large.size(), kRounds);
+        for (uint32_t i = 0; i < received.large.size(); ++i) {
+            ASSERT_EQ(received.large[i], i);
+        }
+        EXPECT_FALSE(received.is_corrupt);
+        EXPECT_LE(received.unreliable, kRounds * kSmallPerRound);
+    }
+
+    bool IsDone() const {
+        return server_received_.small.size() == kRounds * kSmallPerRound && server_received_.large.size() == kRounds &&
+               client_received_.small.size() == kRounds * kSmallPerRound && client_received_.large.size() == kRounds;
+    }
+
+    ENetHost* server_ = nullptr;
+    ENetHost* client_ = nullptr;
+    ENetPeer* client_peer_ = nullptr;
+    ENetPeer* server_peer_ = nullptr;
+    Received server_received_;
+    Received client_received_;
+};
+
+}
+
+TEST_P(EnetIoBatchTest, DeliversReliablePacketsInOrderBothWays) {
+    for (uint32_t round = 0; round < kRounds; ++round) {
+        SendRound(client_peer_, round);
+        SendRound(server_peer_, round);
+        Service(client_, client_received_);
+        Service(server_, server_received_);
+    }
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (!IsDone() && std::chrono::steady_clock::now() < deadline) {
+        Service(client_, client_received_);
+        Service(server_, server_received_);
+    }
+    ExpectInOrder(server_received_);
+    ExpectInOrder(client_received_);
+}
+
+TEST_P(EnetIoBatchTest, BatchSizeChangesBetweenServices) {
+    SendRound(client_peer_, 0);
+    Service(client_, client_received_);
+    ASSERT_EQ(enet_host_io_batch(client_, GetParam().first), 0);
+    for (uint32_t round = 1; round < kRounds; ++round) {
+        SendRound(client_peer_, round);
+        SendRound(server_peer_, round - 1);
+        Service(client_, client_received_);
+        Service(server_, server_received_);
+    }
+    SendRound(server_peer_, kRounds - 1);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (!IsDone() && std::chrono::steady_clock::now() < deadline) {
+        Service(client_, client_received_);
+        Service(server_, server_received_);
+    }
+    ExpectInOrder(server_received_);
+    ExpectInOrder(client_received_);
+}
+
+INSTANTIATE_TEST_SUITE_P(BatchSizes, EnetIoBatchTest,
+                         ::testing::Values(std::make_pair(size_t(1), size_t(1)), std::make_pair(size_t(32), size_t(1)),
+                                           std::make_pair(size_t(1), size_t(8)), std::make_pair(size_t(32), size_t(8))));
+
+}  // namespace blackbox2
+}  // namespace msgbus
+}  // namespace asf
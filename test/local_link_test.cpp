@@ -0,0 +1,382 @@
+// -----------------------------------------------------------------------
+// |             _     _              _____         _____                |
+// |            |  \  | |            / ____|  /\   |  __ \               |
+// |            | | \ | |  __       | (___   /  \  | |__) |              |
+// |            | |\ \| | /__\|   |  \___ \ / /\ \ |  _  /               |
+// |            | | \ \ ||    |   |   ___) / /__\ \| | \ \               |
+// |            |_|  \_\| \__/ \_/|/|_____/________\_|  \_\              |
+// |                                                                     |
+// -----------------------------------------------------------------------
+// COPYRIGHT
+// -----------------------------------------------------------------------
+//
+// This software is copyright protected and proprietary to Neusoft Reach.
+// Neusoft Reach grants to you only those rights as set out in the license
+// conditions.
+// All other rights remain with Neusoft Reach.
+// -----------------------------------------------------------------------
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstring>
+#include <cstddef>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include <gtest/gtest.h>
+
+#include "local_link.h"
+#include "packet_pool.h"
+
+namespace asf {
+namespace msgbus {
+namespace blackbox2 {
+
+namespace {
+
+constexpr auto kTimeout = std::chrono::seconds(5);
+
+std::vector<uint8_t> MakeBytes(size_t size, uint8_t seed) {
+    std::vector<uint8_t> bytes(size);
+    for (size_t i = 0; i < size; ++i) {
+        bytes[i] = static_cast<uint8_t>(seed + i * 7);
+    }
+    return bytes;
+}
+
+class LocalLinkTest: public ::testing::TestWithParam<LocalLink::Kind> {
+ protected:
+    struct Received {
+        enet_uint8 channel;
+        ENetPacket* enet_pkt;
+    };
+
+    static void SetUpTestSuite() {
+        ASSERT_EQ(enet_initialize(), 0);
+        PacketPool::Install();
+    }
+
+    void SetUp() override {
+        name_ = "sf-msgbus-blackbox2-test." + std::to_string(getpid());
+        ASSERT_TRUE(listener_.Listen(name_, [this](ENetSocket, bool watch) {
+            watched_ += watch ? 1 : -1;
+            return true;
+        }));
+    }
+
+    void TearDown() override {
+        for (auto& received: received_) {
+            PacketPool::Destroy(received.enet_pkt);
+        }
+        client_.reset();
+        server_.reset();
+        listener_.Close();
+    }
+
+    void Connect() {
+        std::thread thread([this] {
+            client_ = LocalLink::Connect(name_, GetParam());
+        });
+        auto deadline = std::chrono::steady_clock::now() + kTimeout;
+        while (!(server_ = listener_.Accept()) && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        thread.join();
+        ASSERT_TRUE(client_);
+        ASSERT_TRUE(server_);
+        EXPECT_EQ(watched_, 0);
+    }
+
+    void Send(enet_uint8 channel, const std::vector<uint8_t>& bytes) {
+        ASSERT_TRUE(client_->Send(channel, PacketPool::Create(bytes.data(), bytes.size(), ENET_PACKET_FLAG_RELIABLE)));
+    }
+
+    // Received packets are kept, so a shared memory link runs out of slots.
+    bool ReceiveAll(size_t count) {
+        auto deadline = std::chrono::steady_clock::now() + kTimeout;
+        while (received_.size() < count && std::chrono::steady_clock::now() < deadline) {
+            client_->Flush();
+            if (!server_->Receive([this](enet_uint8 channel, ENetPacket* enet_pkt) {
+                    received_.push_back(Received{ channel, enet_pkt });
+                })) {
+                return false;
+            }
+            if (server_->PrepareWait()) {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+        return received_.size() == count;
+    }
+
+    void ExpectReceived(size_t index, enet_uint8 channel, const std::vector<uint8_t>& bytes) {
+        ASSERT_LT(index, received_.size());
+        auto& received = received_[index];
+        EXPECT_EQ(received.channel, channel);
+        ASSERT_EQ(enet_packet_get_length(received.enet_pkt), bytes.size());
+        EXPECT_EQ(memcmp(enet_packet_get_data(received.enet_pkt), bytes.data(), bytes.size()), 0);
+    }
+
+    std::string name_;
+    int watched_ = 0;
+    LocalListener listener_;
+    std::unique_ptr<LocalLink> client_;
+    std::unique_ptr<LocalLink> server_;
+    std::vector<Received> received_;
+};
+
+}
+
+TEST_P(LocalLinkTest, KeepsChannelsOrderAndBytes) {
+    Connect();
+    // Inline, one record, several records, a shared memory slot and more
+    // than a slot holds.
+    std::vector<std::vector<uint8_t>> packets;
+    for (size_t size: { size_t(1), size_t(100), size_t(20000), size_t(70000), size_t(200000), size_t(3 * 1024 * 1024) }) {
+        packets.push_back(MakeBytes(size, static_cast<uint8_t>(packets.size())));
+    }
+    for (size_t i = 0; i < packets.size(); ++i) {
+        Send(static_cast<enet_uint8>(i % 3), packets[i]);
+    }
+    ASSERT_TRUE(ReceiveAll(packets.size()));
+    for (size_t i = 0; i < packets.size(); ++i) {
+        ExpectReceived(i, static_cast<enet_uint8>(i % 3), packets[i]);
+    }
+}
+
+TEST_P(LocalLinkTest, FragmentsWhileTheReceiverHoldsItsPackets) {
+    Connect();
+    // More large packets than there are slots, none is released before the
+    // last one has arrived.
+    std::vector<std::vector<uint8_t>> packets;
+    for (size_t i = 0; i < 20; ++i) {
+        packets.push_back(MakeBytes(100000 + i, static_cast<uint8_t>(i)));
+        Send(2, packets.back());
+        packets.push_back(MakeBytes(64, static_cast<uint8_t>(i)));
+        Send(1, packets.back());
+    }
+    ASSERT_TRUE(ReceiveAll(packets.size()));
+    for (size_t i = 0; i < packets.size(); ++i) {
+        ExpectReceived(i, (i % 2 == 0) ? 2 : 1, packets[i]);
+    }
+}
+
+TEST_P(LocalLinkTest, ClosedPeerIsReported) {
+    Connect();
+    client_.reset();
+    auto deadline = std::chrono::steady_clock::now() + kTimeout;
+    bool open = true;
+    while (open && std::chrono::steady_clock::now() < deadline) {
+        open = server_->Receive([](enet_uint8, ENetPacket* enet_pkt) {
+            PacketPool::Destroy(enet_pkt);
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_FALSE(open);
+}
+
+INSTANTIATE_TEST_SUITE_P(Kinds, LocalLinkTest, ::testing::Values(LocalLink::Kind::kShm, LocalLink::Kind::kUnix),
+                         [](const ::testing::TestParamInfo<LocalLink::Kind>& info) {
+                             return info.param == LocalLink::Kind::kShm ? "Shm" : "Unix";
+                         });
+
+namespace {
+
+// Talks to the listener without a LocalLink, for handshakes and frames
+// a well-behaved client never sends.
+class RawClient {
+ public:
+    explicit RawClient(const std::string& name)
+        : socket_(::socket(AF_UNIX, SOCK_SEQPACKET, 0))
+        , shm_(nullptr) {
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path + 1, name.data(), name.size());
+        auto size = static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + 1 + name.size());
+        is_connected_ = connect(socket_, reinterpret_cast<sockaddr*>(&addr), size) == 0;
+    }
+
+    ~RawClient() {
+        if (shm_ != nullptr) {
+            munmap(shm_, kShmSize);
+        }
+        close(socket_);
+    }
+
+    bool IsConnected() const {
+        return is_connected_;
+    }
+
+    bool SendKind(LocalLink::Kind kind) {
+        auto request = static_cast<char>(kind);
+        uint32_t magic = 0;
+        return send(socket_, &request, sizeof(request), 0) == sizeof(request) &&
+               recv(socket_, &magic, sizeof(magic), 0) == sizeof(magic);
+    }
+
+    // A record of one frame, the same layout as UnixLink's.
+    bool SendFrame(uint32_t size, uint32_t total) {
+        std::vector<uint8_t> record(12 + size);
+        memcpy(record.data(), &size, sizeof(size));
+        memcpy(record.data() + 4, &total, sizeof(total));
+        return send(socket_, record.data(), record.size(), 0) == static_cast<ssize_t>(record.size());
+    }
+
+    // Maps the memory ShmLink passes with its handshake instead of the magic.
+    bool OpenShm() {
+        auto request = static_cast<char>(LocalLink::Kind::kShm);
+        if (send(socket_, &request, sizeof(request), 0) != sizeof(request)) {
+            return false;
+        }
+        int fds[3];
+        char control[CMSG_SPACE(sizeof(fds))];
+        uint32_t magic = 0;
+        iovec iov = { &magic, sizeof(magic) };
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        auto cmsg = (recvmsg(socket_, &msg, 0) == sizeof(magic)) ? CMSG_FIRSTHDR(&msg) : nullptr;
+        if (cmsg == nullptr || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+            return false;
+        }
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+        auto base = mmap(nullptr, kShmSize, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+        for (auto fd: fds) {
+            close(fd);
+        }
+        shm_ = (base != MAP_FAILED) ? static_cast<uint8_t*>(base) : nullptr;
+        return shm_ != nullptr;
+    }
+
+    // A fragment record in the client to server ring, the same layout as
+    // ShmLink's, published by moving the head past it.
+    void PushFragment(uint32_t size, uint32_t total) {
+        auto head = reinterpret_cast<uint64_t*>(shm_ + kShmBlockSize);
+        auto record = shm_ + 2 * kShmBlockSize + kShmRingSize + *head;
+        memset(record, 0, 16 + size);
+        memcpy(record, &size, sizeof(size));
+        memcpy(record + 4, &total, sizeof(total));
+        record[9] = 3;
+        __atomic_store_n(head, *head + 16 + ((size + 15) & ~15U), __ATOMIC_RELEASE);
+    }
+
+ private:
+    static constexpr size_t kShmBlockSize = 4096;
+    static constexpr size_t kShmRingSize = 1024 * 1024;
+    static constexpr size_t kShmSize = 2 * kShmBlockSize + 2 * kShmRingSize + 16 * kShmRingSize;
+
+    int socket_;
+    bool is_connected_;
+    uint8_t* shm_;
+};
+
+// Accepts the link of a raw client once handshake() has run on its side.
+template <typename Handshake>
+std::unique_ptr<LocalLink> AcceptRaw(LocalListener& listener, Handshake handshake) {
+    std::unique_ptr<LocalLink> link;
+    std::thread thread(handshake);
+    auto deadline = std::chrono::steady_clock::now() + kTimeout;
+    while (!(link = listener.Accept()) && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    thread.join();
+    return link;
+}
+
+// Receives until the link fails or the timeout, true if it is still open.
+bool ReceiveUntilClosed(LocalLink& link, size_t& received) {
+    bool open = true;
+    auto deadline = std::chrono::steady_clock::now() + kTimeout;
+    while (open && std::chrono::steady_clock::now() < deadline) {
+        open = link.Receive([&received](enet_uint8, ENetPacket* enet_pkt) {
+            ++received;
+            PacketPool::Destroy(enet_pkt);
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return open;
+}
+
+}
+
+TEST(LocalListenerTest, StalledHandshakeNeverBlocksAccept) {
+    ASSERT_EQ(enet_initialize(), 0);
+    auto name = "sf-msgbus-blackbox2-stall." + std::to_string(getpid());
+    int watched = 0;
+    LocalListener listener;
+    ASSERT_TRUE(listener.Listen(name, [&watched](ENetSocket, bool watch) {
+        watched += watch ? 1 : -1;
+        return true;
+    }));
+    RawClient stalled(name);
+    ASSERT_TRUE(stalled.IsConnected());
+
+    auto start = std::chrono::steady_clock::now();
+    EXPECT_FALSE(listener.Accept());
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(100));
+    EXPECT_EQ(watched, 1);
+
+    // The handshake is given up after its timeout.
+    auto deadline = std::chrono::steady_clock::now() + kTimeout;
+    while (watched != 0 && std::chrono::steady_clock::now() < deadline) {
+        EXPECT_FALSE(listener.Accept());
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_EQ(watched, 0);
+}
+
+TEST(LocalListenerTest, UnixLinkClosesOnFramesBeyondTheirTotal) {
+    ASSERT_EQ(enet_initialize(), 0);
+    PacketPool::Install();
+    auto name = "sf-msgbus-blackbox2-frames." + std::to_string(getpid());
+    LocalListener listener;
+    ASSERT_TRUE(listener.Listen(name, [](ENetSocket, bool) { return true; }));
+    RawClient client(name);
+    ASSERT_TRUE(client.IsConnected());
+    auto link = AcceptRaw(listener, [&client] {
+        EXPECT_TRUE(client.SendKind(LocalLink::Kind::kUnix));
+    });
+    ASSERT_TRUE(link);
+
+    // The second frame claims a larger packet than the first one started.
+    ASSERT_TRUE(client.SendFrame(1, 2));
+    ASSERT_TRUE(client.SendFrame(60000, 70000));
+    size_t received = 0;
+    EXPECT_FALSE(ReceiveUntilClosed(*link, received));
+    EXPECT_EQ(received, 0U);
+}
+
+TEST(LocalListenerTest, ShmLinkClosesOnFragmentsOfChangingTotal) {
+    ASSERT_EQ(enet_initialize(), 0);
+    PacketPool::Install();
+    auto name = "sf-msgbus-blackbox2-records." + std::to_string(getpid());
+    LocalListener listener;
+    ASSERT_TRUE(listener.Listen(name, [](ENetSocket, bool) { return true; }));
+    RawClient client(name);
+    ASSERT_TRUE(client.IsConnected());
+    bool opened = false;
+    auto link = AcceptRaw(listener, [&client, &opened] {
+        opened = client.OpenShm();
+    });
+    ASSERT_TRUE(link);
+    ASSERT_TRUE(opened);
+
+    // The second fragment claims a larger packet than the first one started.
+    client.PushFragment(16, 32);
+    client.PushFragment(16, 64);
+    size_t received = 0;
+    EXPECT_FALSE(ReceiveUntilClosed(*link, received));
+    EXPECT_EQ(received, 0U);
+}
+
+}  // namespace blackbox2
+}  // namespace msgbus
+}  // namespace asf
@@ -0,0 +1,166 @@
+// -----------------------------------------------------------------------
+// |             _     _              _____         _____                |
+// |            |  \  | |            / ____|  /\   |  __ \               |
+// |            | | \ | |  __       | (___   /  \  | |__) |              |
+// |            | |\ \| | /__\|   |  \___ \ / /\ \ |  _  /               |
+// |            | | \ \ ||    |   |   ___) / /__\ \| | \ \               |
+// |            |_|  \_\| \__/ \_/|/|_____/________\_|  \_\              |
+// |                                                                     |
+// -----------------------------------------------------------------------
+// COPYRIGHT
+// -----------------------------------------------------------------------
+//
+// This software is copyright protected and proprietary to Neusoft Reach.
+// Neusoft Reach grants to you only those rights as set out in the license
+// conditions.
+// All other rights remain with Neusoft Reach.
+// -----------------------------------------------------------------------
+
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "packet_pool.h"
+
+namespace asf {
+namespace msgbus {
+namespace blackbox2 {
+
+namespace {
+
+class PacketPoolTest: public ::testing::Test {
+ protected:
+    static void SetUpTestSuite() {
+        ASSERT_TRUE(PacketPool::Install());
+    }
+};
+
+void CountFree(void* packet) {
+    ++*static_cast<int*>(static_cast<ENetPacket*>(packet)->userData);
+}
+
+}
+
+TEST_F(PacketPoolTest, CreateCopiesTheData) {
+    const char data[] = "blackbox2";
+    auto packet = PacketPool::Create(data, sizeof(data), ENET_PACKET_FLAG_RELIABLE);
+    ASSERT_NE(packet, nullptr);
+    EXPECT_EQ(packet->dataLength, sizeof(data));
+    EXPECT_EQ(memcmp(packet->data, data, sizeof(data)), 0);
+    EXPECT_TRUE(packet->flags & ENET_PACKET_FLAG_RELIABLE);
+    EXPECT_EQ(packet->referenceCount, 0U);
+    EXPECT_EQ(packet->freeCallback, nullptr);
+    PacketPool::Destroy(packet);
+}
+
+TEST_F(PacketPoolTest, ReusesPacketsOfTheSameSizeClass) {
+    auto packet = PacketPool::Create(nullptr, 1500, 0);
+    ASSERT_NE(packet, nullptr);
+    PacketPool::Destroy(packet);
+    auto before = PacketPool::GetStats();
+
+    // 1500 and 2048 bytes share the 2 KiB class.
+    auto reused = PacketPool::Create(nullptr, 2048, 0);
+    EXPECT_EQ(reused, packet);
+    EXPECT_EQ(reused->dataLength, 2048U);
+    auto after = PacketPool::GetStats();
+    EXPECT_EQ(after.hits, before.hits + 1);
+    EXPECT_EQ(after.misses, before.misses);
+    EXPECT_EQ(after.cached, before.cached - 1);
+    PacketPool::Destroy(reused);
+}
+
+TEST_F(PacketPoolTest, KeepsSizeClassesApart) {
+    auto packet = PacketPool::Create(nullptr, 3000, 0);
+    ASSERT_NE(packet, nullptr);
+    PacketPool::Destroy(packet);
+
+    // 1 byte more is the next class, 4 KiB less is another one.
+    auto larger = PacketPool::Create(nullptr, 4097, 0);
+    auto smaller = PacketPool::Create(nullptr, 100, 0);
+    EXPECT_NE(larger, packet);
+    EXPECT_NE(smaller, packet);
+    auto same = PacketPool::Create(nullptr, 4096, 0);
+    EXPECT_EQ(same, packet);
+    PacketPool::Destroy(larger);
+    PacketPool::Destroy(smaller);
+    PacketPool::Destroy(same);
+}
+
+TEST_F(PacketPoolTest, LargePacketsBypassThePool) {
+    auto before = PacketPool::GetStats();
+    std::vector<uint8_t> data(1024 * 1024, 0x5a);
+    auto packet = PacketPool::Create(data.data(), data.size(), ENET_PACKET_FLAG_RELIABLE);
+    ASSERT_NE(packet, nullptr);
+    EXPECT_EQ(packet->dataLength, data.size());
+    EXPECT_EQ(memcmp(packet->data, data.data(), data.size()), 0);
+    PacketPool::Destroy(packet);
+    auto after = PacketPool::GetStats();
+    EXPECT_EQ(after.hits, before.hits);
+    EXPECT_EQ(after.misses, before.misses);
+    EXPECT_EQ(after.cached, before.cached);
+}
+
+TEST_F(PacketPoolTest, NoAllocatePacketsViewTheCallersBytes) {
+    uint8_t data[256] = {};
+    auto packet = PacketPool::Create(data, sizeof(data), ENET_PACKET_FLAG_NO_ALLOCATE);
+    ASSERT_NE(packet, nullptr);
+    EXPECT_EQ(packet->data, data);
+    PacketPool::Destroy(packet);
+}
+
+TEST_F(PacketPoolTest, DestroyRunsTheFreeCallback) {
+    int freed = 0;
+    auto pooled = PacketPool::Create(nullptr, 64, 0);
+    pooled->userData = &freed;
+    pooled->freeCallback = &CountFree;
+    PacketPool::Destroy(pooled);
+    EXPECT_EQ(freed, 1);
+
+    // Recycled packets come back without the callback.
+    auto recycled = PacketPool::Create(nullptr, 64, 0);
+    EXPECT_EQ(recycled->freeCallback, nullptr);
+    EXPECT_EQ(recycled->userData, nullptr);
+    PacketPool::Destroy(recycled);
+
+    auto large = PacketPool::Create(nullptr, 512 * 1024, 0);
+    large->userData = &freed;
+    large->freeCallback = &CountFree;
+    PacketPool::Destroy(large);
+    EXPECT_EQ(freed, 2);
+}
+
+TEST_F(PacketPoolTest, SharedRefKeepsThePacketAlive) {
+    int freed = 0;
+    auto packet = PacketPool::Create(nullptr, 64, 0);
+    packet->userData = &freed;
+    packet->freeCallback = &CountFree;
+    std::shared_ptr<ENetPacket> shared;
+    {
+        PacketRef ref(packet);
+        shared = ref.Share();
+        EXPECT_EQ(shared.get(), packet);
+    }
+    EXPECT_EQ(freed, 0);
+    shared.reset();
+    EXPECT_EQ(freed, 1);
+
+    {
+        PacketRef ref(PacketPool::Create(nullptr, 64, 0));
+        auto released = ref.Release();
+        EXPECT_EQ(ref.Get(), nullptr);
+        PacketPool::Destroy(released);
+    }
+    {
+        PacketRef ref(PacketPool::Create(nullptr, 64, 0));
+        ref.Get()->userData = &freed;
+        ref.Get()->freeCallback = &CountFree;
+    }
+    EXPECT_EQ(freed, 2);
+}
+
+}  // namespace blackbox2
+}  // namespace msgbus
+}  // namespace asf
@@ -0,0 +1,189 @@
+// -----------------------------------------------------------------------
+// |             _     _              _____         _____                |
+// |            |  \  | |            / ____|  /\   |  __ \               |
+// |            | | \ | |  __       | (___   /  \  | |__) |              |
+// |            | |\ \| | /__\|   |  \___ \ / /\ \ |  _  /               |
+// |            | | \ \ ||    |   |   ___) / /__\ \| | \ \               |
+// |            |_|  \_\| \__/ \_/|/|_____/________\_|  \_\              |
+// |                                                                     |
+// -----------------------------------------------------------------------
+// COPYRIGHT
+// -----------------------------------------------------------------------
+//
+// This software is copyright protected and proprietary to Neusoft Reach.
+// Neusoft Reach grants to you only those rights as set out in the license
+// conditions.
+// All other rights remain with Neusoft Reach.
+// -----------------------------------------------------------------------
+
+#include <cstdio>
+#include <string>
+#include <fstream>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include "resume_cache.h"
+
+namespace asf {
+namespace msgbus {
+namespace blackbox2 {
+
+namespace {
+
+constexpr std::chrono::seconds kTtl(60);
+
+class ResumeCacheTest: public ::testing::Test {
+ protected:
+    void SetUp() override {
+        auto info = ::testing::UnitTest::GetInstance()->current_test_info();
+        path_ = ::testing::TempDir() + "blackbox2_" + info->name() + "." + std::to_string(getpid());
+        std::remove(path_.c_str());
+    }
+
+    void TearDown() override {
+        std::remove(path_.c_str());
+        std::remove((path_ + ".tmp").c_str());
+    }
+
+    static void Put(ResumeCache& cache, uint64_t instance_id, uint64_t digest, const std::string& payload) {
+        cache.Put(instance_id, kOpcode, digest, reinterpret_cast<const uint8_t*>(payload.data()), payload.size());
+    }
+
+    static std::string Find(ResumeCache& cache, uint64_t instance_id, uint64_t digest) {
+        std::string payload;
+        return cache.Find(instance_id, kOpcode, digest, payload) ? payload : "<none>";
+    }
+
+    void Truncate(size_t drop) {
+        std::ifstream in(path_, std::ios::binary);
+        std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        ASSERT_GT(data.size(), drop);
+        std::ofstream(path_, std::ios::binary | std::ios::trunc).write(data.data(), data.size() - drop);
+    }
+
+    static constexpr uint8_t kOpcode = 3;
+    std::string path_;
+};
+
+}
+
+TEST_F(ResumeCacheTest, FindsOnlyTheMatchingPayload) {
+    ResumeCache cache("", kTtl);
+    Put(cache, 1, 100, "process");
+    Put(cache, 2, 200, std::string(70000, 'x'));
+
+    EXPECT_EQ(Find(cache, 1, 100), "process");
+    EXPECT_EQ(Find(cache, 2, 200), std::string(70000, 'x'));
+    EXPECT_EQ(Find(cache, 1, 101), "<none>");
+    EXPECT_EQ(Find(cache, 3, 100), "<none>");
+    std::string payload;
+    EXPECT_FALSE(cache.Find(1, kOpcode + 1, 100, payload));
+
+    // A newer payload of the instance replaces the old one.
+    Put(cache, 1, 102, "process v2");
+    EXPECT_EQ(Find(cache, 1, 100), "<none>");
+    EXPECT_EQ(Find(cache, 1, 102), "process v2");
+}
+
+TEST_F(ResumeCacheTest, DropsReleasedPayloadsAfterTheTtl) {
+    ResumeCache cache("", kTtl);
+    Put(cache, 1, 100, "released");
+    Put(cache, 2, 200, "attached");
+    Put(cache, 3, 300, "resumed");
+    cache.Release(1);
+    cache.Release(3);
+    // Resuming an instance keeps its payload again.
+    EXPECT_EQ(Find(cache, 3, 300), "resumed");
+
+    cache.Maintain(ResumeCache::Clock::now() + kTtl / 2);
+    EXPECT_EQ(Find(cache, 1, 100), "released");
+    cache.Release(1);
+    cache.Maintain(ResumeCache::Clock::now() + kTtl + std::chrono::seconds(1));
+    EXPECT_EQ(Find(cache, 1, 100), "<none>");
+    EXPECT_EQ(Find(cache, 2, 200), "attached");
+    EXPECT_EQ(Find(cache, 3, 300), "resumed");
+}
+
+TEST_F(ResumeCacheTest, SavesAndLoadsTheSnapshot) {
+    {
+        ResumeCache cache(path_, kTtl);
+        EXPECT_FALSE(cache.Load());
+        Put(cache, 1, 100, "process");
+        Put(cache, 2, 200, std::string(70000, 'x'));
+        Put(cache, 3, 300, "");
+        cache.Maintain(ResumeCache::Clock::now());
+    }
+    ResumeCache cache(path_, kTtl);
+    ASSERT_TRUE(cache.Load());
+    EXPECT_EQ(Find(cache, 1, 100), "process");
+    EXPECT_EQ(Find(cache, 2, 200), std::string(70000, 'x'));
+    EXPECT_EQ(Find(cache, 3, 300), "");
+    EXPECT_EQ(Find(cache, 4, 400), "<none>");
+}
+
+TEST_F(ResumeCacheTest, LoadedPayloadsExpireUnlessResumed) {
+    {
+        ResumeCache cache(path_, kTtl);
+        Put(cache, 1, 100, "resumed");
+        Put(cache, 2, 200, "gone");
+        cache.Maintain(ResumeCache::Clock::now());
+    }
+    ResumeCache cache(path_, kTtl);
+    ASSERT_TRUE(cache.Load());
+    EXPECT_EQ(Find(cache, 1, 100), "resumed");
+    cache.Maintain(ResumeCache::Clock::now() + kTtl + std::chrono::seconds(1));
+    EXPECT_EQ(Find(cache, 1, 100), "resumed");
+    EXPECT_EQ(Find(cache, 2, 200), "<none>");
+}
+
+TEST_F(ResumeCacheTest, StopWritesTheLastSnapshot) {
+    {
+        ResumeCache cache(path_, kTtl);
+        ASSERT_TRUE(cache.Start(std::chrono::hours(1)));
+        EXPECT_FALSE(cache.Start(std::chrono::hours(1)));
+        Put(cache, 1, 100, "process");
+        cache.Stop();
+    }
+    ResumeCache cache(path_, kTtl);
+    ASSERT_TRUE(cache.Load());
+    EXPECT_EQ(Find(cache, 1, 100), "process");
+}
+
+TEST_F(ResumeCacheTest, RejectsTruncatedSnapshots) {
+    {
+        ResumeCache cache(path_, kTtl);
+        Put(cache, 1, 100, std::string(1000, 'a'));
+        Put(cache, 2, 200, std::string(1000, 'b'));
+        cache.Maintain(ResumeCache::Clock::now());
+    }
+    // Cut into the payload of the last record, its size now claims more
+    // bytes than the file has left.
+    Truncate(10);
+    ResumeCache cache(path_, kTtl);
+    EXPECT_FALSE(cache.Load());
+    EXPECT_EQ(Find(cache, 1, 100), "<none>");
+    EXPECT_EQ(Find(cache, 2, 200), "<none>");
+}
+
+TEST_F(ResumeCacheTest, RejectsCountsBeyondTheFile) {
+    {
+        ResumeCache cache(path_, kTtl);
+        Put(cache, 1, 100, "process");
+        cache.Maintain(ResumeCache::Clock::now());
+    }
+    // The record count follows the magic and the version.
+    {
+        std::fstream file(path_, std::ios::binary | std::ios::in | std::ios::out);
+        uint64_t count = UINT64_MAX / 2;
+        file.seekp(2 * sizeof(uint32_t));
+        file.write(reinterpret_cast<const char*>(&count), sizeof(count));
+    }
+    ResumeCache cache(path_, kTtl);
+    EXPECT_FALSE(cache.Load());
+    EXPECT_EQ(Find(cache, 1, 100), "<none>");
+}
+
+}  // namespace blackbox2
+}  // namespace msgbus
+}  // namespace asf
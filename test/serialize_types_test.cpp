@@ -0,0 +1,62 @@
+// -----------------------------------------------------------------------
+// |             _     _              _____         _____                |
+// |            |  \  | |            / ____|  /\   |  __ \               |
+// |            | | \ | |  __       | (___   /  \  | |__) |              |
+// |            | |\ \| | /__\|   |  \___ \ / /\ \ |  _  /               |
+// |            | | \ \ ||    |   |   ___) / /__\ \| | \ \               |
+// |            |_|  \_\| \__/ \_/|/|_____/________\_|  \_\              |
+// |                                                                     |
+// -----------------------------------------------------------------------
+// COPYRIGHT
+// -----------------------------------------------------------------------
+//
+// This software is copyright protected and proprietary to Neusoft Reach.
+// Neusoft Reach grants to you only those rights as set out in the license
+// conditions.
+// All other rights remain with Neusoft Reach.
+// -----------------------------------------------------------------------
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "protocol.h"
+#include "serialize_types.h"
+
+namespace asf {
+namespace msgbus {
+namespace blackbox2 {
+
+TEST(SerializeTypeIdsTest, AnnouncesTypesOnceAcknowledged) {
+    SerializeTypeIds ids;
+    auto id = ids.Add("pkg/Type");
+    ASSERT_NE(id, 0);
+    EXPECT_EQ(ids.Find("pkg/Type"), id);
+    EXPECT_FALSE(ids.IsAnnounced(id));
+
+    // The acknowledgement carries the block of the announcement without the type.
+    std::string ack;
+    protocol::EncodeMessageType(ack, id, std::string());
+    uint16_t acked = 0;
+    std::string type = "unset";
+    ASSERT_TRUE(protocol::DecodeMessageType(reinterpret_cast<const uint8_t*>(ack.data()), ack.size(), acked, type));
+    EXPECT_TRUE(type.empty());
+    ids.Announce(acked);
+    EXPECT_TRUE(ids.IsAnnounced(id));
+    EXPECT_FALSE(ids.IsAnnounced(ids.Add("pkg/Other")));
+}
+
+TEST(SerializeTypeIdsTest, IgnoresAcknowledgementsOfAnEarlierReceiver) {
+    SerializeTypeIds ids;
+    auto id = ids.Add("pkg/Type");
+    ids.Announce(id);
+    ids.Clear();
+    ids.Announce(id);
+    EXPECT_FALSE(ids.IsAnnounced(id));
+    EXPECT_EQ(ids.Add("pkg/Type"), id);
+    EXPECT_FALSE(ids.IsAnnounced(id));
+}
+
+}  // namespace blackbox2
+}  // namespace msgbus
+}  // namespace asf
@@ -0,0 +1,147 @@
+// -----------------------------------------------------------------------
+// |             _     _              _____         _____                |
+// |            |  \  | |            / ____|  /\   |  __ \               |
+// |            | | \ | |  __       | (___   /  \  | |__) |              |
+// |            | |\ \| | /__\|   |  \___ \ / /\ \ |  _  /               |
+// |            | | \ \ ||    |   |   ___) / /__\ \| | \ \               |
+// |            |_|  \_\| \__/ \_/|/|_____/________\_|  \_\              |
+// |                                                                     |
+// -----------------------------------------------------------------------
+// COPYRIGHT
+// -----------------------------------------------------------------------
+//
+// This software is copyright protected and proprietary to Neusoft Reach.
+// Neusoft Reach grants to you only those rights as set out in the license
+// conditions.
+// All other rights remain with Neusoft Reach.
+// -----------------------------------------------------------------------
+
+#include <vector>
+#include <chrono>
+
+#include <gtest/gtest.h>
+
+#include "timer_wheel.h"
+
+namespace asf {
+namespace msgbus {
+namespace blackbox2 {
+
+namespace {
+
+using std::chrono::milliseconds;
+
+constexpr milliseconds kTick(10);
+constexpr size_t kSlotCount = 8;
+
+// Runs the expired callbacks the way the backend does, after Advance().
+size_t Advance(TimerWheel& wheel, TimerWheel::Clock::time_point now) {
+    std::vector<TimerWheel::Callback> expired;
+    wheel.Advance(now, expired);
+    for (auto& cb: expired) {
+        cb();
+    }
+    return expired.size();
+}
+
+}
+
+TEST(TimerWheelTest, ExpiresInDeadlineOrderNeverEarly) {
+    TimerWheel wheel(kTick, kSlotCount);
+    auto start = TimerWheel::Clock::now();
+    std::vector<int> fired;
+    wheel.Add(start + milliseconds(30), [&fired] { fired.push_back(30); });
+    wheel.Add(start + milliseconds(10), [&fired] { fired.push_back(10); });
+    wheel.Add(start + milliseconds(55), [&fired] { fired.push_back(55); });
+
+    EXPECT_EQ(Advance(wheel, start + milliseconds(9)), 0U);
+    EXPECT_EQ(Advance(wheel, start + milliseconds(10) + kTick), 1U);
+    EXPECT_EQ(Advance(wheel, start + milliseconds(29)), 0U);
+    EXPECT_EQ(Advance(wheel, start + milliseconds(60) + kTick), 2U);
+    EXPECT_EQ(fired, (std::vector<int>{ 10, 30, 55 }));
+    EXPECT_TRUE(wheel.IsEmpty());
+}
+
+TEST(TimerWheelTest, KeepsTimersBeyondOneTurn) {
+    TimerWheel wheel(kTick, kSlotCount);
+    auto start = TimerWheel::Clock::now();
+    bool fired = false;
+    // Its slot comes by twice before the timer is due.
+    wheel.Add(start + kTick * (kSlotCount * 2 + 3), [&fired] { fired = true; });
+
+    EXPECT_EQ(Advance(wheel, start + kTick * kSlotCount), 0U);
+    EXPECT_EQ(Advance(wheel, start + kTick * (kSlotCount * 2 + 2)), 0U);
+    EXPECT_FALSE(fired);
+    EXPECT_EQ(Advance(wheel, start + kTick * (kSlotCount * 2 + 4)), 1U);
+    EXPECT_TRUE(fired);
+}
+
+TEST(TimerWheelTest, JumpOverSeveralTurnsExpiresEverything) {
+    TimerWheel wheel(kTick, kSlotCount);
+    auto start = TimerWheel::Clock::now();
+    for (size_t i = 1; i <= kSlotCount * 3; ++i) {
+        wheel.Add(start + kTick * i, [] {});
+    }
+    EXPECT_EQ(Advance(wheel, start + kTick * (kSlotCount * 5)), kSlotCount * 3);
+    EXPECT_TRUE(wheel.IsEmpty());
+}
+
+TEST(TimerWheelTest, CanceledTimerNeverFires) {
+    TimerWheel wheel(kTick, kSlotCount);
+    auto start = TimerWheel::Clock::now();
+    bool canceled_fired = false;
+    bool kept_fired = false;
+    auto canceled = wheel.Add(start + milliseconds(20), [&canceled_fired] { canceled_fired = true; });
+    wheel.Add(start + milliseconds(20), [&kept_fired] { kept_fired = true; });
+
+    EXPECT_TRUE(wheel.Cancel(canceled));
+    EXPECT_FALSE(wheel.Cancel(canceled));
+    EXPECT_EQ(Advance(wheel, start + milliseconds(100)), 1U);
+    EXPECT_FALSE(canceled_fired);
+    EXPECT_TRUE(kept_fired);
+    // Expired timers are gone as well.
+    EXPECT_FALSE(wheel.Cancel(canceled + 1));
+}
+
+TEST(TimerWheelTest, TimeoutFollowsTheEarliestTimer) {
+    TimerWheel wheel(kTick, kSlotCount);
+    auto start = TimerWheel::Clock::now();
+    EXPECT_EQ(wheel.GetTimeout(start, 1000), 1000U);
+
+    auto early = wheel.Add(start + milliseconds(40), [] {});
+    wheel.Add(start + milliseconds(300), [] {});
+    auto timeout = wheel.GetTimeout(start, 1000);
+    EXPECT_GE(timeout, 40U);
+    EXPECT_LE(timeout, 40U + kTick.count());
+    EXPECT_EQ(wheel.GetTimeout(start, 20), 20U);
+
+    // The cached earliest expiry goes with its timer.
+    EXPECT_TRUE(wheel.Cancel(early));
+    timeout = wheel.GetTimeout(start, 1000);
+    EXPECT_GE(timeout, 300U);
+    EXPECT_LE(timeout, 300U + kTick.count());
+
+    auto earlier = wheel.Add(start + milliseconds(100), [] {});
+    timeout = wheel.GetTimeout(start, 1000);
+    EXPECT_GE(timeout, 100U);
+    EXPECT_LE(timeout, 100U + kTick.count());
+    EXPECT_EQ(wheel.GetTimeout(start + milliseconds(500), 1000), 0U);
+    EXPECT_TRUE(wheel.Cancel(earlier));
+}
+
+TEST(TimerWheelTest, ClearDropsEveryTimer) {
+    TimerWheel wheel(kTick, kSlotCount);
+    auto start = TimerWheel::Clock::now();
+    bool fired = false;
+    auto id = wheel.Add(start + milliseconds(10), [&fired] { fired = true; });
+    wheel.Clear();
+
+    EXPECT_TRUE(wheel.IsEmpty());
+    EXPECT_FALSE(wheel.Cancel(id));
+    EXPECT_EQ(Advance(wheel, start + milliseconds(100)), 0U);
+    EXPECT_FALSE(fired);
+}
+
+}  // namespace blackbox2
+}  // namespace msgbus
+}  // namespace asf
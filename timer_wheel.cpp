@@ -0,0 +1,141 @@
+// -----------------------------------------------------------------------
+// |             _     _              _____         _____                |
+// |            |  \  | |            / ____|  /\   |  __ \               |
+// |            | | \ | |  __       | (___   /  \  | |__) |              |
+// |            | |\ \| | /__\|   |  \___ \ / /\ \ |  _  /               |
+// |            | | \ \ ||    |   |   ___) / /__\ \| | \ \               |
+// |            |_|  \_\| \__/ \_/|/|_____/________\_|  \_\              |
+// |                                                                     |
+// -----------------------------------------------------------------------
+// COPYRIGHT
+// -----------------------------------------------------------------------
+//
+// This software is copyright protected and proprietary to Neusoft Reach.
+// Neusoft Reach grants to you only those rights as set out in the license
+// conditions.
+// All other rights remain with Neusoft Reach.
+// -----------------------------------------------------------------------
+
+#include <algorithm>
+
+#include "timer_wheel.h"
+
+namespace asf {
+namespace msgbus {
+namespace blackbox2 {
+
+TimerWheel::TimerWheel(std::chrono::milliseconds tick, size_t slot_count)
+    : tick_(tick)
+    , origin_(Clock::now())
+    , slots_(slot_count)
+    , current_tick_(0)
+    , next_id_(1)
+    , next_expire_tick_(0) {
+}
+
+TimerWheel::TimerId TimerWheel::Add(Clock::time_point deadline, Callback cb) {
+    // Round up so a timer never fires early, and never put it into a slot
+    // that has already been visited.
+    auto expire_tick = std::max(ToTick(deadline + tick_ - Clock::duration(1)), current_tick_ + 1);
+    auto index = expire_tick % slots_.size();
+    auto id = next_id_++;
+    auto& slot = slots_[index];
+    slot.push_back(Timer{ id, expire_tick, std::move(cb) });
+    timers_.emplace(id, std::make_pair(index, std::prev(slot.end())));
+    if (next_expire_tick_ != 0) {
+        next_expire_tick_ = std::min(next_expire_tick_, expire_tick);
+    }
+    return id;
+}
+
+bool TimerWheel::Cancel(TimerId id) {
+    auto it = timers_.find(id);
+    if (it == timers_.end()) {
+        return false;
+    }
+    if (it->second.second->expire_tick == next_expire_tick_) {
+        next_expire_tick_ = 0;
+    }
+    slots_[it->second.first].erase(it->second.second);
+    timers_.erase(it);
+    return true;
+}
+
+void TimerWheel::Clear() {
+    for (auto& slot: slots_) {
+        slot.clear();
+    }
+    timers_.clear();
+    next_expire_tick_ = 0;
+}
+
+bool TimerWheel::IsEmpty() const {
+    return timers_.empty();
+}
+
+void TimerWheel::Advance(Clock::time_point now, std::vector<Callback>& expired) {
+    auto now_tick = ToTick(now);
+    if (timers_.empty()) {
+        current_tick_ = std::max(current_tick_, now_tick);
+        return;
+    }
+    // A full turn visits every slot, later ticks would visit them again.
+    auto last_tick = std::min(now_tick, current_tick_ + slots_.size());
+    while (current_tick_ < last_tick) {
+        ++current_tick_;
+        auto& slot = slots_[current_tick_ % slots_.size()];
+        for (auto it = slot.begin(); it != slot.end();) {
+            if (it->expire_tick <= now_tick) {
+                if (it->expire_tick == next_expire_tick_) {
+                    next_expire_tick_ = 0;
+                }
+                expired.push_back(std::move(it->cb));
+                timers_.erase(it->id);
+                it = slot.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    current_tick_ = std::max(current_tick_, now_tick);
+}
+
+uint32_t TimerWheel::GetTimeout(Clock::time_point now, uint32_t max_timeout) const {
+    if (timers_.empty()) {
+        return max_timeout;
+    }
+    auto next = origin_ + tick_ * static_cast<int64_t>(GetNextExpireTick());
+    auto timeout = std::chrono::ceil<std::chrono::milliseconds>(next - now).count();
+    return static_cast<uint32_t>(std::min<int64_t>(std::max<int64_t>(timeout, 0), max_timeout));
+}
+
+// The slots of the coming turn in order, the first timer due in its own turn
+// is the earliest. Timers further out are only found by the full scan.
+uint64_t TimerWheel::GetNextExpireTick() const {
+    if (next_expire_tick_ != 0) {
+        return next_expire_tick_;
+    }
+    auto next_expire_tick = UINT64_MAX;
+    for (uint64_t tick = current_tick_ + 1; tick <= current_tick_ + slots_.size(); ++tick) {
+        for (auto& timer: slots_[tick % slots_.size()]) {
+            if (timer.expire_tick <= tick) {
+                next_expire_tick_ = timer.expire_tick;
+                return next_expire_tick_;
+            }
+            next_expire_tick = std::min(next_expire_tick, timer.expire_tick);
+        }
+    }
+    next_expire_tick_ = next_expire_tick;
+    return next_expire_tick_;
+}
+
+uint64_t TimerWheel::ToTick(Clock::time_point time) const {
+    if (time <= origin_) {
+        return 0;
+    }
+    return static_cast<uint64_t>((time - origin_) / tick_);
+}
+
+}  // namespace blackbox2
+}  // namespace msgbus
+}  // namespace asf
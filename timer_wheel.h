@@ -0,0 +1,80 @@
+// -----------------------------------------------------------------------
+// |             _     _              _____         _____                |
+// |            |  \  | |            / ____|  /\   |  __ \               |
+// |            | | \ | |  __       | (___   /  \  | |__) |              |
+// |            | |\ \| | /__\|   |  \___ \ / /\ \ |  _  /               |
+// |            | | \ \ ||    |   |   ___) / /__\ \| | \ \               |
+// |            |_|  \_\| \__/ \_/|/|_____/________\_|  \_\              |
+// |                                                                     |
+// -----------------------------------------------------------------------
+// COPYRIGHT
+// -----------------------------------------------------------------------
+//
+// This software is copyright protected and proprietary to Neusoft Reach.
+// Neusoft Reach grants to you only those rights as set out in the license
+// conditions.
+// All other rights remain with Neusoft Reach.
+// -----------------------------------------------------------------------
+
+#ifndef SF_MSGBUS_BLACKBOX2_TIMER_WHEEL_H_
+#define SF_MSGBUS_BLACKBOX2_TIMER_WHEEL_H_
+
+#include <list>
+#include <chrono>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+
+namespace asf {
+namespace msgbus {
+namespace blackbox2 {
+
+// Hashed timer wheel, not thread-safe. Timers are bucketed by their expiry
+// tick, Advance() only visits the slots passed since the previous call. The
+// earliest expiry is cached and only searched for again after it has gone.
+class TimerWheel {
+ public:
+    using Clock = std::chrono::steady_clock;
+    using TimerId = uint64_t;
+    using Callback = std::function<void ()>;
+
+    TimerWheel(std::chrono::milliseconds tick, size_t slot_count);
+
+ public:
+    TimerId Add(Clock::time_point deadline, Callback cb);
+    bool Cancel(TimerId id);
+    void Clear();
+    bool IsEmpty() const;
+    // Moves the callbacks of the expired timers into expired, the caller runs
+    // them after it has finished with the wheel.
+    void Advance(Clock::time_point now, std::vector<Callback>& expired);
+    // Milliseconds until the earliest timer expires, at most max_timeout.
+    uint32_t GetTimeout(Clock::time_point now, uint32_t max_timeout) const;
+
+ private:
+    struct Timer {
+        TimerId id;
+        uint64_t expire_tick;
+        Callback cb;
+    };
+    using Slot = std::list<Timer>;
+
+    uint64_t ToTick(Clock::time_point time) const;
+    uint64_t GetNextExpireTick() const;
+
+ private:
+    const std::chrono::milliseconds tick_;
+    const Clock::time_point origin_;
+    std::vector<Slot> slots_;
+    std::unordered_map<TimerId, std::pair<size_t, Slot::iterator>> timers_;
+    uint64_t current_tick_;
+    TimerId next_id_;
+    mutable uint64_t next_expire_tick_;     // 0 if it has to be searched for.
+};
+
+}  // namespace blackbox2
+}  // namespace msgbus
+}  // namespace asf
+
+#endif  // SF_MSGBUS_BLACKBOX2_TIMER_WHEEL_H_